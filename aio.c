@@ -0,0 +1,347 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * aio.c - asynchronous file I/O
+ *
+ * File data for loads and saves is read and written through here, so
+ * that waiting for the disk doesn't hold up the network.  On Linux,
+ * operations are queued on an io_uring, submitted in one go each time
+ * round the event loop, and completed from the loop when the ring
+ * says they're done.  Where io_uring isn't available (or the kernel
+ * won't let us have one) each operation is simply carried out there
+ * and then, and its done function is called before it returns.
+ *
+ * The ring is set up on first use rather than at start-up, so that
+ * each worker process gets one of its own.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#if HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aio.h"
+#include "event.h"
+#include "extern.h"
+
+#if HAVE_LINUX_IO_URING_H && defined(__NR_io_uring_setup)
+#define USE_IO_URING 1
+#endif
+
+static unsigned long aio_nsync, aio_nasync;
+
+/* Set this to do everything synchronously. */
+int aio_sync = 0;
+
+#ifdef USE_IO_URING
+
+#define AIO_ENTRIES 64
+
+/* What to call when an operation completes. */
+struct aio_req {
+	aio_done_fn *done;
+	void *arg;
+};
+
+static int aio_fd = -1;
+static int aio_tried = 0;
+
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+static struct io_uring_sqe *sqes;
+static unsigned *cq_head, *cq_tail, *cq_mask, cq_entries;
+static struct io_uring_cqe *cqes;
+
+static unsigned aio_unsubmitted;	/* SQEs queued since last enter */
+static unsigned aio_inflight;		/* Submitted, not yet completed */
+
+static void aio_flush(void);
+static void aio_complete(int, void *);
+
+/*
+ * Try to set up the ring.  Returns 0 if we got one.
+ */
+static int
+aio_setup(void)
+{
+	struct io_uring_params p;
+	void *sq, *cq;
+	size_t sqlen, cqlen;
+	int fd;
+
+	aio_tried = 1;
+	memset(&p, 0, sizeof(p));
+	if ((fd = syscall(__NR_io_uring_setup, AIO_ENTRIES, &p)) == -1) {
+		if (debug)
+			printf("io_uring unavailable (%s), "
+			    "using synchronous file I/O\n", strerror(errno));
+		return -1;
+	}
+	/* IORING_OP_READ and WRITE arrived at the same time as this. */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		if (debug)
+			printf("io_uring too old, "
+			    "using synchronous file I/O\n");
+		close(fd);
+		return -1;
+	}
+	sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cqlen > sqlen)
+			sqlen = cqlen;
+		cqlen = sqlen;
+	}
+	sq = mmap(NULL, sqlen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else {
+		cq = mmap(NULL, cqlen, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto fail;
+	}
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+	    IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto fail;
+	sq_head = (unsigned *)((char *)sq + p.sq_off.head);
+	sq_tail = (unsigned *)((char *)sq + p.sq_off.tail);
+	sq_mask = (unsigned *)((char *)sq + p.sq_off.ring_mask);
+	sq_array = (unsigned *)((char *)sq + p.sq_off.array);
+	sq_entries = p.sq_entries;
+	cq_head = (unsigned *)((char *)cq + p.cq_off.head);
+	cq_tail = (unsigned *)((char *)cq + p.cq_off.tail);
+	cq_mask = (unsigned *)((char *)cq + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+	cq_entries = p.cq_entries;
+	aio_fd = fd;
+	/* The ring's descriptor becomes readable when there are CQEs. */
+	ev_add_fd(aio_fd, aio_complete, NULL);
+	ev_add_flush(aio_flush);
+	if (debug)
+		printf("using io_uring for file I/O\n");
+	return 0;
+fail:
+	/* The mappings go away with the process; there aren't many. */
+	if (debug)
+		printf("io_uring mmap: %s\n", strerror(errno));
+	close(fd);
+	return -1;
+}
+
+/*
+ * Queue an operation.  Returns NULL if it can't be done
+ * asynchronously, in which case the caller should do it itself.
+ */
+static struct io_uring_sqe *
+aio_get_sqe(aio_done_fn *done, void *arg)
+{
+	struct io_uring_sqe *sqe;
+	struct aio_req *req;
+	unsigned tail, idx;
+
+	if (aio_sync)
+		return NULL;
+	if (!aio_tried)
+		aio_setup();
+	if (aio_fd == -1)
+		return NULL;
+	/* Don't risk overflowing the completion queue. */
+	if (aio_inflight + aio_unsubmitted >= cq_entries)
+		return NULL;
+	tail = *sq_tail;
+	if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+		aio_flush();
+		if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) ==
+		    sq_entries)
+			return NULL;
+	}
+	if ((req = malloc(sizeof(*req))) == NULL)
+		return NULL;
+	req->done = done;
+	req->arg = arg;
+	idx = tail & *sq_mask;
+	sqe = &sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uintptr_t)req;
+	sq_array[idx] = idx;
+	return sqe;
+}
+
+static void
+aio_queue(void)
+{
+
+	__atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+	aio_unsubmitted++;
+	aio_nasync++;
+}
+
+/*
+ * Hand everything queued to the kernel.  Called before the event
+ * loop waits.
+ */
+static void
+aio_flush(void)
+{
+	int ret;
+
+	if (aio_unsubmitted == 0)
+		return;
+	ret = syscall(__NR_io_uring_enter, aio_fd, aio_unsubmitted, 0, 0,
+	    NULL, 0);
+	if (ret == -1) {
+		/* Try again next time round. */
+		if (errno != EAGAIN && errno != EBUSY && errno != EINTR)
+			warn("io_uring_enter");
+		return;
+	}
+	aio_inflight += ret;
+	aio_unsubmitted -= ret;
+}
+
+static void
+aio_complete(int fd, void *arg)
+{
+	struct aio_req *req;
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	ssize_t res;
+
+	head = *cq_head;
+	while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &cqes[head & *cq_mask];
+		req = (struct aio_req *)(uintptr_t)cqe->user_data;
+		res = cqe->res;
+		head++;
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		aio_inflight--;
+		req->done(req->arg, res);
+		free(req);
+	}
+}
+
+#endif /* USE_IO_URING */
+
+/*
+ * Read len bytes at offset off.  done() may be called before this
+ * returns.
+ */
+void
+aio_read(int fd, void *buf, size_t len, off_t off, aio_done_fn *done,
+    void *arg)
+{
+	ssize_t res;
+#ifdef USE_IO_URING
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = aio_get_sqe(done, arg)) != NULL) {
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->addr = (uintptr_t)buf;
+		sqe->len = len;
+		sqe->off = off;
+		aio_queue();
+		return;
+	}
+#endif
+	aio_nsync++;
+	res = pread(fd, buf, len, off);
+	done(arg, res == -1 ? -errno : res);
+}
+
+void
+aio_write(int fd, const void *buf, size_t len, off_t off, aio_done_fn *done,
+    void *arg)
+{
+	ssize_t res;
+#ifdef USE_IO_URING
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = aio_get_sqe(done, arg)) != NULL) {
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = fd;
+		sqe->addr = (uintptr_t)buf;
+		sqe->len = len;
+		sqe->off = off;
+		aio_queue();
+		return;
+	}
+#endif
+	aio_nsync++;
+	res = pwrite(fd, buf, len, off);
+	done(arg, res == -1 ? -errno : res);
+}
+
+void
+aio_fsync(int fd, aio_done_fn *done, void *arg)
+{
+#ifdef USE_IO_URING
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = aio_get_sqe(done, arg)) != NULL) {
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = fd;
+		aio_queue();
+		return;
+	}
+#endif
+	aio_nsync++;
+	done(arg, fsync(fd) == -1 ? -errno : 0);
+}
+
+void
+aio_stats(void)
+{
+
+	stats_printf("file I/O: %lu asynchronous, %lu synchronous operations",
+	    aio_nasync, aio_nsync);
+}
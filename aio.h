@@ -0,0 +1,56 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * aio.h - asynchronous file I/O
+ */
+
+#ifndef _AIO_H
+#define _AIO_H
+
+#include <sys/types.h>
+
+/*
+ * Called when an operation completes, with the number of bytes
+ * transferred (zero for aio_fsync()), or a negated errno value.
+ */
+typedef void aio_done_fn(void *arg, ssize_t result);
+
+extern void aio_read(int, void *, size_t, off_t, aio_done_fn *, void *);
+extern void aio_write(int, const void *, size_t, off_t, aio_done_fn *,
+    void *);
+extern void aio_fsync(int, aio_done_fn *, void *);
+extern void aio_stats(void);
+
+extern int aio_sync;
+
+#endif
@@ -30,15 +30,22 @@
  * Networking for Unix.
  */	
 
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -48,182 +55,972 @@
 #include <unistd.h>
 
 #include "aun.h"
+#include "capture.h"
+#include "event.h"
 #include "extern.h"
 #include "version.h"
 
-static void aun_ack(int sock, struct aun_packet *pkt, struct sockaddr_in *from,
-	int);
+#if HAVE_LINUX_ERRQUEUE_H
+#include <linux/errqueue.h>
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define AUN_ZEROCOPY 1
+#endif
+#endif
+
+struct aun_tx;
+
+static void aun_ack(struct aun_packet *pkt, struct sockaddr_in *from, int);
+static int aun_input(struct pkt_buf *, struct sockaddr_in *);
+static void aun_readable(int, void *);
+static void aun_tx_ack(struct in_addr, struct aun_packet *);
+static void aun_queue(void *, size_t, struct sockaddr_in *);
+static void aun_queuev(const struct iovec *, int, size_t,
+    struct sockaddr_in *, struct aun_tx *);
+static void aun_flush(void);
+#ifdef AUN_ZEROCOPY
+static void aun_zc_reap(void);
+#endif
 
 int sock;
-unsigned char buf[65536];
 int default_timeout = 100000;
+char *aun_bind_addr = NULL;	       /* set by conf_lex.l */
 
 union internal_addr {
 	struct aun_srcaddr srcaddr;
 	struct in_addr sin_addr;
 };
 
+/*
+ * Reliable unicast.
+ *
+ * Each unicast packet we send stays in the outstanding table, keyed
+ * by destination and sequence number, until the matching ACK turns
+ * up or we give up retransmitting it.  Packets for a given station
+ * are queued and sent in order, with at most peer->window of them
+ * unacknowledged at once, but different stations proceed
+ * independently, so one slow client doesn't hold up the others.
+ *
+ * How long we wait before retransmitting depends on how quickly the
+ * station has been acknowledging things lately (see rtt.c).  We give
+ * up on a packet once it has gone unacknowledged for as long as 50
+ * fixed timeouts would have taken.
+ */
+
+struct aun_tx {
+	TAILQ_ENTRY(aun_tx) qlink;	/* on peer's queue, until sent */
+	LIST_ENTRY(aun_tx) hlink;	/* in outstanding table, once sent */
+					/* or on aun_zc_waiting, once done */
+	struct aun_peer *peer;
+	uint32_t seq;
+	int tries;
+	uint64_t first_sent;
+	uint64_t last_sent;
+	struct ev_timer timer;
+	aun_done_fn *done;
+	void *arg;
+	size_t len;
+	struct aun_packet hdr;
+	struct iovec iov[AUN_MAXIOV + 1];
+	int iovcnt;
+	int error;
+	int zc_wait;			/* kernel may still have our data */
+	uint32_t zc_last;		/* last zero-copy send of it */
+};
+
+struct aun_peer {
+	LIST_ENTRY(aun_peer) link;
+	struct in_addr addr;
+	TAILQ_HEAD(, aun_tx) queue;
+	int inflight;
+	int window;
+	struct rtt rtt;
+};
+
+/*
+ * Packets are received, and sent, in batches of up to this many,
+ * to save on system calls.
+ */
+#define AUN_BATCH 32
+
+/* Receive ring.  Slots are refilled from the pool as packets are taken. */
+static struct pkt_buf *aun_ring[AUN_BATCH];
+
+/*
+ * Packets waiting to be sent by aun_flush().  Data is not copied, so
+ * anything queued here must stay put until then.  ACKs carry their
+ * own storage.
+ */
+static struct aun_out {
+	struct sockaddr_in to;
+	struct iovec iov[AUN_MAXIOV + 1];
+	int iovcnt;
+	size_t len;
+	struct aun_packet ack;
+	struct aun_tx *tx;	/* if reliable unicast */
+} aun_out[AUN_BATCH];
+static int aun_nout;
+
+#ifdef UDP_SEGMENT
+/* Cleared if the kernel turns out not to support UDP GSO. */
+static int aun_gso = 1;
+#define AUN_GSO_MAX 65507
+#endif
+
+/*
+ * MSG_ZEROCOPY only pays for itself on large sends, which in
+ * practice means GSO super-datagrams.  The kernel won't take a
+ * zero-copy datagram in more than MAX_SKB_FRAGS (usually 17) pieces,
+ * counting each page separately, and since every packet has its own
+ * header that limits us to about eight blocks per send.
+ *
+ * The kernel numbers each zero-copy send, and tells us through the
+ * socket's error queue when it has finished with the data; until
+ * then, it mustn't be freed or reused.  We keep track of which of the
+ * last AUN_ZC_MAX sends are done, and of the oldest one that isn't.
+ */
+#ifdef AUN_ZEROCOPY
+#define AUN_ZC_MIN 4096
+#define AUN_ZC_FRAGS 17
+#define AUN_ZC_MAX 256
+static int aun_zc = 0;			/* Set if the socket allows it */
+static uint32_t aun_zc_next;		/* Number of next send */
+static uint32_t aun_zc_oldest;		/* Oldest unfinished send */
+static unsigned char aun_zc_done[AUN_ZC_MAX];
+static size_t aun_zc_len[AUN_ZC_MAX];
+#endif
+
+/*
+ * Statistics: how many bytes of packet data we've sent, how many of
+ * those we had to copy first, and how many went out zero-copy.
+ * The kernel sometimes copies zero-copy sends anyway (loopback always
+ * does), and tells us so.
+ */
+static unsigned long long aun_data_sent, aun_data_copied;
+static unsigned long long aun_zc_bytes, aun_zc_copied;
+
+/*
+ * One socket per worker.  They're all bound to the same address with
+ * SO_REUSEPORT, which makes the kernel pick a socket for each packet
+ * by hashing its source address and port.  AUN stations always send
+ * from port 32768, so each station sticks to a single worker.
+ */
+static int *aun_socks;
+
 static void
 aun_setup(void)
 {
 	struct sockaddr_in name;
+	int fl, i, one = 1;
 
-	sock = socket(AF_INET, SOCK_DGRAM, 0);
-	if (sock < 0)
-		err(1, "socket");
 	name.sin_family = AF_INET;
 	name.sin_addr.s_addr = INADDR_ANY;
+	if (aun_bind_addr != NULL &&
+	    inet_aton(aun_bind_addr, &name.sin_addr) == 0)
+		errx(1, "%s: bad address", aun_bind_addr);
 	name.sin_port = htons(PORT_AUN);
-	if (bind(sock, (struct sockaddr*)&name, sizeof(name)))
-		err(1, "bind");
+	if ((aun_socks = calloc(workers, sizeof(*aun_socks))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < workers; i++) {
+		sock = socket(AF_INET, SOCK_DGRAM, 0);
+		if (sock < 0)
+			err(1, "socket");
+		if (workers > 1) {
+#ifdef SO_REUSEPORT
+			if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one,
+			    sizeof(one)) == -1)
+				err(1, "setsockopt(SO_REUSEPORT)");
+#else
+			errx(1, "multiple workers need SO_REUSEPORT");
+#endif
+		}
+		if (bind(sock, (struct sockaddr*)&name, sizeof(name)))
+			err(1, "bind");
+		if ((fl = fcntl(sock, F_GETFL)) < 0)
+			err(1, "fcntl(F_GETFL)");
+		if (fcntl(sock, F_SETFL, fl | O_NONBLOCK) < 0)
+			err(1, "fcntl(F_SETFL)");
+#ifdef AUN_ZEROCOPY
+		aun_zc = setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one,
+		    sizeof(one)) == 0;
+#endif
+		aun_socks[i] = sock;
+	}
+	sock = aun_socks[0];
+	ev_add_fd(sock, aun_readable, NULL);
+	ev_add_flush(aun_flush);
 }
 
-static struct aun_packet *
-aun_recv(ssize_t *outsize, struct aun_srcaddr *vfrom, int want_port)
+/*
+ * Become worker n, and close everyone else's sockets.
+ */
+static void
+aun_worker(int n)
+{
+	int i;
+
+	ev_del_fd(sock);
+	for (i = 0; i < workers; i++)
+		if (i != n)
+			close(aun_socks[i]);
+	sock = aun_socks[n];
+	ev_add_fd(sock, aun_readable, NULL);
+}
+
+/*
+ * Read a batch of packets into the receive ring.  Returns the number
+ * read, which is zero if there weren't any waiting.
+ */
+static int
+aun_read(struct sockaddr_in *from)
 {
+	int i, n;
+#if HAVE_RECVMMSG
+	struct mmsghdr msgs[AUN_BATCH];
+	struct iovec iov[AUN_BATCH];
+#else
+	socklen_t fromlen;
 	ssize_t msgsize;
-	struct aun_packet *pkt = (struct aun_packet *)buf;
-	union internal_addr *afrom = (union internal_addr *)vfrom;
-	struct sockaddr_in from;
-
-	while (1) {
-		socklen_t fromlen = sizeof(from);
-		int i;
-		msgsize = recvfrom(sock, pkt, sizeof(buf), 0,
-		    (struct sockaddr *)&from, &fromlen);
-		if (msgsize == -1)
+#endif
+
+	for (i = 0; i < AUN_BATCH; i++)
+		if (aun_ring[i] == NULL &&
+		    (aun_ring[i] = pkt_buf_get()) == NULL)
+			break;
+	if (i < AUN_BATCH) {
+		warnx("aun_read: malloc failed");
+		if (i == 0)
+			return 0;
+	}
+#if HAVE_RECVMMSG
+	n = i;
+	memset(msgs, 0, sizeof(msgs[0]) * n);
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = aun_ring[i]->data;
+		iov[i].iov_len = PKT_BUF_SIZE;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &from[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+	}
+	n = recvmmsg(sock, msgs, n, 0, NULL);
+	if (n == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK &&
+		    errno != EINTR)
+			err(1, "recvmmsg");
+		return 0;
+	}
+	for (i = 0; i < n; i++)
+		aun_ring[i]->len = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ?
+		    -1 : msgs[i].msg_len;
+#else
+	/* Without recvmmsg, we only bother with one at a time. */
+	fromlen = sizeof(from[0]);
+	msgsize = recvfrom(sock, aun_ring[0]->data, PKT_BUF_SIZE, 0,
+	    (struct sockaddr *)&from[0], &fromlen);
+	if (msgsize == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK &&
+		    errno != EINTR)
 			err(1, "recvfrom");
-		if (0) {
-			printf("Rx");
-			for (i = 0; i < msgsize; i++) {
-				printf(" %02x", buf[i]);
-			}
-			printf(" from UDP port %hu", ntohs(from.sin_port));
+		return 0;
+	}
+	aun_ring[0]->len = msgsize;
+	n = 1;
+#endif
+	for (i = 0; i < n; i++) {
+		if (capturing && aun_ring[i]->len >= 0) {
+			struct iovec civ;
+
+			civ.iov_base = aun_ring[i]->data;
+			civ.iov_len = aun_ring[i]->len;
+			capture_packet(CAPTURE_IN, &from[i], PORT_AUN, &civ, 1);
 		}
 		/* Replies seem always to go to port 32768 */
-		from.sin_port = htons(PORT_AUN);
-		switch (pkt->type) {
-		case AUN_TYPE_IMMEDIATE:
-			if (pkt->flag == 8) {
-				/* Echo request? */
-				pkt->type = AUN_TYPE_IMM_REPLY;
-				pkt->data[0] = AUND_MACHINE_PEEK_LO;
-				pkt->data[1] = AUND_MACHINE_PEEK_HI;
-				pkt->data[2] = AUND_VERSION_MINOR;
-				pkt->data[3] = AUND_VERSION_MAJOR;
-				if (sendto(sock, buf, 12, 0,
-					   (struct sockaddr*)&from,
-					   sizeof(from))
-				    == -1) {
-					err(1, "sendto(echo reply)");
+		from[i].sin_port = htons(PORT_AUN);
+	}
+	return n;
+}
+
+static void
+aun_readable(int fd, void *arg)
+{
+	struct sockaddr_in from[AUN_BATCH];
+	int i, n;
+
+#ifdef AUN_ZEROCOPY
+	if (aun_zc_oldest != aun_zc_next)
+		aun_zc_reap();
+#endif
+	do {
+		n = aun_read(from);
+		for (i = 0; i < n; i++)
+			if (aun_input(aun_ring[i], &from[i]))
+				aun_ring[i] = NULL;
+		/* Send any ACKs before the buffers get reused. */
+		aun_flush();
+	} while (n == AUN_BATCH);
+}
+
+/*
+ * Deal with a packet which has just been read.  Returns non-zero if
+ * we've kept the buffer.
+ */
+static int
+aun_input(struct pkt_buf *pb, struct sockaddr_in *from)
+{
+	struct aun_packet *pkt = (struct aun_packet *)pb->data;
+	union internal_addr *afrom = (union internal_addr *)&pb->from;
+
+	if (pb->len < (ssize_t)sizeof(*pkt))
+		return 0;	/* Runt, or too big for the buffer */
+	memset(&pb->from, 0, sizeof(pb->from));
+	afrom->sin_addr = from->sin_addr;
+	switch (pkt->type) {
+	case AUN_TYPE_IMMEDIATE:
+		if (pkt->flag == 8) {
+			/* Echo request? */
+			pkt->type = AUN_TYPE_IMM_REPLY;
+			pkt->data[0] = AUND_MACHINE_PEEK_LO;
+			pkt->data[1] = AUND_MACHINE_PEEK_HI;
+			pkt->data[2] = AUND_VERSION_MINOR;
+			pkt->data[3] = AUND_VERSION_MAJOR;
+			aun_queue(pkt, 12, from);
+			if (debug) printf(" (echo request)");
+		}
+		break;
+	case AUN_TYPE_ACK:
+		aun_tx_ack(from->sin_addr, pkt);
+		break;
+	case AUN_TYPE_UNICAST:
+	case AUN_TYPE_BROADCAST:
+		if (ec_port_wanted(pkt->dest_port, &pb->from)) {
+			if (pkt->type == AUN_TYPE_UNICAST)
+				aun_ack(pkt, from, AUN_TYPE_ACK);
+			ec_port_input_buf(pb);
+			return 1;
+		} else {
+			if (pkt->type == AUN_TYPE_UNICAST)
+				aun_ack(pkt, from, AUN_TYPE_REJ);
+		}
+		break;
+	}
+	return 0;
+}
+
+static void
+aun_ack(struct aun_packet *pkt, struct sockaddr_in *from, int type)
+{
+	struct aun_packet *ack;
+	int i;
+
+	if (aun_nout == AUN_BATCH)
+		aun_flush();
+	ack = &aun_out[aun_nout].ack;
+	ack->type = type;
+	ack->dest_port = 0;
+	ack->flag = 0;
+	ack->retrans = 0;
+	for (i=0;i<4;i++) ack->seq[i] = pkt->seq[i];
+	aun_queue(ack, sizeof(*ack), from);
+}
+
+/*
+ * Add a packet to the next batch to be sent.
+ */
+static void
+aun_queue(void *data, size_t len, struct sockaddr_in *to)
+{
+
+	struct iovec iov;
+
+	iov.iov_base = data;
+	iov.iov_len = len;
+	aun_queuev(&iov, 1, len, to, NULL);
+}
+
+#ifdef AUN_ZEROCOPY
+/*
+ * Count how many pieces the kernel would split some data into for a
+ * zero-copy send.
+ */
+static int
+aun_zc_frags(const struct iovec *iov, int iovcnt)
+{
+	uintptr_t first, last;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	int i, n;
+
+	for (i = n = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len == 0)
+			continue;
+		first = (uintptr_t)iov[i].iov_base / pagesize;
+		last = ((uintptr_t)iov[i].iov_base + iov[i].iov_len - 1) /
+		    pagesize;
+		n += last - first + 1;
+	}
+	return n;
+}
+#endif
+
+/*
+ * Queue a packet made up of several pieces.  If it's a reliable
+ * unicast, tx is its transmission record, which allows it to be sent
+ * zero-copy.
+ */
+static void
+aun_queuev(const struct iovec *iov, int iovcnt, size_t len,
+    struct sockaddr_in *to, struct aun_tx *tx)
+{
+	struct aun_out *out;
+	int i;
+
+	if (aun_nout == AUN_BATCH)
+		aun_flush();
+	out = &aun_out[aun_nout++];
+	out->to = *to;
+	for (i = 0; i < iovcnt; i++)
+		out->iov[i] = iov[i];
+	out->iovcnt = iovcnt;
+	out->len = len;
+	out->tx = tx;
+}
+
+/*
+ * Send queued packets aun_out[start] to aun_out[end - 1], one
+ * datagram each.
+ */
+static void
+aun_send_batch(int start, int end)
+{
+	int i;
+#if HAVE_SENDMMSG
+	struct mmsghdr msgs[AUN_BATCH];
+	int n;
+
+	memset(msgs, 0, sizeof(msgs[0]) * (end - start));
+	for (i = start; i < end; i++) {
+		msgs[i - start].msg_hdr.msg_iov = aun_out[i].iov;
+		msgs[i - start].msg_hdr.msg_iovlen = aun_out[i].iovcnt;
+		msgs[i - start].msg_hdr.msg_name = &aun_out[i].to;
+		msgs[i - start].msg_hdr.msg_namelen = sizeof(aun_out[i].to);
+	}
+	for (i = 0; i < end - start; i += n) {
+		/*
+		 * A failure here is treated like a lost packet, and
+		 * the packet that caused it is skipped.
+		 */
+		n = sendmmsg(sock, msgs + i, end - start - i, 0);
+		if (n <= 0) {
+			if (debug) printf("sendmmsg: %s\n", strerror(errno));
+			n = 1;
+		}
+	}
+#else
+	struct msghdr msg;
+
+	for (i = start; i < end; i++) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &aun_out[i].to;
+		msg.msg_namelen = sizeof(aun_out[i].to);
+		msg.msg_iov = aun_out[i].iov;
+		msg.msg_iovlen = aun_out[i].iovcnt;
+		if (sendmsg(sock, &msg, 0) == -1 && debug)
+			printf("sendmsg: %s\n", strerror(errno));
+	}
+#endif
+}
+
+#ifdef UDP_SEGMENT
+/*
+ * Send a run of equal-sized packets (the last may be shorter) to one
+ * station as a single UDP GSO super-datagram, which the kernel will
+ * split up again.  Returns -1 if GSO isn't available.
+ */
+static int
+aun_send_gso(int start, int end)
+{
+	struct msghdr msg;
+	struct iovec iov[AUN_BATCH * (AUN_MAXIOV + 1)];
+	union {
+		char buf[CMSG_SPACE(sizeof(uint16_t))];
+		struct cmsghdr align;
+	} control;
+	struct cmsghdr *cm;
+	size_t len;
+	int i, j, niov, flags = 0;
+
+	/*
+	 * The kernel splits the data up by length, regardless of how
+	 * it's divided between iovecs, so no copying is needed.
+	 */
+	for (i = start, len = 0, niov = 0; i < end; i++) {
+		for (j = 0; j < aun_out[i].iovcnt; j++)
+			iov[niov++] = aun_out[i].iov[j];
+		len += aun_out[i].len;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &aun_out[start].to;
+	msg.msg_namelen = sizeof(aun_out[start].to);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = niov;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_UDP;
+	cm->cmsg_type = UDP_SEGMENT;
+	cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	*(uint16_t *)CMSG_DATA(cm) = aun_out[start].len;
+#ifdef AUN_ZEROCOPY
+	/*
+	 * Only reliable unicasts can wait for the kernel to finish
+	 * with their data, so don't use zero-copy for anything else.
+	 */
+	if (aun_zc && len >= AUN_ZC_MIN &&
+	    aun_zc_next - aun_zc_oldest < AUN_ZC_MAX &&
+	    aun_zc_frags(iov, niov) <= AUN_ZC_FRAGS) {
+		flags = MSG_ZEROCOPY;
+		for (i = start; i < end; i++)
+			if (aun_out[i].tx == NULL)
+				flags = 0;
+	}
+	if (flags != 0 && sendmsg(sock, &msg, flags) != -1) {
+		for (i = start; i < end; i++) {
+			aun_out[i].tx->zc_wait = 1;
+			aun_out[i].tx->zc_last = aun_zc_next;
+		}
+		aun_zc_done[aun_zc_next % AUN_ZC_MAX] = 0;
+		aun_zc_len[aun_zc_next % AUN_ZC_MAX] = len;
+		aun_zc_next++;
+		aun_zc_bytes += len;
+		return 0;
+	}
+	/* ENOBUFS means we're over the locked memory limit; try again. */
+#endif
+	if (sendmsg(sock, &msg, 0) == -1) {
+		if (errno == EINVAL || errno == EIO || errno == ENOPROTOOPT ||
+		    errno == EOPNOTSUPP) {
+			if (debug) printf("UDP GSO unavailable: %s\n",
+			    strerror(errno));
+			aun_gso = 0;
+			return -1;
+		}
+		if (debug) printf("sendmsg: %s\n", strerror(errno));
+	}
+	return 0;
+}
+#endif
+
+/*
+ * Send everything that's been queued.  Runs of packets to the same
+ * station go out in one go if UDP GSO is available; everything else
+ * is sent with as few system calls as we can manage.
+ */
+static void
+aun_flush(void)
+{
+	int i, start, run;
+
+	if (capturing)
+		for (i = 0; i < aun_nout; i++)
+			capture_packet(CAPTURE_OUT, &aun_out[i].to, PORT_AUN,
+			    aun_out[i].iov, aun_out[i].iovcnt);
+	for (i = start = 0; i < aun_nout; i += run) {
+		run = 1;
+#ifdef UDP_SEGMENT
+		if (aun_gso) {
+			size_t total = aun_out[i].len;
+
+			while (i + run < aun_nout &&
+			    aun_out[i + run].to.sin_addr.s_addr ==
+			    aun_out[i].to.sin_addr.s_addr &&
+			    aun_out[i + run - 1].len == aun_out[i].len &&
+			    aun_out[i + run].len <= aun_out[i].len &&
+			    total + aun_out[i + run].len <= AUN_GSO_MAX) {
+				total += aun_out[i + run].len;
+				run++;
+			}
+			if (run > 1) {
+				aun_send_batch(start, i);
+				if (aun_send_gso(i, i + run) == 0) {
+					start = i + run;
+					continue;
 				}
-				if (debug) printf(" (echo request)");
+				/* Fall back to sending them one by one. */
+				start = i;
 			}
+		}
+#endif
+	}
+	aun_send_batch(start, aun_nout);
+	aun_nout = 0;
+}
+
+static LIST_HEAD(, aun_peer) aun_peers = LIST_HEAD_INITIALIZER(aun_peers);
+
+#define AUN_TX_HASH 64
+static LIST_HEAD(, aun_tx) aun_outstanding[AUN_TX_HASH];
+
+/* Finished, but waiting for the kernel to let go of their data. */
+static LIST_HEAD(, aun_tx) aun_zc_waiting =
+    LIST_HEAD_INITIALIZER(aun_zc_waiting);
+
+#define AUN_TX_BUCKET(addr, seq) \
+	(&aun_outstanding[(ntohl((addr).s_addr) + ((seq) >> 2)) % AUN_TX_HASH])
+
+static struct aun_peer *
+aun_peer_get(struct in_addr addr)
+{
+	struct aun_peer *peer;
+
+	LIST_FOREACH(peer, &aun_peers, link)
+		if (peer->addr.s_addr == addr.s_addr)
+			return peer;
+	if ((peer = calloc(1, sizeof(*peer))) == NULL)
+		return NULL;
+	peer->addr = addr;
+	TAILQ_INIT(&peer->queue);
+	peer->window = 1;
+	rtt_init(&peer->rtt);
+	LIST_INSERT_HEAD(&aun_peers, peer, link);
+	return peer;
+}
+
+static void
+aun_tx_send(struct aun_tx *tx)
+{
+	struct sockaddr_in to;
+
+	to.sin_family = AF_INET;
+	to.sin_addr = tx->peer->addr;
+	to.sin_port = htons(PORT_AUN);
+	tx->last_sent = ev_now();
+	if (tx->tries++ == 0)
+		tx->first_sent = tx->last_sent;
+	tx->peer->rtt.sent++;
+	aun_data_sent += tx->len - sizeof(tx->hdr);
+	aun_queuev(tx->iov, tx->iovcnt, tx->len, &to, tx);
+	ev_timer_add(&tx->timer, tx->peer->rtt.rto);
+}
+
+/*
+ * Send as many queued packets to a station as its window allows.
+ */
+static void
+aun_peer_run(struct aun_peer *peer)
+{
+	struct aun_tx *tx;
+
+	while (peer->inflight < peer->window &&
+	    (tx = TAILQ_FIRST(&peer->queue)) != NULL) {
+		TAILQ_REMOVE(&peer->queue, tx, qlink);
+		LIST_INSERT_HEAD(AUN_TX_BUCKET(peer->addr, tx->seq), tx,
+		    hlink);
+		peer->inflight++;
+		aun_tx_send(tx);
+	}
+}
+
+static void
+aun_tx_free(struct aun_tx *tx, int error)
+{
+
+	if (tx->done != NULL)
+		tx->done(tx->arg, error);
+	free(tx);
+}
+
+static void
+aun_tx_complete(struct aun_tx *tx, int error)
+{
+	struct aun_peer *peer = tx->peer;
+	int i;
+
+	/* A retransmission might be waiting to go out. */
+	for (i = 0; i < aun_nout; i++)
+		if (aun_out[i].tx == tx) {
+			aun_flush();
 			break;
-		case AUN_TYPE_UNICAST:
-		case AUN_TYPE_BROADCAST:
-			if ((want_port == 0 || pkt->dest_port == want_port) &&
-			    (afrom->sin_addr.s_addr == htons(INADDR_ANY) ||
-			     from.sin_addr.s_addr == afrom->sin_addr.s_addr)) {
-				if (pkt->type == AUN_TYPE_UNICAST)
-					aun_ack(sock, pkt, &from, AUN_TYPE_ACK);
-				/* Real packet; return it. */
-				*outsize = msgsize;
-				afrom->sin_addr = from.sin_addr;
-				return pkt;
-			} else {
-				if (pkt->type == AUN_TYPE_UNICAST)
-					aun_ack(sock, pkt, &from, AUN_TYPE_REJ);
-			}
+		}
+	ev_timer_del(&tx->timer);
+	LIST_REMOVE(tx, hlink);
+	peer->inflight--;
+#ifdef AUN_ZEROCOPY
+	if (tx->zc_wait && (int32_t)(tx->zc_last - aun_zc_oldest) >= 0 &&
+	    !aun_zc_done[tx->zc_last % AUN_ZC_MAX]) {
+		/* The caller can't have its buffer back yet. */
+		tx->error = error;
+		LIST_INSERT_HEAD(&aun_zc_waiting, tx, hlink);
+		aun_peer_run(peer);
+		return;
+	}
+#endif
+	aun_tx_free(tx, error);
+	aun_peer_run(peer);
+}
+
+#ifdef AUN_ZEROCOPY
+/*
+ * Collect notifications of finished zero-copy sends from the socket's
+ * error queue, and finish off any transmissions that were waiting for
+ * them.
+ */
+static void
+aun_zc_reap(void)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(struct sock_extended_err))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *ee;
+	LIST_HEAD(, aun_tx) ready = LIST_HEAD_INITIALIZER(ready);
+	struct aun_tx *tx, *next;
+	uint32_t i;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		if (recvmsg(sock, &msg, MSG_ERRQUEUE) == -1)
 			break;
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+		     cm = CMSG_NXTHDR(&msg, cm)) {
+			if (cm->cmsg_level != SOL_IP ||
+			    cm->cmsg_type != IP_RECVERR)
+				continue;
+			ee = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (ee->ee_errno != 0 ||
+			    ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			for (i = ee->ee_info; i != ee->ee_data + 1; i++) {
+				if ((int32_t)(i - aun_zc_oldest) < 0 ||
+				    (int32_t)(i - aun_zc_next) >= 0)
+					continue;
+				aun_zc_done[i % AUN_ZC_MAX] = 1;
+				if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+					aun_zc_copied +=
+					    aun_zc_len[i % AUN_ZC_MAX];
+			}
 		}
 	}
+	while (aun_zc_oldest != aun_zc_next &&
+	    aun_zc_done[aun_zc_oldest % AUN_ZC_MAX])
+		aun_zc_oldest++;
+	/* Callbacks might send more, so don't call them mid-list. */
+	for (tx = LIST_FIRST(&aun_zc_waiting); tx != NULL; tx = next) {
+		next = LIST_NEXT(tx, hlink);
+		if ((int32_t)(tx->zc_last - aun_zc_oldest) < 0 ||
+		    aun_zc_done[tx->zc_last % AUN_ZC_MAX]) {
+			LIST_REMOVE(tx, hlink);
+			LIST_INSERT_HEAD(&ready, tx, hlink);
+		}
+	}
+	while ((tx = LIST_FIRST(&ready)) != NULL) {
+		LIST_REMOVE(tx, hlink);
+		aun_tx_free(tx, tx->error);
+	}
 }
+#endif
 
 static void
-aun_ack(int sock, struct aun_packet *pkt, struct sockaddr_in *from, int type)
+aun_tx_timeout(void *arg)
 {
-	struct aun_packet ack; /* No data */
-	int i;
-	ack.type = type;
-	ack.dest_port = 0;
-	ack.flag = 0;
-	ack.retrans = 0;
-	for (i=0;i<4;i++) ack.seq[i] = pkt->seq[i];
-	if (sendto(sock, &ack, sizeof(ack), 0,
-	    (struct sockaddr *)from, sizeof(*from)) == -1) {
-		err(1, "sendto (ack)");
+	struct aun_tx *tx = arg;
+	struct rtt *rtt = &tx->peer->rtt;
+
+	if (ev_now() - tx->first_sent >= 50 * (uint64_t)default_timeout) {
+		rtt->failures++;
+		aun_tx_complete(tx, ETIMEDOUT);
+	} else {
+		rtt_backoff(rtt);
+		aun_tx_send(tx);	/* Retransmit. */
 	}
 }
 
-static ssize_t
-aun_xmit(struct aun_packet *pkt, size_t len, struct aun_srcaddr *vto)
+/*
+ * Handle an ACK from a station.  ACKs for things that aren't
+ * outstanding are probably for retransmissions, and can be ignored.
+ */
+static void
+aun_tx_ack(struct in_addr addr, struct aun_packet *ack)
+{
+	struct aun_tx *tx;
+	uint32_t seq;
+
+	seq = ack->seq[0] | ack->seq[1] << 8 | ack->seq[2] << 16 |
+	    (uint32_t)ack->seq[3] << 24;
+	LIST_FOREACH(tx, AUN_TX_BUCKET(addr, seq), hlink)
+		if (tx->seq == seq && tx->peer->addr.s_addr == addr.s_addr) {
+			/*
+			 * If we've retransmitted, there's no telling
+			 * which copy this ACK is for, so don't take a
+			 * sample.
+			 */
+			if (tx->tries == 1)
+				rtt_sample(&tx->peer->rtt,
+				    ev_now() - tx->last_sent);
+			aun_tx_complete(tx, 0);
+			return;
+		}
+}
+
+/*
+ * Queue a packet for transmission.  done() is called (possibly
+ * before this returns) once it has been acknowledged, with a zero
+ * error, or once we've given up, with an errno value.  The header is
+ * always copied.  If copy is set, so is the data, and the caller
+ * needn't keep it; otherwise, the data mustn't change until done()
+ * has been called.
+ */
+static void
+aun_xmit_common(struct aun_packet *hdr, const struct iovec *iov, int iovcnt,
+    struct aun_srcaddr *vto, aun_done_fn *done, void *arg, int copy)
 {
 	static u_int32_t sequence = 2;
-	struct aun_packet buf;
 	union internal_addr *ato = (union internal_addr *)vto;
-	struct sockaddr_in from, to;
-	socklen_t fromlen;
+	struct sockaddr_in to;
+	struct msghdr msg;
+	struct iovec msgiov[AUN_MAXIOV + 1];
+	struct aun_peer *peer;
+	struct aun_tx *tx;
+	size_t len;
+	uint8_t *p;
 	int i;
-	ssize_t retval;
-	int count;
-
-	fromlen = sizeof(from);
-	pkt->retrans = 0;
-	pkt->seq[0] = (sequence & 0x000000ff);
-	pkt->seq[1] = (sequence & 0x0000ff00) >> 8;
-	pkt->seq[2] = (sequence & 0x00ff0000) >> 16;
-	pkt->seq[3] = (sequence & 0xff000000) >> 24;
+
+	hdr->retrans = 0;
+	hdr->seq[0] = (sequence & 0x000000ff);
+	hdr->seq[1] = (sequence & 0x0000ff00) >> 8;
+	hdr->seq[2] = (sequence & 0x00ff0000) >> 16;
+	hdr->seq[3] = (sequence & 0xff000000) >> 24;
+	for (i = 0, len = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (hdr->type != AUN_TYPE_UNICAST) {
+		/* Nothing to wait for. */
+		sequence += 4;
+		to.sin_family = AF_INET;
+		to.sin_addr = ato->sin_addr;
+		to.sin_port = htons(PORT_AUN);
+		msgiov[0].iov_base = hdr;
+		msgiov[0].iov_len = sizeof(*hdr);
+		for (i = 0; i < iovcnt; i++)
+			msgiov[i + 1] = iov[i];
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &to;
+		msg.msg_namelen = sizeof(to);
+		msg.msg_iov = msgiov;
+		msg.msg_iovlen = iovcnt + 1;
+		if (capturing)
+			capture_packet(CAPTURE_OUT, &to, PORT_AUN, msgiov,
+			    iovcnt + 1);
+		if (sendmsg(sock, &msg, 0) == -1) {
+			if (done != NULL) done(arg, errno);
+		} else {
+			if (done != NULL) done(arg, 0);
+		}
+		return;
+	}
+	if ((peer = aun_peer_get(ato->sin_addr)) == NULL ||
+	    (tx = malloc(sizeof(*tx) + (copy ? len : 0))) == NULL) {
+		if (done != NULL) done(arg, ENOMEM);
+		return;
+	}
+	tx->peer = peer;
+	tx->seq = sequence;
 	sequence += 4;
-	to.sin_family = AF_INET;
-	to.sin_addr = ato->sin_addr;
-	to.sin_port = htons(PORT_AUN);
-	if (0) {
-		printf("Tx");
-		for (i = 0; i < len; i++) {
-			printf(" %02x", ((unsigned char *)pkt)[i]);
+	tx->tries = 0;
+	ev_timer_init(&tx->timer, aun_tx_timeout, tx);
+	tx->done = done;
+	tx->arg = arg;
+	tx->len = sizeof(*hdr) + len;
+	tx->hdr = *hdr;
+	tx->iov[0].iov_base = &tx->hdr;
+	tx->iov[0].iov_len = sizeof(tx->hdr);
+	if (copy) {
+		p = (uint8_t *)(tx + 1);
+		for (i = 0; i < iovcnt; i++) {
+			memcpy(p, iov[i].iov_base, iov[i].iov_len);
+			p += iov[i].iov_len;
 		}
-		printf(" to UDP port %hu\n", ntohs(to.sin_port));
+		aun_data_copied += len;
+		tx->iov[1].iov_base = tx + 1;
+		tx->iov[1].iov_len = len;
+		tx->iovcnt = 2;
+	} else {
+		for (i = 0; i < iovcnt; i++)
+			tx->iov[i + 1] = iov[i];
+		tx->iovcnt = iovcnt + 1;
 	}
-	count = 50;
-	while (count--) {
-		retval = sendto(sock, pkt, len, 0, (struct sockaddr *)&to,
-		    sizeof(to));
-		/* Grotty hack to see if it works */
-		if (retval < 0) return retval;
-		if (pkt->type == AUN_TYPE_UNICAST) {
-			int nready;
-			fd_set fdset;
-			struct timeval timeout;
-
-			timeout.tv_sec = 0;
-			timeout.tv_usec = default_timeout;
-			FD_ZERO(&fdset);
-			FD_SET(sock, &fdset);
-			do {
-				nready = select(FD_SETSIZE, &fdset, NULL, NULL,
-				    &timeout);
-				if (FD_ISSET(sock, &fdset)) {
-					recvfrom(sock, &buf, sizeof(buf), 0,
-					    (struct sockaddr *)&from, &fromlen);
-					/*
-					 * Is this an ack of the right
-					 * packet?
-					 */
-					if (from.sin_addr.s_addr ==
-					    to.sin_addr.s_addr &&
-					    buf.type == AUN_TYPE_ACK &&
-					    memcmp(&(buf.seq),
-					      &(pkt->seq), 4) == 0)
-						return retval;
-				}
-			} while (nready > 0);
-			/* Timeout.  Retransmit. */
-		} else
-			return retval;
+	tx->zc_wait = 0;
+	TAILQ_INSERT_TAIL(&peer->queue, tx, qlink);
+	aun_peer_run(peer);
+}
+
+static void
+aun_xmit_async(struct aun_packet *pkt, size_t len, struct aun_srcaddr *vto,
+    aun_done_fn *done, void *arg)
+{
+	struct iovec iov;
+
+	iov.iov_base = pkt->data;
+	iov.iov_len = len - sizeof(*pkt);
+	aun_xmit_common(pkt, &iov, 1, vto, done, arg, 1);
+}
+
+static void
+aun_xmitv_async(struct aun_packet *hdr, const struct iovec *iov, int iovcnt,
+    struct aun_srcaddr *vto, aun_done_fn *done, void *arg)
+{
+
+	aun_xmit_common(hdr, iov, iovcnt, vto, done, arg, 0);
+}
+
+struct aun_wait {
+	int pending;
+	int error;
+};
+
+static void
+aun_wait_done(void *arg, int error)
+{
+	struct aun_wait *w = arg;
+
+	w->pending = 0;
+	w->error = error;
+}
+
+/*
+ * Send a packet and wait for it to be acknowledged.  Other stations
+ * carry on being served while we wait.
+ */
+static ssize_t
+aun_xmit(struct aun_packet *pkt, size_t len, struct aun_srcaddr *vto)
+{
+	struct aun_wait w;
+
+	w.pending = 1;
+	aun_xmit_async(pkt, len, vto, aun_wait_done, &w);
+	while (w.pending)
+		ev_run_once(1);
+	if (w.error != 0) {
+		errno = w.error;
+		return -1;
 	}
-	errno = ETIMEDOUT;
-	return -1;
+	return len;
+}
+
+/*
+ * Allow this many unacknowledged packets to a station at once.
+ */
+static void
+aun_set_window(struct aun_srcaddr *vto, int window)
+{
+	union internal_addr *ato = (union internal_addr *)vto;
+	struct aun_peer *peer;
+
+	if ((peer = aun_peer_get(ato->sin_addr)) == NULL)
+		return;
+	peer->window = window < 1 ? 1 : window;
+	aun_peer_run(peer);
 }
 
 static char *
@@ -233,6 +1030,32 @@ aun_ntoa(struct aun_srcaddr *vfrom)
 	return inet_ntoa(afrom->sin_addr);
 }
 
+static int
+aun_aton(const char *s, struct aun_srcaddr *vaddr)
+{
+	union internal_addr *aaddr = (union internal_addr *)vaddr;
+
+	return inet_aton(s, &aaddr->sin_addr) ? 0 : -1;
+}
+
+/*
+ * Report how much copying we've done, and round-trip times and
+ * retransmissions for each station.
+ */
+static void
+aun_stats(void)
+{
+	struct aun_peer *peer;
+
+	stats_printf("AUN: %llu bytes of data sent, %llu copied (%.3f per byte),"
+	    " %llu sent zero-copy, %llu of those copied by the kernel",
+	    aun_data_sent, aun_data_copied, aun_data_sent == 0 ? 0.0 :
+	    (double)aun_data_copied / aun_data_sent, aun_zc_bytes,
+	    aun_zc_copied);
+	LIST_FOREACH(peer, &aun_peers, link)
+		rtt_report(inet_ntoa(peer->addr), &peer->rtt);
+}
+
 static void
 aun_get_stn(struct aun_srcaddr *vfrom, uint8_t *out)
 {
@@ -249,8 +1072,13 @@ aun_get_stn(struct aun_srcaddr *vfrom, uint8_t *out)
 const struct aun_funcs aun = {
 	AUN_MAX_BLOCK,
 	aun_setup,
-	aun_recv,
         aun_xmit,
+	aun_xmit_async,
+	aun_xmitv_async,
+	aun_set_window,
         aun_ntoa,
+	aun_aton,
+	aun_stats,
+	aun_worker,
         aun_get_stn,
 };
@@ -0,0 +1,1228 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * aund-bench.c - measure file server performance over AUN
+ *
+ * This pretends to be an AUN client station, logs on to a running
+ * aund and times repeated loads of a file, once for each send window
+ * requested.  It can delay its ACKs to simulate a network with a
+ * longer round-trip time than the one it's actually running on.
+ *
+ * Since replies always go to UDP port 32768, the station address
+ * must be different from the server's; on a single machine, run the
+ * server with "bind 127.0.0.1" and the benchmark with the default
+ * station address of 127.0.0.2.
+ *
+ * With -c, that many stations, at consecutive addresses, load the
+ * file at once, and the throughput reported is their total.  Running
+ * this against servers with different "workers" settings shows how
+ * well the server scales.
+ *
+ * With -m, each station instead does -n operations picked at random
+ * from a weighted mix, such as "logon=1,examine=4,load=4,save=2,
+ * getbytes=8,putbytes=2", on scratch files of the sizes given with -z,
+ * paging through the directory given instead of a file when it
+ * examines.  -p picks which kind of client to behave like, and the
+ * report gives throughput and latency percentiles for each file server
+ * function.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aun.h"
+#include "fs_proto.h"
+
+#define REPLY_PORT	0x90
+#define DATA_PORT	0x92
+#define ACK_PORT	0x93
+
+/* A packet received from the server and not yet consumed. */
+struct bench_rx {
+	struct bench_rx *next;
+	int port;
+	size_t len;
+	uint8_t data[AUN_MAX_BLOCK * 2];
+};
+
+/* An ACK waiting to be sent. */
+struct bench_ack {
+	uint64_t when;
+	uint8_t seq[4];
+};
+
+#define MAXACKS 256
+
+struct bench_stn {
+	int sock;
+	struct sockaddr_in server;
+	uint32_t seq;
+	uint8_t urd, csd, lib;
+	int flag;		/* of the last GETBYTES or PUTBYTES */
+	int ackdelay;		/* microseconds */
+	struct bench_ack acks[MAXACKS];
+	int nacks;
+	int acked;		/* got the ACK we're waiting for */
+	uint8_t ackseq[4];
+	struct bench_rx *rxq;
+};
+
+/*
+ * What each station tells the parent when running with -c.  A ready
+ * message is sent before each window, and the station then waits to
+ * be told to go, so that all of them start together.
+ */
+struct bench_result {
+	int ready;
+	size_t bytes;
+	uint64_t start, end;
+	size_t nsamples;	/* workload mixes: samples that follow */
+};
+
+static char *progname;
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: %s [-a station-addr] [-c stations] "
+	    "[-d ack-delay] [-n loads]\n"
+	    "       [-s server-addr] [-w windows] file\n"
+	    "       %s -m mix [-a station-addr] [-c stations] "
+	    "[-d ack-delay] [-n ops]\n"
+	    "       [-p riscos|nfs] [-r seed] [-s server-addr] [-z sizes] "
+	    "[dir]\n", progname, progname);
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t
+now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Set up a station at stnaddr to talk to the server at srvaddr.
+ */
+static void
+bench_stn_init(struct bench_stn *st, struct in_addr stnaddr,
+    struct in_addr srvaddr, int ackdelay)
+{
+	struct sockaddr_in name;
+
+	memset(st, 0, sizeof(*st));
+	st->ackdelay = ackdelay;
+	if ((st->sock = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		err(1, "socket");
+	memset(&name, 0, sizeof(name));
+	name.sin_family = AF_INET;
+	name.sin_port = htons(PORT_AUN);
+	name.sin_addr = stnaddr;
+	if (bind(st->sock, (struct sockaddr *)&name, sizeof(name)) == -1)
+		err(1, "bind %s", inet_ntoa(stnaddr));
+	st->server.sin_family = AF_INET;
+	st->server.sin_port = htons(PORT_AUN);
+	st->server.sin_addr = srvaddr;
+	st->seq = 0x1000;
+}
+
+static void
+bench_send_ack(struct bench_stn *st, uint8_t *seq)
+{
+	struct aun_packet ack;
+
+	memset(&ack, 0, sizeof(ack));
+	ack.type = AUN_TYPE_ACK;
+	memcpy(ack.seq, seq, 4);
+	if (sendto(st->sock, &ack, sizeof(ack), 0,
+	    (struct sockaddr *)&st->server, sizeof(st->server)) == -1)
+		err(1, "sendto (ack)");
+}
+
+/*
+ * Send any ACKs that are due, and return how long until the next
+ * one is, in milliseconds, or -1 if there are none.
+ */
+static int
+bench_run_acks(struct bench_stn *st)
+{
+	uint64_t now = now_usec();
+	int i;
+
+	while (st->nacks > 0 && st->acks[0].when <= now) {
+		bench_send_ack(st, st->acks[0].seq);
+		st->nacks--;
+		for (i = 0; i < st->nacks; i++)
+			st->acks[i] = st->acks[i + 1];
+	}
+	if (st->nacks == 0)
+		return -1;
+	return (st->acks[0].when - now + 999) / 1000;
+}
+
+/*
+ * Wait up to timeout milliseconds for a packet, and deal with it.
+ */
+static void
+bench_pump(struct bench_stn *st, int timeout)
+{
+	struct pollfd pfd;
+	struct aun_packet *pkt;
+	struct bench_rx *rx, **rxp;
+	unsigned char buf[65536];
+	ssize_t len;
+	int acktimeout;
+
+	acktimeout = bench_run_acks(st);
+	if (acktimeout != -1 && acktimeout < timeout)
+		timeout = acktimeout;
+	pfd.fd = st->sock;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, timeout) <= 0) {
+		bench_run_acks(st);
+		return;
+	}
+	if ((len = recv(st->sock, buf, sizeof(buf), 0)) == -1)
+		err(1, "recv");
+	pkt = (struct aun_packet *)buf;
+	if (len < sizeof(*pkt))
+		return;
+	switch (pkt->type) {
+	case AUN_TYPE_ACK:
+		if (memcmp(pkt->seq, st->ackseq, 4) == 0)
+			st->acked = 1;
+		break;
+	case AUN_TYPE_UNICAST:
+		if (st->ackdelay == 0)
+			bench_send_ack(st, pkt->seq);
+		else {
+			if (st->nacks == MAXACKS)
+				errx(1, "too many ACKs pending");
+			st->acks[st->nacks].when = now_usec() + st->ackdelay;
+			memcpy(st->acks[st->nacks].seq, pkt->seq, 4);
+			st->nacks++;
+		}
+		if (len - sizeof(*pkt) > sizeof(rx->data))
+			return;
+		if ((rx = malloc(sizeof(*rx))) == NULL)
+			err(1, "malloc");
+		rx->next = NULL;
+		rx->port = pkt->dest_port;
+		rx->len = len - sizeof(*pkt);
+		memcpy(rx->data, pkt->data, rx->len);
+		for (rxp = &st->rxq; *rxp != NULL; rxp = &(*rxp)->next)
+			continue;
+		*rxp = rx;
+		break;
+	}
+	bench_run_acks(st);
+}
+
+/*
+ * Send a packet to the server and wait for it to be acknowledged.
+ */
+static void
+bench_send(struct bench_stn *st, int port, int flag, const void *data,
+    size_t len)
+{
+	unsigned char buf[sizeof(struct aun_packet) + AUN_MAX_BLOCK];
+	struct aun_packet *pkt = (struct aun_packet *)buf;
+	uint64_t deadline;
+	int tries;
+
+	if (len > AUN_MAX_BLOCK)
+		errx(1, "packet too long");
+	st->seq += 4;
+	pkt->type = AUN_TYPE_UNICAST;
+	pkt->dest_port = port;
+	pkt->flag = flag;
+	pkt->retrans = 0;
+	pkt->seq[0] = st->seq;
+	pkt->seq[1] = st->seq >> 8;
+	pkt->seq[2] = st->seq >> 16;
+	pkt->seq[3] = st->seq >> 24;
+	memcpy(pkt->data, data, len);
+	memcpy(st->ackseq, pkt->seq, 4);
+	st->acked = 0;
+	for (tries = 0; tries < 20; tries++) {
+		if (sendto(st->sock, buf, sizeof(*pkt) + len, 0,
+		    (struct sockaddr *)&st->server, sizeof(st->server)) == -1)
+			err(1, "sendto");
+		deadline = now_usec() + 200000;
+		while (!st->acked && now_usec() < deadline)
+			bench_pump(st, 20);
+		if (st->acked)
+			return;
+	}
+	errx(1, "no ACK from server");
+}
+
+/*
+ * Wait for a packet to arrive on the given port, and return it.  The
+ * caller should free it.
+ */
+static struct bench_rx *
+bench_recv(struct bench_stn *st, int port)
+{
+	struct bench_rx *rx, **rxp;
+	uint64_t deadline;
+
+	deadline = now_usec() + 10000000;
+	for (;;) {
+		for (rxp = &st->rxq; (rx = *rxp) != NULL; rxp = &rx->next)
+			if (rx->port == port) {
+				*rxp = rx->next;
+				return rx;
+			}
+		if (now_usec() > deadline)
+			errx(1, "timed out waiting for port 0x%02x", port);
+		bench_pump(st, 100);
+	}
+}
+
+/*
+ * Make a file server request, and return the first reply.  The
+ * server spots repeated GETBYTES and PUTBYTES requests by their flag,
+ * so callers alternate it for those.
+ */
+static struct bench_rx *
+bench_fsreq(struct bench_stn *st, int function, int urd, int flag,
+    const void *data, size_t len)
+{
+	uint8_t buf[AUN_MAX_BLOCK];
+	struct bench_rx *rx;
+
+	buf[0] = REPLY_PORT;
+	buf[1] = function;
+	buf[2] = urd;
+	buf[3] = st->csd;
+	buf[4] = st->lib;
+	memcpy(buf + 5, data, len);
+	bench_send(st, EC_PORT_FS, flag, buf, len + 5);
+	rx = bench_recv(st, REPLY_PORT);
+	if (rx->len < 2)
+		errx(1, "short reply");
+	if (rx->data[1] != EC_FS_RC_OK)
+		errx(1, "error from server: %.*s", (int)rx->len - 2,
+		    rx->data + 2);
+	return rx;
+}
+
+static void
+bench_cli(struct bench_stn *st, const char *cmd)
+{
+	char buf[256];
+	struct bench_rx *rx;
+
+	snprintf(buf, sizeof(buf), "%s\r", cmd);
+	rx = bench_fsreq(st, EC_FS_FUNC_CLI, st->urd, 0, buf, strlen(buf));
+	if (rx->data[0] == EC_FS_CC_LOGON && rx->len >= 5) {
+		st->urd = rx->data[2];
+		st->csd = rx->data[3];
+		st->lib = rx->data[4];
+	}
+	free(rx);
+}
+
+/*
+ * Load a file, returning its size.
+ */
+static size_t
+bench_load(struct bench_stn *st, const char *name)
+{
+	char buf[256];
+	struct bench_rx *rx;
+	size_t size, got;
+
+	snprintf(buf, sizeof(buf), "%s\r", name);
+	rx = bench_fsreq(st, EC_FS_FUNC_LOAD, DATA_PORT, 0, buf, strlen(buf));
+	/* Size follows the command and return codes and the meta. */
+	if (rx->len < 13)
+		errx(1, "short load reply");
+	size = rx->data[10] | rx->data[11] << 8 | rx->data[12] << 16;
+	free(rx);
+	for (got = 0; got < size; ) {
+		rx = bench_recv(st, DATA_PORT);
+		got += rx->len;
+		free(rx);
+	}
+	free(bench_recv(st, REPLY_PORT));
+	return size;
+}
+
+/*
+ * Send size bytes of data to a SAVE or PUTBYTES, given the server's
+ * first reply, and return the final reply.
+ */
+static struct bench_rx *
+bench_send_data(struct bench_stn *st, struct bench_rx *rx, size_t size)
+{
+	static const uint8_t junk[AUN_MAX_BLOCK];
+	size_t done, blocksize, this;
+	int port;
+
+	if (rx->len < 5)
+		errx(1, "short reply to start data transfer");
+	port = rx->data[2];
+	blocksize = rx->data[3] | rx->data[4] << 8;
+	if (blocksize == 0 || blocksize > sizeof(junk))
+		blocksize = sizeof(junk);
+	free(rx);
+	for (done = 0; done < size; done += this) {
+		this = size - done;
+		if (this > blocksize)
+			this = blocksize;
+		bench_send(st, port, 0, junk, this);
+		/* The server acknowledges all but the last block. */
+		if (done + this < size)
+			free(bench_recv(st, ACK_PORT));
+	}
+	return bench_recv(st, REPLY_PORT);
+}
+
+/*
+ * Save a file of the given size.
+ */
+static void
+bench_save(struct bench_stn *st, const char *name, size_t size)
+{
+	uint8_t buf[256];
+	struct bench_rx *rx;
+	size_t len;
+
+	/* Load and execute addresses, then size, then name. */
+	memset(buf, 0, 8);
+	buf[8] = size;
+	buf[9] = size >> 8;
+	buf[10] = size >> 16;
+	len = 11 + snprintf((char *)buf + 11, sizeof(buf) - 11, "%s\r",
+	    name);
+	rx = bench_fsreq(st, EC_FS_FUNC_SAVE, ACK_PORT, 0, buf, len);
+	free(bench_send_data(st, rx, size));
+}
+
+/*
+ * Read one page of a directory listing, returning the number of
+ * entries in it.
+ */
+static int
+bench_examine(struct bench_stn *st, const char *dir, int arg, int start,
+    int n)
+{
+	uint8_t buf[256];
+	struct bench_rx *rx;
+	size_t len;
+	int got;
+
+	buf[0] = arg;
+	buf[1] = start;
+	buf[2] = n;
+	len = 3 + snprintf((char *)buf + 3, sizeof(buf) - 3, "%s\r", dir);
+	rx = bench_fsreq(st, EC_FS_FUNC_EXAMINE, st->urd, 0, buf, len);
+	got = rx->len >= 3 ? rx->data[2] : 0;
+	free(rx);
+	return got;
+}
+
+static int
+bench_open(struct bench_stn *st, const char *name)
+{
+	uint8_t buf[256];
+	struct bench_rx *rx;
+	size_t len;
+	int h;
+
+	buf[0] = 0;		/* Create it if need be */
+	buf[1] = 0;		/* For update */
+	len = 2 + snprintf((char *)buf + 2, sizeof(buf) - 2, "%s\r", name);
+	rx = bench_fsreq(st, EC_FS_FUNC_OPEN, st->urd, 0, buf, len);
+	if (rx->len < 3)
+		errx(1, "short open reply");
+	h = rx->data[2];
+	free(rx);
+	return h;
+}
+
+/*
+ * Read or write n bytes of an open file at the given offset.
+ */
+static void
+bench_getbytes(struct bench_stn *st, int h, size_t n, size_t off)
+{
+	uint8_t buf[8];
+	struct bench_rx *rx;
+	size_t got;
+
+	buf[0] = h;
+	buf[1] = 0;		/* Use the offset given */
+	buf[2] = n;
+	buf[3] = n >> 8;
+	buf[4] = n >> 16;
+	buf[5] = off;
+	buf[6] = off >> 8;
+	buf[7] = off >> 16;
+	st->flag ^= 1;
+	free(bench_fsreq(st, EC_FS_FUNC_GETBYTES, DATA_PORT, st->flag, buf,
+	    8));
+	for (got = 0; got < n; ) {
+		rx = bench_recv(st, DATA_PORT);
+		got += rx->len;
+		free(rx);
+	}
+	free(bench_recv(st, REPLY_PORT));
+}
+
+static void
+bench_putbytes(struct bench_stn *st, int h, size_t n, size_t off)
+{
+	uint8_t buf[8];
+	struct bench_rx *rx;
+
+	buf[0] = h;
+	buf[1] = 0;
+	buf[2] = n;
+	buf[3] = n >> 8;
+	buf[4] = n >> 16;
+	buf[5] = off;
+	buf[6] = off >> 8;
+	buf[7] = off >> 16;
+	st->flag ^= 1;
+	rx = bench_fsreq(st, EC_FS_FUNC_PUTBYTES, ACK_PORT, st->flag, buf, 8);
+	free(bench_send_data(st, rx, n));
+}
+
+/*
+ * Client personalities for workload mixes.  RISC OS clients open a
+ * wide window and read big directory pages; NFS 3.60 wants handles it
+ * can use as bit masks, stops and waits for every packet, and reads
+ * small pieces at a time.
+ */
+struct bench_persona {
+	const char *name;
+	int safehandles;
+	int window;
+	int examine_arg;	/* EC_FS_EXAMINE_* */
+	int examine_page;	/* entries per EXAMINE */
+	size_t rwsize;		/* bytes per GETBYTES or PUTBYTES */
+};
+
+static const struct bench_persona personas[] = {
+	{ "riscos",	0, 8, EC_FS_EXAMINE_ALL,	16, 4096 },
+	{ "nfs",	1, 1, EC_FS_EXAMINE_LONGTXT,	4,  256 },
+};
+
+#define NPERSONAS (sizeof(personas) / sizeof(personas[0]))
+
+/* The operations a workload mix is made from. */
+enum {
+	OP_LOGON, OP_EXAMINE, OP_LOAD, OP_SAVE, OP_GETBYTES, OP_PUTBYTES,
+	NOPS
+};
+
+static const char *const op_names[NOPS] = {
+	"logon", "examine", "load", "save", "getbytes", "putbytes",
+};
+
+/* Names of the function codes that latencies are reported under. */
+static const struct {
+	int func;
+	const char *name;
+} func_names[] = {
+	{ EC_FS_FUNC_CLI,	"CLI" },
+	{ EC_FS_FUNC_SAVE,	"SAVE" },
+	{ EC_FS_FUNC_LOAD,	"LOAD" },
+	{ EC_FS_FUNC_EXAMINE,	"EXAMINE" },
+	{ EC_FS_FUNC_OPEN,	"OPEN" },
+	{ EC_FS_FUNC_GETBYTES,	"GETBYTES" },
+	{ EC_FS_FUNC_PUTBYTES,	"PUTBYTES" },
+};
+
+#define NFUNCS (sizeof(func_names) / sizeof(func_names[0]))
+
+#define MAXSIZES 8
+
+struct bench_mix {
+	const struct bench_persona *persona;
+	int weights[NOPS];
+	int total;		/* sum of weights */
+	size_t sizes[MAXSIZES];	/* of files saved and loaded */
+	int nsizes;
+	const char *dir;	/* to EXAMINE */
+	int nops;		/* per station */
+	unsigned seed;
+};
+
+/* One timed request. */
+struct bench_sample {
+	int func;
+	uint32_t usec;
+};
+
+/* A station's state while running a workload mix. */
+struct bench_mixer {
+	struct bench_stn st;
+	const struct bench_mix *mix;
+	unsigned rand;
+	char prefix[16];	/* of scratch file names */
+	int handle;		/* of the random-access file */
+	size_t rasize;		/* its size */
+	struct bench_sample *samples;
+	size_t nsamples, maxsamples;
+	size_t bytes;
+};
+
+static void
+bench_sample(struct bench_mixer *m, int func, uint64_t start)
+{
+	size_t newmax;
+
+	if (m->nsamples == m->maxsamples) {
+		newmax = m->maxsamples ? m->maxsamples * 2 : 1024;
+		m->samples = realloc(m->samples, newmax * sizeof(*m->samples));
+		if (m->samples == NULL)
+			err(1, "realloc");
+		m->maxsamples = newmax;
+	}
+	m->samples[m->nsamples].func = func;
+	m->samples[m->nsamples].usec = now_usec() - start;
+	m->nsamples++;
+}
+
+/*
+ * Log on, set the options the personality wants, and open the
+ * random-access file, timing each step.
+ */
+static void
+bench_mix_logon(struct bench_mixer *m)
+{
+	const struct bench_persona *p = m->mix->persona;
+	char cmd[64];
+	uint64_t start;
+
+	start = now_usec();
+	bench_cli(&m->st, "I AM BENCH");
+	bench_sample(m, EC_FS_FUNC_CLI, start);
+	snprintf(cmd, sizeof(cmd), "FSOPT SAFEHANDLES %s",
+	    p->safehandles ? "ON" : "OFF");
+	bench_cli(&m->st, cmd);
+	snprintf(cmd, sizeof(cmd), "FSOPT WINDOW %d", p->window);
+	bench_cli(&m->st, cmd);
+	snprintf(cmd, sizeof(cmd), "%sR", m->prefix);
+	start = now_usec();
+	m->handle = bench_open(&m->st, cmd);
+	bench_sample(m, EC_FS_FUNC_OPEN, start);
+	if (p->safehandles && (m->handle & (m->handle - 1)) != 0)
+		errx(1, "handle %d is not safe", m->handle);
+}
+
+/*
+ * Page through a directory the way the personality would.
+ */
+static void
+bench_mix_examine(struct bench_mixer *m)
+{
+	const struct bench_persona *p = m->mix->persona;
+	uint64_t start;
+	int pos, got;
+
+	for (pos = 0; pos < 256; pos += got) {
+		start = now_usec();
+		got = bench_examine(&m->st, m->mix->dir, p->examine_arg, pos,
+		    p->examine_page);
+		bench_sample(m, EC_FS_FUNC_EXAMINE, start);
+		if (got == 0)
+			break;
+	}
+}
+
+/*
+ * Do an operation chosen at random according to the mix's weights.
+ */
+static void
+bench_mix_op(struct bench_mixer *m)
+{
+	const struct bench_mix *mix = m->mix;
+	char name[32];
+	uint64_t start;
+	size_t off, n;
+	int op, r, j;
+
+	r = rand_r(&m->rand) % mix->total;
+	for (op = 0; r >= mix->weights[op]; op++)
+		r -= mix->weights[op];
+	j = rand_r(&m->rand) % mix->nsizes;
+	snprintf(name, sizeof(name), "%s%d", m->prefix, j);
+	n = mix->persona->rwsize;
+	off = rand_r(&m->rand) % (m->rasize - n + 1);
+	start = now_usec();
+	switch (op) {
+	case OP_LOGON:
+		bench_mix_logon(m);
+		return;
+	case OP_EXAMINE:
+		bench_mix_examine(m);
+		return;
+	case OP_LOAD:
+		m->bytes += bench_load(&m->st, name);
+		bench_sample(m, EC_FS_FUNC_LOAD, start);
+		break;
+	case OP_SAVE:
+		bench_save(&m->st, name, mix->sizes[j]);
+		m->bytes += mix->sizes[j];
+		bench_sample(m, EC_FS_FUNC_SAVE, start);
+		break;
+	case OP_GETBYTES:
+		bench_getbytes(&m->st, m->handle, n, off);
+		m->bytes += n;
+		bench_sample(m, EC_FS_FUNC_GETBYTES, start);
+		break;
+	case OP_PUTBYTES:
+		bench_putbytes(&m->st, m->handle, n, off);
+		m->bytes += n;
+		bench_sample(m, EC_FS_FUNC_PUTBYTES, start);
+		break;
+	}
+}
+
+/*
+ * Be one station: log on, and for each window, time nloads loads of
+ * the file.  If resfd isn't -1, we're one of several, and report to
+ * the parent through resfd instead of printing the results.
+ */
+static void
+bench_station(struct in_addr stnaddr, struct in_addr srvaddr, int ackdelay,
+    char *windows, int nloads, const char *file, int resfd, int gofd)
+{
+	struct bench_stn st;
+	struct bench_result res;
+	char *w, cmd[64], go;
+	int i;
+
+	bench_stn_init(&st, stnaddr, srvaddr, ackdelay);
+
+	bench_cli(&st, "I AM BENCH");
+	if (resfd == -1)
+		printf("%6s %12s %10s\n", "window", "KB/s", "ms/load");
+	for (w = strtok(windows, ","); w != NULL; w = strtok(NULL, ",")) {
+		snprintf(cmd, sizeof(cmd), "FSOPT WINDOW %s", w);
+		bench_cli(&st, cmd);
+		memset(&res, 0, sizeof(res));
+		if (resfd != -1) {
+			res.ready = 1;
+			if (write(resfd, &res, sizeof(res)) != sizeof(res))
+				err(1, "write");
+			if (read(gofd, &go, 1) != 1)
+				errx(1, "lost contact with parent");
+			res.ready = 0;
+		}
+		res.start = now_usec();
+		for (i = 0; i < nloads; i++)
+			res.bytes += bench_load(&st, file);
+		res.end = now_usec();
+		if (resfd != -1) {
+			if (write(resfd, &res, sizeof(res)) != sizeof(res))
+				err(1, "write");
+		} else
+			printf("%6s %12.1f %10.2f\n", w,
+			    res.bytes / 1024.0 / ((res.end - res.start) / 1e6),
+			    (res.end - res.start) / 1000.0 / nloads);
+	}
+	bench_cli(&st, "BYE");
+}
+
+/*
+ * Run several stations at once, each in its own process, and add up
+ * their results.
+ */
+static void
+bench_many(struct in_addr stnaddr, struct in_addr srvaddr, int ackdelay,
+    char *windows, int nloads, const char *file, int nstations)
+{
+	struct bench_result res;
+	struct in_addr addr;
+	uint64_t start, end, elapsed;
+	size_t bytes;
+	char *w, *go;
+	int *resfds, resp[2], gop[2], i, status, failed;
+
+	/*
+	 * Each station gets its own pipe for results, so that we
+	 * notice if one dies.
+	 */
+	if ((go = calloc(nstations, 1)) == NULL ||
+	    (resfds = calloc(nstations, sizeof(*resfds))) == NULL)
+		err(1, "calloc");
+	if (pipe(gop) == -1)
+		err(1, "pipe");
+	for (i = 0; i < nstations; i++) {
+		if (pipe(resp) == -1)
+			err(1, "pipe");
+		switch (fork()) {
+		case -1:
+			err(1, "fork");
+		case 0:
+			close(resp[0]);
+			close(gop[1]);
+			addr.s_addr = htonl(ntohl(stnaddr.s_addr) + i);
+			bench_station(addr, srvaddr, ackdelay, windows,
+			    nloads, file, resp[1], gop[0]);
+			exit(EXIT_SUCCESS);
+		}
+		close(resp[1]);
+		resfds[i] = resp[0];
+	}
+	close(gop[0]);
+
+	printf("%d stations\n", nstations);
+	printf("%6s %12s %10s\n", "window", "KB/s", "ms/load");
+	for (w = strtok(windows, ","); w != NULL; w = strtok(NULL, ",")) {
+		for (i = 0; i < nstations; i++)
+			if (read(resfds[i], &res, sizeof(res)) != sizeof(res) ||
+			    !res.ready)
+				errx(1, "a station failed");
+		if (write(gop[1], go, nstations) != nstations)
+			err(1, "write");
+		bytes = 0;
+		start = UINT64_MAX;
+		end = elapsed = 0;
+		for (i = 0; i < nstations; i++) {
+			if (read(resfds[i], &res, sizeof(res)) != sizeof(res) ||
+			    res.ready)
+				errx(1, "a station failed");
+			bytes += res.bytes;
+			if (res.start < start)
+				start = res.start;
+			if (res.end > end)
+				end = res.end;
+			elapsed += res.end - res.start;
+		}
+		printf("%6s %12.1f %10.2f\n", w,
+		    bytes / 1024.0 / ((end - start) / 1e6),
+		    elapsed / 1000.0 / nloads / nstations);
+	}
+	failed = 0;
+	for (i = 0; i < nstations; i++)
+		if (wait(&status) == -1 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != 0)
+			failed = 1;
+	free(go);
+	free(resfds);
+	if (failed)
+		errx(1, "a station failed");
+}
+
+static int
+bench_sample_cmp(const void *a, const void *b)
+{
+	const struct bench_sample *x = a, *y = b;
+
+	if (x->func != y->func)
+		return x->func - y->func;
+	return (x->usec > y->usec) - (x->usec < y->usec);
+}
+
+/*
+ * The q'th quantile of n sorted samples, in milliseconds.
+ */
+static double
+bench_quantile(const struct bench_sample *s, size_t n, double q)
+{
+	size_t i;
+
+	i = q * n;
+	if (i >= n)
+		i = n - 1;
+	return s[i].usec / 1000.0;
+}
+
+/*
+ * Print throughput and latency for each function code in a set of
+ * samples taken over elapsed microseconds.
+ */
+static void
+bench_report(struct bench_sample *s, size_t n, size_t bytes,
+    uint64_t elapsed)
+{
+	size_t i, j;
+	double secs = elapsed / 1e6;
+	int f;
+
+	qsort(s, n, sizeof(*s), bench_sample_cmp);
+	printf("%-9s %8s %10s %9s %9s %9s\n", "function", "ops", "ops/s",
+	    "p50 ms", "p99 ms", "p99.9 ms");
+	for (i = 0; i < n; i = j) {
+		for (j = i; j < n && s[j].func == s[i].func; j++)
+			continue;
+		for (f = 0; f < NFUNCS; f++)
+			if (func_names[f].func == s[i].func)
+				break;
+		printf("%-9s %8zu %10.1f %9.2f %9.2f %9.2f\n",
+		    f < NFUNCS ? func_names[f].name : "?", j - i,
+		    (j - i) / secs, bench_quantile(s + i, j - i, 0.5),
+		    bench_quantile(s + i, j - i, 0.99),
+		    bench_quantile(s + i, j - i, 0.999));
+	}
+	printf("%-9s %8zu %10.1f   %.1f KB/s\n", "total", n, n / secs,
+	    bytes / 1024.0 / secs);
+}
+
+static void
+bench_readall(int fd, void *buf, size_t len)
+{
+	ssize_t got;
+
+	for (; len > 0; len -= got, buf = (char *)buf + got)
+		if ((got = read(fd, buf, len)) <= 0)
+			errx(1, "a station failed");
+}
+
+static void
+bench_writeall(int fd, const void *buf, size_t len)
+{
+	ssize_t done;
+
+	for (; len > 0; len -= done, buf = (const char *)buf + done)
+		if ((done = write(fd, buf, len)) == -1)
+			err(1, "write");
+}
+
+/*
+ * Be one station running a workload mix: log on, save a scratch file
+ * of each size and one for random access, then do the mix's
+ * operations.  Setup isn't counted in the results.  The scratch files
+ * are deleted afterwards.
+ */
+static void
+bench_mix_station(struct in_addr stnaddr, struct in_addr srvaddr,
+    int ackdelay, const struct bench_mix *mix, int index, int resfd,
+    int gofd)
+{
+	struct bench_mixer m;
+	struct bench_result res;
+	uint8_t h;
+	char name[64], go;
+	uint64_t start;
+	int i, j;
+
+	memset(&m, 0, sizeof(m));
+	bench_stn_init(&m.st, stnaddr, srvaddr, ackdelay);
+	m.mix = mix;
+	m.rand = mix->seed + index;
+	snprintf(m.prefix, sizeof(m.prefix), "BN%d_", index);
+	m.rasize = mix->persona->rwsize * 16;
+	for (j = 0; j < mix->nsizes; j++)
+		if (mix->sizes[j] > m.rasize)
+			m.rasize = mix->sizes[j];
+
+	bench_cli(&m.st, "I AM BENCH");
+	snprintf(name, sizeof(name), "%sR", m.prefix);
+	bench_save(&m.st, name, m.rasize);
+	for (j = 0; j < mix->nsizes; j++) {
+		snprintf(name, sizeof(name), "%s%d", m.prefix, j);
+		bench_save(&m.st, name, mix->sizes[j]);
+	}
+	bench_mix_logon(&m);
+	m.nsamples = 0;
+
+	memset(&res, 0, sizeof(res));
+	if (resfd != -1) {
+		res.ready = 1;
+		bench_writeall(resfd, &res, sizeof(res));
+		if (read(gofd, &go, 1) != 1)
+			errx(1, "lost contact with parent");
+		res.ready = 0;
+	}
+	res.start = start = now_usec();
+	for (i = 0; i < mix->nops; i++)
+		bench_mix_op(&m);
+	res.end = now_usec();
+	res.bytes = m.bytes;
+	res.nsamples = m.nsamples;
+	if (resfd != -1) {
+		bench_writeall(resfd, &res, sizeof(res));
+		bench_writeall(resfd, m.samples,
+		    m.nsamples * sizeof(*m.samples));
+	} else
+		bench_report(m.samples, m.nsamples, m.bytes, res.end - start);
+
+	h = m.handle;
+	free(bench_fsreq(&m.st, EC_FS_FUNC_CLOSE, m.st.urd, 0, &h, 1));
+	snprintf(name, sizeof(name), "DELETE %sR", m.prefix);
+	bench_cli(&m.st, name);
+	for (j = 0; j < mix->nsizes; j++) {
+		snprintf(name, sizeof(name), "DELETE %s%d", m.prefix, j);
+		bench_cli(&m.st, name);
+	}
+	bench_cli(&m.st, "BYE");
+	free(m.samples);
+}
+
+/*
+ * Run a workload mix on several stations at once, and report on all
+ * their requests together.
+ */
+static void
+bench_mix_many(struct in_addr stnaddr, struct in_addr srvaddr,
+    int ackdelay, const struct bench_mix *mix, int nstations)
+{
+	struct bench_result res;
+	struct bench_sample *samples;
+	struct in_addr addr;
+	uint64_t start, end;
+	size_t bytes, nsamples;
+	char *go;
+	int *resfds, resp[2], gop[2], i, status, failed;
+
+	if ((go = calloc(nstations, 1)) == NULL ||
+	    (resfds = calloc(nstations, sizeof(*resfds))) == NULL)
+		err(1, "calloc");
+	if (pipe(gop) == -1)
+		err(1, "pipe");
+	for (i = 0; i < nstations; i++) {
+		if (pipe(resp) == -1)
+			err(1, "pipe");
+		switch (fork()) {
+		case -1:
+			err(1, "fork");
+		case 0:
+			close(resp[0]);
+			close(gop[1]);
+			addr.s_addr = htonl(ntohl(stnaddr.s_addr) + i);
+			bench_mix_station(addr, srvaddr, ackdelay, mix, i,
+			    resp[1], gop[0]);
+			exit(EXIT_SUCCESS);
+		}
+		close(resp[1]);
+		resfds[i] = resp[0];
+	}
+	close(gop[0]);
+
+	for (i = 0; i < nstations; i++) {
+		bench_readall(resfds[i], &res, sizeof(res));
+		if (!res.ready)
+			errx(1, "a station failed");
+	}
+	if (write(gop[1], go, nstations) != nstations)
+		err(1, "write");
+	samples = NULL;
+	bytes = nsamples = 0;
+	start = UINT64_MAX;
+	end = 0;
+	for (i = 0; i < nstations; i++) {
+		bench_readall(resfds[i], &res, sizeof(res));
+		if (res.ready)
+			errx(1, "a station failed");
+		samples = realloc(samples,
+		    (nsamples + res.nsamples) * sizeof(*samples));
+		if (samples == NULL)
+			err(1, "realloc");
+		bench_readall(resfds[i], samples + nsamples,
+		    res.nsamples * sizeof(*samples));
+		nsamples += res.nsamples;
+		bytes += res.bytes;
+		if (res.start < start)
+			start = res.start;
+		if (res.end > end)
+			end = res.end;
+	}
+	printf("%d stations\n", nstations);
+	bench_report(samples, nsamples, bytes, end - start);
+	failed = 0;
+	for (i = 0; i < nstations; i++)
+		if (wait(&status) == -1 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != 0)
+			failed = 1;
+	free(samples);
+	free(go);
+	free(resfds);
+	if (failed)
+		errx(1, "a station failed");
+}
+
+/*
+ * Parse a mix like "load=4,save=1" into weights.
+ */
+static void
+bench_parse_mix(struct bench_mix *mix, char *arg)
+{
+	char *w, *val;
+	int op;
+
+	for (w = strtok(arg, ","); w != NULL; w = strtok(NULL, ",")) {
+		if ((val = strchr(w, '=')) == NULL)
+			usage();
+		*val++ = '\0';
+		for (op = 0; op < NOPS; op++)
+			if (strcasecmp(w, op_names[op]) == 0)
+				break;
+		if (op == NOPS)
+			errx(1, "%s: unknown operation", w);
+		mix->weights[op] = atoi(val);
+		if (mix->weights[op] < 0)
+			usage();
+		mix->total += mix->weights[op];
+	}
+	if (mix->total == 0)
+		errx(1, "empty mix");
+}
+
+/*
+ * Parse a list of sizes like "1k,16k,100000".
+ */
+static void
+bench_parse_sizes(struct bench_mix *mix, char *arg)
+{
+	char *w, *end;
+	unsigned long n;
+
+	mix->nsizes = 0;
+	for (w = strtok(arg, ","); w != NULL; w = strtok(NULL, ",")) {
+		if (mix->nsizes == MAXSIZES)
+			errx(1, "too many sizes");
+		n = strtoul(w, &end, 10);
+		if (*end == 'k' || *end == 'K')
+			n *= 1024, end++;
+		/* Sizes are 24 bits in the protocol. */
+		if (*end != '\0' || n == 0 || n > 0xffffff)
+			errx(1, "%s: bad size", w);
+		mix->sizes[mix->nsizes++] = n;
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct in_addr stnaddr, srvaddr;
+	const char *stn = "127.0.0.2", *srv = "127.0.0.1";
+	struct bench_mix mix;
+	char *windows, *sizes = NULL;
+	int c, ackdelay = 0, nloads = 20, nstations = 1, i;
+
+	progname = argv[0];
+	memset(&mix, 0, sizeof(mix));
+	mix.persona = &personas[0];
+	mix.seed = 1;
+	if ((windows = strdup("1,2,4,8,16")) == NULL)
+		err(1, "strdup");
+	while ((c = getopt(argc, argv, "a:c:d:m:n:p:r:s:w:z:")) != -1) {
+		switch (c) {
+		case 'a':
+			stn = optarg;
+			break;
+		case 'c':
+			nstations = atoi(optarg);
+			if (nstations < 1)
+				usage();
+			break;
+		case 'd':
+			ackdelay = atoi(optarg);
+			break;
+		case 'm':
+			bench_parse_mix(&mix, optarg);
+			break;
+		case 'n':
+			nloads = atoi(optarg);
+			break;
+		case 'p':
+			for (i = 0; i < NPERSONAS; i++)
+				if (strcasecmp(optarg, personas[i].name) == 0)
+					break;
+			if (i == NPERSONAS)
+				errx(1, "%s: unknown personality", optarg);
+			mix.persona = &personas[i];
+			break;
+		case 'r':
+			mix.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			srv = optarg;
+			break;
+		case 'w':
+			windows = optarg;
+			break;
+		case 'z':
+			sizes = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1 && (mix.total == 0 || argc != 0))
+		usage();
+	if (inet_aton(stn, &stnaddr) == 0)
+		errx(1, "%s: bad address", stn);
+	if (inet_aton(srv, &srvaddr) == 0)
+		errx(1, "%s: bad address", srv);
+
+	if (mix.total != 0) {
+		if (sizes == NULL && (sizes = strdup("1k,16k,64k")) == NULL)
+			err(1, "strdup");
+		bench_parse_sizes(&mix, sizes);
+		mix.dir = argc == 1 ? argv[0] : "@";
+		mix.nops = nloads;
+		if (nstations == 1)
+			bench_mix_station(stnaddr, srvaddr, ackdelay, &mix, 0,
+			    -1, -1);
+		else
+			bench_mix_many(stnaddr, srvaddr, ackdelay, &mix,
+			    nstations);
+		return 0;
+	}
+
+	if (nstations == 1)
+		bench_station(stnaddr, srvaddr, ackdelay, windows, nloads,
+		    argv[0], -1, -1);
+	else
+		bench_many(stnaddr, srvaddr, ackdelay, windows, nloads,
+		    argv[0], nstations);
+	return 0;
+}
@@ -0,0 +1,255 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * aund-metaconv.c - move Acorn metadata from one backend to another
+ *
+ * This walks the trees it's given, finding every directory, and
+ * then shares the directories out between several processes, each
+ * of which goes through its directories moving the load and execute
+ * addresses of everything in them from the old backend to the new
+ * one.  Each directory is only handled by one process, so backends
+ * that keep things per directory don't see any contention.
+ *
+ * Metadata is removed from the old backend once it's safely in the
+ * new one, unless -k is given.  The file server shouldn't be running
+ * on the tree while this is.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "fileserver.h"
+
+static const char *progname;
+static struct meta_funcs const *from = &meta_symlink, *to;
+static int keep, verbose;
+
+static char **mc_dirs;
+static int mc_ndirs;
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: %s [-kv] [-f from] [-j jobs] -t to "
+	    "directory ...\n", progname);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Names the file server doesn't show, apart from dot-stuffed ones,
+ * which include where the backends keep things.
+ */
+static int
+mc_hidden(const char *name)
+{
+
+	return name[0] == '.' && strncmp(name, "...", 3) != 0;
+}
+
+static void
+mc_adddir(const char *path)
+{
+	static int cap;
+
+	if (mc_ndirs == cap) {
+		cap = cap ? cap * 2 : 64;
+		if ((mc_dirs = realloc(mc_dirs, cap * sizeof(*mc_dirs))) ==
+		    NULL)
+			err(1, "realloc");
+	}
+	if ((mc_dirs[mc_ndirs++] = strdup(path)) == NULL)
+		err(1, "strdup");
+}
+
+/*
+ * Find all the directories under 'path'.
+ */
+static void
+mc_walk(char *path)
+{
+	char *argv[] = { path, NULL };
+	FTS *ftsp;
+	FTSENT *f;
+
+	if ((ftsp = fts_open(argv, FTS_PHYSICAL | FTS_NOCHDIR, NULL)) ==
+	    NULL)
+		err(1, "%s", path);
+	while ((f = fts_read(ftsp)) != NULL) {
+		switch (f->fts_info) {
+		case FTS_D:
+			if (f->fts_level > 0 && mc_hidden(f->fts_name))
+				fts_set(ftsp, f, FTS_SKIP);
+			else
+				mc_adddir(f->fts_path);
+			break;
+		case FTS_DNR: case FTS_ERR:
+			warnx("%s: %s", f->fts_path, strerror(f->fts_errno));
+			break;
+		}
+	}
+	fts_close(ftsp);
+}
+
+/*
+ * Move the metadata of everything in one directory.  Returns the
+ * number of objects that couldn't be moved.
+ */
+static int
+mc_convert(char *dir, unsigned long *moved)
+{
+	char *argv[] = { dir, NULL };
+	struct ec_fs_meta meta;
+	struct fs_ent ent;
+	FTS *ftsp;
+	FTSENT *f;
+	int failed = 0;
+
+	if ((ftsp = fts_open(argv, FTS_PHYSICAL | FTS_NOCHDIR, NULL)) ==
+	    NULL) {
+		warn("%s", dir);
+		return 1;
+	}
+	/*
+	 * fts_children() doesn't give its entries their full paths, so
+	 * read the directory, without going any further down.
+	 */
+	while ((f = fts_read(ftsp)) != NULL) {
+		if (f->fts_level == 0 || f->fts_info == FTS_DP)
+			continue;
+		if (f->fts_info == FTS_D)
+			fts_set(ftsp, f, FTS_SKIP);
+		if (mc_hidden(f->fts_name))
+			continue;
+		/* The backends only look at the path and name. */
+		memset(&ent, 0, sizeof(ent));
+		ent.path = f->fts_path;
+		ent.pathlen = f->fts_pathlen;
+		ent.name = f->fts_path + f->fts_pathlen - f->fts_namelen;
+		ent.namelen = f->fts_namelen;
+		if (from->get(&ent, &meta) < 0)
+			continue;
+		if (to->set(&ent, &meta) < 0) {
+			warn("%s", f->fts_path);
+			failed++;
+			continue;
+		}
+		if (!keep)
+			from->del(&ent);
+		(*moved)++;
+	}
+	fts_close(ftsp);
+	if (!keep && failed == 0)
+		from->deldir(AT_FDCWD, dir, 1);
+	if (verbose)
+		printf("%s\n", dir);
+	return failed;
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long moved;
+	pid_t pid;
+	int c, i, j, jobs = 1, failed, status, ret;
+
+	progname = argv[0];
+	while ((c = getopt(argc, argv, "f:j:kt:v")) != -1) {
+		switch (c) {
+		case 'f':
+			if ((from = meta_find(optarg)) == NULL)
+				errx(1, "unknown metadata backend \"%s\"",
+				    optarg);
+			break;
+		case 'j':
+			if ((jobs = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		case 't':
+			if ((to = meta_find(optarg)) == NULL)
+				errx(1, "unknown metadata backend \"%s\"",
+				    optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0 || to == NULL)
+		usage();
+	if (to == from)
+		errx(1, "nothing to do");
+
+	for (i = 0; i < argc; i++)
+		mc_walk(argv[i]);
+	if (jobs > mc_ndirs)
+		jobs = mc_ndirs;
+	fflush(stdout);
+	for (j = 0; j < jobs; j++) {
+		if ((pid = fork()) < 0)
+			err(1, "fork");
+		if (pid > 0)
+			continue;
+		moved = 0;
+		for (i = j, failed = 0; i < mc_ndirs; i += jobs)
+			failed += mc_convert(mc_dirs[i], &moved);
+		if (verbose)
+			printf("job %d: %lu moved, %d failed\n", j, moved,
+			    failed);
+		exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+	ret = EXIT_SUCCESS;
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			ret = EXIT_FAILURE;
+	return ret;
+}
@@ -0,0 +1,906 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * aund-microbench.c - time the file server's name and metadata helpers
+ *
+ * This builds a scratch directory tree with the sort of things
+ * clients throw at the file server (deep paths, names in the wrong
+ * case, files with ",xxx" type suffixes, dot-stuffed names and
+ * .Acorn metadata), loads a large typemap, and then calls each of
+ * the path-translation and metadata functions over and over, on its
+ * own, reporting the time and the number of allocations each call
+ * takes.
+ *
+ * Allocations are counted by having the linker wrap malloc(),
+ * calloc(), realloc(), strdup() and opendir() (see Makefile.am), so
+ * only calls made by aund itself are seen: allocation inside the C
+ * library, by regexec() for instance, isn't.  opendir() counts as one
+ * allocation.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <err.h>
+#include <errno.h>
+#include <fts.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aun.h"
+#include "extern.h"
+#include "fileserver.h"
+#include "fs_proto.h"
+#include "loopback.h"
+
+#define MB_DEPTH	16	/* Directories in the deep chain */
+#define MB_FILES	48	/* Files in each of them */
+#define MB_TYPEMAP	256	/* Name rules that never match */
+#define MB_BIG		10000	/* Files in the big directory */
+
+/* Things the rest of aund expects the main program to provide. */
+int debug = 0;
+int workers = 1;
+int using_syslog = 0;
+char *beebem_cfg_file = NULL;
+const struct aun_funcs *aunfuncs = &loopback;
+
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+char *__real_strdup(const char *);
+DIR *__real_opendir(const char *);
+void *__wrap_malloc(size_t);
+void *__wrap_calloc(size_t, size_t);
+void *__wrap_realloc(void *, size_t);
+char *__wrap_strdup(const char *);
+DIR *__wrap_opendir(const char *);
+
+static uint64_t mb_allocs;
+
+void *
+__wrap_malloc(size_t size)
+{
+
+	mb_allocs++;
+	return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t n, size_t size)
+{
+
+	mb_allocs++;
+	return __real_calloc(n, size);
+}
+
+void *
+__wrap_realloc(void *p, size_t size)
+{
+
+	mb_allocs++;
+	return __real_realloc(p, size);
+}
+
+char *
+__wrap_strdup(const char *s)
+{
+
+	mb_allocs++;
+	return __real_strdup(s);
+}
+
+DIR *
+__wrap_opendir(const char *name)
+{
+
+	mb_allocs++;
+	return __real_opendir(name);
+}
+
+static char *progname;
+static uint64_t mb_mintime = 200000000;	/* ns to run each case for */
+static char mb_tree[] = "/tmp/aund-mb.XXXXXX";
+static char mb_deep[128];		/* Deepest directory */
+static struct fs_context mb_ctx;
+static uint64_t mb_iter;	/* Calls so far of the current case */
+static char *mb_arg;		/* Argument of the current case */
+
+/* Client paths, built by mb_paths(). */
+static char mb_exact[256], mb_folded[256], mb_hats[512], mb_wild[256];
+static char mb_dots[320], mb_suffix[320], mb_chain[256];
+
+/* Entries of the deepest directory, for the fs_ent-based calls. */
+static struct fs_ent mb_meta[MB_FILES], mb_plain[MB_FILES];
+static struct fs_ent mb_typed[MB_FILES];
+static int mb_nmeta, mb_nplain, mb_ntyped;
+/* One of mb_meta and one of mb_plain, for GET_INFO. */
+static char mb_infopath[PATH_MAX], mb_guesspath[PATH_MAX];
+static const char *mb_names[MB_FILES];
+static int mb_namelens[MB_FILES];
+static int mb_nnames;
+
+/* Names in Big, in directory order. */
+static char *mb_bignames[MB_BIG];
+static int mb_biglens[MB_BIG];
+static int mb_nbig;
+static struct fs_wildcard *mb_wc;
+
+static void mb_unixify(void);
+static void mb_unixify_cold(void);
+static void mb_unixify_csd(void);
+static void mb_match_path(void);
+static void mb_match_absent(void);
+static void mb_dirsnap(void);
+static void mb_dirsnap_cold(void);
+static void mb_dirstream(void);
+static void mb_dirsnap_fts(void);
+static void mb_wild_one(void);
+static void mb_wild_scan(void);
+static void mb_wild_scan_old(void);
+static void mb_get_meta_link(void);
+static void mb_get_meta_stat(void);
+static void mb_stat_fts(void);
+static void mb_stat_ent(void);
+static void mb_get_info_fts(void);
+static void mb_get_info_cached(void);
+static void mb_write_date(void);
+static void mb_guess_suffix(void);
+static void mb_guess_typemap(void);
+static void mb_acornify(void);
+
+static const struct mb_case {
+	const char *name;
+	void (*fn)(void);
+	char *arg;
+} mb_cases[] = {
+	{ "unixify/exact",	mb_unixify,		mb_exact },
+	{ "unixify/folded",	mb_unixify,		mb_folded },
+	{ "unixify/hats",	mb_unixify,		mb_hats },
+	{ "unixify/wild",	mb_unixify,		mb_wild },
+	{ "unixify/dotstuff",	mb_unixify,		mb_dots },
+	{ "unixify/suffix",	mb_unixify,		mb_suffix },
+	{ "unixify/cold",	mb_unixify_cold,	mb_chain },
+	{ "unixify/csd-cold",	mb_unixify_csd,		"" },
+	{ "match_path/exact",	mb_match_path,		"Dir01/File22" },
+	{ "match_path/folded",	mb_match_path,		"Dir01/fILE22" },
+	{ "match_path/wild",	mb_match_path,		"Dir01/F*3?" },
+	{ "match_path/big",	mb_match_path,		"Big/nAME01999" },
+	{ "match_path/absent",	mb_match_absent,	"Big/Absent" },
+	{ "match_path/bigwild",	mb_match_path,		"Big/n*09999" },
+	{ "listing/shared",	mb_dirsnap,		"Big" },
+	{ "listing/cold",	mb_dirsnap_cold,	"Big/Absent" },
+	{ "listing/stream",	mb_dirstream,		"Big" },
+	{ "listing/fts",	mb_dirsnap_fts,		"Big" },
+	{ "wildcard/literal",	mb_wild_one,		"file23" },
+	{ "wildcard/star",	mb_wild_one,		"F*2#" },
+	{ "wildcard/stars",	mb_wild_one,		"*i*e*3" },
+	{ "wildcard/big",	mb_wild_scan,		"n*09999" },
+	{ "wildcard/big-old",	mb_wild_scan_old,	"n*09999" },
+	{ "get_meta/link",	mb_get_meta_link,	NULL },
+	{ "get_meta/stat",	mb_get_meta_stat,	NULL },
+	{ "stat/fts",		mb_stat_fts,		mb_infopath },
+	{ "stat/ent",		mb_stat_ent,		mb_infopath },
+	{ "get_info/fts",	mb_get_info_fts,	mb_infopath },
+	{ "get_info/cached",	mb_get_info_cached,	mb_infopath },
+	{ "get_info/guess-fts", mb_get_info_fts,	mb_guesspath },
+	{ "get_info/guess-cache", mb_get_info_cached,	mb_guesspath },
+	{ "write_date",		mb_write_date,		NULL },
+	{ "guess_type/suffix",	mb_guess_suffix,	NULL },
+	{ "guess_type/typemap",	mb_guess_typemap,	NULL },
+	{ "acornify_name",	mb_acornify,		NULL },
+};
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: %s [-t msec] [case ...]\n", progname);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Report a line of statistics.
+ */
+void
+stats_printf(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	putchar('\n');
+	va_end(ap);
+}
+
+static void
+mb_touch(const char *fmt, int n)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), fmt, mb_deep, n);
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+		err(1, "%s", path);
+	close(fd);
+}
+
+static void
+mb_remove(void)
+{
+	char *argv[] = { mb_tree, NULL };
+	FTS *ftsp;
+	FTSENT *f;
+
+	if (chdir("/") < 0 ||
+	    (ftsp = fts_open(argv, FTS_PHYSICAL, NULL)) == NULL)
+		return;
+	while ((f = fts_read(ftsp)) != NULL) {
+		switch (f->fts_info) {
+		case FTS_D:
+			break;
+		case FTS_DP:
+			rmdir(f->fts_accpath);
+			break;
+		default:
+			unlink(f->fts_accpath);
+		}
+	}
+	fts_close(ftsp);
+}
+
+/*
+ * Build the tree: Dir01/Dir02/.../Dir16, each holding MB_FILES
+ * files.  Every sixth file is dot-stuffed, every fourth of the rest
+ * has a ",ffb" suffix, and every third of the others has load and
+ * execute addresses in .Acorn.  Alongside them is Big, holding
+ * MB_BIG files.
+ */
+static void
+mb_build(void)
+{
+	char path[PATH_MAX], info[24];
+	size_t len;
+	int i, j, fd;
+
+	if (mkdtemp(mb_tree) == NULL)
+		err(1, "mkdtemp");
+	atexit(mb_remove);
+	if (chdir(mb_tree) < 0)
+		err(1, "%s", mb_tree);
+	if (mkdir("Big", 0777) < 0)
+		err(1, "Big");
+	for (j = 0; j < MB_BIG; j++) {
+		snprintf(path, sizeof(path), "Big/Name%05d", j);
+		if ((fd = open(path, O_WRONLY | O_CREAT, 0666)) < 0)
+			err(1, "%s", path);
+		close(fd);
+	}
+	len = 0;
+	for (i = 1; i <= MB_DEPTH; i++) {
+		len += snprintf(mb_deep + len, sizeof(mb_deep) - len,
+		    "%sDir%02d", i > 1 ? "/" : "", i);
+		snprintf(path, sizeof(path), "%s/.Acorn", mb_deep);
+		if (mkdir(mb_deep, 0777) < 0 || mkdir(path, 0777) < 0)
+			err(1, "%s", path);
+		for (j = 0; j < MB_FILES; j++) {
+			if (j % 6 == 5)
+				mb_touch("%s/...Dot%02d", j);
+			else if (j % 4 == 0)
+				mb_touch("%s/File%02d,ffb", j);
+			else {
+				mb_touch("%s/File%02d", j);
+				if (j % 3 != 1)
+					continue;
+				snprintf(path, sizeof(path),
+				    "%s/.Acorn/File%02d", mb_deep, j);
+				snprintf(info, sizeof(info), "%08X %08X",
+				    0xFFFFFF00U | j, 0x8023U);
+				if (symlink(info, path) < 0)
+					err(1, "%s", path);
+			}
+		}
+	}
+}
+
+/*
+ * Client paths down the whole chain: exactly as on disc, in the
+ * wrong case, with a detour up and down at every level, as
+ * wildcards, and ending in a dot-stuffed name and a name whose file
+ * has a type suffix.
+ */
+static void
+mb_paths(void)
+{
+	size_t e = 0, f = 0, h = 0, w = 0;
+	int i;
+
+	for (i = 1; i <= MB_DEPTH; i++) {
+		e += sprintf(mb_exact + e, "Dir%02d.", i);
+		f += sprintf(mb_folded + f, "dIR%02d.", i);
+		h += sprintf(mb_hats + h, "Dir%02d.Dir%02d.^.", i, i + 1);
+		w += sprintf(mb_wild + w, "D*%02d.", i);
+	}
+	strcpy(mb_chain, mb_exact);
+	snprintf(mb_dots, sizeof(mb_dots), "%s/dOT11", mb_exact);
+	snprintf(mb_suffix, sizeof(mb_suffix), "%sFile08", mb_exact);
+	strcat(mb_exact, "File07");
+	strcat(mb_folded, "fILE07");
+	strcat(mb_hats, "File07");
+	strcat(mb_wild, "F*07");
+}
+
+/*
+ * A typemap that makes fs_guess_type() work hard: lots of name rules
+ * that don't match anything, then a permission rule that doesn't
+ * match either, then the default.
+ */
+static void
+mb_typemap(void)
+{
+	char re[32];
+	int i;
+
+	for (i = 0; i < MB_TYPEMAP; i++) {
+		snprintf(re, sizeof(re), "\\.x%03d$", i);
+		if (fs_add_typemap_name(re, 0x100 + i) < 0)
+			err(1, "fs_add_typemap_name");
+	}
+	if (fs_add_typemap_mode(0111, 0111, 0xfe6) < 0 ||
+	    fs_add_typemap_default(0xfff) < 0)
+		err(1, "fs_add_typemap");
+}
+
+/*
+ * A logged-on client with its URD, CSD and library all at the root,
+ * making an EXAMINE request.  Handle 4 is the deepest directory, for
+ * use as the CSD instead.
+ */
+static void
+mb_dirhandle(struct fs_handle *h, char *path)
+{
+	struct stat st;
+
+	h->path = path;
+	h->type = FS_HANDLE_DIR;
+	if ((h->fd = open(path, O_RDONLY | O_DIRECTORY)) < 0 ||
+	    fstat(h->fd, &st) < 0)
+		err(1, "%s", path);
+	h->dev = st.st_dev;
+	h->ino = st.st_ino;
+	h->pin = NULL;
+}
+
+static void
+mb_context(void)
+{
+	static char dot[] = ".", deep[sizeof(mb_deep) + 2];
+	static struct fs_handle h, hdeep;
+	static struct fs_handle *handles[5];
+	static struct fs_client client;
+	static struct ec_fs_req req;
+
+	snprintf(deep, sizeof(deep), "./%s", mb_deep);
+	mb_dirhandle(&h, dot);
+	mb_dirhandle(&hdeep, deep);
+	handles[1] = handles[2] = handles[3] = &h;
+	handles[4] = &hdeep;
+	client.nhandles = 5;
+	client.handles = handles;
+	req.function = EC_FS_FUNC_EXAMINE;
+	req.urd = 1;
+	req.csd = 2;
+	req.lib = 3;
+	mb_ctx.req = &req;
+	mb_ctx.req_len = sizeof(req);
+	mb_ctx.client = &client;
+}
+
+static void
+mb_entries(void)
+{
+	char path[PATH_MAX], *upath;
+	struct dirent *dp;
+	struct fs_ent *ent;
+	struct stat st;
+	size_t len;
+	DIR *d;
+
+	if ((d = opendir(mb_deep)) == NULL)
+		err(1, "%s", mb_deep);
+	while ((dp = readdir(d)) != NULL && mb_nnames < MB_FILES) {
+		if (fs_hidden_name(dp->d_name))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", mb_deep, dp->d_name);
+		if ((upath = strdup(path)) == NULL)
+			err(1, "strdup");
+		snprintf(path, sizeof(path), "%s/.Acorn/%s", mb_deep,
+		    dp->d_name);
+		len = strlen(dp->d_name);
+		if (len >= 4 && dp->d_name[len - 4] == ',')
+			ent = &mb_typed[mb_ntyped++];
+		else if (lstat(path, &st) == 0)
+			ent = &mb_meta[mb_nmeta++];
+		else
+			ent = &mb_plain[mb_nplain++];
+		if (fs_ent_stat(upath, ent) < 0)
+			err(1, "%s", upath);
+		mb_names[mb_nnames] = ent->name;
+		mb_namelens[mb_nnames++] = ent->namelen;
+	}
+	closedir(d);
+	if (mb_nmeta == 0 || mb_nplain == 0 || mb_ntyped == 0)
+		errx(1, "%s: not enough entries", mb_deep);
+	snprintf(mb_infopath, sizeof(mb_infopath), "%s", mb_meta[0].path);
+	snprintf(mb_guesspath, sizeof(mb_guesspath), "%s", mb_plain[0].path);
+
+	if ((d = opendir("Big")) == NULL)
+		err(1, "Big");
+	while ((dp = readdir(d)) != NULL && mb_nbig < MB_BIG) {
+		if (dp->d_name[0] == '.')
+			continue;
+		mb_biglens[mb_nbig] = strlen(dp->d_name);
+		if ((mb_bignames[mb_nbig++] = strdup(dp->d_name)) == NULL)
+			err(1, "strdup");
+	}
+	closedir(d);
+}
+
+static void
+mb_unixify(void)
+{
+	struct stat st;
+	char *path;
+
+	path = fs_unixify_path(&mb_ctx, mb_arg);
+	if (mb_iter == 0 && (path == NULL || lstat(path, &st) < 0))
+		errx(1, "%s: resolved to %s", mb_arg,
+		    path ? path : "nothing");
+	free(path);
+}
+
+/*
+ * A different path every time, so that the path cache can't help.
+ */
+static void
+mb_unixify_cold(void)
+{
+	char path[320];
+
+	snprintf(path, sizeof(path), "%sX%08" PRIu64, mb_arg, mb_iter);
+	free(fs_unixify_path(&mb_ctx, path));
+}
+
+/*
+ * The same, but from a CSD at the bottom of the tree.
+ */
+static void
+mb_unixify_csd(void)
+{
+
+	mb_ctx.req->csd = 4;
+	mb_unixify_cold();
+	mb_ctx.req->csd = 2;
+}
+
+static void
+mb_match_path(void)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	strcpy(path, mb_arg);
+	fs_match_path(AT_FDCWD, path);
+	if (mb_iter == 0 && lstat(path, &st) < 0)
+		errx(1, "%s: matched %s", mb_arg, path);
+}
+
+static void
+mb_match_absent(void)
+{
+	char path[PATH_MAX];
+
+	strcpy(path, mb_arg);
+	fs_match_path(AT_FDCWD, path);
+}
+
+/*
+ * Getting a directory listing for EXAMINE, from the shared snapshots
+ * and the way each client used to make its own.
+ */
+static void
+mb_dirsnap(void)
+{
+	struct fs_dirsnap *ds;
+
+	if ((ds = fs_dirsnap_get(mb_arg)) == NULL)
+		err(1, "%s", mb_arg);
+	fs_dirsnap_release(ds);
+}
+
+/*
+ * Make fs_dirsnap_get() read the directory again each time: a name
+ * that isn't in the snapshot makes fs_dirsnap_changed() drop it.
+ */
+static void
+mb_dirsnap_cold(void)
+{
+	struct fs_dirsnap *ds;
+
+	fs_dirsnap_changed(mb_arg);
+	if ((ds = fs_dirsnap_get("Big")) == NULL)
+		err(1, "Big");
+	fs_dirsnap_release(ds);
+}
+
+static int
+mb_count(void *arg, struct fs_ent *ent)
+{
+
+	(*(int *)arg)++;
+	return 0;
+}
+
+/* Read a page from somewhere in a directory too big to keep. */
+static void
+mb_dirstream(void)
+{
+	static struct fs_dirstream *dst;
+	int n;
+
+	if (dst == NULL && (dst = fs_dirstream_open(mb_arg)) == NULL)
+		err(1, "%s", mb_arg);
+	n = 0;
+	if (fs_dirstream_read(dst, (mb_iter * 997) % (MB_BIG - 32), 32,
+	    mb_count, &n) != 32 || n != 32)
+		errx(1, "%s: short read", mb_arg);
+}
+
+static int
+mb_compare(const FTSENT **a, const FTSENT **b)
+{
+
+	return strcasecmp((*a)->fts_name, (*b)->fts_name);
+}
+
+static void
+mb_dirsnap_fts(void)
+{
+	char *argv[] = { mb_arg, NULL };
+	FTS *ftsp;
+
+	if ((ftsp = fts_open(argv, FTS_LOGICAL, mb_compare)) == NULL ||
+	    fts_read(ftsp) == NULL || fts_children(ftsp, 0) == NULL)
+		err(1, "%s", mb_arg);
+	fts_close(ftsp);
+}
+
+/*
+ * The wildcard matcher that fs_wild_match() replaced, for comparison.
+ */
+static int
+mb_oldfrag(char *frag, char *file)
+{
+	while (*frag && *frag != '*') {
+		if (*frag != '?' && (toupper((unsigned char)*file) !=
+				     toupper((unsigned char)*frag)))
+			return 0;
+		frag++;
+		file++;
+	}
+	return 1;
+}
+
+static int
+mb_oldmatch(char *wc, char *file, int len)
+{
+	char *fragend;
+	char *filestart = file;
+	int at_start = 1;
+
+	while (*wc) {
+		for (fragend = wc; *fragend && *fragend != '*'; fragend++);
+		if (*fragend) {
+			while (len >= fragend - wc &&
+			       ((at_start && file!=filestart) ||
+				!mb_oldfrag(wc, file)))
+				file++, len--;
+			if (len < fragend - wc)
+				return 0;
+			file += fragend - wc;
+			len -= fragend - wc;
+			wc = fragend;
+		} else {
+			if (len < fragend - wc)
+				return 0;
+			file += len - (fragend - wc);
+			return ((!at_start || file==filestart) &&
+				mb_oldfrag(wc, file));
+		}
+		while (*wc == '*') wc++;
+		at_start = 0;
+	}
+	return 1;
+}
+
+/*
+ * Wildcards are compiled by the first call of each case, and then
+ * matched against one name per call, or against every name in Big.
+ */
+static void
+mb_wild_compile(void)
+{
+
+	if (mb_iter == 0) {
+		if (mb_wc != NULL)
+			fs_wild_free(mb_wc);
+		if ((mb_wc = fs_wild_compile(mb_arg)) == NULL)
+			err(1, "fs_wild_compile");
+	}
+}
+
+static void
+mb_wild_one(void)
+{
+	int i = mb_iter % mb_nnames;
+
+	mb_wild_compile();
+	fs_wild_match(mb_wc, mb_names[i], mb_namelens[i]);
+}
+
+static void
+mb_wild_scan(void)
+{
+	int i, n = 0;
+
+	mb_wild_compile();
+	for (i = 0; i < mb_nbig; i++)
+		n += fs_wild_match(mb_wc, mb_bignames[i], mb_biglens[i]);
+	if (n != 1)
+		errx(1, "%s: %d matches", mb_arg, n);
+}
+
+static void
+mb_wild_scan_old(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < mb_nbig; i++)
+		n += mb_oldmatch(mb_arg, mb_bignames[i], mb_biglens[i]);
+	if (n != 1)
+		errx(1, "%s: %d matches", mb_arg, n);
+}
+
+static void
+mb_get_meta_link(void)
+{
+	struct ec_fs_meta meta;
+
+	fs_get_meta(&mb_meta[mb_iter % mb_nmeta], &meta);
+	if (mb_iter == 0 && meta.exec_addr[1] != 0x80)
+		errx(1, "get_meta: metadata not found");
+}
+
+static void
+mb_get_meta_stat(void)
+{
+	struct ec_fs_meta meta;
+
+	fs_get_meta(&mb_plain[mb_iter % mb_nplain], &meta);
+}
+
+/*
+ * Finding out about one file, as the handlers used to, and with
+ * fs_ent_stat().
+ */
+static void
+mb_stat_fts(void)
+{
+	char *argv[] = { mb_arg, NULL };
+	FTS *ftsp;
+
+	if ((ftsp = fts_open(argv, FTS_LOGICAL, NULL)) == NULL ||
+	    fts_read(ftsp) == NULL)
+		err(1, "%s", mb_arg);
+	fts_close(ftsp);
+}
+
+static void
+mb_stat_ent(void)
+{
+	struct fs_ent ent;
+
+	if (fs_ent_stat(mb_arg, &ent) < 0)
+		err(1, "%s", mb_arg);
+}
+
+/*
+ * What GET_INFO used to do for each request, and what it does now.
+ */
+static void
+mb_get_info_fts(void)
+{
+	char *argv[] = { mb_arg, NULL };
+	struct ec_fs_meta meta;
+	struct fs_ent ent;
+	FTS *ftsp;
+	FTSENT *f;
+
+	if ((ftsp = fts_open(argv, FTS_LOGICAL, NULL)) == NULL ||
+	    (f = fts_read(ftsp)) == NULL)
+		err(1, "%s", mb_arg);
+	fs_ent_path(&ent, f->fts_path);
+	fs_ent_fromstat(&ent, f->fts_statp);
+	fs_get_meta(&ent, &meta);
+	fs_get_birthtime(&ent);
+	fts_close(ftsp);
+}
+
+static void
+mb_get_info_cached(void)
+{
+	struct fs_attr attr;
+
+	if (fs_attr_get(mb_arg, &attr, FS_ATTR_META) < 0)
+		err(1, "%s", mb_arg);
+	if (mb_arg == mb_infopath && mb_iter == 0 &&
+	    attr.meta.exec_addr[1] != 0x80)
+		errx(1, "get_info: metadata not found");
+}
+
+static void
+mb_write_date(void)
+{
+	struct ec_fs_date date;
+
+	fs_write_date(&date, 1000000000 + mb_iter * 3600);
+}
+
+static void
+mb_guess_suffix(void)
+{
+
+	if (fs_guess_type(&mb_typed[mb_iter % mb_ntyped]) != 0xffb)
+		errx(1, "guess_type: suffix ignored");
+}
+
+static void
+mb_guess_typemap(void)
+{
+
+	if (fs_guess_type(&mb_plain[mb_iter % mb_nplain]) != 0xfff)
+		errx(1, "guess_type: wrong type");
+}
+
+static void
+mb_acornify(void)
+{
+	char name[NAME_MAX + 1];
+
+	strcpy(name, mb_names[mb_iter % mb_nnames]);
+	fs_acornify_name(name);
+}
+
+static uint64_t
+mb_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Time one case, doubling the number of calls until they take at
+ * least mb_mintime.  The first call is made on its own beforehand,
+ * so that it can check its result and warm up the caches.
+ */
+static void
+mb_run(const struct mb_case *mc)
+{
+	uint64_t allocs, elapsed, start, n, i;
+
+	mb_arg = mc->arg;
+	mb_iter = 0;
+	mc->fn();
+	mb_iter++;
+	for (n = 1;; n *= 2) {
+		allocs = mb_allocs;
+		start = mb_nsec();
+		for (i = 0; i < n; i++, mb_iter++)
+			mc->fn();
+		elapsed = mb_nsec() - start;
+		allocs = mb_allocs - allocs;
+		if (elapsed >= mb_mintime || n >= (uint64_t)1 << 32)
+			break;
+	}
+	printf("%-20s %10" PRIu64 " %12.1f %10.2f\n", mc->name, n,
+	    (double)elapsed / n, (double)allocs / n);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t i;
+	int c, j, len;
+
+	progname = argv[0];
+	while ((c = getopt(argc, argv, "t:")) != -1) {
+		switch (c) {
+		case 't':
+			mb_mintime = strtoull(optarg, NULL, 10) * 1000000;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	mb_build();
+	/*
+	 * The name index doesn't trust directories that have only
+	 * just changed, so let the new ones age first.
+	 */
+	sleep(2);
+	mb_paths();
+	mb_typemap();
+	mb_context();
+	mb_entries();
+	printf("%d levels of %d files, %d typemap rules\n",
+	    MB_DEPTH, MB_FILES, MB_TYPEMAP + 2);
+	printf("%-20s %10s %12s %10s\n", "case", "calls", "ns/op",
+	    "allocs/op");
+	for (i = 0; i < sizeof(mb_cases) / sizeof(mb_cases[0]); i++) {
+		for (j = 0; j < argc; j++) {
+			len = strlen(argv[j]);
+			if (strncmp(mb_cases[i].name, argv[j], len) == 0)
+				break;
+		}
+		if (argc == 0 || j < argc)
+			mb_run(&mb_cases[i]);
+	}
+	return 0;
+}
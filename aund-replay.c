@@ -0,0 +1,660 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * aund-replay.c - play a packet capture back through the file server
+ *
+ * This reads a capture made with aund's "capture" option (or by
+ * tcpdump, given -s to say which address was the server's), picks
+ * out what the client stations sent, and sends it again, from
+ * simulated stations on the loopback transport, to the file server
+ * linked in here.  Since requests change the files they act on, the
+ * server should be given a copy of the tree that was being served
+ * when the capture started, with -r or in the configuration file.
+ *
+ * Packets are sent at the times they were captured, or with -f on
+ * the event loop's virtual clock, which keeps them in the same order
+ * and spacing but doesn't wait, so the trace runs as fast as the
+ * server can go.  Either way, a station which is still waiting for an
+ * answer holds back its next request, as the real one did, so a
+ * server slower than the original doesn't see requests it could never
+ * have had.  At the end, the time each kind of request took to be
+ * answered is reported, in real time, followed by the usual
+ * statistics.
+ *
+ * Both AUN and BeebEm captures are understood.  A BeebEm station's
+ * scout and payload packets are put back together, and retransmitted
+ * AUN packets are only sent once.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aio.h"
+#include "aun.h"
+#include "capture.h"
+#include "event.h"
+#include "extern.h"
+#include "fileserver.h"
+#include "fs_proto.h"
+#include "loopback.h"
+
+/* Things the rest of aund expects the main program to provide. */
+int debug = 0;
+int workers = 1;
+int using_syslog = 0;
+char *beebem_cfg_file = NULL;
+const struct aun_funcs *aunfuncs = &loopback;
+
+/* Where a BeebEm file server lives, as network * 256 + station. */
+#define BEEBEM_FS	254
+
+/* A packet sent by a client station. */
+struct rp_msg {
+	STAILQ_ENTRY(rp_msg) link;
+	uint64_t when;		/* microseconds into the trace */
+	int stn;
+	int port, flag;
+	size_t len;
+	uint8_t *data;
+};
+
+#define RP_SEEN 16
+
+/*
+ * How long a station waits for an answer before carrying on with the
+ * trace regardless.
+ */
+#define RP_REQ_TIMEOUT 1000000
+
+struct rp_stn {
+	struct lb_station *lb;
+	/* Reading the trace. */
+	uint32_t seen[RP_SEEN];	/* Recent AUN sequence numbers */
+	int nseen;
+	int scout;		/* BeebEm scout waiting for its payload */
+	int scout_port, scout_flag;
+	/*
+	 * Replaying it.  Like a real client, a station has only one
+	 * file server request going at once, and anything after it in
+	 * the trace is held back until it's answered.
+	 */
+	int busy;
+	int func, replyport;
+	int replies, expect;	/* received, and how many to expect */
+	uint64_t start;
+	struct ev_timer timer;
+	STAILQ_HEAD(, rp_msg) held;
+};
+
+/* One reply, and how long it took. */
+struct rp_sample {
+	int func;
+	uint64_t usec;
+};
+
+static char *progname;
+static struct rp_stn rp_stns[256];
+static struct rp_msg *rp_msgs;
+static size_t rp_nmsgs, rp_next;
+static struct rp_sample *rp_samples;
+static size_t rp_nsamples, rp_maxsamples;
+static struct ev_timer rp_timer;
+static uint64_t rp_start;
+static int rp_busy;		/* stations waiting for answers */
+static size_t rp_nheld;		/* packets held back */
+static unsigned long rp_timeouts;
+static int rp_done;
+
+static const char *const func_names[] = {
+	"CLI", "SAVE", "LOAD", "EXAMINE", "CATHDR", "LOADCMD", "OPEN",
+	"CLOSE", "GETBYTE", "PUTBYTE", "GETBYTES", "PUTBYTES", "GETARGS",
+	"SETARGS", "GETDISCS", "USERSON", "GETTIME", "GETEOF", "GETINFO",
+	"SETINFO", "DELETE", "GETUENV", "SETOPT4", "LOGOFF", "GETUSER",
+	"VERSION", "DISCFREE", "CDIRN", "SETTIME", "CREATE", "USERFREE",
+	"SETUFREE", "WHOAMI", "USERSEXT", "UINFOEXT", "COPYDATA",
+};
+
+#define NFUNCS (sizeof(func_names) / sizeof(func_names[0]))
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: %s [-df] [-c config] [-r root] "
+	    "[-s server-addr] capture\n", progname);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Report a line of statistics.
+ */
+void
+stats_printf(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	putchar('\n');
+	va_end(ap);
+}
+
+static uint64_t
+real_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned
+get16(const uint8_t *p)
+{
+
+	return p[0] << 8 | p[1];
+}
+
+static uint32_t
+get32(const uint8_t *p, int swap)
+{
+
+	if (swap)
+		return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+	return (uint32_t)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+static void
+rp_add(uint64_t when, int stn, int port, int flag, const uint8_t *data,
+    size_t len)
+{
+	struct rp_msg *m;
+	static size_t max;
+
+	if (rp_nmsgs == max) {
+		max = max ? max * 2 : 1024;
+		if ((rp_msgs = realloc(rp_msgs, max * sizeof(*rp_msgs))) ==
+		    NULL)
+			err(1, "realloc");
+	}
+	m = &rp_msgs[rp_nmsgs++];
+	m->when = when;
+	m->stn = stn;
+	m->port = port;
+	m->flag = flag;
+	m->len = len;
+	if ((m->data = malloc(len ? len : 1)) == NULL)
+		err(1, "malloc");
+	memcpy(m->data, data, len);
+}
+
+/*
+ * Deal with the UDP payload of a packet sent to the server.
+ */
+static void
+rp_payload(uint64_t when, struct in_addr src, const uint8_t *p, size_t len)
+{
+	struct rp_stn *s;
+	uint32_t seq;
+	int i;
+
+	if (len >= 4 && p[1] * 256 + p[0] == BEEBEM_FS) {
+		/* A BeebEm frame: destination, then source. */
+		s = &rp_stns[p[2]];
+		if (s->scout) {
+			s->scout = 0;
+			rp_add(when, p[2], s->scout_port, s->scout_flag, p + 4,
+			    len - 4);
+		} else if (len == 6 && p[5] != 0) {
+			s->scout = 1;
+			s->scout_flag = p[4];
+			s->scout_port = p[5];
+		}
+		/* Anything else is an ACK or an immediate operation. */
+		return;
+	}
+	if (len < sizeof(struct aun_packet) ||
+	    (p[0] != AUN_TYPE_UNICAST && p[0] != AUN_TYPE_BROADCAST))
+		return;
+	/* AUN stations are numbered after the last byte of their address. */
+	s = &rp_stns[ntohl(src.s_addr) & 0xff];
+	seq = get32(p + 4, 0);
+	for (i = 0; i < s->nseen && i < RP_SEEN; i++)
+		if (s->seen[i] == seq)
+			return;
+	s->seen[s->nseen++ % RP_SEEN] = seq;
+	rp_add(when, ntohl(src.s_addr) & 0xff, p[1], p[2],
+	    p + sizeof(struct aun_packet), len - sizeof(struct aun_packet));
+}
+
+/*
+ * Read a capture, keeping what was sent to the server.  Captures with
+ * no record of direction need the server's address.
+ */
+static void
+rp_read(const char *file, const char *server)
+{
+	uint8_t ghdr[24], rhdr[16], *pkt, *ip, *udp;
+	struct in_addr srvaddr, src;
+	uint64_t when, first = 0;
+	uint32_t linktype, caplen, frac;
+	size_t off, ihl, len;
+	FILE *f;
+	int swap, nano, inbound;
+
+	if (server != NULL && inet_aton(server, &srvaddr) == 0)
+		errx(1, "%s: bad address", server);
+	if ((f = fopen(file, "r")) == NULL)
+		err(1, "%s", file);
+	if (fread(ghdr, sizeof(ghdr), 1, f) != 1)
+		errx(1, "%s: not a capture file", file);
+	switch (get32(ghdr, 0)) {
+	case 0xa1b2c3d4: swap = 0; nano = 0; break;
+	case 0xa1b23c4d: swap = 0; nano = 1; break;
+	case 0xd4c3b2a1: swap = 1; nano = 0; break;
+	case 0x4d3cb2a1: swap = 1; nano = 1; break;
+	default:
+		errx(1, "%s: not a capture file", file);
+	}
+	linktype = get32(ghdr + 20, swap);
+	switch (linktype) {
+	case CAPTURE_LINKTYPE:
+		off = CAPTURE_SLL_LEN;
+		break;
+	case 1:		/* Ethernet */
+		off = 14;
+		break;
+	case 101:	/* Raw IP */
+	case 228:	/* IPv4 */
+		off = 0;
+		break;
+	default:
+		errx(1, "%s: can't handle link type %u", file, linktype);
+	}
+	if (linktype != CAPTURE_LINKTYPE && server == NULL)
+		errx(1, "%s: need the server's address (-s)", file);
+	if ((pkt = malloc(65536 + off)) == NULL)
+		err(1, "malloc");
+
+	while (fread(rhdr, sizeof(rhdr), 1, f) == 1) {
+		caplen = get32(rhdr + 8, swap);
+		if (caplen > 65536 + off)
+			errx(1, "%s: record too long", file);
+		if (fread(pkt, caplen, 1, f) != 1)
+			break;
+		frac = get32(rhdr + 4, swap);
+		when = get32(rhdr, swap) * (uint64_t)1000000 +
+		    (nano ? frac / 1000 : frac);
+		if (first == 0)
+			first = when;
+		if (caplen < off + 28)
+			continue;
+		if (linktype == CAPTURE_LINKTYPE &&
+		    get16(pkt + 14) != 0x0800)
+			continue;
+		if (linktype == 1 && get16(pkt + 12) != 0x0800)
+			continue;
+		ip = pkt + off;
+		ihl = (ip[0] & 0x0f) * 4;
+		if ((ip[0] >> 4) != 4 || ip[9] != IPPROTO_UDP ||
+		    caplen < off + ihl + 8)
+			continue;
+		memcpy(&src, ip + 12, 4);
+		if (linktype == CAPTURE_LINKTYPE)
+			inbound = get16(pkt) != CAPTURE_OUT;
+		else
+			inbound = memcmp(ip + 16, &srvaddr, 4) == 0;
+		if (!inbound)
+			continue;
+		udp = ip + ihl;
+		len = get16(udp + 4);
+		if (len < 8)
+			continue;
+		len -= 8;
+		if (len > caplen - off - ihl - 8)
+			len = caplen - off - ihl - 8;
+		rp_payload(when - first, src, udp + 8, len);
+	}
+	if (ferror(f))
+		err(1, "%s", file);
+	fclose(f);
+	free(pkt);
+}
+
+static void
+rp_sent(void *arg, int error)
+{
+	struct rp_stn *s = arg;
+
+	if (error != 0)
+		warnx("station %d: packet not delivered: %s",
+		    lb_station_number(s->lb), strerror(error));
+}
+
+static void rp_xmit(struct rp_stn *, struct rp_msg *);
+
+/*
+ * Must a station hold a packet back?  Data for a request can go once
+ * the server has replied to it.
+ */
+static int
+rp_must_hold(struct rp_stn *s, struct rp_msg *m)
+{
+
+	return s->busy && (m->port == EC_PORT_FS || s->replies == 0);
+}
+
+/*
+ * Send what a station has been holding back, until it has to wait
+ * again.
+ */
+static void
+rp_flush(struct rp_stn *s)
+{
+	struct rp_msg *m;
+
+	while ((m = STAILQ_FIRST(&s->held)) != NULL && !rp_must_hold(s, m)) {
+		STAILQ_REMOVE_HEAD(&s->held, link);
+		rp_nheld--;
+		rp_xmit(s, m);
+	}
+}
+
+/*
+ * A station's request has been answered, or we've given up on it.
+ */
+static void
+rp_release(struct rp_stn *s)
+{
+
+	ev_timer_del(&s->timer);
+	s->busy = 0;
+	rp_busy--;
+	rp_flush(s);
+}
+
+static void
+rp_timeout(void *arg)
+{
+	struct rp_stn *s = arg;
+
+	rp_timeouts++;
+	rp_release(s);
+}
+
+static void
+rp_input(struct lb_station *lb, struct aun_packet *pkt, size_t len,
+    void *arg)
+{
+	struct rp_stn *s = arg;
+	struct rp_sample *sp;
+
+	if (!s->busy || pkt->dest_port != s->replyport)
+		return;
+	len -= sizeof(*pkt);
+	/* An error is the only reply. */
+	if (++s->replies < s->expect && len >= 2 && pkt->data[1] == 0) {
+		rp_flush(s);
+		return;
+	}
+	if (rp_nsamples == rp_maxsamples) {
+		rp_maxsamples = rp_maxsamples ? rp_maxsamples * 2 : 1024;
+		rp_samples = realloc(rp_samples,
+		    rp_maxsamples * sizeof(*rp_samples));
+		if (rp_samples == NULL)
+			err(1, "realloc");
+	}
+	sp = &rp_samples[rp_nsamples++];
+	sp->func = s->func;
+	sp->usec = real_usec() - s->start;
+	rp_release(s);
+}
+
+static void
+rp_xmit(struct rp_stn *s, struct rp_msg *m)
+{
+
+	if (m->port == EC_PORT_FS && m->len >= 2) {
+		s->busy = 1;
+		rp_busy++;
+		s->replyport = m->data[0];
+		s->func = m->data[1];
+		s->replies = 0;
+		/* These have a reply before the data and one after. */
+		switch (s->func) {
+		case EC_FS_FUNC_SAVE:
+		case EC_FS_FUNC_LOAD:
+		case EC_FS_FUNC_LOAD_COMMAND:
+		case EC_FS_FUNC_GETBYTES:
+		case EC_FS_FUNC_PUTBYTES:
+			s->expect = 2;
+			break;
+		default:
+			s->expect = 1;
+			break;
+		}
+		s->start = real_usec();
+		ev_timer_add(&s->timer, RP_REQ_TIMEOUT);
+	}
+	lb_station_xmit(s->lb, m->port, m->flag, m->data, m->len, rp_sent,
+	    s);
+}
+
+/*
+ * Send a packet from the trace, unless its station is waiting for an
+ * answer to an earlier request.
+ */
+static void
+rp_send(struct rp_msg *m)
+{
+	struct rp_stn *s = &rp_stns[m->stn];
+
+	if (s->lb == NULL) {
+		if ((s->lb = lb_station_new(m->stn, rp_input, s)) == NULL)
+			err(1, "lb_station_new");
+		ev_timer_init(&s->timer, rp_timeout, s);
+		STAILQ_INIT(&s->held);
+	}
+	if (!STAILQ_EMPTY(&s->held) || rp_must_hold(s, m)) {
+		STAILQ_INSERT_TAIL(&s->held, m, link);
+		rp_nheld++;
+		return;
+	}
+	rp_xmit(s, m);
+}
+
+/*
+ * Send everything that's due, and wait for the next one.  Once it's
+ * all been sent and answered, the last packets have a moment to get
+ * through.
+ */
+static void
+rp_tick(void *arg)
+{
+	uint64_t now;
+
+	if (rp_next == rp_nmsgs && rp_nheld == 0 && rp_busy == 0) {
+		rp_done = 1;
+		return;
+	}
+	while (rp_next < rp_nmsgs &&
+	    rp_msgs[rp_next].when <= (now = ev_now() - rp_start))
+		rp_send(&rp_msgs[rp_next++]);
+	if (rp_next < rp_nmsgs)
+		ev_timer_add(&rp_timer, rp_msgs[rp_next].when - now);
+}
+
+static int
+rp_compare(const void *a, const void *b)
+{
+	const struct rp_sample *x = a, *y = b;
+
+	if (x->func != y->func)
+		return x->func - y->func;
+	return (x->usec > y->usec) - (x->usec < y->usec);
+}
+
+static double
+rp_quantile(const struct rp_sample *s, size_t n, double q)
+{
+	size_t i;
+
+	i = q * n;
+	if (i >= n)
+		i = n - 1;
+	return s[i].usec / 1000.0;
+}
+
+static void
+rp_report(void)
+{
+	char name[16];
+	size_t i, j;
+
+	qsort(rp_samples, rp_nsamples, sizeof(*rp_samples), rp_compare);
+	printf("%-9s %8s %9s %9s %9s %9s\n", "function", "requests",
+	    "p50 ms", "p99 ms", "p99.9 ms", "max ms");
+	for (i = 0; i < rp_nsamples; i = j) {
+		for (j = i; j < rp_nsamples &&
+		    rp_samples[j].func == rp_samples[i].func; j++)
+			continue;
+		if (rp_samples[i].func < NFUNCS)
+			snprintf(name, sizeof(name), "%s",
+			    func_names[rp_samples[i].func]);
+		else
+			snprintf(name, sizeof(name), "%d",
+			    rp_samples[i].func);
+		printf("%-9s %8zu %9.3f %9.3f %9.3f %9.3f\n", name, j - i,
+		    rp_quantile(rp_samples + i, j - i, 0.5),
+		    rp_quantile(rp_samples + i, j - i, 0.99),
+		    rp_quantile(rp_samples + i, j - i, 0.999),
+		    rp_samples[j - 1].usec / 1000.0);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct lb_params params;
+	const char *conffile = "/etc/aund.conf", *server = NULL;
+	char *newroot = NULL;
+	uint64_t t0, t1;
+	int c, fast = 0, override_debug = 0, draining = 0;
+
+	progname = argv[0];
+	while ((c = getopt(argc, argv, "c:dfr:s:")) != -1) {
+		switch (c) {
+		case 'c':
+			conffile = optarg;
+			break;
+		case 'd':
+			override_debug = 1;
+			break;
+		case 'f':
+			fast = 1;
+			break;
+		case 'r':
+			newroot = optarg;
+			break;
+		case 's':
+			server = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+
+	rp_read(argv[0], server);
+	if (rp_nmsgs == 0)
+		errx(1, "%s: nothing sent to the server", argv[0]);
+
+	conf_init(conffile);
+	if (override_debug)
+		debug = 1;
+	if (newroot != NULL)
+		root = newroot;
+	using_syslog = 0;
+	capture_file = NULL;
+	ev_init();
+	if (fast) {
+		ev_set_virtual();
+		aio_sync = 1;
+	}
+	fs_init();
+	memset(&params, 0, sizeof(params));
+	lb_configure(&params);
+	aunfuncs->setup();
+	if (chdir(root) < 0)
+		err(1, "%s: chdir", root);
+
+	ev_timer_init(&rp_timer, rp_tick, NULL);
+	rp_start = ev_now();
+	rp_tick(NULL);
+	t0 = real_usec();
+	while (!rp_done) {
+		ev_run_once(!ec_port_pending());
+		while (ec_port_dispatch())
+			continue;
+		if (rp_next == rp_nmsgs && rp_nheld == 0 && rp_busy == 0 &&
+		    !draining) {
+			ev_timer_add(&rp_timer, 10000);
+			draining = 1;
+		}
+	}
+	t1 = real_usec();
+
+	printf("%zu packets in %.3fs of trace, replayed in %.3fs; "
+	    "%lu requests unanswered\n", rp_nmsgs,
+	    rp_msgs[rp_nmsgs - 1].when / 1e6, (t1 - t0) / 1e6, rp_timeouts);
+	rp_report();
+	fs_stats();
+	aunfuncs->stats();
+	return 0;
+}
@@ -0,0 +1,441 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * aund-sim.c - run the file server against simulated stations
+ *
+ * This links in the whole file server, connects it to a number of
+ * simulated client stations through the loopback transport, and has
+ * each of them log on and load a file repeatedly.  The network
+ * between them can be made to lose, delay, duplicate and reorder
+ * packets.  Everything runs on the event loop's virtual clock, and
+ * file I/O is done synchronously, so the results depend only on the
+ * settings and the random seed, not on how fast the machine is or
+ * what else it's doing.
+ *
+ * At the end, it reports the throughput and the distribution of load
+ * times, in virtual time, followed by the usual statistics.
+ * If the stations stop getting anywhere, it says where each of them
+ * had got to and fails.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aio.h"
+#include "aun.h"
+#include "event.h"
+#include "extern.h"
+#include "fileserver.h"
+#include "fs_proto.h"
+#include "loopback.h"
+
+/*
+ * Each request asks for its reply on a different port, so that
+ * stray replies to earlier ones, such as repeats from the server's
+ * reply cache when a request is duplicated, are ignored.
+ */
+#define REPLY_PORT	0x80	/* to 0x8f */
+#define DATA_PORT	0x92
+
+/* Things the rest of aund expects the main program to provide. */
+int debug = 0;
+int workers = 1;
+int using_syslog = 0;
+char *beebem_cfg_file = NULL;
+const struct aun_funcs *aunfuncs = &loopback;
+
+enum sim_state { SIM_LOGON, SIM_WINDOW, SIM_LOAD, SIM_DONE };
+
+struct sim_stn {
+	struct lb_station *lb;
+	enum sim_state state;
+	int replyport;
+	uint8_t urd, csd, lib;
+	int loads;		/* Still to do */
+	/*
+	 * The current load.  The network may reorder the replies and
+	 * the data, so they're counted in whatever order they come.
+	 */
+	int have_size;
+	size_t size, got;
+	int finished;		/* Final reply seen */
+	uint64_t start;
+};
+
+static char *progname;
+static const char *sim_file;
+static int sim_window = 0;
+static int sim_nloads = 10;
+static int sim_active;
+
+/* Time taken by each load, in microseconds. */
+static uint64_t *sim_times;
+static size_t sim_ntimes;
+static size_t sim_bytes;
+
+static void sim_next(struct sim_stn *);
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: %s [-d] [-c config] [-D delay] [-j jitter] "
+	    "[-l loss] [-n loads]\n"
+	    "       [-r reorder] [-R reorder-delay] [-s stations] [-S seed] "
+	    "[-u dup]\n"
+	    "       [-w window] file\n", progname);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Report a line of statistics.
+ */
+void
+stats_printf(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	putchar('\n');
+	va_end(ap);
+}
+
+static void
+sim_sent(void *arg, int error)
+{
+	struct sim_stn *s = arg;
+
+	if (error != 0)
+		errx(1, "station %d: request failed: %s",
+		    lb_station_number(s->lb), strerror(error));
+}
+
+static void
+sim_fsreq(struct sim_stn *s, int function, int urd, const char *arg)
+{
+	uint8_t buf[256];
+	size_t len;
+
+	s->replyport = REPLY_PORT + (s->replyport + 1) % 16;
+	buf[0] = s->replyport;
+	buf[1] = function;
+	buf[2] = urd;
+	buf[3] = s->csd;
+	buf[4] = s->lib;
+	len = snprintf((char *)buf + 5, sizeof(buf) - 5, "%s\r", arg);
+	lb_station_xmit(s->lb, EC_PORT_FS, 0, buf, len + 5, sim_sent, s);
+}
+
+static int
+sim_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * If the current load has finished, record it and start the next
+ * thing.
+ */
+static void
+sim_load_check(struct sim_stn *s)
+{
+
+	if (!s->have_size || !s->finished || s->got < s->size)
+		return;
+	sim_times[sim_ntimes++] = ev_now() - s->start;
+	sim_bytes += s->size;
+	s->loads--;
+	sim_next(s);
+}
+
+static void
+sim_input(struct lb_station *lb, struct aun_packet *pkt, size_t len,
+    void *arg)
+{
+	struct sim_stn *s = arg;
+	uint8_t *data = pkt->data;
+
+	len -= sizeof(*pkt);
+	if (pkt->dest_port == DATA_PORT && s->state == SIM_LOAD) {
+		s->got += len;
+		sim_load_check(s);
+		return;
+	}
+	if (pkt->dest_port != s->replyport)
+		return;
+	if (len < 2)
+		errx(1, "station %d: short reply", lb_station_number(lb));
+	if (data[1] != EC_FS_RC_OK)
+		errx(1, "station %d: error from server: %.*s",
+		    lb_station_number(lb), (int)len - 2, data + 2);
+	switch (s->state) {
+	case SIM_LOGON:
+		if (data[0] != EC_FS_CC_LOGON || len < 5)
+			errx(1, "station %d: bad logon reply",
+			    lb_station_number(lb));
+		s->urd = data[2];
+		s->csd = data[3];
+		s->lib = data[4];
+		s->state = SIM_WINDOW;
+		sim_next(s);
+		break;
+	case SIM_WINDOW:
+		s->state = SIM_LOAD;
+		sim_next(s);
+		break;
+	case SIM_LOAD:
+		/*
+		 * The first reply has the size, after the command and
+		 * return codes and the meta.  The final one is bare.
+		 */
+		if (len >= 13 && !s->have_size) {
+			s->size = data[10] | data[11] << 8 | data[12] << 16;
+			s->have_size = 1;
+		} else
+			s->finished = 1;
+		sim_load_check(s);
+		break;
+	case SIM_DONE:
+		break;
+	}
+}
+
+/*
+ * Send a station's next request.
+ */
+static void
+sim_next(struct sim_stn *s)
+{
+	char cmd[64];
+
+	switch (s->state) {
+	case SIM_LOGON:
+		sim_fsreq(s, EC_FS_FUNC_CLI, 0, "I AM SIM");
+		break;
+	case SIM_WINDOW:
+		if (sim_window == 0) {
+			s->state = SIM_LOAD;
+			sim_next(s);
+			break;
+		}
+		snprintf(cmd, sizeof(cmd), "FSOPT WINDOW %d", sim_window);
+		sim_fsreq(s, EC_FS_FUNC_CLI, s->urd, cmd);
+		break;
+	case SIM_LOAD:
+		if (s->loads == 0) {
+			s->state = SIM_DONE;
+			sim_active--;
+			break;
+		}
+		s->have_size = 0;
+		s->got = 0;
+		s->finished = 0;
+		s->start = ev_now();
+		sim_fsreq(s, EC_FS_FUNC_LOAD, DATA_PORT, sim_file);
+		break;
+	case SIM_DONE:
+		break;
+	}
+}
+
+/*
+ * Give up on a simulation that can't make any more progress: every
+ * station that hasn't finished is waiting for something that will
+ * never arrive.
+ */
+static void
+sim_stuck(struct sim_stn *stns, int nstations)
+{
+	static const char *const states[] = {
+		[SIM_LOGON] = "logging on", [SIM_WINDOW] = "setting window",
+		[SIM_LOAD] = "loading", [SIM_DONE] = "done",
+	};
+	struct sim_stn *s;
+	int i;
+
+	for (i = 0; i < nstations; i++) {
+		s = &stns[i];
+		if (s->state == SIM_DONE)
+			continue;
+		warnx("station %d: %s, %d loads to go, %zu/%zu bytes%s%s",
+		    lb_station_number(s->lb), states[s->state], s->loads,
+		    s->got, s->size, s->have_size ? "" : ", no size",
+		    s->finished ? ", final reply seen" : "");
+	}
+	errx(1, "stuck at %.3fs virtual time", ev_now() / 1e6);
+}
+
+static double
+sim_percentile(double p)
+{
+	double rank = p * sim_ntimes;
+	size_t i;
+
+	/* Nearest rank: the smallest time at least p of loads took. */
+	i = rank;
+	if (i < rank)
+		i++;
+	if (i > 0)
+		i--;
+	if (i >= sim_ntimes)
+		i = sim_ntimes - 1;
+	return sim_times[i] / 1000.0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct lb_params params;
+	struct sim_stn *stns;
+	const char *conffile = "/etc/aund.conf";
+	struct timespec t0, t1;
+	uint64_t elapsed;
+	int c, i, nstations = 1, override_debug = 0;
+
+	progname = argv[0];
+	memset(&params, 0, sizeof(params));
+	params.delay = 500;
+	params.reorder_delay = 2000;
+	params.seed = 1;
+	while ((c = getopt(argc, argv, "c:dD:j:l:n:r:R:s:S:u:w:")) != -1) {
+		switch (c) {
+		case 'c':
+			conffile = optarg;
+			break;
+		case 'd':
+			override_debug = 1;
+			break;
+		case 'D':
+			params.delay = atof(optarg) * 1000;
+			break;
+		case 'j':
+			params.jitter = atof(optarg) * 1000;
+			break;
+		case 'l':
+			params.loss = atof(optarg) / 100;
+			break;
+		case 'n':
+			sim_nloads = atoi(optarg);
+			break;
+		case 'r':
+			params.reorder = atof(optarg) / 100;
+			break;
+		case 'R':
+			params.reorder_delay = atof(optarg) * 1000;
+			break;
+		case 's':
+			nstations = atoi(optarg);
+			if (nstations < 1 || nstations > 254)
+				usage();
+			break;
+		case 'S':
+			params.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			params.dup = atof(optarg) / 100;
+			break;
+		case 'w':
+			sim_window = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1 || sim_nloads < 1)
+		usage();
+	sim_file = argv[0];
+
+	conf_init(conffile);
+	if (override_debug)
+		debug = 1;
+	using_syslog = 0;
+	ev_init();
+	ev_set_virtual();
+	aio_sync = 1;
+	fs_init();
+	lb_configure(&params);
+	aunfuncs->setup();
+	if (chdir(root) < 0)
+		err(1, "%s: chdir", root);
+
+	if ((stns = calloc(nstations, sizeof(*stns))) == NULL ||
+	    (sim_times = calloc((size_t)nstations * sim_nloads,
+	    sizeof(*sim_times))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < nstations; i++) {
+		if ((stns[i].lb = lb_station_new(i + 1, sim_input,
+		    &stns[i])) == NULL)
+			err(1, "lb_station_new");
+		stns[i].loads = sim_nloads;
+		sim_active++;
+		sim_next(&stns[i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (sim_active > 0) {
+		ev_run_once(!ec_port_pending());
+		while (ec_port_dispatch())
+			continue;
+		if (sim_active > 0 && !ev_timer_any() && !ec_port_pending())
+			sim_stuck(stns, nstations);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	elapsed = ev_now();
+	qsort(sim_times, sim_ntimes, sizeof(*sim_times), sim_compare);
+	printf("%d stations, %zu loads, %zu bytes in %.3fs virtual time "
+	    "(%.3fs real)\n", nstations, sim_ntimes, sim_bytes,
+	    elapsed / 1e6, (t1.tv_sec - t0.tv_sec) +
+	    (t1.tv_nsec - t0.tv_nsec) / 1e9);
+	printf("throughput %.1f KB/s\n",
+	    elapsed ? sim_bytes / 1024.0 / (elapsed / 1e6) : 0.0);
+	printf("load time (ms): p50 %.3f p99 %.3f p99.9 %.3f max %.3f\n",
+	    sim_percentile(0.5), sim_percentile(0.99),
+	    sim_percentile(0.999), sim_times[sim_ntimes - 1] / 1000.0);
+	fs_stats();
+	aunfuncs->stats();
+	return 0;
+}
@@ -31,36 +31,52 @@
  */	
 
 #include <sys/types.h>
+#include <sys/queue.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 
-#include <assert.h>
 #include <err.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 
+#include "aio.h"
 #include "aun.h"
+#include "capture.h"
+#include "event.h"
 #include "extern.h"
 #include "fileserver.h"
 
-#define EC_PORT_FS 0x99
-
 extern const struct aun_funcs aun, beebem;
 
 int debug = 0;
 int foreground = 0;
+int workers = 1;			/* set by conf_lex.l */
 int using_syslog = 1;
 char *beebem_cfg_file = NULL;
 const struct aun_funcs *aunfuncs = &aun;
 char *progname;
 
 volatile int painful_death = 0;
+static volatile sig_atomic_t want_stats = 0;
+
+/*
+ * With more than one worker, the original process is worker 0, and
+ * keeps track of the others so that it can pass signals on.
+ */
+static int worker_id = 0;
+static pid_t *worker_pids = NULL;
 
 static void sig_init(void);
 static void sigcatcher(int);
+static void sigstats(int);
+static void stats_dump(void);
+static void start_workers(void);
+static void stop_workers(void);
 
 static void
 usage(void)
@@ -136,7 +152,12 @@ main(int argc, char *argv[])
 	conf_init(conffile);
 	if (beebem_cfg_file)
 		aunfuncs = &beebem;
+	if (workers > 1 && aunfuncs->worker == NULL)
+		errx(1, "this transport only supports one worker");
+	if (workers > 1 && fs_journal_file != NULL)
+		errx(1, "the metadata journal only supports one worker");
 
+	ev_init();
 	fs_init();
 
 	/*
@@ -151,6 +172,7 @@ main(int argc, char *argv[])
 	if (debug) setlinebuf(stdout);
 
 	aunfuncs->setup();
+	capture_init();
 
 	/*
 	 * We'll use relative pathnames for all our file accesses,
@@ -168,32 +190,76 @@ main(int argc, char *argv[])
 			LOG_DAEMON);
 		syslog(LOG_NOTICE, "started");
 	}
-	dopidfile(pidfile);
+	fs_journal_recover();
+	start_workers();
+	capture_start(worker_id);
+	fs_journal_start();
+	if (worker_id == 0)
+		dopidfile(pidfile);
 	if (debug)
 		printf("started\n");
 
 	for (;!painful_death;) {
-		ssize_t msgsize;
-		struct aun_packet *pkt;
-		struct aun_srcaddr from;
-
-		memset(&from, 0, sizeof(from)); /* all hosts */
-		pkt = aunfuncs->recv(&msgsize, &from, EC_PORT_FS);
-
-		switch (pkt->dest_port) {
-		case EC_PORT_FS:
-			if (debug) printf("\n\t(file server: ");
-			file_server(pkt, msgsize, &from);
-			if (debug) printf(")");
-			break;
-		default:
-			assert(!"Packet received from wrong port");
+		/* Only sleep if there's nothing already waiting. */
+		ev_run_once(!ec_port_pending());
+		while (!painful_death && ec_port_dispatch())
+			continue;
+		if (want_stats) {
+			want_stats = 0;
+			stats_dump();
 		}
-		if (debug) printf("\n");
 	}
+	fs_journal_stop();
+	stop_workers();
 	return 0;
 }
 
+/*
+ * Split into the configured number of worker processes.  Each has
+ * its own socket, and the transport arranges for all packets from a
+ * given station to arrive at the same one, so every worker serves a
+ * disjoint set of clients and they needn't share any state.
+ */
+static void
+start_workers(void)
+{
+	pid_t pid;
+	int i;
+
+	if (workers <= 1)
+		return;
+	if ((worker_pids = calloc(workers, sizeof(*worker_pids))) == NULL)
+		err(1, "calloc");
+	for (i = 1; i < workers; i++) {
+		if ((pid = fork()) == -1)
+			err(1, "fork");
+		if (pid == 0) {
+			free(worker_pids);
+			worker_pids = NULL;
+			worker_id = i;
+			ev_fork();
+			break;
+		}
+		worker_pids[i] = pid;
+	}
+	aunfuncs->worker(worker_id);
+	if (debug)
+		printf("worker %d is pid %d\n", worker_id, (int)getpid());
+}
+
+static void
+stop_workers(void)
+{
+	int i;
+
+	if (worker_pids == NULL)
+		return;
+	for (i = 1; i < workers; i++)
+		kill(worker_pids[i], SIGTERM);
+	for (i = 1; i < workers; i++)
+		waitpid(worker_pids[i], NULL, 0);
+}
+
 static void
 sig_init(void)
 {
@@ -203,6 +269,9 @@ sig_init(void)
 	sigemptyset(&(sa.sa_mask));
 	sa.sa_flags = 0;
 	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = sigstats;
+	sigaction(SIGUSR1, &sa, NULL);
 }
 
 static void
@@ -211,3 +280,48 @@ sigcatcher(int s)
 
 	painful_death = 1;
 }
+
+static void
+sigstats(int s)
+{
+
+	want_stats = 1;
+}
+
+/*
+ * Report a line of statistics, to wherever our messages go.
+ */
+void
+stats_printf(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (using_syslog)
+		vsyslog(LOG_INFO, fmt, ap);
+	else {
+		vprintf(fmt, ap);
+		putchar('\n');
+		fflush(stdout);
+	}
+	va_end(ap);
+}
+
+static void
+stats_dump(void)
+{
+
+	int i;
+
+	if (worker_pids != NULL)
+		for (i = 1; i < workers; i++)
+			kill(worker_pids[i], SIGUSR1);
+	if (workers > 1)
+		stats_printf("statistics for worker %d:", worker_id);
+	else
+		stats_printf("statistics:");
+	fs_stats();
+	aio_stats();
+	if (aunfuncs->stats != NULL)
+		aunfuncs->stats();
+}
@@ -33,6 +33,7 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -51,6 +52,8 @@
 #include <fcntl.h>
 
 #include "aun.h"
+#include "capture.h"
+#include "event.h"
 #include "extern.h"
 #include "fileserver.h"
 #include "version.h"
@@ -61,7 +64,7 @@ struct econet_addr {
 };
 
 static int sock;
-static unsigned char sbuf[65536];
+static unsigned char sbuf[6];
 static unsigned char rbuf[65536];
 static struct aun_packet *const rpkt = (struct aun_packet *)rbuf;
 
@@ -78,8 +81,12 @@ union internal_addr {
 static struct ipport {
 	struct in_addr addr;
 	int port;
+	struct rtt *rtt;
 } ec2ip[256*256];		       /* index is network*256+station */
 
+/* Round-trip times for stations not in the config file. */
+static struct rtt beebem_rtt_unknown;
+
 /* List of Econet addresses (as network*256+station) actually in use */
 static unsigned short eclist[256*256];
 static int eccount = 0;
@@ -89,6 +96,8 @@ static int our_econet_addr = 254;      /* 0.254 */
 
 int beebem_ingress = 0;		       /* set by conf_lex.l */
 
+static void beebem_readable(int, void *);
+
 static void
 beebem_setup(void)
 {
@@ -141,9 +150,13 @@ beebem_setup(void)
 			     beebem_cfg_file, lineno, network, station);
 		ec2ip[ecaddr].addr = addr;
 		ec2ip[ecaddr].port = port;
+		if ((ec2ip[ecaddr].rtt = malloc(sizeof(struct rtt))) == NULL)
+			err(1, "malloc");
+		rtt_init(ec2ip[ecaddr].rtt);
 		eclist[eccount++] = ecaddr;
 	}
 	fclose(fp);
+	rtt_init(&beebem_rtt_unknown);
 
 	/*
 	 * Make sure the config file listed details for the Econet
@@ -169,9 +182,10 @@ beebem_setup(void)
 		err(1, "fcntl(F_GETFL)");
         if (fcntl(sock, F_SETFL, fl | O_NONBLOCK) < 0)
 		err(1, "fcntl(F_SETFL)");
+	ev_add_fd(sock, beebem_readable, NULL);
 }
 
-static ssize_t beebem_listen(unsigned *addr, int forever)
+static ssize_t beebem_listen(unsigned *addr, int usec)
 {
 	ssize_t msgsize;
 	struct sockaddr_in from;
@@ -185,15 +199,16 @@ static ssize_t beebem_listen(unsigned *addr, int forever)
 
 		/*
 		 * We set the socket to nonblocking mode, and must
-		 * therefore always select before we recvfrom. The
-		 * timeout varies depending on 'forever'.
+		 * therefore always select before we recvfrom.  A
+		 * timeout of zero just checks for anything that's
+		 * already arrived.
 		 */
 		FD_ZERO(&r);
 		FD_SET(sock, &r);
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 100000;   /* 100ms */
-		i = select(sock+1, &r, NULL, NULL, forever ? NULL : &timeout);
-		if (i == 0)
+		timeout.tv_sec = usec / 1000000;
+		timeout.tv_usec = usec % 1000000;
+		i = select(sock+1, &r, NULL, NULL, &timeout);
+		if (i <= 0)
 			return 0;      /* nothing turned up */
 
 		msgsize = recvfrom(sock, rbuf + PKTOFF,
@@ -202,6 +217,15 @@ static ssize_t beebem_listen(unsigned *addr, int forever)
 		if (msgsize == -1)
 			err(1, "recvfrom");
 
+		if (capturing) {
+			struct iovec civ;
+
+			civ.iov_base = rbuf + PKTOFF;
+			civ.iov_len = msgsize;
+			capture_packet(CAPTURE_IN, &from,
+			    ec2ip[our_econet_addr].port, &civ, 1);
+		}
+
 		if (msgsize < 4)
 			continue;      /* not big enough for an Econet frame */
 
@@ -234,10 +258,23 @@ static ssize_t beebem_listen(unsigned *addr, int forever)
 	}
 }
 
-static void beebem_send(const void *data, ssize_t len)
+static void beebem_sendv(const struct iovec *iov, int iovcnt)
 {
 	int i;
 	struct sockaddr_in to;
+	struct msghdr msg;
+	const uint8_t *ehdr = iov[0].iov_base;
+
+	/* The capture shows each packet once, going to its destination. */
+	if (capturing) {
+		unsigned ecaddr = ehdr[1] * 256 + ehdr[0];
+
+		to.sin_family = AF_INET;
+		to.sin_addr = ec2ip[ecaddr].addr;
+		to.sin_port = htons(ec2ip[ecaddr].port);
+		capture_packet(CAPTURE_OUT, &to, ec2ip[our_econet_addr].port,
+		    iov, iovcnt);
+	}
 
 	/*
 	 * We're emulating a broadcast medium, so we should attempt
@@ -253,42 +290,100 @@ static void beebem_send(const void *data, ssize_t len)
 		to.sin_family = AF_INET;
 		to.sin_addr = ec2ip[ecaddr].addr;
 		to.sin_port = htons(ec2ip[ecaddr].port);
-		if (sendto(sock, data, len, 0,
-			   (struct sockaddr*)&to, sizeof(to)) < 0)
-			err(1, "sendto");
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &to;
+		msg.msg_namelen = sizeof(to);
+		msg.msg_iov = (struct iovec *)iov;
+		msg.msg_iovlen = iovcnt;
+		if (sendmsg(sock, &msg, 0) < 0)
+			err(1, "sendmsg");
 	}
 }
 
-static struct aun_packet *
-beebem_recv(ssize_t *outsize, struct aun_srcaddr *vfrom, int want_port)
+static void beebem_send(const void *data, ssize_t len)
 {
+	struct iovec iov;
+
+	iov.iov_base = (void *)data;
+	iov.iov_len = len;
+	beebem_sendv(&iov, 1);
+}
+
+/*
+ * Send a packet, repeatedly if necessary, until a reply turns up
+ * from the station we're talking to.  Each attempt waits for that
+ * station's current retransmission timeout, and we give up
+ * altogether after as long as 50 fixed timeouts would have taken.
+ * Returns the size of the reply, which is left in rbuf, or 0 if
+ * none arrived.
+ */
+static ssize_t
+beebem_exchange(unsigned theiraddr, const struct iovec *iov, int iovcnt)
+{
+	struct rtt *rtt;
+	uint64_t start, sent, now;
+	unsigned addr;
 	ssize_t msgsize;
-	union internal_addr *afrom = (union internal_addr *)vfrom;
-	int scoutaddr, mainaddr;
+	int tries;
+
+	rtt = ec2ip[theiraddr].rtt;
+	if (rtt == NULL)
+		rtt = &beebem_rtt_unknown;
+	start = ev_now();
+	for (tries = 1; ; tries++) {
+		beebem_sendv(iov, iovcnt);
+		rtt->sent++;
+		sent = ev_now();
+		while ((now = ev_now()) - sent < rtt->rto) {
+			msgsize = beebem_listen(&addr,
+			    rtt->rto - (now - sent));
+			if (msgsize == 0)
+				break;
+			if (addr != theiraddr) {
+				if (debug)
+					printf("ignoring packet from %d.%d"
+					       " during other transaction\n",
+					       addr>>8, addr&0xFF);
+				continue;
+			}
+			/* Karn: only time packets sent just once. */
+			if (tries == 1)
+				rtt_sample(rtt, ev_now() - sent);
+			return msgsize;
+		}
+		if (ev_now() - start >= 50 * (uint64_t)default_timeout) {
+			rtt->failures++;
+			return 0;
+		}
+		rtt_backoff(rtt);
+	}
+}
+
+/*
+ * Called from the event loop when a packet arrives.  Run the rest of
+ * the four-way handshake for each scout we find, and pass on the
+ * resulting packets.
+ */
+static void
+beebem_readable(int fd, void *arg)
+{
+	ssize_t msgsize;
+	union internal_addr afrom;
+	unsigned scoutaddr;
 	int ctlbyte, destport;
-	int count, forever;
 	unsigned char ack[8];
+	struct iovec iov[1];
 
-	/*
-	 * If we're told to listen for a packet from a particular
-	 * station, impose a time limit after which we'll give up on
-	 * it, so that a client that goes away in the middle of a
-	 * load or save doesn't lock everyone else out indefinitely.
-	 */
-	count = 50;
-	forever = !(afrom->eaddr.network || afrom->eaddr.station);
-	while (count > 0) {
+	for (;;) {
 		/*
 		 * Listen for a scout packet. This should be 6 bytes
 		 * long, and the second payload byte should indicate
 		 * the destination port.
 		 */
-		msgsize = beebem_listen(&scoutaddr, forever);
+		msgsize = beebem_listen(&scoutaddr, 0);
 
-		if (msgsize == 0) {
-			count--;
-			continue;
-		}
+		if (msgsize == 0)
+			return;
 
 		ack[0] = scoutaddr & 0xFF;
 		ack[1] = scoutaddr >> 8;
@@ -311,20 +406,18 @@ beebem_recv(ssize_t *outsize, struct aun_srcaddr *vfrom, int want_port)
 		}
 
 		/*
-		 * If we've been told to listen for a particular
-		 * source address and/or port, loop round again
-		 * without ACK if we didn't get it.
+		 * If nobody wants a packet from this station on this
+		 * port, don't ACK it.
 		 */
-		if (((afrom->eaddr.network || afrom->eaddr.station) &&
-		     (afrom->eaddr.network != (scoutaddr >> 8) ||
-		      afrom->eaddr.station != (scoutaddr & 0xFF))) ||
-		    (want_port && want_port != rbuf[PKTOFF+5])) {
+		memset(&afrom, 0, sizeof(afrom));
+		afrom.eaddr.network = scoutaddr >> 8;
+		afrom.eaddr.station = scoutaddr & 0xFF;
+		if (!ec_port_wanted(rbuf[PKTOFF+5], &afrom.srcaddr)) {
 			if (debug)
 				printf("ignoring packet from %d.%d for port"
-				       " %d during other transaction\n",
+				       " %d\n",
 				       scoutaddr>>8, scoutaddr&0xFF,
 				       rbuf[PKTOFF+5]);
-			if (!forever) count--;
 			continue;
 		}
 
@@ -333,7 +426,6 @@ beebem_recv(ssize_t *outsize, struct aun_srcaddr *vfrom, int want_port)
 				printf("received wrong-size scout packet "
 				    "(%zd) from %d.%d\n",
 				    msgsize, scoutaddr>>8, scoutaddr&0xFF);
-			if (!forever) count--;
 			continue;
 		}
 
@@ -351,23 +443,9 @@ beebem_recv(ssize_t *outsize, struct aun_srcaddr *vfrom, int want_port)
 		 * four-way handshake would tie up the bus for all
 		 * other stations until it had finished.)
 		 */
-		count = 50;
-		do {
-			beebem_send(ack, 4);
-			msgsize = beebem_listen(&mainaddr, 0);
-			if (msgsize != 0) {
-				if (mainaddr != scoutaddr) {
-					if (debug)
-						printf("ignoring packet from"
-						       " %d.%d during other"
-						       " transaction\n",
-						       mainaddr>>8,
-						       mainaddr&0xFF);
-					msgsize = 0;   /* go round again */
-				}
-			}
-			count--;
-		} while (count > 0 && msgsize == 0);
+		iov[0].iov_base = ack;
+		iov[0].iov_len = 4;
+		msgsize = beebem_exchange(scoutaddr, iov, 1);
 
 		if (msgsize == 0) {
 			if (debug)
@@ -384,33 +462,35 @@ beebem_recv(ssize_t *outsize, struct aun_srcaddr *vfrom, int want_port)
 		beebem_send(ack, 4);
 
 		/*
-		 * Now fake up an aun_packet structure to return.
+		 * Now fake up an aun_packet structure to pass on.
 		 */
 		rpkt->type = AUN_TYPE_UNICAST;   /* shouldn't matter */
 		rpkt->dest_port = destport; 
 		rpkt->flag = ctlbyte;
 		rpkt->retrans = 0;
 		memset(rpkt->seq, 0, 4);
-		*outsize = msgsize + PKTOFF;
-		memset(afrom, 0, sizeof(struct aun_srcaddr));
-		afrom->eaddr.network = scoutaddr >> 8;
-		afrom->eaddr.station = scoutaddr & 0xFF;
-		return rpkt;
+		ec_port_input(rpkt, msgsize + PKTOFF, &afrom.srcaddr);
 	}
-
-	errno = ETIMEDOUT;
-	return NULL;
 }
 
+/*
+ * Send a packet whose data is in pieces.  The pieces go straight
+ * into the payload packet, after its Econet header, so they aren't
+ * copied.
+ */
 static ssize_t
-beebem_xmit(struct aun_packet *spkt, size_t len, struct aun_srcaddr *vto)
+beebem_xmitv(struct aun_packet *hdr, const struct iovec *iov, int iovcnt,
+    struct aun_srcaddr *vto)
 {
 	union internal_addr *ato = (union internal_addr *)vto;
-	int theiraddr, ackaddr;
-	int count;
-	ssize_t msgsize, payloadlen;
+	struct iovec piov[AUN_MAXIOV + 1];
+	int theiraddr, i;
+	ssize_t msgsize;
+	size_t len;
 
-	if (len > sizeof(sbuf) - 4) {
+	for (i = 0, len = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (len > 65536 - 4) {
 		if (debug)
 			printf("outgoing packet too large (%zu)\n", len);
 		return -1;
@@ -425,27 +505,11 @@ beebem_xmit(struct aun_packet *spkt, size_t len, struct aun_srcaddr *vto)
 	sbuf[1] = ato->eaddr.network;
 	sbuf[2] = our_econet_addr & 0xFF;
 	sbuf[3] = our_econet_addr >> 8;
-	sbuf[4] = 0x80 | spkt->flag;
-	sbuf[5] = spkt->dest_port;
-	count = 50;
-	do {
-		beebem_send(sbuf, 6);
-		msgsize = beebem_listen(&ackaddr, 0);
-		if (msgsize > 0) {
-			/*
-			 * We expect the ACK to have come from the
-			 * right address.
-			 */
-			if (ackaddr != theiraddr) {
-				if (debug)
-					printf("ignoring packet from %d.%d"
-					       " during other transaction\n",
-					       ackaddr>>8, ackaddr&0xFF);
-				msgsize = 0;   /* so we'll go round again */
-			}
-		}
-		count--;
-	} while (count > 0 && msgsize == 0);
+	sbuf[4] = 0x80 | hdr->flag;
+	sbuf[5] = hdr->dest_port;
+	piov[0].iov_base = sbuf;
+	piov[0].iov_len = 6;
+	msgsize = beebem_exchange(theiraddr, piov, 1);
 
 	if (msgsize == 0) {
 		if (debug)
@@ -464,34 +528,13 @@ beebem_xmit(struct aun_packet *spkt, size_t len, struct aun_srcaddr *vto)
 	}
 
 	/*
-	 * Construct and send the payload packet, and wait for an
-	 * ACK.
+	 * Send the payload packet, which has the same Econet header
+	 * as the scout, and wait for an ACK.
 	 */
-	sbuf[0] = ato->eaddr.station;
-	sbuf[1] = ato->eaddr.network;
-	sbuf[2] = our_econet_addr & 0xFF;
-	sbuf[3] = our_econet_addr >> 8;
-	payloadlen = len - offsetof(struct aun_packet, data);
-	memcpy(sbuf + 4, spkt->data, payloadlen);
-	count = 50;
-	do {
-		beebem_send(sbuf, payloadlen+4);
-		msgsize = beebem_listen(&ackaddr, 0);
-		if (msgsize > 0) {
-			/*
-			 * The second ACK, just as above, should
-			 * have come from the right address.
-			 */
-			if (ackaddr != theiraddr) {
-				if (debug)
-					printf("ignoring packet from %d.%d"
-					       " during other transaction\n",
-					       ackaddr>>8, ackaddr&0xFF);
-				msgsize = 0;   /* so we'll go round again */
-			}
-		}
-		count--;
-	} while (count > 0 && msgsize == 0);
+	piov[0].iov_len = 4;
+	for (i = 0; i < iovcnt; i++)
+		piov[i + 1] = iov[i];
+	msgsize = beebem_exchange(theiraddr, piov, iovcnt + 1);
 
 	if (msgsize == 0) {
 		if (debug)
@@ -509,7 +552,43 @@ beebem_xmit(struct aun_packet *spkt, size_t len, struct aun_srcaddr *vto)
 		return -1;
 	}
 
-	return len;
+	return offsetof(struct aun_packet, data) + len;
+}
+
+static ssize_t
+beebem_xmit(struct aun_packet *spkt, size_t len, struct aun_srcaddr *vto)
+{
+	struct iovec iov;
+
+	iov.iov_base = spkt->data;
+	iov.iov_len = len - offsetof(struct aun_packet, data);
+	return beebem_xmitv(spkt, &iov, 1, vto);
+}
+
+/*
+ * The four-way handshake leaves nothing outstanding, so these just
+ * send the packet and report the result straight away.
+ */
+static void
+beebem_xmit_async(struct aun_packet *spkt, size_t len,
+    struct aun_srcaddr *vto, aun_done_fn *done, void *arg)
+{
+	int error;
+
+	error = beebem_xmit(spkt, len, vto) == -1 ? errno : 0;
+	if (done != NULL)
+		done(arg, error);
+}
+
+static void
+beebem_xmitv_async(struct aun_packet *hdr, const struct iovec *iov,
+    int iovcnt, struct aun_srcaddr *vto, aun_done_fn *done, void *arg)
+{
+	int error;
+
+	error = beebem_xmitv(hdr, iov, iovcnt, vto) == -1 ? errno : 0;
+	if (done != NULL)
+		done(arg, error);
 }
 
 static char *
@@ -522,6 +601,48 @@ beebem_ntoa(struct aun_srcaddr *vfrom)
 	return retbuf;
 }
 
+/*
+ * Parse a station address of the form "net.stn" or just "stn".
+ */
+static int
+beebem_aton(const char *s, struct aun_srcaddr *vaddr)
+{
+	union internal_addr *aaddr = (union internal_addr *)vaddr;
+	unsigned net, stn;
+	char c;
+
+	if (sscanf(s, "%u.%u%c", &net, &stn, &c) != 2) {
+		net = 0;
+		if (sscanf(s, "%u%c", &stn, &c) != 1)
+			return -1;
+	}
+	if (net > 255 || stn > 255)
+		return -1;
+	aaddr->eaddr.network = net;
+	aaddr->eaddr.station = stn;
+	return 0;
+}
+
+/*
+ * Report round-trip times and retransmissions for each station.
+ */
+static void
+beebem_stats(void)
+{
+	char name[16];
+	int i;
+
+	for (i = 0; i < eccount; i++) {
+		if (eclist[i] == our_econet_addr)
+			continue;
+		sprintf(name, "station %d.%d", eclist[i] >> 8,
+		    eclist[i] & 0xFF);
+		rtt_report(name, ec2ip[eclist[i]].rtt);
+	}
+	if (beebem_rtt_unknown.sent != 0)
+		rtt_report("other stations", &beebem_rtt_unknown);
+}
+
 static void
 beebem_get_stn(struct aun_srcaddr *vfrom, uint8_t *out)
 {
@@ -533,8 +654,13 @@ beebem_get_stn(struct aun_srcaddr *vfrom, uint8_t *out)
 const struct aun_funcs beebem = {
 	512,
 	beebem_setup,
-	beebem_recv,
         beebem_xmit,
+	beebem_xmit_async,
+	beebem_xmitv_async,
+	NULL,
         beebem_ntoa,
+	beebem_aton,
+	beebem_stats,
+	NULL,
         beebem_get_stn,
 };
@@ -0,0 +1,219 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * capture.c - recording packets to a file
+ *
+ * With "capture" in the configuration file, every packet the
+ * transport sends or receives is written, with a timestamp, to a
+ * pcap file which tcpdump or Wireshark can read and aund-replay can
+ * play back.  Each record has a Linux cooked header giving its
+ * direction, and IPv4 and UDP headers made up from the addresses and
+ * ports involved.  Writes are buffered, and the buffer is flushed
+ * every second, so capturing costs little more than a copy.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aun.h"
+#include "capture.h"
+#include "event.h"
+#include "extern.h"
+
+#define CAPTURE_SNAPLEN		65535
+#define CAPTURE_FLUSH		1000000	/* microseconds */
+#define CAPTURE_BUFSIZE		65536
+
+char *capture_file = NULL;		/* set by conf_lex.l */
+int capturing = 0;
+
+static FILE *capture_fp;
+static struct in_addr capture_local;
+static struct ev_timer capture_timer;
+
+static void
+put16(uint8_t *p, unsigned v)
+{
+
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+/*
+ * Called before we change directory, so that a relative file name
+ * means what the user expects.
+ */
+void
+capture_init(void)
+{
+	char cwd[1024], *path;
+
+	if (capture_file == NULL || capture_file[0] == '/')
+		return;
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+		err(1, "getcwd");
+	if (asprintf(&path, "%s/%s", cwd, capture_file) == -1)
+		err(1, "asprintf");
+	free(capture_file);
+	capture_file = path;
+}
+
+static void
+capture_flush(void *arg)
+{
+
+	fflush(capture_fp);
+	ev_timer_add(&capture_timer, CAPTURE_FLUSH);
+}
+
+/*
+ * Start capturing, if we've been asked to.  Each worker other than
+ * the first writes to its own file, named with the worker number.
+ */
+void
+capture_start(int worker)
+{
+	struct {
+		uint32_t magic;
+		uint16_t major, minor;
+		int32_t zone;
+		uint32_t sigfigs, snaplen, linktype;
+	} hdr;
+	char *path;
+
+	if (capture_file == NULL)
+		return;
+	if (worker == 0)
+		path = capture_file;
+	else if (asprintf(&path, "%s.%d", capture_file, worker) == -1)
+		err(1, "asprintf");
+	if ((capture_fp = fopen(path, "w")) == NULL)
+		err(1, "%s", path);
+	if (path != capture_file)
+		free(path);
+	setvbuf(capture_fp, NULL, _IOFBF, CAPTURE_BUFSIZE);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = 0xa1b2c3d4;
+	hdr.major = 2;
+	hdr.minor = 4;
+	hdr.snaplen = CAPTURE_SNAPLEN;
+	hdr.linktype = CAPTURE_LINKTYPE;
+	fwrite(&hdr, sizeof(hdr), 1, capture_fp);
+	if (aun_bind_addr == NULL ||
+	    inet_aton(aun_bind_addr, &capture_local) == 0)
+		capture_local.s_addr = htonl(INADDR_ANY);
+	ev_timer_init(&capture_timer, capture_flush, NULL);
+	ev_timer_add(&capture_timer, CAPTURE_FLUSH);
+	capturing = 1;
+}
+
+/*
+ * Record a packet, made up of iovcnt pieces, which we've received
+ * from (dir == CAPTURE_IN) or sent to (CAPTURE_OUT) peer, on our UDP
+ * port localport.
+ */
+void
+capture_packet(int dir, const struct sockaddr_in *peer, int localport,
+    const struct iovec *iov, int iovcnt)
+{
+	struct {
+		uint32_t sec, usec, caplen, len;
+	} rec;
+	uint8_t hdr[CAPTURE_SLL_LEN + 28], *ip, *udp;
+	struct in_addr src, dst;
+	struct timespec ts;
+	size_t len;
+	uint32_t sum;
+	int i, sport, dport;
+
+	for (i = 0, len = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (len > CAPTURE_SNAPLEN - sizeof(hdr))
+		return;
+	if (dir == CAPTURE_IN) {
+		src = peer->sin_addr;
+		sport = ntohs(peer->sin_port);
+		dst = capture_local;
+		dport = localport;
+	} else {
+		src = capture_local;
+		sport = localport;
+		dst = peer->sin_addr;
+		dport = ntohs(peer->sin_port);
+	}
+
+	memset(hdr, 0, sizeof(hdr));
+	put16(hdr, dir);
+	put16(hdr + 2, 0xffff);		/* ARPHRD_VOID */
+	put16(hdr + 14, 0x0800);	/* ETHERTYPE_IP */
+	ip = hdr + CAPTURE_SLL_LEN;
+	ip[0] = 0x45;
+	put16(ip + 2, 28 + len);
+	ip[8] = 64;			/* TTL */
+	ip[9] = IPPROTO_UDP;
+	memcpy(ip + 12, &src, 4);
+	memcpy(ip + 16, &dst, 4);
+	for (i = 0, sum = 0; i < 20; i += 2)
+		sum += ip[i] << 8 | ip[i + 1];
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum += sum >> 16;
+	put16(ip + 10, ~sum & 0xffff);
+	udp = ip + 20;
+	put16(udp, sport);
+	put16(udp + 2, dport);
+	put16(udp + 4, 8 + len);	/* and no checksum */
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec.sec = ts.tv_sec;
+	rec.usec = ts.tv_nsec / 1000;
+	rec.caplen = rec.len = sizeof(hdr) + len;
+	fwrite(&rec, sizeof(rec), 1, capture_fp);
+	fwrite(hdr, sizeof(hdr), 1, capture_fp);
+	for (i = 0; i < iovcnt; i++)
+		fwrite(iov[i].iov_base, iov[i].iov_len, 1, capture_fp);
+}
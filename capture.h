@@ -0,0 +1,63 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * capture.h - recording packets to a file
+ */
+
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+/*
+ * Captures are pcap files with Linux "cooked" headers, which say
+ * which way each packet went, followed by made-up IPv4 and UDP
+ * headers, so that ordinary tools can read them.
+ */
+#define CAPTURE_LINKTYPE	113	/* LINKTYPE_LINUX_SLL */
+#define CAPTURE_SLL_LEN		16
+#define CAPTURE_IN		0	/* PACKET_HOST */
+#define CAPTURE_OUT		4	/* PACKET_OUTGOING */
+
+extern void capture_init(void);
+extern void capture_start(int);
+extern void capture_packet(int, const struct sockaddr_in *, int,
+    const struct iovec *, int);
+
+extern char *capture_file;
+extern int capturing;
+
+#endif
@@ -0,0 +1,182 @@
+/*-
+ * Copyright (c) 2010 Simon Tatham
+ * Copyright (c) 1998, 2010 Ben Harris
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+
+/*
+ * ec_port.c - delivering incoming packets to Econet port listeners
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <assert.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aun.h"
+#include "extern.h"
+
+/*
+ * Who is listening on each Econet port.
+ */
+static struct ec_port {
+	const char	*name;
+	ec_port_fn	*input;
+	ec_accept_fn	*accept;
+} ec_ports[256];
+
+/*
+ * Packets which have been accepted by the transport but not yet
+ * dispatched.
+ */
+static TAILQ_HEAD(, pkt_buf) rx_queue = TAILQ_HEAD_INITIALIZER(rx_queue);
+
+/*
+ * Spare packet buffers.  We keep enough to cope with a burst without
+ * going back to malloc, but give the rest back.
+ */
+#define PKT_BUF_SPARE 256
+static TAILQ_HEAD(, pkt_buf) pkt_buf_pool =
+    TAILQ_HEAD_INITIALIZER(pkt_buf_pool);
+static int pkt_buf_nspare;
+
+void
+ec_port_listen(int port, const char *name, ec_port_fn *input,
+    ec_accept_fn *accept)
+{
+
+	assert(port > 0 && port < 256);
+	ec_ports[port].name = name;
+	ec_ports[port].input = input;
+	ec_ports[port].accept = accept;
+}
+
+/*
+ * Would anyone like a packet from this address on this port?
+ */
+int
+ec_port_wanted(int port, struct aun_srcaddr *from)
+{
+
+	if (port <= 0 || port > 255 || ec_ports[port].input == NULL)
+		return 0;
+	return ec_ports[port].accept == NULL || ec_ports[port].accept(from);
+}
+
+struct pkt_buf *
+pkt_buf_get(void)
+{
+	struct pkt_buf *pb;
+
+	if ((pb = TAILQ_FIRST(&pkt_buf_pool)) != NULL) {
+		TAILQ_REMOVE(&pkt_buf_pool, pb, link);
+		pkt_buf_nspare--;
+		return pb;
+	}
+	return malloc(sizeof(struct pkt_buf));
+}
+
+void
+pkt_buf_put(struct pkt_buf *pb)
+{
+
+	if (pkt_buf_nspare >= PKT_BUF_SPARE) {
+		free(pb);
+		return;
+	}
+	TAILQ_INSERT_HEAD(&pkt_buf_pool, pb, link);
+	pkt_buf_nspare++;
+}
+
+void
+ec_port_input(struct aun_packet *pkt, ssize_t len, struct aun_srcaddr *from)
+{
+	struct pkt_buf *pb;
+
+	if (len > PKT_BUF_SIZE) {
+		if (debug) printf("dropping oversized packet (%zd)\n", len);
+		return;
+	}
+	if ((pb = pkt_buf_get()) == NULL) {
+		warnx("ec_port_input: malloc failed");
+		return;
+	}
+	pb->from = *from;
+	pb->len = len;
+	memcpy(pb->data, pkt, len);
+	ec_port_input_buf(pb);
+}
+
+void
+ec_port_input_buf(struct pkt_buf *pb)
+{
+
+	TAILQ_INSERT_TAIL(&rx_queue, pb, link);
+}
+
+/*
+ * Are there any packets waiting to be dispatched?
+ */
+int
+ec_port_pending(void)
+{
+
+	return !TAILQ_EMPTY(&rx_queue);
+}
+
+/*
+ * Hand the first queued packet to its listener.  Anything which
+ * arrives while it's doing so (for instance while waiting for an ACK)
+ * is queued behind the rest.  Returns zero if there was nothing to
+ * dispatch.
+ */
+int
+ec_port_dispatch(void)
+{
+	struct pkt_buf *pb;
+	struct aun_packet *pkt;
+	struct ec_port *p;
+
+	if ((pb = TAILQ_FIRST(&rx_queue)) == NULL)
+		return 0;
+	TAILQ_REMOVE(&rx_queue, pb, link);
+	pkt = (struct aun_packet *)pb->data;
+	p = &ec_ports[pkt->dest_port];
+	if (p->input != NULL) {
+		if (debug) printf("\n\t(%s: ", p->name);
+		p->input(pkt, pb->len, &pb->from);
+		if (debug) printf(")\n");
+	}
+	pkt_buf_put(pb);
+	return 1;
+}
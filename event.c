@@ -0,0 +1,343 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * event.c - the main event loop
+ *
+ * Everything aund does happens in response to a packet arriving on
+ * one of the transport's sockets or a timer expiring, so the server
+ * is structured around a single loop which waits for either.  On
+ * Linux we use epoll; elsewhere we fall back to poll(2), which is
+ * quite adequate for the handful of descriptors we have.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event.h"
+
+struct ev_fd {
+	ev_fd_fn	*fn;
+	void		*arg;
+};
+
+/* Indexed by file descriptor. */
+static struct ev_fd *fds;
+static int nfds;
+
+#define EV_MAXFLUSH 4
+static ev_flush_fn *flushes[EV_MAXFLUSH];
+static int nflushes;
+
+static TAILQ_HEAD(ev_timer_head, ev_timer) timers = TAILQ_HEAD_INITIALIZER(timers);
+
+#if HAVE_SYS_EPOLL_H
+static int epfd = -1;
+#endif
+
+/*
+ * With a virtual clock, time stands still while there's anything to
+ * do, and then jumps straight to the next timer.  This is for
+ * simulations, where everything interesting is driven by timers.
+ */
+static int ev_virtual = 0;
+static uint64_t ev_vclock;
+
+void
+ev_init(void)
+{
+
+#if HAVE_SYS_EPOLL_H
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		err(1, "epoll_create1");
+#endif
+}
+
+/*
+ * Called in the child after a fork(), so that it stops sharing the
+ * parent's epoll instance.  Everything registered so far stays
+ * registered.
+ */
+void
+ev_fork(void)
+{
+#if HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+	int fd;
+
+	close(epfd);
+	ev_init();
+	for (fd = 0; fd < nfds; fd++) {
+		if (fds[fd].fn == NULL)
+			continue;
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+			err(1, "epoll_ctl");
+	}
+#endif
+}
+
+void
+ev_add_fd(int fd, ev_fd_fn *fn, void *arg)
+{
+#if HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+#endif
+	struct ev_fd *newfds;
+	int i;
+
+	if (fd >= nfds) {
+		newfds = realloc(fds, (fd + 1) * sizeof(*fds));
+		if (newfds == NULL)
+			err(1, "ev_add_fd");
+		for (i = nfds; i <= fd; i++)
+			newfds[i].fn = NULL;
+		fds = newfds;
+		nfds = fd + 1;
+	}
+	fds[fd].fn = fn;
+	fds[fd].arg = arg;
+#if HAVE_SYS_EPOLL_H
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		err(1, "epoll_ctl");
+#endif
+}
+
+void
+ev_del_fd(int fd)
+{
+
+	if (fd < nfds && fds[fd].fn != NULL) {
+		fds[fd].fn = NULL;
+#if HAVE_SYS_EPOLL_H
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+	}
+}
+
+void
+ev_add_flush(ev_flush_fn *fn)
+{
+
+	if (nflushes == EV_MAXFLUSH)
+		errx(1, "ev_add_flush: too many");
+	flushes[nflushes++] = fn;
+}
+
+/*
+ * Switch to the virtual clock, which starts at zero.
+ */
+void
+ev_set_virtual(void)
+{
+
+	ev_virtual = 1;
+	ev_vclock = 0;
+}
+
+/*
+ * Return a monotonic timestamp in microseconds.
+ */
+uint64_t
+ev_now(void)
+{
+	struct timespec ts;
+
+	if (ev_virtual)
+		return ev_vclock;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+ev_timer_init(struct ev_timer *t, ev_timer_fn *fn, void *arg)
+{
+
+	t->fn = fn;
+	t->arg = arg;
+	t->pending = 0;
+}
+
+/*
+ * Arm a timer to fire after the given number of microseconds.  A
+ * timer which is already pending is rescheduled.
+ */
+void
+ev_timer_add(struct ev_timer *t, uint64_t usec)
+{
+	struct ev_timer *p;
+
+	ev_timer_del(t);
+	t->when = ev_now() + usec;
+	/* The list is short and kept in expiry order. */
+	TAILQ_FOREACH_REVERSE(p, &timers, ev_timer_head, link)
+		if (p->when <= t->when)
+			break;
+	if (p == NULL)
+		TAILQ_INSERT_HEAD(&timers, t, link);
+	else
+		TAILQ_INSERT_AFTER(&timers, p, t, link);
+	t->pending = 1;
+}
+
+void
+ev_timer_del(struct ev_timer *t)
+{
+
+	if (t->pending) {
+		TAILQ_REMOVE(&timers, t, link);
+		t->pending = 0;
+	}
+}
+
+/*
+ * Say whether any timer is armed.  On the virtual clock, nothing more
+ * can happen once none are.
+ */
+int
+ev_timer_any(void)
+{
+
+	return !TAILQ_EMPTY(&timers);
+}
+
+/*
+ * Work out how long we can sleep for without missing a timer, in
+ * milliseconds as wanted by poll and epoll_wait.
+ */
+static int
+ev_timeout(int block)
+{
+	struct ev_timer *t;
+	uint64_t now;
+
+	if (!block)
+		return 0;
+	if ((t = TAILQ_FIRST(&timers)) == NULL)
+		return ev_virtual ? 0 : -1;
+	now = ev_now();
+	if (t->when <= now)
+		return 0;
+	if (ev_virtual) {
+		ev_vclock = t->when;
+		return 0;
+	}
+	/* Round up, or we'll wake just too early and spin. */
+	return (t->when - now + 999) / 1000;
+}
+
+static void
+ev_run_timers(void)
+{
+	struct ev_timer *t;
+	uint64_t now;
+
+	now = ev_now();
+	while ((t = TAILQ_FIRST(&timers)) != NULL && t->when <= now) {
+		ev_timer_del(t);
+		t->fn(t->arg);
+	}
+}
+
+/*
+ * Wait for something to happen, and deal with it.  If block is zero,
+ * just deal with anything that's already happened.  Returns early
+ * if interrupted by a signal.
+ */
+void
+ev_run_once(int block)
+{
+#if HAVE_SYS_EPOLL_H
+	struct epoll_event evs[16];
+	int i, n, fd;
+
+	for (i = 0; i < nflushes; i++)
+		flushes[i]();
+	n = epoll_wait(epfd, evs, sizeof(evs) / sizeof(evs[0]),
+	    ev_timeout(block));
+	if (n == -1) {
+		if (errno == EINTR)
+			return;
+		err(1, "epoll_wait");
+	}
+	for (i = 0; i < n; i++) {
+		fd = evs[i].data.fd;
+		if (fd < nfds && fds[fd].fn != NULL)
+			fds[fd].fn(fd, fds[fd].arg);
+	}
+#else
+	struct pollfd pfds[16];
+	int i, n, npfds;
+
+	for (i = 0; i < nflushes; i++)
+		flushes[i]();
+	for (i = 0, npfds = 0; i < nfds && npfds < 16; i++)
+		if (fds[i].fn != NULL) {
+			pfds[npfds].fd = i;
+			pfds[npfds].events = POLLIN;
+			npfds++;
+		}
+	n = poll(pfds, npfds, ev_timeout(block));
+	if (n == -1) {
+		if (errno == EINTR)
+			return;
+		err(1, "poll");
+	}
+	for (i = 0; i < npfds && n > 0; i++)
+		if (pfds[i].revents != 0) {
+			n--;
+			if (fds[pfds[i].fd].fn != NULL)
+				fds[pfds[i].fd].fn(pfds[i].fd,
+				    fds[pfds[i].fd].arg);
+		}
+#endif
+	ev_run_timers();
+}
@@ -0,0 +1,83 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * event.h - the main event loop
+ */
+
+#ifndef _EVENT_H
+#define _EVENT_H
+
+#include <sys/queue.h>
+
+#include <stdint.h>
+
+/*
+ * Called when a file descriptor registered with ev_add_fd() becomes
+ * readable.
+ */
+typedef void ev_fd_fn(int fd, void *arg);
+
+typedef void ev_timer_fn(void *arg);
+
+/*
+ * Called each time round the loop before we wait for anything, so
+ * that output can be batched up and sent in one go.
+ */
+typedef void ev_flush_fn(void);
+
+/*
+ * A one-shot timer.  These are embedded in whatever structure wants
+ * them, initialised once with ev_timer_init(), and can then be armed
+ * and disarmed as often as desired.
+ */
+struct ev_timer {
+	TAILQ_ENTRY(ev_timer) link;
+	uint64_t	when;	/* ev_now() value at which to fire */
+	ev_timer_fn	*fn;
+	void		*arg;
+	int		pending;
+};
+
+extern void ev_init(void);
+extern void ev_fork(void);
+extern void ev_add_fd(int, ev_fd_fn *, void *);
+extern void ev_del_fd(int);
+extern void ev_add_flush(ev_flush_fn *);
+extern void ev_set_virtual(void);
+extern uint64_t ev_now(void);
+extern void ev_timer_init(struct ev_timer *, ev_timer_fn *, void *);
+extern void ev_timer_add(struct ev_timer *, uint64_t);
+extern void ev_timer_del(struct ev_timer *);
+extern int ev_timer_any(void);
+extern void ev_run_once(int);
+
+#endif
@@ -32,7 +32,9 @@
 
 
 #include <sys/types.h>
+#include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
 #include <stdint.h>
@@ -52,20 +54,96 @@ extern void conf_init(const char *);
 extern void fs_init(void);
 extern void file_server(struct aun_packet *, ssize_t, struct aun_srcaddr *);
 
+/*
+ * A buffer holding a received packet.  These come from a pool, and
+ * belong to whoever has them until they're handed back with
+ * pkt_buf_put().  There's room for a trailing null.
+ */
+#define PKT_BUF_SIZE 2048
+struct pkt_buf {
+	TAILQ_ENTRY(pkt_buf) link;
+	struct aun_srcaddr from;
+	ssize_t len;
+	unsigned char data[PKT_BUF_SIZE + 1];
+};
+extern struct pkt_buf *pkt_buf_get(void);
+extern void pkt_buf_put(struct pkt_buf *);
+
+/*
+ * Incoming packets are handed by the transport to whichever part of
+ * aund is listening on their destination port.  The transport asks
+ * ec_port_wanted() first, so that it can refuse packets nobody is
+ * expecting; accepted packets are queued by ec_port_input() (which
+ * copies them) or ec_port_input_buf() (which takes the buffer) and
+ * dispatched from the main loop by ec_port_dispatch().
+ */
+typedef void ec_port_fn(struct aun_packet *, ssize_t, struct aun_srcaddr *);
+typedef int ec_accept_fn(struct aun_srcaddr *);
+extern void ec_port_listen(int, const char *, ec_port_fn *, ec_accept_fn *);
+extern int ec_port_wanted(int, struct aun_srcaddr *);
+extern void ec_port_input(struct aun_packet *, ssize_t, struct aun_srcaddr *);
+extern void ec_port_input_buf(struct pkt_buf *);
+extern int ec_port_pending(void);
+extern int ec_port_dispatch(void);
+
+/*
+ * Round-trip time estimator for one station.  Times are in
+ * microseconds, and an srtt of zero means there haven't been any
+ * samples yet.
+ */
+struct rtt {
+	uint64_t	srtt;
+	uint64_t	rttvar;
+	uint64_t	rto;		/* Current retransmission timeout */
+	unsigned long	samples;
+	unsigned long	sent;		/* Packets sent, including retries */
+	unsigned long	retransmits;
+	unsigned long	failures;	/* Packets we gave up on */
+};
+extern void rtt_init(struct rtt *);
+extern void rtt_sample(struct rtt *, uint64_t);
+extern void rtt_backoff(struct rtt *);
+extern void rtt_report(const char *, struct rtt *);
+
+extern void stats_printf(const char *, ...);
+extern void fs_stats(void);
+
 extern int debug;
+extern int workers;
 extern int using_syslog;
 extern char *beebem_cfg_file;
 extern int beebem_ingress;
 extern int default_timeout;
+extern char *aun_bind_addr;
+
+/*
+ * Called when an asynchronous transmission completes, with zero on
+ * success or an errno value.
+ */
+typedef void aun_done_fn(void *, int);
+
+/*
+ * xmitv_async() sends a packet whose data is in up to this many
+ * pieces, without copying them, so they must stay put until done()
+ * is called.
+ */
+#define AUN_MAXIOV 4
 
 struct aun_funcs {
 	int max_block;
 	void (*setup)(void);
-	struct aun_packet *(*recv)(ssize_t *outsize,
-	    struct aun_srcaddr *from, int want_port);
 	ssize_t (*xmit)(struct aun_packet *pkt,
 			size_t len, struct aun_srcaddr *to);
+	void (*xmit_async)(struct aun_packet *pkt, size_t len,
+	    struct aun_srcaddr *to, aun_done_fn *done, void *arg);
+	void (*xmitv_async)(struct aun_packet *hdr, const struct iovec *iov,
+	    int iovcnt, struct aun_srcaddr *to, aun_done_fn *done,
+	    void *arg);
+	void (*set_window)(struct aun_srcaddr *to, int window);
 	char *(*ntoa)(struct aun_srcaddr *addr);
+	int (*aton)(const char *, struct aun_srcaddr *addr);
+	void (*stats)(void);
+	void (*worker)(int n);
 	void (*get_stn)(struct aun_srcaddr *addr, uint8_t *out);
 };
 
@@ -33,7 +33,6 @@
 
 #include <err.h>
 #include <errno.h>
-#include <fts.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -55,9 +54,38 @@ char *lib = ".";		       /* default to the root dir */
 int default_opt4 = 0;
 enum fs_info_format default_infoformat = FS_INFO_RISCOS;
 bool default_safehandles = true;
+int default_window = 1;
+
+/*
+ * Per-station overrides of default_window, from the configuration
+ * file.  Stations are kept as strings until a client turns up, since
+ * we don't know which transport is in use while reading the file.
+ */
+struct fs_window {
+	SLIST_ENTRY(fs_window) link;
+	char *station;
+	int window;
+};
+static SLIST_HEAD(, fs_window) fs_windows = SLIST_HEAD_INITIALIZER(fs_windows);
 
 struct user_funcs const * userfuncs;
 
+static unsigned long fs_reply_cache_hits;
+static unsigned long fs_duplicates_dropped;
+
+/*
+ * Requests from stations that aren't logged on, including the logon
+ * itself, and those left behind by clients that have gone.
+ */
+#define FS_ANON_REPLIES 32
+static struct fs_cached_reply fs_anon_replies[FS_ANON_REPLIES];
+static int fs_anon_next;	/* slot to reuse next */
+
+static int fs_reply_cache_check(struct fs_context *);
+static void fs_reply_cache_store(struct fs_context *, struct ec_fs_reply *,
+    size_t);
+static void fs_reply_cache_release(struct fs_client *);
+
 void
 fs_init(void)
 {
@@ -80,6 +108,9 @@ fs_init(void)
 		userfuncs = &user_pw;
 	else
 		userfuncs = &user_null;
+
+	ec_port_listen(EC_PORT_FS, "file server", file_server, NULL);
+	fs_data_init();
 }
 
 #if 0
@@ -145,6 +176,8 @@ file_server(struct aun_packet *pkt, ssize_t len, struct aun_srcaddr *from)
 	c->req_len = len;
 	c->from = from;
 	c->client = fs_find_client(from);
+	if (fs_reply_cache_check(c))
+		return;
 	fs_check_handles(c);
 	/* Null-terminate in case client is silly */
 	((char *)(c->req))[c->req_len] = '\0';
@@ -167,14 +200,285 @@ fs_unrec(struct fs_context *c)
 	fs_reply(c, &reply, sizeof(reply));
 }
 
+static uint32_t
+fs_request_seq(struct ec_fs_req *req)
+{
+
+	return req->aun.seq[0] | req->aun.seq[1] << 8 |
+	    req->aun.seq[2] << 16 | (uint32_t)req->aun.seq[3] << 24;
+}
+
+static struct fs_cached_reply *
+fs_reply_cache_search(struct fs_cached_reply *cache, int n,
+    struct aun_srcaddr *from, struct ec_fs_req *req)
+{
+	struct fs_cached_reply *cr;
+	uint32_t seq = fs_request_seq(req);
+	int i;
+
+	for (i = 0; i < n; i++) {
+		cr = &cache[i];
+		if (cr->req != NULL && cr->seq == seq &&
+		    cr->port == req->reply_port &&
+		    memcmp(&cr->host, from, sizeof(cr->host)) == 0)
+			return cr;
+	}
+	return NULL;
+}
+
+/*
+ * Find a request in the cache.  A station's logon is remembered from
+ * before it had a client, so the anonymous entries are searched too.
+ */
+static struct fs_cached_reply *
+fs_reply_cache_find(struct fs_client *client, struct aun_srcaddr *from,
+    struct ec_fs_req *req)
+{
+	struct fs_cached_reply *cr = NULL;
+
+	if (client != NULL)
+		cr = fs_reply_cache_search(client->replies, FS_REPLY_CACHE,
+		    from, req);
+	if (cr == NULL)
+		cr = fs_reply_cache_search(fs_anon_replies, FS_ANON_REPLIES,
+		    from, req);
+	return cr;
+}
+
+/*
+ * Say whether a function's reply can be repeated.  Those that move
+ * data send several replies, and a repeat of the last one, or of the
+ * first once the transfer is over, would only confuse the client.
+ */
+static bool
+fs_reply_repeatable(int function)
+{
+
+	switch (function) {
+	case EC_FS_FUNC_LOAD:
+	case EC_FS_FUNC_LOAD_COMMAND:
+	case EC_FS_FUNC_SAVE:
+	case EC_FS_FUNC_GETBYTES:
+	case EC_FS_FUNC_PUTBYTES:
+		return false;
+	}
+	return true;
+}
+
+static void
+fs_reply_cache_clear(struct fs_cached_reply *cr)
+{
+
+	free(cr->req);
+	free(cr->reply);
+	memset(cr, 0, sizeof(*cr));
+}
+
+/*
+ * See if a request is one we've already had.  If so, deal with it
+ * and return 1.  Otherwise, make a note of it and return 0.
+ *
+ * A repeated request is answered with the reply we sent last time.
+ * If we haven't replied yet, or there's still a data transfer in
+ * progress, the original is still being dealt with, so the copy is
+ * just dropped.  So are repeats of requests with several replies.
+ */
+static int
+fs_reply_cache_check(struct fs_context *c)
+{
+	struct fs_client *client = c->client;
+	struct fs_cached_reply *cr;
+	size_t len = c->req_len - sizeof(c->req->aun);
+
+	/* BeebEm doesn't give us sequence numbers. */
+	if (fs_request_seq(c->req) == 0)
+		return 0;
+	/*
+	 * A station that has been restarted might reuse a sequence
+	 * number, so check it really is the same request.
+	 */
+	if ((cr = fs_reply_cache_find(client, c->from, c->req)) != NULL &&
+	    cr->req_len == len &&
+	    memcmp(cr->req, &c->req->reply_port, len) == 0) {
+		if (cr->reply == NULL || (client != NULL &&
+		    (client->data_tx != NULL || client->data_rx != NULL))) {
+			if (debug) printf("duplicate request dropped\n");
+			fs_duplicates_dropped++;
+		} else {
+			if (debug) printf("duplicate request, "
+			    "repeating reply\n");
+			fs_reply_cache_hits++;
+			aunfuncs->xmit_async(&cr->reply->aun, cr->len,
+			    c->from, NULL, NULL);
+		}
+		return 1;
+	}
+	if (cr == NULL && client != NULL) {
+		cr = &client->replies[client->nextreply];
+		client->nextreply = (client->nextreply + 1) % FS_REPLY_CACHE;
+	} else if (cr == NULL) {
+		cr = &fs_anon_replies[fs_anon_next];
+		fs_anon_next = (fs_anon_next + 1) % FS_ANON_REPLIES;
+	}
+	fs_reply_cache_clear(cr);
+	if ((cr->req = malloc(len)) == NULL)
+		return 0;
+	memcpy(cr->req, &c->req->reply_port, len);
+	cr->req_len = len;
+	cr->host = *c->from;
+	cr->seq = fs_request_seq(c->req);
+	cr->port = c->req->reply_port;
+	cr->multi = !fs_reply_repeatable(c->req->function);
+	return 0;
+}
+
+/*
+ * Remember a reply, in case the request it answers turns up again.
+ * Requests can outlive their clients, so the client is looked up
+ * afresh.  The request may have been altered while being handled, so
+ * only the sequence number and port are checked here.  Replies to
+ * requests with more than one aren't kept, so repeats of those are
+ * dropped.
+ */
+static void
+fs_reply_cache_store(struct fs_context *c, struct ec_fs_reply *reply,
+    size_t len)
+{
+	struct fs_client *client;
+	struct fs_cached_reply *cr;
+	struct ec_fs_reply *copy;
+
+	client = fs_find_client(c->from);
+	if ((cr = fs_reply_cache_find(client, c->from, c->req)) == NULL ||
+	    cr->multi)
+		return;
+	if ((copy = realloc(cr->reply, len)) == NULL)
+		return;
+	memcpy(copy, reply, len);
+	cr->reply = copy;
+	cr->len = len;
+}
+
+/*
+ * Move a departing client's requests to the anonymous entries, so
+ * that a repeated logon or logoff isn't carried out a second time.
+ */
+static void
+fs_reply_cache_release(struct fs_client *client)
+{
+	struct fs_cached_reply *cr;
+	int i;
+
+	for (i = 0; i < FS_REPLY_CACHE; i++) {
+		if (client->replies[i].req == NULL)
+			continue;
+		cr = &fs_anon_replies[fs_anon_next];
+		fs_anon_next = (fs_anon_next + 1) % FS_ANON_REPLIES;
+		fs_reply_cache_clear(cr);
+		*cr = client->replies[i];
+		memset(&client->replies[i], 0, sizeof(client->replies[i]));
+	}
+}
+
+static void
+fs_reply_done(void *arg, int error)
+{
+
+	if (error != 0)
+		warnx("Tx reply: %s", strerror(error));
+}
+
+/*
+ * Replies are sent asynchronously; nobody needs to wait for them.
+ */
 void
 fs_reply(struct fs_context *c, struct ec_fs_reply *reply, size_t len)
 {
 	reply->aun.type = AUN_TYPE_UNICAST;
 	reply->aun.dest_port = c->req->reply_port;
 	reply->aun.flag = c->req->aun.flag;
-	if (aunfuncs->xmit(&(reply->aun), len, c->from) == -1)
-		warn("Tx reply");
+	fs_reply_cache_store(c, reply, len);
+	aunfuncs->xmit_async(&(reply->aun), len, c->from, fs_reply_done,
+	    NULL);
+}
+
+/*
+ * Make a copy of a request context which can outlive the packet it
+ * came from, for operations which complete after we've gone back to
+ * the main loop.
+ */
+struct fs_context *
+fs_save_context(struct fs_context *c)
+{
+	struct fs_context *copy;
+
+	if ((copy = malloc(sizeof(*copy) + sizeof(*copy->from) +
+	    c->req_len + 1)) == NULL)
+		return NULL;
+	*copy = *c;
+	copy->from = (struct aun_srcaddr *)(copy + 1);
+	*copy->from = *c->from;
+	copy->req = (struct ec_fs_req *)(copy->from + 1);
+	memcpy(copy->req, c->req, c->req_len + 1);
+	return copy;
+}
+
+void
+fs_free_context(struct fs_context *c)
+{
+
+	free(c);
+}
+
+int
+fs_add_window(const char *station, int window)
+{
+	struct fs_window *w;
+
+	if ((w = malloc(sizeof(*w))) == NULL ||
+	    (w->station = strdup(station)) == NULL) {
+		free(w);
+		return -1;
+	}
+	w->window = window;
+	SLIST_INSERT_HEAD(&fs_windows, w, link);
+	return 0;
+}
+
+static int
+fs_station_window(struct aun_srcaddr *from)
+{
+	struct fs_window *w;
+	struct aun_srcaddr addr;
+
+	SLIST_FOREACH(w, &fs_windows, link) {
+		memset(&addr, 0, sizeof(addr));
+		if (aunfuncs->aton(w->station, &addr) == 0 &&
+		    memcmp(&addr, from, sizeof(addr)) == 0)
+			return w->window;
+	}
+	return default_window;
+}
+
+/*
+ * Report file server statistics.
+ */
+void
+fs_stats(void)
+{
+	struct fs_client *client;
+	int n = 0;
+
+	LIST_FOREACH(client, &fs_clients, link)
+		n++;
+	stats_printf("file server: %d clients logged on, "
+	    "%lu repeated requests answered from cache, %lu dropped",
+	    n, fs_reply_cache_hits, fs_duplicates_dropped);
+	fs_nameindex_stats();
+	fs_pathcache_stats();
+	fs_dirsnap_stats();
+	fs_attr_stats();
+	fs_journal_stats();
 }
 
 struct fs_client *
@@ -200,11 +504,9 @@ fs_new_client(struct aun_srcaddr *from)
 	client->nhandles = 4;
 	client->host = *from;
 	client->login = NULL;
-	client->dir_cache.path = NULL;
-	client->dir_cache.ftsp = NULL;
-	client->dir_cache.f = NULL;
 	client->infoformat = default_infoformat;
 	client->safehandles = default_safehandles;
+	client->window = fs_station_window(from);
 	LIST_INSERT_HEAD(&fs_clients, client, link);
 	if (using_syslog)
 		syslog(LOG_INFO, "login from %s", aunfuncs->ntoa(from));
@@ -226,13 +528,14 @@ fs_delete_client(struct fs_client *client)
 {
 	int i;
 	LIST_REMOVE(client, link);
+	fs_data_abort(client);
+	fs_reply_cache_release(client);
 	for (i=0; i < client->nhandles; i++)
 		if (client->handles[i] != NULL)
 			fs_close_handle(client, i);
 	free(client->handles);
 	free(client->login);
-	if (client->dir_cache.ftsp)
-		fts_close(client->dir_cache.ftsp);
+	fs_examine_forget(client);
 	if (using_syslog)
 		syslog(LOG_INFO, "logout from %s",
 		    aunfuncs->ntoa(&client->host));
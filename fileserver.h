@@ -35,12 +35,14 @@
 #include <netinet/in.h>
 
 #include <dirent.h>
-#include <fts.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "aun.h"
+#include "event.h"
 #include "fs_proto.h"
 
 struct fs_context {
@@ -56,7 +58,10 @@ struct fs_handle {
 	char	*path;
 	off_t	oldoffset; /* files only */
 	enum 	fs_handle_type type;
-	int	fd;
+	int	fd; /* O_PATH for directories not opened with OPEN */
+	dev_t	dev; /* directories only */
+	ino_t	ino;
+	struct fs_pathpin *pin; /* moves that would make path stale */
 	/*
 	 * The sequence number field here has three states: 0 and 1
 	 * indicate the sequence number we last received from
@@ -70,11 +75,171 @@ struct fs_handle {
 	uint8_t	sequence; /* also only for files */
 };
 
-struct fs_dir_cache {
-	char *path; /* Path for which this is a cache. */
-	int start; /* position in the directory this list starts at */
-	FTS *ftsp; /* Pass to fts_close to free f */
-	FTSENT *f; /* Result of fts_children on path */
+/*
+ * An object, and the parts of its stat information that we use, as
+ * found by fs_ent_stat().  The path and name aren't copied, so they
+ * must last as long as the entry does.
+ */
+struct fs_ent {
+	const char *path;	/* Unix path */
+	const char *name;	/* Its last component, within path */
+	size_t pathlen, namelen;
+	mode_t mode;
+	off_t size;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime, ctime;
+	time_t btime;		/* Creation time, or 0 if unknown */
+};
+
+/*
+ * Where a metadata backend keeps something, as its stamp() or
+ * dirstamp() found it (see struct meta_funcs), or all zero if
+ * there's nothing there.
+ */
+struct meta_stamp {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;		/* Racy stamps aren't used, so seconds */
+	time_t ctime;		/* are enough. */
+};
+
+/*
+ * A sorted listing of a directory, shared between clients.  Entries
+ * that clients can't see have already been left out.
+ */
+/* Kinds of EXAMINE record a snapshot can keep. */
+enum fs_exrec {
+	FS_EXREC_ALL, FS_EXREC_NAME, FS_EXREC_SHORTTXT,
+	FS_EXREC_LONGTXT, FS_EXREC_LONGTXT_SJ, FS_EXREC_MAX
+};
+
+struct fs_dirsnap {
+	TAILQ_ENTRY(fs_dirsnap) link;
+	int refs;
+	int cached; /* Still on offer to new listings */
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime, ctime;
+	time_t made;
+	int racy; /* Directory changed just before we read it */
+	struct meta_stamp stamp; /* Where its metadata is kept */
+	int big; /* Too big to keep; use an fs_dirstream */
+	char *path; /* Path it was read by */
+	int nents;
+	uint32_t *name; /* Offsets into names and keys */
+	uint16_t *namelen;
+	struct fs_ent *ent; /* No paths or names; they're above */
+	char *names;
+	char *keys; /* Names folded to lower case */
+	unsigned char *rec[FS_EXREC_MAX]; /* EXAMINE records; see fs_examine.c */
+	uint8_t *rendered; /* Which records are made, per entry */
+};
+
+/*
+ * What fs_attr_get() found out about an object.
+ */
+struct fs_attr {
+	struct fs_ent ent;
+	time_t birth;		/* From fs_get_birthtime() */
+	int sin;		/* From fs_get_sin() */
+	struct ec_fs_meta meta;	/* Only if asked for with FS_ATTR_META */
+};
+
+#define FS_ATTR_META	0x01
+
+/*
+ * Where a client is getting a directory listing from.  A client can
+ * have a few on the go at once, and each can be read from anywhere.
+ */
+struct fs_examine_cursor {
+	char *path; /* Path for which this is a cursor, or NULL */
+	struct fs_dirsnap *snap; /* Listing being read, */
+	struct fs_dirstream *stream; /* or where to read it from */
+	unsigned long used; /* For finding the least recently used */
+};
+
+#define FS_EXAMINE_CURSORS 4
+
+/*
+ * State of a SAVE or PUTBYTES whose data is still arriving.  Data
+ * packets are fed in from the main loop as they turn up, and written
+ * out asynchronously.  Once the last one has been written, done()
+ * sends the final reply.
+ */
+struct fs_data_rx {
+	struct fs_context *c;	/* Private copy of the original request */
+	int	fd;
+	bool	owns_fd;	/* close fd when finished */
+	off_t	start;		/* File offset of first byte */
+	size_t	size;		/* Bytes expected */
+	size_t	got;		/* Bytes received so far */
+	int	writing;	/* Writes not yet completed */
+	int	error;		/* errno value if a write failed */
+	bool	aborted;	/* Client has gone away */
+	int	ackport;
+	struct ev_timer timeout;
+	void	(*done)(struct fs_data_rx *, ssize_t);
+	/* Only used by SAVE */
+	char	*upath;
+	struct ec_fs_meta meta;
+};
+
+/*
+ * State of a LOAD or GETBYTES whose data is still being sent.  The
+ * file is read a window's worth at a time, and the next lot is read
+ * while the current one is being sent.  Blocks are sent straight from
+ * these buffers, so one can't be reused until all of its blocks have
+ * been acknowledged.
+ */
+struct fs_data_buf {
+	struct fs_data_tx *tx;
+	uint8_t	*data;
+	size_t	len, pos;
+	int	busy;		/* Blocks sent from here and not yet done */
+};
+
+struct fs_data_tx {
+	struct fs_context *c;	/* Private copy of the original request */
+	int	fd;
+	bool	owns_fd;	/* close fd when finished */
+	size_t	size;		/* Bytes still to be sent */
+	size_t	got;		/* Bytes read from the file */
+	off_t	start;		/* File offset of first byte */
+	size_t	toread;		/* Bytes not yet asked for */
+	size_t	chunk;		/* Size of buffers */
+	struct fs_data_buf buf[2];
+	int	cur;		/* Index of buffer being sent */
+	bool	reading;	/* Read into the other in progress */
+	bool	nextready;	/* Read into the other finished */
+	int	error;		/* errno value if anything failed */
+	bool	faking;		/* Hit EOF, so padding with zeroes */
+	bool	filling;	/* In fs_data_tx_fill() */
+	bool	aborted;	/* Client has gone away */
+	int	inflight;	/* Blocks sent but not yet acknowledged */
+	int	window;		/* Maximum value of inflight */
+	void	(*done)(struct fs_data_tx *, ssize_t);
+};
+
+/*
+ * A recent request from a station, and the reply we sent to it.  If
+ * the station retransmits the request, perhaps because our ACK got
+ * lost, it's answered from here rather than being carried out again.
+ * Each client has a few of these, and there are more in fileserver.c
+ * for stations that aren't logged on.
+ */
+#define FS_REPLY_CACHE 4
+
+struct fs_cached_reply {
+	struct aun_srcaddr host; /* Station that sent the request */
+	uint32_t seq;		/* AUN sequence number of request */
+	uint8_t	port;		/* and its reply port */
+	bool	multi;		/* More than one reply, so don't repeat */
+	size_t	req_len;	/* Request, less AUN header, or NULL if */
+	uint8_t	*req;		/* this slot is unused */
+	size_t	len;		/* Reply, or NULL if none sent yet */
+	struct ec_fs_reply *reply;
 };
 
 extern enum fs_info_format { FS_INFO_RISCOS, FS_INFO_SJ } default_infoformat;
@@ -86,9 +251,14 @@ struct fs_client {
 	int nhandles;
 	struct fs_handle **handles; /* array of handles for this client */
 	char *login;
-	struct fs_dir_cache dir_cache;
+	struct fs_examine_cursor cursors[FS_EXAMINE_CURSORS];
 	enum fs_info_format infoformat;
 	bool safehandles;
+	struct fs_data_rx *data_rx; /* incoming data transfer, if any */
+	struct fs_data_tx *data_tx; /* outgoing data transfer, if any */
+	int window; /* data blocks to send before waiting for an ACK */
+	struct fs_cached_reply replies[FS_REPLY_CACHE];
+	int nextreply; /* slot in replies to reuse next */
 };
 
 LIST_HEAD(fs_client_head, fs_client);
@@ -100,6 +270,7 @@ extern char *fixedurd;
 extern char *pwfile;
 extern char *lib;
 extern int default_opt4;
+extern int default_window;
 
 typedef void fs_func_impl(struct fs_context *);
 extern fs_func_impl fs_cli;
@@ -134,8 +305,12 @@ extern fs_func_impl fs_get_user_free;
 
 extern void fs_unrec(struct fs_context *);
 extern char *fs_cli_getarg(char **);
-extern void fs_long_info(struct fs_context *, char *, FTSENT *);
+extern void fs_long_info(struct fs_context *, char *, struct fs_ent *);
 extern void fs_reply(struct fs_context *, struct ec_fs_reply *, size_t);
+extern struct fs_context *fs_save_context(struct fs_context *);
+extern void fs_free_context(struct fs_context *);
+extern void fs_data_init(void);
+extern void fs_data_abort(struct fs_client *);
 extern void fs_cdir1(struct fs_context *, char *);
 extern void fs_delete1(struct fs_context *, char *);
 
@@ -147,12 +322,16 @@ extern void fs_check_handles(struct fs_context *);
 extern int fs_check_handle(struct fs_client *, int);
 extern int fs_open_handle(struct fs_client *, char *, int, bool);
 extern void fs_close_handle(struct fs_client *, int);
+extern void fs_handle_check_path(struct fs_handle *);
+extern int fs_path_at(struct fs_client *, const char *, const char **);
 
 extern struct fs_client *fs_new_client(struct aun_srcaddr *);
 extern void fs_delete_client(struct fs_client *);
 extern struct fs_client *fs_find_client(struct aun_srcaddr *);
+extern int fs_add_window(const char *, int);
 
 extern char *strpad(char *, int, size_t);
+extern char *strpadcpy(char *, const char *, int, size_t);
 extern uint8_t fs_mode_to_type(mode_t);
 extern uint8_t fs_mode_to_access(mode_t);
 extern mode_t fs_access_to_mode(unsigned char, int);
@@ -160,20 +339,80 @@ extern char *fs_access_to_string(char *, uint8_t);
 extern uint64_t fs_read_val(uint8_t *, size_t);
 extern void fs_write_val(uint8_t *, uint64_t, size_t);
 extern uint64_t fs_riscos_date(time_t, unsigned);
-extern void fs_get_meta(FTSENT *, struct ec_fs_meta *);
-extern int fs_set_meta(FTSENT *, struct ec_fs_meta *);
-extern void fs_del_meta(FTSENT *);
-extern int fs_get_sin(FTSENT *);
-extern time_t fs_get_birthtime(FTSENT *);
+extern int fs_get_meta(struct fs_ent *, struct ec_fs_meta *);
+extern int fs_set_meta(struct fs_ent *, struct ec_fs_meta *);
+extern void fs_del_meta(struct fs_ent *);
+extern int fs_get_sin(struct fs_ent *);
+extern time_t fs_get_birthtime(struct fs_ent *);
 extern void fs_write_date(struct ec_fs_date *, time_t);
 extern int fs_stat(const char *, struct stat *);
+extern int fs_ent_stat(const char *, struct fs_ent *);
+extern int fs_ent_statat(int, const char *, struct fs_ent *);
+extern void fs_ent_path(struct fs_ent *, const char *);
+/*
+ * Timestamps move in clock ticks, so an object that changed less than
+ * FS_STAT_RACY seconds before we looked could change again without
+ * them moving.  The caches of what's on disc don't trust anything for
+ * more than FS_STAT_MAXAGE seconds, in case of changes that they
+ * can't see.
+ */
+#define FS_STAT_RACY	1	/* Seconds */
+#define FS_STAT_MAXAGE	10	/* Seconds */
+
+extern void fs_stat_times(const struct stat *, struct timespec *,
+    struct timespec *);
+extern void fs_ent_fromstat(struct fs_ent *, const struct stat *);
 extern const char *fs_leafname(const char *);
 
 extern char *fs_acornify_name(char *);
 extern int fs_hidden_name(char *);
 extern char *fs_unixify_path(struct fs_context *, char *);
+extern void fs_match_path(int, char *);
+struct fs_wildcard;
+extern int fs_wild_is_wild(const char *);
+extern struct fs_wildcard *fs_wild_compile(const char *);
+extern int fs_wild_match(const struct fs_wildcard *, const char *, int);
+extern void fs_wild_free(struct fs_wildcard *);
+extern const char *fs_nameindex_find(int, const char *, const char *);
+extern void fs_nameindex_stats(void);
+extern struct fs_dirsnap *fs_dirsnap_get(const char *);
+extern void fs_dirsnap_release(struct fs_dirsnap *);
+extern void fs_dirsnap_changed(const char *);
+extern struct fs_ent *fs_dirsnap_ent(struct fs_dirsnap *, int,
+    struct fs_ent *, char *, size_t);
+extern int fs_bigdir;
+extern struct fs_dirstream *fs_dirstream_open(const char *);
+extern void fs_dirstream_close(struct fs_dirstream *);
+extern int fs_dirstream_read(struct fs_dirstream *, int, int,
+    int (*)(void *, struct fs_ent *), void *);
+extern void fs_examine_forget(struct fs_client *);
+extern void fs_dirsnap_stats(void);
+extern int fs_attr_get(const char *, struct fs_attr *, int);
+extern void fs_attr_set_meta(const char *, struct ec_fs_meta *);
+extern void fs_attr_changed(const char *);
+extern void fs_attr_forget(const char *);
+extern void fs_attr_stats(void);
+#define FS_JOURNAL_SET	1
+#define FS_JOURNAL_DEL	2
+extern char *fs_journal_file;
+extern int fs_journal_set(struct fs_ent *, struct ec_fs_meta *);
+extern int fs_journal_del(struct fs_ent *);
+extern int fs_journal_get(struct fs_ent *, struct ec_fs_meta *);
+extern void fs_journal_flush(void);
+extern void fs_journal_recover(void);
+extern void fs_journal_start(void);
+extern void fs_journal_stop(void);
+extern void fs_journal_stats(void);
+extern char *fs_pathcache_lookup(const char *, const char *);
+extern void fs_pathcache_watch(const char *);
+extern void fs_pathcache_add(const char *, const char *, const char *);
+extern void fs_pathcache_update(void);
+extern struct fs_pathpin *fs_pathcache_pin(const char *);
+extern int fs_pathcache_moved(struct fs_pathpin *);
+extern void fs_pathcache_unpin(struct fs_pathpin *);
+extern void fs_pathcache_stats(void);
 
-extern int fs_guess_type(FTSENT *);
+extern int fs_guess_type(struct fs_ent *);
 extern int fs_add_typemap_name(const char *, int);
 extern int fs_add_typemap_mode(mode_t, mode_t, int);
 extern int fs_add_typemap_default(int);
@@ -189,4 +428,45 @@ extern struct user_funcs const *userfuncs;
 extern struct user_funcs const user_pw;
 extern struct user_funcs const user_null;
 
+/*
+ * Where load and execute addresses are kept.  get() returns -1 if
+ * an object has none, and set() returns -1, with errno set, on
+ * failure.  deldir() removes anything the backend keeps in a
+ * directory.  If 'moved' is set, the metadata has been copied
+ * elsewhere and can all go; otherwise, this is so the directory can
+ * be removed, and nothing must be lost if it still has other things
+ * in it.  If 'byinode' is
+ * set, the metadata belongs to the file rather than its name, and
+ * goes with it when it's renamed.
+ *
+ * stamp() and dirstamp() describe where the metadata of an object,
+ * or of everything in a directory, is kept, so that the caches can
+ * tell when someone else has changed it.  They're NULL if a change
+ * always shows in the object's own ctime.
+ */
+struct meta_funcs {
+	char const *name;
+	int byinode;
+	int (*get)(struct fs_ent *, struct ec_fs_meta *);
+	int (*set)(struct fs_ent *, struct ec_fs_meta *);
+	void (*del)(struct fs_ent *);
+	void (*deldir)(int, char const *, int);
+	void (*stamp)(struct fs_ent *, struct meta_stamp *);
+	void (*dirstamp)(char const *, struct meta_stamp *);
+};
+
+extern struct meta_funcs const *metafuncs;
+extern struct meta_funcs const meta_symlink;
+extern struct meta_funcs const meta_xattr;
+extern struct meta_funcs const meta_catalog;
+extern struct meta_funcs const *meta_find(char const *);
+#define META_TEXTLEN	17	/* "LLLLLLLL EEEEEEEE" */
+#define META_OLDTEXTLEN	23	/* "LL LL LL LL EE EE EE EE" */
+extern void meta_format(char *, struct ec_fs_meta *);
+extern int meta_parse(char const *, size_t, struct ec_fs_meta *);
+extern void meta_stamp_path(char const *, struct meta_stamp *);
+extern int meta_stamp_same(struct meta_stamp const *,
+    struct meta_stamp const *);
+extern int meta_stamp_racy(struct meta_stamp const *, time_t);
+
 #endif
@@ -0,0 +1,334 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * fs_attrcache.c - remembering what we know about files
+ *
+ * The RISC OS Filer asks for the information on the same few
+ * objects many times a second, and each answer needs the file's load
+ * and execute addresses, which means asking the metadata backend (a
+ * readlink(), say) and perhaps guessing a file type from the name.
+ * So we remember the addresses we last worked out for the last
+ * FS_ATTR_ENTRIES objects, found by their device and inode numbers.
+ * Each also remembers the path it was looked up by, and a second
+ * table finds them by that, so that we can keep them up to date
+ * when we change something and only have a path to hand.
+ *
+ * Every lookup still stat()s the object, which is the only system
+ * call it needs, and an entry is only used if the object's ctime is
+ * unchanged, so anything done to the file itself is noticed.
+ * Metadata kept by name (rather than in the file) depends on the
+ * path as well, so for those backends the path has to match too.
+ * The symlink and catalog backends keep their metadata outside the
+ * file, where the ctime doesn't show changes made by anyone else
+ * (another worker, say), so each entry also remembers the backend's
+ * stamp() of where it was found, and is only used if that's
+ * unchanged too.  Our own changes go through fs_set_meta() and
+ * fs_del_meta(), which keep the entries up to date.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "extern.h"
+#include "fileserver.h"
+
+#define FS_ATTR_ENTRIES		1024	/* Objects to remember */
+#define FS_ATTR_BUCKETS		2048
+
+struct fs_attrent {
+	TAILQ_ENTRY(fs_attrent) lru;
+	LIST_ENTRY(fs_attrent) idlink;
+	LIST_ENTRY(fs_attrent) pathlink;
+	dev_t dev;
+	ino_t ino;
+	struct timespec ctime;
+	time_t made;
+	uint32_t pathhash;
+	char *path;
+	int stored;		/* meta came from the backend */
+	struct meta_stamp stamp;	/* where the backend keeps it */
+	struct ec_fs_meta meta;
+};
+
+LIST_HEAD(fs_attrent_list, fs_attrent);
+TAILQ_HEAD(fs_attrent_lru, fs_attrent);
+
+static struct fs_attrent_list fs_attrids[FS_ATTR_BUCKETS];
+static struct fs_attrent_list fs_attrpaths[FS_ATTR_BUCKETS];
+static struct fs_attrent_lru fs_attrlru = TAILQ_HEAD_INITIALIZER(fs_attrlru);
+static int fs_nattrents;
+
+static unsigned long fs_attr_hits, fs_attr_misses, fs_attr_stale;
+
+static uint32_t
+fs_attr_pathhash(const char *path)
+{
+	uint32_t h = 2166136261U;
+
+	while (*path != '\0')
+		h = (h ^ (uint8_t)*path++) * 16777619U;
+	return h;
+}
+
+static unsigned
+fs_attr_idhash(dev_t dev, ino_t ino)
+{
+
+	return ((uint64_t)ino * 2654435761U + (uint64_t)dev) %
+	    FS_ATTR_BUCKETS;
+}
+
+static void
+fs_attr_drop(struct fs_attrent *e)
+{
+
+	TAILQ_REMOVE(&fs_attrlru, e, lru);
+	LIST_REMOVE(e, idlink);
+	LIST_REMOVE(e, pathlink);
+	fs_nattrents--;
+	free(e->path);
+	free(e);
+}
+
+static struct fs_attrent *
+fs_attr_bypath(const char *upath)
+{
+	struct fs_attrent *e;
+	uint32_t h;
+
+	h = fs_attr_pathhash(upath);
+	LIST_FOREACH(e, &fs_attrpaths[h % FS_ATTR_BUCKETS], pathlink)
+		if (e->pathhash == h && strcmp(e->path, upath) == 0)
+			return e;
+	return NULL;
+}
+
+static struct fs_attrent *
+fs_attr_byid(struct fs_ent *ent)
+{
+	struct fs_attrent *e;
+
+	LIST_FOREACH(e, &fs_attrids[fs_attr_idhash(ent->dev, ent->ino)],
+	    idlink)
+		if (e->dev == ent->dev && e->ino == ent->ino)
+			return e;
+	return NULL;
+}
+
+/*
+ * Remember 'meta' for the object 'ent', replacing anything we knew
+ * about it or its path before.  'ms' is the backend's stamp, taken
+ * before 'meta' was read, or NULL if it doesn't have one.
+ */
+static void
+fs_attr_keep(struct fs_ent *ent, struct ec_fs_meta *meta, int stored,
+    struct meta_stamp const *ms)
+{
+	const char *upath = ent->path;
+	struct fs_attrent *e;
+	char *path;
+
+	if ((e = fs_attr_bypath(upath)) != NULL &&
+	    (e->dev != ent->dev || e->ino != ent->ino))
+		fs_attr_drop(e);
+	if ((e = fs_attr_byid(ent)) == NULL) {
+		if ((e = calloc(1, sizeof(*e))) == NULL)
+			return;
+		if ((e->path = strdup(upath)) == NULL) {
+			free(e);
+			return;
+		}
+		e->dev = ent->dev;
+		e->ino = ent->ino;
+		LIST_INSERT_HEAD(&fs_attrids[fs_attr_idhash(e->dev, e->ino)],
+		    e, idlink);
+		TAILQ_INSERT_HEAD(&fs_attrlru, e, lru);
+		fs_nattrents++;
+	} else {
+		LIST_REMOVE(e, pathlink);
+		if (strcmp(e->path, upath) != 0) {
+			if ((path = strdup(upath)) == NULL) {
+				LIST_INSERT_HEAD(&fs_attrpaths[e->pathhash %
+				    FS_ATTR_BUCKETS], e, pathlink);
+				fs_attr_drop(e);
+				return;
+			}
+			free(e->path);
+			e->path = path;
+		}
+		if (e != TAILQ_FIRST(&fs_attrlru)) {
+			TAILQ_REMOVE(&fs_attrlru, e, lru);
+			TAILQ_INSERT_HEAD(&fs_attrlru, e, lru);
+		}
+	}
+	e->pathhash = fs_attr_pathhash(upath);
+	LIST_INSERT_HEAD(&fs_attrpaths[e->pathhash % FS_ATTR_BUCKETS], e,
+	    pathlink);
+	e->ctime = ent->ctime;
+	e->made = time(NULL);
+	e->stored = stored;
+	if (ms != NULL)
+		e->stamp = *ms;
+	e->meta = *meta;
+	while (fs_nattrents > FS_ATTR_ENTRIES)
+		fs_attr_drop(TAILQ_LAST(&fs_attrlru, fs_attrent_lru));
+}
+
+/*
+ * Find out about the object at 'upath', which must last as long as
+ * a->ent is used.  Its load and execute addresses are only filled
+ * in if 'want' includes FS_ATTR_META.  Returns -1, with errno set,
+ * on failure.
+ */
+int
+fs_attr_get(const char *upath, struct fs_attr *a, int want)
+{
+	struct fs_attrent *e;
+	struct meta_stamp ms;
+	time_t now;
+	int stored;
+
+	if (fs_ent_stat(upath, &a->ent) < 0)
+		return -1;
+	a->birth = fs_get_birthtime(&a->ent);
+	a->sin = fs_get_sin(&a->ent);
+	if (!(want & FS_ATTR_META))
+		return 0;
+	now = time(NULL);
+	if (metafuncs->stamp != NULL)
+		metafuncs->stamp(&a->ent, &ms);
+	if ((e = fs_attr_bypath(upath)) == NULL ||
+	    e->dev != a->ent.dev || e->ino != a->ent.ino)
+		e = fs_attr_byid(&a->ent);
+	if (e != NULL) {
+		if (e->ctime.tv_sec == a->ent.ctime.tv_sec &&
+		    e->ctime.tv_nsec == a->ent.ctime.tv_nsec &&
+		    now - e->made < FS_STAT_MAXAGE &&
+		    (metafuncs->stamp == NULL ||
+			meta_stamp_same(&e->stamp, &ms)) &&
+		    (strcmp(e->path, upath) == 0 ||
+			(metafuncs->byinode && e->stored))) {
+			fs_attr_hits++;
+			a->meta = e->meta;
+			if (e != TAILQ_FIRST(&fs_attrlru)) {
+				TAILQ_REMOVE(&fs_attrlru, e, lru);
+				TAILQ_INSERT_HEAD(&fs_attrlru, e, lru);
+			}
+			return 0;
+		}
+		fs_attr_stale++;
+		fs_attr_drop(e);
+	}
+	fs_attr_misses++;
+	stored = fs_get_meta(&a->ent, &a->meta);
+	/*
+	 * If the file or its metadata changed this second, it could
+	 * change again without the times moving, so don't rely on it.
+	 */
+	if (now - a->ent.ctime.tv_sec > FS_STAT_RACY) {
+		if (metafuncs->stamp == NULL)
+			fs_attr_keep(&a->ent, &a->meta, stored, NULL);
+		else if (!meta_stamp_racy(&ms, now))
+			fs_attr_keep(&a->ent, &a->meta, stored, &ms);
+	}
+	return 0;
+}
+
+/*
+ * We've just given the object at 'upath' new load and execute
+ * addresses.  That may have changed its ctime, so look again.  If
+ * the backend keeps them elsewhere, that has only just changed, and
+ * can't be relied on until it's had time to settle.
+ */
+void
+fs_attr_set_meta(const char *upath, struct ec_fs_meta *meta)
+{
+	struct fs_ent ent;
+
+	if (metafuncs->stamp != NULL || fs_ent_stat(upath, &ent) < 0)
+		fs_attr_forget(upath);
+	else
+		fs_attr_keep(&ent, meta, 1, NULL);
+}
+
+/*
+ * We've changed something else about the object at 'upath', such as
+ * its access, that will change its ctime but not where its metadata
+ * is kept.
+ */
+void
+fs_attr_changed(const char *upath)
+{
+	struct fs_attrent *e;
+	struct fs_ent ent;
+
+	if ((e = fs_attr_bypath(upath)) == NULL)
+		return;
+	if (!e->stored || fs_ent_stat(upath, &ent) < 0 ||
+	    e->dev != ent.dev || e->ino != ent.ino)
+		fs_attr_drop(e);
+	else
+		e->ctime = ent.ctime;
+}
+
+/*
+ * The object at 'upath' has gone, or been moved away.
+ */
+void
+fs_attr_forget(const char *upath)
+{
+	struct fs_attrent *e;
+
+	if ((e = fs_attr_bypath(upath)) != NULL)
+		fs_attr_drop(e);
+}
+
+void
+fs_attr_stats(void)
+{
+	unsigned long total = fs_attr_hits + fs_attr_misses;
+
+	stats_printf("attribute cache: %d entries, %lu hits, %lu misses "
+	    "(%.1f%% hit rate), %lu found stale",
+	    fs_nattrents, fs_attr_hits, fs_attr_misses,
+	    total ? 100.0 * fs_attr_hits / total : 0.0, fs_attr_stale);
+}
@@ -33,6 +33,7 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <grp.h>
 #include <libgen.h>
@@ -336,16 +337,36 @@ fs_cmd_cat(struct fs_context *c, char *tail)
 	free(reply);
 }
 
+/*
+ * Move an object's metadata from its old name to its new one.  If it
+ * had none, there's nothing to move, and it'll be made up from the
+ * new name.
+ */
+static void
+fs_cmd_rename_meta(char *oldupath, char *newupath)
+{
+	struct fs_attr attr;
+	struct fs_ent old;
+
+	/* The object is at its new name now, so look there. */
+	if (fs_attr_get(newupath, &attr, 0) < 0)
+		return;
+	old = attr.ent;
+	fs_ent_path(&old, oldupath);
+	if (!fs_get_meta(&old, &attr.meta))
+		return;
+	fs_del_meta(&old);
+	fs_set_meta(&attr.ent, &attr.meta);
+}
+
 static void
 fs_cmd_rename(struct fs_context *c, char *tail)
 {
 	struct ec_fs_reply reply;
-	struct ec_fs_meta meta;
 	char *oldname, *newname;
 	char *oldupath, *newupath;
-	char *path_argv[2];
-	FTS *ftsp;
-	FTSENT *f;
+	const char *oldrel, *newrel;
+	int oldat, newat;
 	
 	oldname = fs_cli_getarg(&tail);
 	newname = fs_cli_getarg(&tail);
@@ -359,24 +380,15 @@ fs_cmd_rename(struct fs_context *c, char *tail)
 		free(oldupath);
 		return;
 	}
-	if (rename(oldupath, newupath) < 0) {
+	oldat = fs_path_at(c->client, oldupath, &oldrel);
+	newat = fs_path_at(c->client, newupath, &newrel);
+	fs_journal_flush();
+	if (renameat(oldat, oldrel, newat, newrel) < 0) {
 		fs_errno(c);
 	} else {
-		path_argv[0] = oldupath;
-		path_argv[1] = NULL;
-		ftsp = fts_open(path_argv, FTS_LOGICAL, NULL);
-		f = fts_read(ftsp);
-		fs_get_meta(f, &meta);
-		fs_del_meta(f);
-		fts_close(ftsp);
-
-		path_argv[0] = newupath;
-		path_argv[1] = NULL;
-		ftsp = fts_open(path_argv, FTS_LOGICAL, NULL);
-		f = fts_read(ftsp);
-		fs_set_meta(f, &meta);
-		fts_close(ftsp);
-
+		if (!metafuncs->byinode)
+			fs_cmd_rename_meta(oldupath, newupath);
+		fs_attr_forget(oldupath);
 		reply.command_code = EC_FS_CC_DONE;
 		reply.return_code = EC_FS_RC_OK;
 		fs_reply(c, &reply, sizeof(reply));
@@ -527,26 +539,27 @@ fs_cmd_bye(struct fs_context *c, char *tail)
 }
 
 void
-fs_long_info(struct fs_context *c, char *string, FTSENT *f)
+fs_long_info(struct fs_context *c, char *string, struct fs_ent *f)
 {
 	struct ec_fs_meta meta;
 	struct tm mtm, btm;
+	struct dirent *dp;
 	time_t birthtime;
 	unsigned long load, exec;
 	char accstring[8], accstr2[8];
 	mode_t currumask;
-	char *acornname;
+	char acornname[NAME_MAX + 1];
 	int entries;
+	DIR *d;
 
-	acornname = strdup(f->fts_name);
+	snprintf(acornname, sizeof(acornname), "%s", f->name);
 	fs_acornify_name(acornname);
 	if (!*acornname)
 		strcpy(acornname, "$");
 
-	fs_access_to_string(accstring,
-			    fs_mode_to_access(f->fts_statp->st_mode));
+	fs_access_to_string(accstring, fs_mode_to_access(f->mode));
 
-	mtm = *localtime(&f->fts_statp->st_mtime);
+	mtm = *localtime(&f->mtime.tv_sec);
 	birthtime = fs_get_birthtime(f);
 	btm = *localtime(&birthtime);
 
@@ -565,7 +578,7 @@ fs_long_info(struct fs_context *c, char *string, FTSENT *f)
 		 * between them, that would be a different matter,
 		 * of course.
 		 */
-		if (S_ISDIR(f->fts_statp->st_mode)) {
+		if (S_ISDIR(f->mode)) {
 			currumask = umask(777);
 			umask(currumask);
 			fs_access_to_string(accstr2,
@@ -574,36 +587,12 @@ fs_long_info(struct fs_context *c, char *string, FTSENT *f)
 			/*
 			 * Count the entries in a subdirectory.
 			 */
-			{
-				char *lastslash = strrchr(f->fts_accpath, '/');
-				char *fullpath;
-				char *path_argv[2];
-				FTS *ftsp2;
-				FTSENT *f2;
-
-				if (lastslash)
-					lastslash++;
-				else
-					lastslash = f->fts_accpath;
-				fullpath = malloc((lastslash - f->fts_accpath) +
-						  f->fts_namelen + 8 + 1);
-				sprintf(fullpath, "%.*s/%s",
-				    (int)(lastslash - f->fts_accpath),
-				    f->fts_accpath, f->fts_name);
-				path_argv[0] = fullpath;
-				path_argv[1] = NULL;
-
-				ftsp2 = fts_open(path_argv, FTS_LOGICAL, NULL);
-				f2 = fts_read(ftsp2);
-				f2 = fts_children(ftsp2, FTS_NAMEONLY);
-				for (entries = 0;
-				     f2 != NULL;
-				     f2 = f2->fts_link) {
-					if (fs_hidden_name(f2->fts_name))
-						continue;      /* hidden file */
-					entries++;          /* count this one */
-				}
-				fts_close(ftsp2);
+			entries = 0;
+			if ((d = opendir(f->path)) != NULL) {
+				while ((dp = readdir(d)) != NULL)
+					if (!fs_hidden_name(dp->d_name))
+						entries++;
+				closedir(d);
 			}
 
 			sprintf(string, "%-10.10s  Entries=%-4dDefault=%-6.6s  "
@@ -630,7 +619,7 @@ fs_long_info(struct fs_context *c, char *string, FTSENT *f)
 			    "%-6.6s  %02d%.3s%02d %02d%.3s%02d %02d:%02d "
 			    "000 (000)\r\x80",
 			    acornname, load, exec,
-			    (uintmax_t)f->fts_statp->st_size, accstring,
+			    (uintmax_t)f->size, accstring,
 			    btm.tm_mday,
 			    "janfebmaraprmayjunjulaugsepoctnovdec" +
 			        3*btm.tm_mon,
@@ -656,14 +645,12 @@ fs_long_info(struct fs_context *c, char *string, FTSENT *f)
 		sprintf(string, "%-10.10s %08lX %08lX   %06jX   "
 			"%-6.6s     %02d:%02d:%02d %06x\r\x80",
 			acornname, load, exec,
-			(uintmax_t)f->fts_statp->st_size, accstring,
+			(uintmax_t)f->size, accstring,
 			btm.tm_mday,
 			btm.tm_mon,
 			btm.tm_year % 100,
 			fs_get_sin(f));
 	}
-
-	free(acornname);
 }
 
 static void
@@ -671,9 +658,7 @@ fs_cmd_info(struct fs_context *c, char *tail)
 {
 	char *upath;
 	struct ec_fs_reply *reply;
-	char *path_argv[2];
-	FTS *ftsp;
-	FTSENT *f;
+	struct fs_ent ent;
 
 	if (c->client == NULL) {
 		fs_err(c, EC_FS_E_WHOAREYOU);
@@ -683,26 +668,20 @@ fs_cmd_info(struct fs_context *c, char *tail)
 	if (debug) printf(" -> info [%s]\n", upath);
 	if ((upath = fs_unixify_path(c, upath)) == NULL) return;
 
-	path_argv[0] = upath;
-	path_argv[1] = NULL;
-	ftsp = fts_open(path_argv, FTS_LOGICAL, NULL);
-	f = fts_read(ftsp);
-	if (f->fts_info == FTS_ERR || f->fts_info == FTS_NS) {
+	if (fs_ent_stat(upath, &ent) < 0) {
 		fs_errno(c);
-		fts_close(ftsp);
 		free(upath);
 		return;
 	}
 
 	reply = malloc(sizeof(*reply) + 100);
-	fs_long_info(c, reply->data, f);
+	fs_long_info(c, reply->data, &ent);
 	reply->command_code = EC_FS_CC_INFO;
 	reply->return_code = EC_FS_RC_OK;
 	fs_reply(c, reply, sizeof(*reply) + strlen(reply->data));
 
 	free(reply);
 	free(upath);
-	fts_close(ftsp);
 }
 
 /*
@@ -790,7 +769,8 @@ static void
 fs_cmd_fsopt(struct fs_context *c, char *tail)
 {
 	struct ec_fs_reply reply;
-	char *key, *val;
+	char *key, *val, *end;
+	long window;
 
 	if (c->client == NULL) {
 		fs_err(c, EC_FS_E_WHOAREYOU);
@@ -820,6 +800,13 @@ fs_cmd_fsopt(struct fs_context *c, char *tail)
 			c->client->safehandles = false;
 		else
 			goto syntax;
+	} else	if (!strcasecmp(key, "window")) {
+		val = fs_cli_getarg(&tail);
+		if (!*val) goto syntax;
+		window = strtol(val, &end, 10);
+		if (*end != '\0' || window < 1 || window > 64)
+			goto syntax;
+		c->client->window = window;
 	} else
 
 		goto syntax;
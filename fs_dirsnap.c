@@ -0,0 +1,664 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * fs_dirsnap.c - shared snapshots of directory listings
+ *
+ * Every client that opens a directory viewer EXAMINEs the directory,
+ * and on a busy network many of them look at the same few
+ * directories (the library, say).  Rather than have each client read,
+ * stat and sort the directory for itself, we keep snapshots of
+ * recently listed directories: the sorted entries that clients can
+ * see, with their stat information, shared by everyone.
+ *
+ * A snapshot is found by the directory's device and inode, and is
+ * used while the directory's mtime and ctime are unchanged, as for
+ * the name index.  Those don't move when a file in the directory is
+ * written or has its attributes changed, so we stat the entry again
+ * when we do that ourselves (fs_dirsnap_changed()), and don't trust
+ * any snapshot for more than a few seconds in case someone else did.
+ * Load and execute addresses kept by the symlink or catalog backend
+ * don't show there either, so a snapshot also needs the backend's
+ * dirstamp() of the directory (the .Acorn directory or .Acorn.cat)
+ * to be unchanged.
+ * fs_examine.c keeps its reply records in the snapshot too, and
+ * those go with the entry's stat information.
+ *
+ * A snapshot is read with getdents64() and fs_ent_statat(), which
+ * asks only for the attributes in a struct fs_ent, and names that
+ * clients can't see are dropped before anything is statted.  The
+ * entries are kept in separate arrays (offsets of names, their
+ * lengths, and stat information) in sorted order.
+ *
+ * Directories with more than fs_bigdir entries would take too much
+ * memory, so they're marked as too big and clients list them with
+ * an fs_dirstream instead: straight from the disc, in directory
+ * order, remembering only where to seek to for every so many
+ * entries.
+ *
+ * Snapshots are reference counted, so that a client part way
+ * through a listing can carry on with the one it started with even
+ * if the directory changes underneath it.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "fileserver.h"
+
+#define FS_DIRSNAP_DIRS		64	/* Directories to remember */
+#define FS_DIRSNAP_ENTRIES	65536	/* Entries in all of them */
+#define FS_DIRSTREAM_MARK	64	/* Entries between seek marks */
+#define FS_DIRSTREAM_READ	4096	/* Bytes per getdents64() when streaming */
+
+/* Directories bigger than this are streamed; set by conf_lex.l */
+int fs_bigdir = FS_DIRSNAP_ENTRIES;
+
+/*
+ * A directory too big to keep, being listed straight from the disc
+ * in directory order.  marks[k] is the offset to seek to to read
+ * entry k * FS_DIRSTREAM_MARK, for as far as we've been.
+ */
+struct fs_dirstream {
+	int fd;
+	char *path;
+	off_t *marks;
+	int nmarks, markcap;
+};
+
+/* Most recently used first. */
+TAILQ_HEAD(fs_dirsnap_head, fs_dirsnap);
+static struct fs_dirsnap_head fs_dirsnaps =
+    TAILQ_HEAD_INITIALIZER(fs_dirsnaps);
+static int fs_ndirsnaps, fs_dirsnap_nents;
+
+static unsigned long fs_dirsnap_hits, fs_dirsnap_reads, fs_dirstreams;
+
+/* Something to sort entries by, and where to find them. */
+struct fs_dirsnap_sort {
+	const char *key;
+	int ent;
+};
+
+static char fs_dirsnap_buf[65536];	/* For getdents64() */
+
+static void
+fs_dirsnap_free(struct fs_dirsnap *ds)
+{
+	int i;
+
+	free(ds->path);
+	free(ds->name);
+	free(ds->namelen);
+	free(ds->ent);
+	free(ds->names);
+	free(ds->keys);
+	for (i = 0; i < FS_EXREC_MAX; i++)
+		free(ds->rec[i]);
+	free(ds->rendered);
+	free(ds);
+}
+
+/*
+ * Stop handing out a snapshot.  It goes once the last client using
+ * it lets go.
+ */
+static void
+fs_dirsnap_drop(struct fs_dirsnap *ds)
+{
+
+	TAILQ_REMOVE(&fs_dirsnaps, ds, link);
+	fs_ndirsnaps--;
+	fs_dirsnap_nents -= ds->nents;
+	ds->cached = 0;
+	fs_dirsnap_release(ds);
+}
+
+void
+fs_dirsnap_release(struct fs_dirsnap *ds)
+{
+
+	if (ds == NULL || --ds->refs > 0)
+		return;
+	fs_dirsnap_free(ds);
+}
+
+/*
+ * Note a name read from a directory.
+ */
+static int
+fs_dirsnap_add(struct fs_dirsnap *ds, const char *name, int *cap,
+    size_t *namesize, size_t *namecap)
+{
+	size_t len = strlen(name);
+	uint32_t *offs;
+	char *names;
+
+	if (ds->nents == *cap) {
+		*cap = *cap ? *cap * 2 : 64;
+		if ((offs = realloc(ds->name, *cap * sizeof(*offs))) == NULL)
+			return -1;
+		ds->name = offs;
+	}
+	if (*namesize + len + 1 > *namecap) {
+		*namecap = *namecap ? *namecap * 2 : 1024;
+		if (*namecap < *namesize + len + 1)
+			*namecap = *namesize + len + 1;
+		if ((names = realloc(ds->names, *namecap)) == NULL)
+			return -1;
+		ds->names = names;
+	}
+	ds->name[ds->nents++] = *namesize;
+	memcpy(ds->names + *namesize, name, len + 1);
+	*namesize += len + 1;
+	return 0;
+}
+
+/*
+ * Read the names clients can see from a directory, in large
+ * batches where we can.
+ */
+static int
+fs_dirsnap_readdir(struct fs_dirsnap *ds, int fd, size_t *namesize)
+{
+	size_t namecap = 0;
+	int cap = 0;
+#if HAVE_GETDENTS64
+	struct dirent64 *dp;
+	ssize_t n, off;
+
+	while ((n = getdents64(fd, fs_dirsnap_buf,
+	    sizeof(fs_dirsnap_buf))) > 0)
+		for (off = 0; off < n; off += dp->d_reclen) {
+			dp = (struct dirent64 *)(fs_dirsnap_buf + off);
+			if (fs_hidden_name(dp->d_name))
+				continue;
+			if (ds->nents == fs_bigdir) {
+				/* Leave this one to fs_dirstream. */
+				ds->big = 1;
+				ds->nents = 0;
+				return 0;
+			}
+			if (fs_dirsnap_add(ds, dp->d_name, &cap,
+				namesize, &namecap) < 0)
+				return -1;
+		}
+	return n < 0 ? -1 : 0;
+#else
+	struct dirent *dp;
+	DIR *d;
+
+	if ((fd = dup(fd)) < 0)
+		return -1;
+	if ((d = fdopendir(fd)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	while ((dp = readdir(d)) != NULL)
+		if (!fs_hidden_name(dp->d_name) &&
+		    fs_dirsnap_add(ds, dp->d_name, &cap,
+			namesize, &namecap) < 0) {
+			closedir(d);
+			return -1;
+		}
+	closedir(d);
+	return 0;
+#endif
+}
+
+static int
+fs_dirsnap_compare(const void *a, const void *b)
+{
+	const struct fs_dirsnap_sort *sa = a, *sb = b;
+
+	return strcmp(sa->key, sb->key);
+}
+
+/*
+ * Read and sort a directory, and keep what clients can see of it.
+ * The entries are kept as separate arrays, sorted by their names
+ * folded to lower case, which is the order strcasecmp() gives.
+ */
+static struct fs_dirsnap *
+fs_dirsnap_read(const char *upath, struct stat *st)
+{
+	struct fs_dirsnap *ds;
+	struct fs_dirsnap_sort *sort = NULL;
+	struct fs_ent *ents = NULL;
+	uint32_t *offs = NULL;
+	size_t namesize = 0, i;
+	char *p;
+	int fd, n, saved;
+
+	if ((fd = open(upath, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return NULL;
+	if ((ds = calloc(1, sizeof(*ds))) == NULL ||
+	    (ds->path = strdup(upath)) == NULL)
+		goto nomem;
+	ds->dev = st->st_dev;
+	ds->ino = st->st_ino;
+	fs_stat_times(st, &ds->mtime, &ds->ctime);
+	ds->made = time(NULL);
+	ds->racy = ds->made - (ds->mtime.tv_sec > ds->ctime.tv_sec ?
+	    ds->mtime.tv_sec : ds->ctime.tv_sec) <= FS_STAT_RACY;
+	if (metafuncs->dirstamp != NULL) {
+		metafuncs->dirstamp(upath, &ds->stamp);
+		if (meta_stamp_racy(&ds->stamp, ds->made))
+			ds->racy = 1;
+	}
+	if (fs_dirsnap_readdir(ds, fd, &namesize) < 0)
+		goto fail;
+	if (ds->big)
+		goto done;
+
+	/* Fold the names, and sort on that. */
+	if ((ds->keys = malloc(namesize + 1)) == NULL ||
+	    (sort = malloc((ds->nents + 1) * sizeof(*sort))) == NULL)
+		goto nomem;
+	for (i = 0; i < namesize; i++)
+		ds->keys[i] = tolower((unsigned char)ds->names[i]);
+	for (n = 0; n < ds->nents; n++) {
+		sort[n].key = ds->keys + ds->name[n];
+		sort[n].ent = n;
+	}
+	qsort(sort, ds->nents, sizeof(*sort), fs_dirsnap_compare);
+
+	/*
+	 * Now stat them, in order.  Anything that can't be statted
+	 * is left out.
+	 */
+	if ((offs = malloc((ds->nents + 1) * sizeof(*offs))) == NULL ||
+	    (ents = malloc((ds->nents + 1) * sizeof(*ents))) == NULL ||
+	    (ds->namelen = malloc((ds->nents + 1) *
+		sizeof(*ds->namelen))) == NULL)
+		goto nomem;
+	for (i = n = 0; n < ds->nents; n++) {
+		p = ds->names + ds->name[sort[n].ent];
+		if (fs_ent_statat(fd, p, &ents[i]) < 0)
+			continue;
+		offs[i] = ds->name[sort[n].ent];
+		ds->namelen[i] = strlen(p);
+		i++;
+	}
+	free(ds->name);
+	ds->name = offs;
+	ds->ent = ents;
+	ds->nents = i;
+	free(sort);
+done:
+	close(fd);
+	ds->refs = 1;
+	fs_dirsnap_reads++;
+	if (debug)
+		printf("fs_dirsnap: read %s, %d entries%s%s\n", upath,
+		    ds->nents, ds->big ? ", too big" : "",
+		    ds->racy ? ", recently changed" : "");
+	return ds;
+nomem:
+	errno = ENOMEM;
+fail:
+	saved = errno;
+	if (ds != NULL) {
+		free(offs);
+		free(ents);
+		fs_dirsnap_free(ds);
+	}
+	free(sort);
+	close(fd);
+	errno = saved;
+	return NULL;
+}
+
+static struct fs_ent *
+fs_dirsnap_mkent(struct fs_ent *ent, const char *dir, const char *name,
+    size_t len, char *buf, size_t size)
+{
+
+	snprintf(buf, size, "%s/%s", dir, name);
+	ent->path = buf;
+	ent->pathlen = strlen(buf);
+	ent->name = buf + ent->pathlen - len;
+	ent->namelen = len;
+	return ent;
+}
+
+/*
+ * Make a whole entry for entry 'i', for the functions that want
+ * one, with its path made in 'buf', which holds 'size' bytes.
+ */
+struct fs_ent *
+fs_dirsnap_ent(struct fs_dirsnap *ds, int i, struct fs_ent *ent, char *buf,
+    size_t size)
+{
+
+	*ent = ds->ent[i];
+	return fs_dirsnap_mkent(ent, ds->path, ds->names + ds->name[i],
+	    ds->namelen[i], buf, size);
+}
+
+/*
+ * Get a snapshot of the directory at 'upath', reading it again if
+ * it's changed.  The caller gets a reference, which it should give
+ * back with fs_dirsnap_release().  Returns NULL, with errno set, on
+ * failure.
+ */
+struct fs_dirsnap *
+fs_dirsnap_get(const char *upath)
+{
+	struct fs_dirsnap *ds;
+	struct meta_stamp ms;
+	struct timespec mtime, ctime;
+	struct stat st;
+
+	if (stat(upath, &st) < 0)
+		return NULL;
+	if (!S_ISDIR(st.st_mode)) {
+		errno = ENOTDIR;
+		return NULL;
+	}
+	TAILQ_FOREACH(ds, &fs_dirsnaps, link)
+		if (ds->dev == st.st_dev && ds->ino == st.st_ino)
+			break;
+	if (ds != NULL) {
+		fs_stat_times(&st, &mtime, &ctime);
+		if (metafuncs->dirstamp != NULL)
+			metafuncs->dirstamp(upath, &ms);
+		if (!ds->racy &&
+		    time(NULL) - ds->made < FS_STAT_MAXAGE &&
+		    ds->mtime.tv_sec == mtime.tv_sec &&
+		    ds->mtime.tv_nsec == mtime.tv_nsec &&
+		    ds->ctime.tv_sec == ctime.tv_sec &&
+		    ds->ctime.tv_nsec == ctime.tv_nsec &&
+		    (metafuncs->dirstamp == NULL ||
+			meta_stamp_same(&ds->stamp, &ms))) {
+			if (ds != TAILQ_FIRST(&fs_dirsnaps)) {
+				TAILQ_REMOVE(&fs_dirsnaps, ds, link);
+				TAILQ_INSERT_HEAD(&fs_dirsnaps, ds, link);
+			}
+			fs_dirsnap_hits++;
+			ds->refs++;
+			return ds;
+		}
+		fs_dirsnap_drop(ds);
+	}
+	if ((ds = fs_dirsnap_read(upath, &st)) == NULL)
+		return NULL;
+	if (!ds->racy) {
+		ds->cached = 1;
+		ds->refs++;
+		TAILQ_INSERT_HEAD(&fs_dirsnaps, ds, link);
+		fs_ndirsnaps++;
+		fs_dirsnap_nents += ds->nents;
+		while (fs_ndirsnaps > FS_DIRSNAP_DIRS ||
+		    (fs_dirsnap_nents > FS_DIRSNAP_ENTRIES &&
+			fs_ndirsnaps > 1))
+			fs_dirsnap_drop(TAILQ_LAST(&fs_dirsnaps,
+			    fs_dirsnap_head));
+	}
+	return ds;
+}
+
+#if HAVE_GETDENTS64
+/*
+ * Start streaming a directory that fs_dirsnap_get() said was too
+ * big.  Returns NULL, with errno set, on failure.
+ */
+struct fs_dirstream *
+fs_dirstream_open(const char *upath)
+{
+	struct fs_dirstream *dst;
+
+	if ((dst = calloc(1, sizeof(*dst))) == NULL ||
+	    (dst->path = strdup(upath)) == NULL ||
+	    (dst->marks = malloc(16 * sizeof(*dst->marks))) == NULL) {
+		if (dst != NULL)
+			free(dst->path);
+		free(dst);
+		errno = ENOMEM;
+		return NULL;
+	}
+	if ((dst->fd = open(upath, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		fs_dirstream_close(dst);
+		return NULL;
+	}
+	dst->marks[0] = 0;
+	dst->nmarks = 1;
+	dst->markcap = 16;
+	fs_dirstreams++;
+	return dst;
+}
+
+void
+fs_dirstream_close(struct fs_dirstream *dst)
+{
+
+	if (dst == NULL)
+		return;
+	if (dst->fd >= 0)
+		close(dst->fd);
+	free(dst->path);
+	free(dst->marks);
+	free(dst);
+}
+
+/*
+ * Pass up to 'n' entries, starting with number 'start', to fn(),
+ * stopping early if it returns -1.  We start from the nearest mark
+ * before 'start', so going back, or forward to somewhere already
+ * visited, only needs to skip at most FS_DIRSTREAM_MARK names.
+ * Returns the number of entries passed to fn(), or -1 on error.
+ *
+ * An entry that can't be statted (because it's just been deleted,
+ * say) still takes up its number, so that later entries keep
+ * theirs, but isn't passed on.
+ */
+int
+fs_dirstream_read(struct fs_dirstream *dst, int start, int n,
+    int (*fn)(void *, struct fs_ent *), void *arg)
+{
+	struct fs_ent ent;
+	struct dirent64 *dp;
+	char path[PATH_MAX];
+	ssize_t len, i;
+	off_t prev, *marks;
+	int m, pos, got;
+
+	m = start / FS_DIRSTREAM_MARK;
+	if (m >= dst->nmarks)
+		m = dst->nmarks - 1;
+	pos = m * FS_DIRSTREAM_MARK;
+	prev = dst->marks[m];
+	if (lseek(dst->fd, prev, SEEK_SET) < 0)
+		return -1;
+	got = 0;
+	len = 0;
+	while (got < n && (len = getdents64(dst->fd, fs_dirsnap_buf,
+	    FS_DIRSTREAM_READ)) > 0) {
+		for (i = 0; i < len && got < n; i += dp->d_reclen) {
+			dp = (struct dirent64 *)(fs_dirsnap_buf + i);
+			if (fs_hidden_name(dp->d_name)) {
+				prev = dp->d_off;
+				continue;
+			}
+			if (pos % FS_DIRSTREAM_MARK == 0 &&
+			    pos / FS_DIRSTREAM_MARK == dst->nmarks) {
+				if (dst->nmarks == dst->markcap) {
+					marks = realloc(dst->marks,
+					    2 * dst->markcap * sizeof(*marks));
+					if (marks == NULL)
+						return -1;
+					dst->marks = marks;
+					dst->markcap *= 2;
+				}
+				dst->marks[dst->nmarks++] = prev;
+			}
+			prev = dp->d_off;
+			if (pos++ < start)
+				continue;
+			if (fs_ent_statat(dst->fd, dp->d_name, &ent) < 0)
+				continue;
+			if (fn(arg, fs_dirsnap_mkent(&ent, dst->path,
+			    dp->d_name, strlen(dp->d_name), path,
+			    sizeof(path))) < 0)
+				return got;
+			got++;
+		}
+	}
+	return len < 0 ? -1 : got;
+}
+#else
+struct fs_dirstream *
+fs_dirstream_open(const char *upath)
+{
+
+	errno = ENOSYS;
+	return NULL;
+}
+
+void
+fs_dirstream_close(struct fs_dirstream *dst)
+{
+}
+
+int
+fs_dirstream_read(struct fs_dirstream *dst, int start, int n,
+    int (*fn)(void *, struct fs_ent *), void *arg)
+{
+
+	errno = ENOSYS;
+	return -1;
+}
+#endif
+
+/*
+ * Find an entry by name: by its folded name, which the entries are
+ * sorted by, and then among any that fold the same.  Returns -1 if
+ * it's not there.
+ */
+static int
+fs_dirsnap_find(struct fs_dirsnap *ds, const char *name)
+{
+	char key[NAME_MAX + 1];
+	int lo, hi, mid;
+	size_t i;
+
+	for (i = 0; name[i] != '\0' && i < NAME_MAX; i++)
+		key[i] = tolower((unsigned char)name[i]);
+	key[i] = '\0';
+	lo = 0;
+	hi = ds->nents;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (strcmp(ds->keys + ds->name[mid], key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < ds->nents && strcmp(ds->keys + ds->name[lo], key) == 0;
+	     lo++)
+		if (strcmp(ds->names + ds->name[lo], name) == 0)
+			return lo;
+	return -1;
+}
+
+/*
+ * We've changed something at 'upath' that its directory's times
+ * won't show, so its entry in any snapshot of that directory is out
+ * of date.  If we can't bring it up to date, the snapshot goes.  So
+ * does one whose metadata store has moved: that was probably us,
+ * but someone else could have changed it at the same time.
+ */
+void
+fs_dirsnap_changed(const char *upath)
+{
+	struct fs_dirsnap *ds;
+	struct meta_stamp ms;
+	struct stat st;
+	const char *name;
+	char *dir, *p;
+	int ret, i;
+
+	if (TAILQ_EMPTY(&fs_dirsnaps))
+		return;
+	if ((p = strrchr(upath, '/')) == NULL)
+		dir = strdup(".");
+	else
+		dir = strndup(upath, p - upath);
+	if (dir == NULL)
+		return;
+	name = p == NULL ? upath : p + 1;
+	ret = stat(dir, &st);
+	if (ret == 0 && metafuncs->dirstamp != NULL)
+		metafuncs->dirstamp(dir, &ms);
+	free(dir);
+	if (ret < 0)
+		return;
+	TAILQ_FOREACH(ds, &fs_dirsnaps, link)
+		if (ds->dev == st.st_dev && ds->ino == st.st_ino) {
+			if ((i = fs_dirsnap_find(ds, name)) < 0 ||
+			    fs_ent_statat(AT_FDCWD, upath, &ds->ent[i]) < 0 ||
+			    (metafuncs->dirstamp != NULL &&
+				!meta_stamp_same(&ds->stamp, &ms)))
+				fs_dirsnap_drop(ds);
+			else if (ds->rendered != NULL)
+				ds->rendered[i] = 0;
+			break;
+		}
+}
+
+void
+fs_dirsnap_stats(void)
+{
+	unsigned long total = fs_dirsnap_hits + fs_dirsnap_reads;
+
+	stats_printf("directory snapshots: %d directories, %d entries, "
+	    "%lu hits, %lu reads (%.1f%% hit rate), %lu streamed",
+	    fs_ndirsnaps, fs_dirsnap_nents, fs_dirsnap_hits,
+	    fs_dirsnap_reads,
+	    total ? 100.0 * fs_dirsnap_hits / total : 0.0, fs_dirstreams);
+}
@@ -31,13 +31,22 @@
  */	
 /*
  * fs_examine.c - the Examine call (code 3) - Directory listing.
+ *
+ * Each entry of a directory snapshot keeps its records in each
+ * format, made the first time someone asks for them, so that most
+ * replies are just copied out of the snapshot.  The records for an
+ * entry are remade when fs_dirsnap_changed() says it's changed.
+ * SJ-format text for a directory says how many entries it has,
+ * which changes without the entry itself changing, so that's always
+ * made afresh.
  */
 
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include <errno.h>
-#include <fts.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -45,25 +54,46 @@
 #include "fileserver.h"
 #include "fs_errors.h"
 
-static int fs_examine_read(struct fs_context *, const char *, int);
+static struct fs_examine_cursor *fs_examine_cursor(struct fs_client *,
+    const char *, int);
+static int fs_examine_one(void *, struct fs_ent *);
+static int fs_examine_kind(struct fs_context *, int);
+static int fs_examine_keep(struct fs_dirsnap *, int, int);
+static size_t fs_examine_render(struct fs_context *, int, struct fs_ent *,
+    unsigned char *);
+static size_t fs_examine_copy(struct fs_context *, struct fs_dirsnap *,
+    int, int, int, unsigned char *);
+
+/* Longest text record, with its terminator. */
+#define FS_EXAMINE_TXTMAX	100
+
+/* Space for a record of each kind, in the order of enum fs_exrec. */
+static const size_t fs_examine_recsize[FS_EXREC_MAX] = {
+	sizeof(struct ec_fs_exall),
+	sizeof(struct ec_fs_exname),
+	10+1+7+1,
+	FS_EXAMINE_TXTMAX,
+	FS_EXAMINE_TXTMAX,
+};
 
-static int fs_examine_all(FTSENT *, struct ec_fs_reply_examine **, size_t *);
-static int fs_examine_longtxt(struct fs_context *c, FTSENT *, struct ec_fs_reply_examine **,
-    size_t *);
-static int fs_examine_name(FTSENT *, struct ec_fs_reply_examine **, size_t *);
-static int fs_examine_shorttxt(FTSENT *, struct ec_fs_reply_examine **,
-    size_t *);
+/* A reply being built from an fs_dirstream. */
+struct fs_examine_reply {
+	struct fs_context *c;
+	int kind;
+	unsigned char *next;
+};
 
 void
 fs_examine(struct fs_context *c)
 {
 	/* LINTED subclass */
 	struct ec_fs_req_examine *request = (struct ec_fs_req_examine *)(c->req);
-	char *upath;
-	FTSENT *ent;
 	struct ec_fs_reply_examine *reply;
+	char *upath;
+	struct fs_examine_cursor *cur;
+	struct fs_examine_reply er;
 	size_t reply_size;
-	int i, rc;
+	int i, kind;
 
 	request->path[strcspn(request->path, "\r")] = '\0';	
 	if (debug)
@@ -74,24 +104,20 @@ fs_examine(struct fs_context *c)
 		fs_err(c, EC_FS_E_WHOAREYOU);
 		return;
 	}
-	switch (request->arg) {
-	default:
+	if ((kind = fs_examine_kind(c, request->arg)) == -1) {
 		fs_err(c, EC_FS_E_BADEXAMINE);
 		return;
-	case EC_FS_EXAMINE_ALL: case EC_FS_EXAMINE_NAME:
-	case EC_FS_EXAMINE_SHORTTXT: case EC_FS_EXAMINE_LONGTXT:
-		break;
 	}
 	upath = fs_unixify_path(c, request->path);
 	if (upath == NULL) return;
 	errno = 0;
-	reply_size = sizeof(*reply);
-	if (request->arg == EC_FS_EXAMINE_SHORTTXT ||
-	    request->arg == EC_FS_EXAMINE_LONGTXT)
-		reply = malloc(reply_size+1);
-	else
-		reply = malloc(reply_size);
-	if (fs_examine_read(c, upath, request->start) == -1 || reply == NULL) {
+	/* Room for every entry asked for, and a terminator for text. */
+	reply = malloc(sizeof(*reply) +
+	    request->nentries * fs_examine_recsize[kind] + 1);
+	cur = NULL;
+	if (reply == NULL ||
+	    (cur = fs_examine_cursor(c->client, upath, request->start)) ==
+	    NULL) {
 		free(reply);
 		free(upath);
 		if (errno)
@@ -100,44 +126,29 @@ fs_examine(struct fs_context *c)
 			fs_err(c, EC_FS_E_NOMEM);
 		return;
 	}
-	ent = c->client->dir_cache.f;
-	for (i = c->client->dir_cache.start;
-	     i < request->start && ent != NULL;
-	     ent = ent->fts_link) {
-		if (fs_hidden_name(ent->fts_name))
-			continue;      /* hidden file */
-		i++;		       /* count this one */
-	}
-	for (i = 0;
-	     i < request->nentries && ent != NULL;
-	     ent = ent->fts_link) {
-		switch (ent->fts_info) {
-		case FTS_ERR: case FTS_NS: /* FTS_DNR doesn't matter here */
-			continue;
-		}
-		if (fs_hidden_name(ent->fts_name))
-			continue;      /* hidden file */
-		i++;
-		switch (request->arg) {
-		case EC_FS_EXAMINE_ALL:
-			rc = fs_examine_all(ent, &reply, &reply_size);
-			break;
-		case EC_FS_EXAMINE_LONGTXT:
-			rc = fs_examine_longtxt(c, ent, &reply, &reply_size);
-			break;
-		case EC_FS_EXAMINE_NAME:
-			rc = fs_examine_name(ent, &reply, &reply_size);
-			break;
-		case EC_FS_EXAMINE_SHORTTXT:
-			rc = fs_examine_shorttxt(ent, &reply, &reply_size);
-			break;
-		default:
-			rc = -1; /* Cheer up gcc */
+	reply_size = sizeof(*reply);
+	if (cur->snap != NULL) {
+		i = request->nentries;
+		if (request->start >= cur->snap->nents)
+			i = 0;
+		else if (i > cur->snap->nents - request->start)
+			i = cur->snap->nents - request->start;
+		reply_size += fs_examine_copy(c, cur->snap, kind,
+		    request->start, i, (unsigned char *)reply + reply_size);
+	} else {
+		er.c = c;
+		er.kind = kind;
+		er.next = (unsigned char *)reply + reply_size;
+		i = fs_dirstream_read(cur->stream, request->start,
+		    request->nentries, fs_examine_one, &er);
+		if (i == -1) {
+			free(reply);
+			free(upath);
+			fs_errno(c);
+			return;
 		}
-		if (rc == -1)
-			goto bye;
+		reply_size = er.next - (unsigned char *)reply;
 	}
-bye:		
 	reply->nentries = i;
 	reply->undef0 = 0; /* What is this for? */
 	reply->std_tx.command_code = EC_FS_CC_DONE;
@@ -149,182 +160,233 @@ bye:
 		reply_size++;
 	}
 	fs_reply(c, &(reply->std_tx), reply_size);
-	/* If there's more to read, leave a useful cache. */
-	if (ent != NULL) {
-		c->client->dir_cache.f = ent;
-		c->client->dir_cache.start = request->start + i;
-	} else {
-		fts_close(c->client->dir_cache.ftsp);
-		c->client->dir_cache.ftsp = NULL;
-		free(c->client->dir_cache.path);
-		c->client->dir_cache.path = NULL;
-	}
 	free(reply);
 	free(upath);
 }
 
+/*
+ * Which kind of record a client wants for an EXAMINE argument, or -1
+ * if we don't know that argument.
+ */
 static int
-fs_filename_compare(const FTSENT **a, const FTSENT **b)
+fs_examine_kind(struct fs_context *c, int arg)
 {
 
-	return strcasecmp((*a)->fts_name, (*b)->fts_name);
+	switch (arg) {
+	case EC_FS_EXAMINE_ALL:
+		return FS_EXREC_ALL;
+	case EC_FS_EXAMINE_NAME:
+		return FS_EXREC_NAME;
+	case EC_FS_EXAMINE_SHORTTXT:
+		return FS_EXREC_SHORTTXT;
+	case EC_FS_EXAMINE_LONGTXT:
+		return c->client->infoformat == FS_INFO_SJ ?
+		    FS_EXREC_LONGTXT_SJ : FS_EXREC_LONGTXT;
+	}
+	return -1;
 }
 
 static int
-fs_examine_read(struct fs_context *c, const char *upath, int start)
+fs_examine_one(void *arg, struct fs_ent *ent)
 {
-	char *path_argv[2];
-	struct fs_dir_cache *dc;
-        FTSENT *dir;
-	
-	dc = &(c->client->dir_cache);
-	if (dc->path && strcmp(dc->path, upath) == 0 && dc->start == start) {
-		/* Already cached */
-		/* XXX this should see how recent the cache is */
-		/* XXX Won't spot if the client skipped a bit of a listing */
-		if (debug) printf("cache HIT!\n");
-		return 0;
-	}
-	if (debug)
-		printf("cache miss.  wanted %d; found %d.\n", start, dc->start);
-	if (dc->ftsp)
-		/* Dispose of old FTS structure */
-		fts_close(dc->ftsp);
-	free(dc->path);
-	dc->path = strdup(upath);
-	if (dc->path == NULL) {
-		errno = ENOMEM;
-		return -1;
-	}
+	struct fs_examine_reply *er = arg;
 
-	path_argv[0] = dc->path;
-	path_argv[1] = NULL;
-        dc->ftsp = fts_open(path_argv, FTS_LOGICAL, fs_filename_compare);
-	if (dc->ftsp == NULL) {
-		free(dc->path); dc->path = NULL;
-		return -1;
-	}
-	dir = fts_read(dc->ftsp); /* Returns the directory itself */
-	if (dir == NULL) {
-		fts_close(dc->ftsp); dc->ftsp = NULL;
-		free(dc->path); dc->path = NULL;
-		return -1;
-	}
-	switch (dir->fts_info) {
-	case FTS_ERR: case FTS_DNR: case FTS_NS:
-		fts_close(dc->ftsp); dc->ftsp = NULL;
-		free(dc->path); dc->path = NULL;
-		return -1;
-	case FTS_D: case FTS_DC: case FTS_DP:
-		break;
-	default:
-		fts_close(dc->ftsp); dc->ftsp = NULL;
-		free(dc->path); dc->path = NULL;
-		errno = ENOTDIR;
-		return -1;
-	}
-	dc->f = fts_children(dc->ftsp, 0);
-	dc->start = 0;
+	er->next += fs_examine_render(er->c, er->kind, ent, er->next);
 	return 0;
 }
 
+/* Whether a record can be kept in the snapshot; see above. */
 static int
-fs_examine_all(FTSENT *ent, struct ec_fs_reply_examine **replyp,
-    size_t *reply_sizep)
+fs_examine_keep(struct fs_dirsnap *ds, int kind, int i)
 {
-	struct ec_fs_exall *exall;
-	void *new_reply;
-	
-	if ((new_reply = realloc(*replyp, *reply_sizep + sizeof(*exall)))
-	    != NULL)
-		*replyp = new_reply;
-	if (new_reply == NULL) {
-		errno = ENOMEM;
-		goto burn;
-	}
-	exall = (struct ec_fs_exall *)(((void *)*replyp) + *reply_sizep);
-	fs_get_meta(ent, &(exall->meta)); /* This needs the name unmodified */
-	fs_acornify_name(ent->fts_name);
-	strncpy(exall->name, ent->fts_name, sizeof(exall->name));
-	strpad(exall->name, ' ', sizeof(exall->name));
-	exall->access = fs_mode_to_access(ent->fts_statp->st_mode);
-	fs_write_date(&(exall->date), fs_get_birthtime(ent));
-	fs_write_val(exall->sin, fs_get_sin(ent), sizeof(exall->sin));
-	fs_write_val(exall->size, ent->fts_statp->st_size,
-		     sizeof(exall->size));
-	*reply_sizep += sizeof(*exall);
-	return 0;
-burn:
-	return -1;
+
+	return kind != FS_EXREC_LONGTXT_SJ || !S_ISDIR(ds->ent[i].mode);
 }
 
-static int
-fs_examine_name(FTSENT *ent, struct ec_fs_reply_examine **replyp,
-    size_t *reply_sizep)
+/*
+ * Copy 'n' records from entry 'start' of a snapshot to 'buf', making
+ * any that haven't been made yet.  Returns the number of bytes
+ * copied.
+ */
+static size_t
+fs_examine_copy(struct fs_context *c, struct fs_dirsnap *ds, int kind,
+    int start, int n, unsigned char *buf)
 {
-	struct ec_fs_exname *exname;
-	void *new_reply;
-	
-	if ((new_reply = realloc(*replyp, *reply_sizep + sizeof(*exname))) !=
-	    NULL)
-		*replyp = new_reply;
-	if (new_reply == NULL) {
-		errno = ENOMEM;
-		goto burn;
+	struct fs_ent ent;
+	char path[PATH_MAX];
+	size_t size = fs_examine_recsize[kind], len, total;
+	unsigned char *rec;
+	int i;
+
+	if (ds->rendered == NULL)
+		ds->rendered = calloc(ds->nents, sizeof(*ds->rendered));
+	if (ds->rec[kind] == NULL)
+		ds->rec[kind] = malloc(ds->nents * size);
+	if (ds->rendered == NULL || ds->rec[kind] == NULL) {
+		/* Do without keeping them, then. */
+		for (total = 0, i = start; i < start + n; i++)
+			total += fs_examine_render(c, kind, fs_dirsnap_ent(ds,
+			    i, &ent, path, sizeof(path)), buf + total);
+		return total;
 	}
-	exname = (struct ec_fs_exname *)(((void *)*replyp) + *reply_sizep);
-	exname->namelen = sizeof(exname->name);
-	fs_acornify_name(ent->fts_name);
-	strncpy(exname->name, ent->fts_name, sizeof(exname->name));
-	strpad(exname->name, ' ', sizeof(exname->name));
-	*reply_sizep += sizeof(*exname);
-	return 0;
-burn:
-	return -1;
+	for (i = start; i < start + n; i++)
+		if (fs_examine_keep(ds, kind, i) &&
+		    !(ds->rendered[i] & 1 << kind)) {
+			fs_examine_render(c, kind, fs_dirsnap_ent(ds, i,
+			    &ent, path, sizeof(path)), ds->rec[kind] + i * size);
+			ds->rendered[i] |= 1 << kind;
+		}
+	switch (kind) {
+	case FS_EXREC_ALL: case FS_EXREC_NAME: case FS_EXREC_SHORTTXT:
+		memcpy(buf, ds->rec[kind] + start * size, n * size);
+		return n * size;
+	}
+	for (total = 0, i = start; i < start + n; i++) {
+		if (!fs_examine_keep(ds, kind, i)) {
+			total += fs_examine_render(c, kind, fs_dirsnap_ent(ds,
+			    i, &ent, path, sizeof(path)), buf + total);
+			continue;
+		}
+		rec = ds->rec[kind] + i * size;
+		len = strlen((char *)rec) + 1;
+		memcpy(buf + total, rec, len);
+		total += len;
+	}
+	return total;
 }
 
-static int
-fs_examine_shorttxt(FTSENT *ent, struct ec_fs_reply_examine **replyp,
-    size_t *reply_sizep)
+static void
+fs_examine_cursor_clear(struct fs_examine_cursor *cur)
+{
+
+	fs_dirsnap_release(cur->snap);
+	fs_dirstream_close(cur->stream);
+	free(cur->path);
+	cur->snap = NULL;
+	cur->stream = NULL;
+	cur->path = NULL;
+}
+
+/*
+ * Find the client's cursor for a directory.  A listing from the
+ * start gets the latest version of the directory; anything else
+ * carries on with the listing the client already has, from wherever
+ * it likes, so that a directory read in several goes is consistent.
+ */
+static struct fs_examine_cursor *
+fs_examine_cursor(struct fs_client *client, const char *upath, int start)
 {
-	void *new_reply;
-	char accstring[8];
-	
-	if ((new_reply = realloc(*replyp, *reply_sizep + 10+1+7+2)) != NULL)
-		*replyp = new_reply;
-	if (new_reply == NULL) {
+	static unsigned long clock;
+	struct fs_examine_cursor *cur, *victim;
+	struct fs_dirsnap *ds;
+	struct fs_dirstream *dst;
+	int i;
+
+	victim = NULL;
+	for (i = 0; i < FS_EXAMINE_CURSORS; i++) {
+		cur = &client->cursors[i];
+		if (cur->path != NULL && strcmp(cur->path, upath) == 0)
+			break;
+		if (victim == NULL || (victim->path != NULL &&
+		    (cur->path == NULL || cur->used < victim->used)))
+			victim = cur;
+	}
+	if (i < FS_EXAMINE_CURSORS) {
+		cur->used = ++clock;
+		if (start != 0) {
+			if (debug) printf("continuing listing\n");
+			return cur;
+		}
+		victim = cur;
+	}
+	if ((ds = fs_dirsnap_get(upath)) == NULL)
+		return NULL;
+	dst = NULL;
+	if (ds->big) {
+		fs_dirsnap_release(ds);
+		ds = NULL;
+		if ((dst = fs_dirstream_open(upath)) == NULL)
+			return NULL;
+	}
+	cur = victim;
+	fs_examine_cursor_clear(cur);
+	if ((cur->path = strdup(upath)) == NULL) {
+		fs_dirsnap_release(ds);
+		fs_dirstream_close(dst);
 		errno = ENOMEM;
-		goto burn;
+		return NULL;
 	}
-	fs_acornify_name(ent->fts_name);
-	fs_access_to_string(accstring,
-	    fs_mode_to_access(ent->fts_statp->st_mode));
-	sprintf((char*)(((void *)*replyp) + *reply_sizep), "%-10.10s %-7.7s",
-	    ent->fts_name, accstring);
-	*reply_sizep += 10+1+7+1; /* one byte spare to terminate */
-	return 0;
-burn:
-	return -1;
+	cur->snap = ds;
+	cur->stream = dst;
+	cur->used = ++clock;
+	return cur;
 }
 
-static int
-fs_examine_longtxt(struct fs_context *c, FTSENT *ent,
-    struct ec_fs_reply_examine **replyp, size_t *reply_sizep)
+/*
+ * Let go of all a client's listings.
+ */
+void
+fs_examine_forget(struct fs_client *client)
 {
-	void *new_reply;
-	char *string;
-	
-	if ((new_reply = realloc(*replyp, *reply_sizep + 100)) != NULL)
-		*replyp = new_reply;
-	if (new_reply == NULL) {
-		errno = ENOMEM;
-		goto burn;
+	int i;
+
+	for (i = 0; i < FS_EXAMINE_CURSORS; i++)
+		fs_examine_cursor_clear(&client->cursors[i]);
+}
+
+/*
+ * The entries belong to a shared listing, so their names have to be
+ * converted in a copy.
+ */
+static void
+fs_examine_name_copy(struct fs_ent *ent, char *name, size_t len)
+{
+
+	snprintf(name, len, "%s", ent->name);
+	fs_acornify_name(name);
+}
+
+/*
+ * Make the record of kind 'kind' for an entry in 'buf', which has
+ * room for fs_examine_recsize[kind] bytes.  Text records are
+ * terminated.  Returns the number of bytes used.
+ */
+static size_t
+fs_examine_render(struct fs_context *c, int kind, struct fs_ent *ent,
+    unsigned char *buf)
+{
+	struct ec_fs_exall *exall;
+	struct ec_fs_exname *exname;
+	char accstring[8], name[NAME_MAX + 1], *string;
+
+	switch (kind) {
+	case FS_EXREC_ALL:
+		exall = (struct ec_fs_exall *)buf;
+		fs_get_meta(ent, &(exall->meta));
+		fs_examine_name_copy(ent, name, sizeof(name));
+		strpadcpy(exall->name, name, ' ', sizeof(exall->name));
+		exall->access = fs_mode_to_access(ent->mode);
+		fs_write_date(&(exall->date), fs_get_birthtime(ent));
+		fs_write_val(exall->sin, fs_get_sin(ent), sizeof(exall->sin));
+		fs_write_val(exall->size, ent->size,
+			     sizeof(exall->size));
+		return sizeof(*exall);
+	case FS_EXREC_NAME:
+		exname = (struct ec_fs_exname *)buf;
+		exname->namelen = sizeof(exname->name);
+		fs_examine_name_copy(ent, name, sizeof(name));
+		strpadcpy(exname->name, name, ' ', sizeof(exname->name));
+		return sizeof(*exname);
+	case FS_EXREC_SHORTTXT:
+		fs_examine_name_copy(ent, name, sizeof(name));
+		fs_access_to_string(accstring,
+		    fs_mode_to_access(ent->mode));
+		sprintf((char *)buf, "%-10.10s %-7.7s", name, accstring);
+		return 10+1+7+1; /* one byte spare to terminate */
+	default:
+		string = (char *)buf;
+		fs_long_info(c, string, ent);
+		string[strcspn(string, "\r\x80")] = '\0';
+		return 1 + strlen(string); /* one byte spare to terminate */
 	}
-	string = (char*)(((void *)*replyp) + *reply_sizep);
-	fs_long_info(c, string, ent);
-	string[strcspn(string, "\r\x80")] = '\0';
-	*reply_sizep += 1 + strlen(string); /* one byte spare to terminate */
-	return 0;
-burn:
-	return -1;
 }
@@ -47,6 +47,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "aio.h"
 #include "aun.h"
 #include "fs_proto.h"
 #include "fs_errors.h"
@@ -55,9 +56,21 @@
 
 #define OUR_DATA_PORT 0x97
 
-static ssize_t fs_data_send(struct fs_context *, int, size_t);
-static ssize_t fs_data_recv(struct fs_context *, int, size_t, int);
-static int fs_close1(struct fs_context *c, int h);
+static void fs_data_send(struct fs_context *, int, bool, size_t,
+    void (*)(struct fs_data_tx *, ssize_t));
+static void fs_data_tx_fill(struct fs_data_tx *);
+static void fs_getbytes_done(struct fs_data_tx *, ssize_t);
+static void fs_load_done(struct fs_data_tx *, ssize_t);
+static struct fs_data_rx *fs_data_rx_new(struct fs_context *, int, size_t,
+    int, void (*)(struct fs_data_rx *, ssize_t));
+static void fs_data_recv(struct fs_data_rx *);
+static void fs_data_finish(struct fs_data_rx *);
+static void fs_data_timeout(void *);
+static void fs_putbytes_done(struct fs_data_rx *, ssize_t);
+static void fs_save_done(struct fs_data_rx *, ssize_t);
+struct fs_close;
+static void fs_close1(struct fs_close *, int);
+static void fs_close_done(void *, ssize_t);
 
 /*
  * Acorn OSes implement mandatory locking in OSFIND, delegating that
@@ -147,12 +160,21 @@ fs_open(struct fs_context *c)
 	fs_reply(c, &(reply.std_tx), sizeof(reply));
 }
 
+/*
+ * A CLOSE waiting for its files to be flushed to disk.
+ */
+struct fs_close {
+	struct fs_context *c;	/* Private copy of the original request */
+	int pending;		/* Files still being flushed */
+	int error;
+};
+
 void
 fs_close(struct fs_context *c)
 {
-	struct ec_fs_reply reply;
 	struct ec_fs_req_close *request;
-	int h, error, thiserr;
+	struct fs_close *cl;
+	int h;
 	
 	if (c->client == NULL) {
 		fs_err(c, EC_FS_E_WHOAREYOU);
@@ -160,44 +182,93 @@ fs_close(struct fs_context *c)
 	}
 	request = (struct ec_fs_req_close *)(c->req);
 	if (debug) printf("close [%d]\n", request->handle);
+	if ((cl = calloc(1, sizeof(*cl))) == NULL ||
+	    (cl->c = fs_save_context(c)) == NULL) {
+		free(cl);
+		fs_err(c, EC_FS_E_NOMEM);
+		return;
+	}
+	/* Hold off replying until we've started all the flushes. */
+	cl->pending = 1;
 	if (request->handle == 0) {
-		error = 0;
 		for (h = 1; h < c->client->nhandles; h++)
 			if (c->client->handles[h] &&
-			    c->client->handles[h]->type == FS_HANDLE_FILE &&
-			    (thiserr = fs_close1(c, h)))
-				error = thiserr;
+			    c->client->handles[h]->type == FS_HANDLE_FILE)
+				fs_close1(cl, h);
 	} else
-		error = fs_close1(c, request->handle);
-	if (error)
-		fs_errno(c);
-        else {
+		fs_close1(cl, request->handle);
+	fs_close_done(cl, 0);
+}
+
+/*
+ * Called as each file has been flushed.  Once they all have, reply.
+ */
+static void
+fs_close_done(void *arg, ssize_t result)
+{
+	struct fs_close *cl = arg;
+	struct ec_fs_reply reply;
+
+	/* EINVAL means the file is fundamentally unfsyncable. */
+	if (result < 0 && result != -EINVAL)
+		cl->error = -result;
+	if (--cl->pending > 0)
+		return;
+	if (cl->error) {
+		errno = cl->error;
+		fs_errno(cl->c);
+	} else {
 		reply.command_code = EC_FS_CC_DONE;
 		reply.return_code = EC_FS_RC_OK;
-		fs_reply(c, &reply, sizeof(reply));
+		fs_reply(cl->c, &reply, sizeof(reply));
 	}
+	fs_free_context(cl->c);
+	free(cl);
+}
+
+/* A file being flushed before it's closed. */
+struct fs_close_file {
+	struct fs_close *cl;
+	int fd;
+};
+
+static void
+fs_close_fsynced(void *arg, ssize_t result)
+{
+	struct fs_close_file *cf = arg;
+	struct fs_close *cl = cf->cl;
+
+	close(cf->fd);
+	free(cf);
+	fs_close_done(cl, result);
 }
 
 /*
- * Close a single handle.
+ * Close a single handle.  The handle goes at once, but the file
+ * isn't closed until it has been flushed.
  */
-static int
-fs_close1(struct fs_context *c, int h)
+static void
+fs_close1(struct fs_close *cl, int h)
 {
+	struct fs_client *client = cl->c->client;
+	struct fs_close_file *cf;
 	struct fs_handle *hp;
-	int error = 0;
 
-	if ((h = fs_check_handle(c->client, h)) != 0) {
-		hp = c->client->handles[h];
+	if ((h = fs_check_handle(client, h)) != 0) {
+		hp = client->handles[h];
 		/* ESUG says this is needed */
-		if (hp->type == FS_HANDLE_FILE && fsync(hp->fd) == -1) {
-			if (errno != EINVAL) /* fundamentally unfsyncable */
-				error = errno;
+		if (hp->type == FS_HANDLE_FILE &&
+		    (cf = malloc(sizeof(*cf))) != NULL) {
+			cf->cl = cl;
+			cf->fd = hp->fd;
+			hp->fd = -1;	/* so fs_close_handle() leaves it */
+			cl->pending++;
+			aio_fsync(cf->fd, fs_close_fsynced, cf);
+			/* Its size and date may well have changed. */
+			fs_dirsnap_changed(hp->path);
 		}
-		close(hp->fd);
-		fs_close_handle(c->client, h);
+		fs_close_handle(client, h);
 	}
-	return error;
 }
 
 void
@@ -393,11 +464,10 @@ void
 fs_getbytes(struct fs_context *c)
 {
 	struct ec_fs_reply reply1;
-	struct ec_fs_reply_getbytes2 reply2;
 	struct ec_fs_req_getbytes *request;
 	int h, fd;
 	off_t off;
-	size_t size, got;
+	size_t size;
 
 	if (c->client == NULL) {
 		fs_err(c, EC_FS_E_WHOAREYOU);
@@ -421,22 +491,33 @@ fs_getbytes(struct fs_context *c)
 		reply1.command_code = EC_FS_CC_DONE;
 		reply1.return_code = EC_FS_RC_OK;
 		fs_reply(c, &reply1, sizeof(reply1));
+		fs_data_send(c, fd, false, size, fs_getbytes_done);
+	}
+	
+}
+
+static void
+fs_getbytes_done(struct fs_data_tx *tx, ssize_t got)
+{
+	struct ec_fs_reply_getbytes2 reply2;
+	struct ec_fs_req_getbytes *request;
+	size_t size;
+
+	if (got == -1) {
+		/* Error */
+		fs_errno(tx->c);
+	} else {
+		request = (struct ec_fs_req_getbytes *)(tx->c->req);
+		size = fs_read_val(request->nbytes, sizeof(request->nbytes));
 		reply2.std_tx.command_code = EC_FS_CC_DONE;
 		reply2.std_tx.return_code = EC_FS_RC_OK;
-		got = fs_data_send(c, fd, size);
-		if (got == -1) {
-			/* Error */
-			fs_errno(c);
-		} else {
-			if (got == size && !at_eof(fd))
-				reply2.flag = 0;
-			else
-				reply2.flag = 0x80; /* EOF reached */
-			fs_write_val(reply2.nbytes, got, sizeof(reply2.nbytes));
-			fs_reply(c, &(reply2.std_tx), sizeof(reply2));
-		}
+		if (got == size && !at_eof(tx->fd))
+			reply2.flag = 0;
+		else
+			reply2.flag = 0x80; /* EOF reached */
+		fs_write_val(reply2.nbytes, got, sizeof(reply2.nbytes));
+		fs_reply(tx->c, &(reply2.std_tx), sizeof(reply2));
 	}
-	
 }
 
 void
@@ -475,17 +556,16 @@ void
 fs_putbytes(struct fs_context *c)
 {
 	struct ec_fs_reply_putbytes1 reply1;
-	struct ec_fs_reply_putbytes2 reply2;
 	struct ec_fs_req_putbytes *request;
-	int h, fd, replyport;
+	struct fs_data_rx *rx;
+	int h, fd;
 	off_t off;
-	size_t size, got;
+	size_t size;
 
 	if (c->client == NULL) {
 		fs_err(c, EC_FS_E_WHOAREYOU);
 		return;
 	}
-	replyport = c->req->reply_port;
 	request = (struct ec_fs_req_putbytes *)(c->req);
 	size = fs_read_val(request->nbytes, sizeof(request->nbytes));
 	off = fs_read_val(request->offset, sizeof(request->offset));
@@ -501,24 +581,34 @@ fs_putbytes(struct fs_context *c)
 				fs_errno(c);
 				return;
 			}
+		rx = fs_data_rx_new(c, fd, size, c->req->urd,
+		    fs_putbytes_done);
+		if (rx == NULL)
+			return;
 		reply1.std_tx.command_code = EC_FS_CC_DONE;
 		reply1.std_tx.return_code = EC_FS_RC_OK;
 		reply1.data_port = OUR_DATA_PORT;
 	        fs_write_val(reply1.block_size, aunfuncs->max_block,
 			     sizeof(reply1.block_size));
 		fs_reply(c, &(reply1.std_tx), sizeof(reply1));
+		fs_data_recv(rx);
+	}
+}
+
+static void
+fs_putbytes_done(struct fs_data_rx *rx, ssize_t got)
+{
+	struct ec_fs_reply_putbytes2 reply2;
+
+	if (got == -1) {
+		/* Error */
+		fs_errno(rx->c);
+	} else {
 		reply2.std_tx.command_code = EC_FS_CC_DONE;
 		reply2.std_tx.return_code = EC_FS_RC_OK;
-		got = fs_data_recv(c, fd, size, c->req->urd);
-		if (got == -1) {
-			/* Error */
-			fs_errno(c);
-		} else {
-			reply2.zero = 0;
-			fs_write_val(reply2.nbytes, got, sizeof(reply2.nbytes));
-			c->req->reply_port = replyport;
-			fs_reply(c, &(reply2.std_tx), sizeof(reply2));
-		}
+		reply2.zero = 0;
+		fs_write_val(reply2.nbytes, got, sizeof(reply2.nbytes));
+		fs_reply(rx->c, &(reply2.std_tx), sizeof(reply2));
 	}
 }
 
@@ -526,13 +616,10 @@ void
 fs_load(struct fs_context *c)
 {
 	struct ec_fs_reply_load1 reply1;
-	struct ec_fs_reply_load2 reply2;
 	struct ec_fs_req_load *request;
-	char *upath, *upathlib, *path_argv[3];
-	int fd, as_command;
-	size_t got;
-	FTS *ftsp;
-	FTSENT *f;
+	char *upath, *upathlib, *path;
+	struct fs_attr attr;
+	int fd, as_command, ret;
 
 	if (c->client == NULL) {
 		fs_err(c, EC_FS_E_WHOAREYOU);
@@ -550,8 +637,7 @@ fs_load(struct fs_context *c)
 	request->path[strcspn(request->path, " ")] = '\0';
 	upath = fs_unixify_path(c, request->path);
 	if (upath == NULL) return;
-	path_argv[0] = upath;
-	path_argv[1] = NULL;
+	path = upath;
 	if (as_command) {
 		c->req->csd = c->req->lib;
 		upathlib = fs_unixify_path(c, request->path);
@@ -559,60 +645,62 @@ fs_load(struct fs_context *c)
 			free(upath);
 			return;
 		}
-		path_argv[1] = upathlib;
-		path_argv[2] = NULL;
-	}
-	ftsp = fts_open(path_argv, FTS_LOGICAL, NULL);
-	f = fts_read(ftsp);
-	if (as_command && f->fts_info == FTS_NS && f->fts_errno == ENOENT)
-		f = fts_read(ftsp);
-	if (f->fts_info == FTS_ERR || f->fts_info == FTS_NS) {
+	}
+	ret = fs_attr_get(path, &attr, FS_ATTR_META);
+	if (as_command && ret < 0 && errno == ENOENT) {
+		path = upathlib;
+		ret = fs_attr_get(path, &attr, FS_ATTR_META);
+	}
+	if (ret < 0) {
 		fs_errno(c);
 		goto out;
 	}
-	if (S_ISDIR(f->fts_statp->st_mode)) {
+	if (S_ISDIR(attr.ent.mode)) {
 		fs_err(c, EC_FS_E_ISDIR);
 		goto out;
 	}
-	if ((fd = open(f->fts_accpath, O_RDONLY)) == -1) {
+	if ((fd = open(path, O_RDONLY)) == -1) {
 		fs_errno(c);
 		goto out;
 	}
-	fs_get_meta(f, &(reply1.meta));
-	fs_write_val(reply1.size, f->fts_statp->st_size, sizeof(reply1.size));
-	reply1.access = fs_mode_to_access(f->fts_statp->st_mode);
-	fs_write_date(&(reply1.date), fs_get_birthtime(f));
+	reply1.meta = attr.meta;
+	fs_write_val(reply1.size, attr.ent.size, sizeof(reply1.size));
+	reply1.access = fs_mode_to_access(attr.ent.mode);
+	fs_write_date(&(reply1.date), attr.birth);
 	reply1.std_tx.command_code = EC_FS_CC_DONE;
 	reply1.std_tx.return_code = EC_FS_RC_OK;
 	fs_reply(c, &(reply1.std_tx), sizeof(reply1));
-	reply2.std_tx.command_code = EC_FS_CC_DONE;
-	reply2.std_tx.return_code = EC_FS_RC_OK;
-	got = fs_data_send(c, fd, f->fts_statp->st_size);
+	fs_data_send(c, fd, true, attr.ent.size, fs_load_done);
+out:
+	free(upath);
+	if (as_command) free(upathlib);
+}
+
+static void
+fs_load_done(struct fs_data_tx *tx, ssize_t got)
+{
+	struct ec_fs_reply_load2 reply2;
+
 	if (got == -1) {
 		/* Error */
-		fs_errno(c);
+		fs_errno(tx->c);
 	} else {
-		fs_reply(c, &(reply2.std_tx), sizeof(reply2));
+		reply2.std_tx.command_code = EC_FS_CC_DONE;
+		reply2.std_tx.return_code = EC_FS_RC_OK;
+		fs_reply(tx->c, &(reply2.std_tx), sizeof(reply2));
 	}
-	close(fd);
-out:
-	fts_close(ftsp);
-	free(upath);
-	if (as_command) free(upathlib);
 }
 
 void
 fs_save(struct fs_context *c)
 {
 	struct ec_fs_reply_save1 reply1;
-	struct ec_fs_reply_save2 reply2;
 	struct ec_fs_req_save *request;
-	struct ec_fs_meta meta;
-	char *upath, *path_argv[2];
-	int fd, ackport, replyport;
-	size_t size, got;
-	FTS *ftsp;
-	FTSENT *f;
+	struct fs_data_rx *rx;
+	const char *rel;
+	char *upath;
+	int fd, at;
+	size_t size;
 
 	if (c->client == NULL) {
 		fs_err(c, EC_FS_E_WHOAREYOU);
@@ -620,49 +708,63 @@ fs_save(struct fs_context *c)
 	}
 	request = (struct ec_fs_req_save *)(c->req);
 	request->path[strcspn(request->path, "\r")] = '\0';
-	replyport = c->req->reply_port;
-	ackport = c->req->urd;
 	if (debug) printf("save [%s]\n", request->path);
 	size = fs_read_val(request->size, sizeof(request->size));
 	upath = fs_unixify_path(c, request->path);
 	if (upath == NULL) return;
-	if ((fd = open(upath, O_CREAT|O_TRUNC|O_RDWR, 0666)) == -1) {
+	at = fs_path_at(c->client, upath, &rel);
+	if ((fd = openat(at, rel, O_CREAT|O_TRUNC|O_RDWR, 0666)) == -1) {
 		fs_errno(c);
 		free(upath);
 		return;
 	}
-	meta = request->meta;
+	/* The ACK port is passed in the URD field. */
+	rx = fs_data_rx_new(c, fd, size, c->req->urd, fs_save_done);
+	if (rx == NULL) {
+		close(fd);
+		free(upath);
+		return;
+	}
+	rx->owns_fd = true;
+	rx->upath = upath;
+	rx->meta = request->meta;
 	reply1.std_tx.command_code = EC_FS_CC_DONE;
 	reply1.std_tx.return_code = EC_FS_RC_OK;
 	reply1.data_port = OUR_DATA_PORT;
 	fs_write_val(reply1.block_size, aunfuncs->max_block,
 		     sizeof(reply1.block_size));
 	fs_reply(c, &(reply1.std_tx), sizeof(reply1));
-	reply2.std_tx.command_code = EC_FS_CC_DONE;
-	reply2.std_tx.return_code = EC_FS_RC_OK;
-	got = fs_data_recv(c, fd, size, ackport);
-	close(fd);
+	fs_data_recv(rx);
+}
+
+static void
+fs_save_done(struct fs_data_rx *rx, ssize_t got)
+{
+	struct ec_fs_reply_save2 reply2;
+	struct fs_attr attr;
+
+	close(rx->fd);
+	rx->fd = -1;
 	if (got == -1) {
 		/* Error */
-		fs_errno(c);
+		fs_errno(rx->c);
 	} else {
 		/*
 		 * Write load and execute addresses from the
 		 * request, and return the file date in the
 		 * response.
 		 */
-		path_argv[0] = upath;
-		path_argv[1] = NULL;
-		ftsp = fts_open(path_argv, FTS_LOGICAL, NULL);
-		f = fts_read(ftsp);
-		fs_set_meta(f, &meta);
-		fs_write_date(&(reply2.date), fs_get_birthtime(f));
-		reply2.access = fs_mode_to_access(f->fts_statp->st_mode);
-		fts_close(ftsp);
-		c->req->reply_port = replyport;
-		fs_reply(c, &(reply2.std_tx), sizeof(reply2));
+		if (fs_attr_get(rx->upath, &attr, 0) < 0) {
+			fs_errno(rx->c);
+			return;
+		}
+		fs_set_meta(&attr.ent, &rx->meta);
+		reply2.std_tx.command_code = EC_FS_CC_DONE;
+		reply2.std_tx.return_code = EC_FS_RC_OK;
+		fs_write_date(&(reply2.date), attr.birth);
+		reply2.access = fs_mode_to_access(attr.ent.mode);
+		fs_reply(rx->c, &(reply2.std_tx), sizeof(reply2));
 	}
-	free(upath);
 }
 
 void
@@ -671,11 +773,11 @@ fs_create(struct fs_context *c)
 	struct ec_fs_reply_create reply;
 	struct ec_fs_req_create *request;
 	struct ec_fs_meta meta;
-	char *upath, *path_argv[2];
-	int fd, replyport;
+	const char *rel;
+	char *upath;
+	int fd, at, replyport;
 	size_t size;
-	FTS *ftsp;
-	FTSENT *f;
+	struct fs_attr attr;
 
 	if (c->client == NULL) {
 		fs_err(c, EC_FS_E_WHOAREYOU);
@@ -688,7 +790,8 @@ fs_create(struct fs_context *c)
 	size = fs_read_val(request->size, sizeof(request->size));
 	upath = fs_unixify_path(c, request->path);
 	if (upath == NULL) return;
-	if ((fd = open(upath, O_CREAT|O_TRUNC|O_RDWR, 0666)) == -1) {
+	at = fs_path_at(c->client, upath, &rel);
+	if ((fd = openat(at, rel, O_CREAT|O_TRUNC|O_RDWR, 0666)) == -1) {
 		fs_errno(c);
 		free(upath);
 		return;
@@ -708,106 +811,448 @@ fs_create(struct fs_context *c)
 	 * request, and return the file date in the
 	 * response.
 	 */
-	path_argv[0] = upath;
-	path_argv[1] = NULL;
-	ftsp = fts_open(path_argv, FTS_LOGICAL, NULL);
-	f = fts_read(ftsp);
-	fs_set_meta(f, &meta);
-	fs_write_date(&(reply.date), fs_get_birthtime(f));
-	reply.access = fs_mode_to_access(f->fts_statp->st_mode);
-	fts_close(ftsp);
+	if (fs_attr_get(upath, &attr, 0) < 0) {
+		fs_errno(c);
+		free(upath);
+		return;
+	}
+	fs_set_meta(&attr.ent, &meta);
+	fs_write_date(&(reply.date), attr.birth);
+	reply.access = fs_mode_to_access(attr.ent.mode);
 	free(upath);
 	c->req->reply_port = replyport;
 	fs_reply(c, &(reply.std_tx), sizeof(reply));
 }
 
-static ssize_t
-fs_data_send(struct fs_context *c, int fd, size_t size)
+/*
+ * Send data for a LOAD or GETBYTES.  Up to the client's window of
+ * blocks are left outstanding at once, and each is retransmitted on
+ * its own if its ACK doesn't turn up.  Once everything has been
+ * acknowledged, done() sends the final reply.  If owns_fd is set, fd
+ * is closed once we've finished with it.
+ */
+static void
+fs_data_send(struct fs_context *c, int fd, bool owns_fd, size_t size,
+    void (*done)(struct fs_data_tx *, ssize_t))
 {
-	struct aun_packet *pkt;
-	void *buf;
-	ssize_t result;
-	size_t this, done;
-	int faking;
+	struct fs_data_tx *tx;
+	size_t chunk;
 
-	if ((pkt = malloc(sizeof(*pkt) +
-	    (size > aunfuncs->max_block ? aunfuncs->max_block : size))) ==
-	    NULL) { 
+	chunk = (size_t)c->client->window * aunfuncs->max_block;
+	if (chunk > size)
+		chunk = size;
+	if ((tx = calloc(1, sizeof(*tx))) == NULL ||
+	    (tx->buf[0].data = malloc(chunk)) == NULL ||
+	    (tx->buf[1].data = malloc(chunk)) == NULL ||
+	    (tx->c = fs_save_context(c)) == NULL) {
+		if (tx != NULL) {
+			free(tx->buf[0].data);
+			free(tx->buf[1].data);
+		}
+		free(tx);
+		if (owns_fd)
+			close(fd);
 		fs_err(c, EC_FS_E_NOMEM);
-		return -1;
-	}
-	buf = pkt->data;
-	faking = 0;
-	done = 0;
-	while (size) {
-		this = size > aunfuncs->max_block ? aunfuncs->max_block : size;
-		if (!faking) {
-			result = read(fd, buf, this);
-			if (result > 0) {
-				/* Normal -- the kernel had something for us */
-				this = result;
-				done += this;
-			} else { /* EOF or error */
-				if (result == -1) done = result;
-				faking = 1;
-			}
+		return;
+	}
+	tx->fd = fd;
+	tx->owns_fd = owns_fd;
+	tx->size = size;
+	if ((tx->start = lseek(fd, 0, SEEK_CUR)) == -1)
+		tx->start = 0;
+	tx->toread = size;
+	tx->chunk = chunk;
+	tx->buf[0].tx = tx->buf[1].tx = tx;
+	tx->window = c->client->window;
+	tx->done = done;
+	fs_data_abort(c->client);
+	c->client->data_tx = tx;
+	if (aunfuncs->set_window != NULL)
+		aunfuncs->set_window(c->from, tx->window);
+	fs_data_tx_fill(tx);
+}
+
+static void
+fs_data_tx_free(struct fs_data_tx *tx)
+{
+
+	if (tx->owns_fd)
+		close(tx->fd);
+	free(tx->buf[0].data);
+	free(tx->buf[1].data);
+	fs_free_context(tx->c);
+	free(tx);
+}
+
+static void
+fs_data_tx_sent(void *arg, int error)
+{
+	struct fs_data_buf *buf = arg;
+	struct fs_data_tx *tx = buf->tx;
+
+	buf->busy--;
+	tx->inflight--;
+	if (error != 0) {
+		warnx("send data: %s", strerror(error));
+		/* No point sending the rest. */
+		if (tx->error == 0)
+			tx->error = error;
+		tx->size = 0;
+	}
+	if (!tx->filling)
+		fs_data_tx_fill(tx);
+}
+
+static void
+fs_data_tx_read_done(void *arg, ssize_t result)
+{
+	struct fs_data_tx *tx = arg;
+
+	tx->reading = false;
+	tx->nextready = true;
+	if (result < 0) {
+		tx->error = -result;
+		result = 0;
+	}
+	tx->buf[!tx->cur].len = result;
+	tx->buf[!tx->cur].pos = 0;
+	tx->got += result;
+	/* Pad with zeroes from EOF, or after an error. */
+	if (result < (tx->toread > tx->chunk ? tx->chunk : tx->toread))
+		tx->faking = true;
+	tx->toread -= result;
+	if (!tx->filling)
+		fs_data_tx_fill(tx);
+}
+
+/*
+ * Start reading the next chunk of the file, unless there's no more
+ * to read, or the buffer it's going into is still being sent from.
+ */
+static void
+fs_data_tx_read(struct fs_data_tx *tx)
+{
+
+	if (tx->reading || tx->nextready || tx->faking || tx->toread == 0 ||
+	    tx->buf[!tx->cur].busy > 0)
+		return;
+	tx->reading = true;
+	aio_read(tx->fd, tx->buf[!tx->cur].data,
+	    tx->toread > tx->chunk ? tx->chunk : tx->toread,
+	    tx->start + tx->got, fs_data_tx_read_done, tx);
+}
+
+/*
+ * Send blocks until the window is full, and finish up if there's
+ * nothing left to wait for.
+ */
+static void
+fs_data_tx_fill(struct fs_data_tx *tx)
+{
+	static uint8_t zeroes[AUN_MAX_BLOCK];
+	struct aun_packet hdr;
+	struct fs_data_buf *buf;
+	struct iovec iov;
+	size_t this;
+
+	/*
+	 * The transport may call fs_data_tx_sent() before xmitv_async()
+	 * returns, and a synchronous read may call
+	 * fs_data_tx_read_done() before aio_read() does, so guard
+	 * against recursing through here.
+	 */
+	tx->filling = true;
+	/* The spare buffer may have become free. */
+	fs_data_tx_read(tx);
+	while (!tx->aborted && tx->inflight < tx->window && tx->size) {
+		buf = &tx->buf[tx->cur];
+		if (buf->pos == buf->len && tx->nextready) {
+			tx->cur = !tx->cur;
+			tx->nextready = false;
+			fs_data_tx_read(tx);
+			continue;
+		} else if (buf->pos == buf->len && tx->faking) {
+			/* Send zeroes until the size we promised. */
+			this = tx->size;
+			if (this > aunfuncs->max_block)
+				this = aunfuncs->max_block;
+			if (this > sizeof(zeroes))
+				this = sizeof(zeroes);
+			iov.iov_base = zeroes;
+		} else if (buf->pos == buf->len) {
+			/* Need more data. */
+			fs_data_tx_read(tx);
+			if (!tx->nextready)
+				break;
+			continue;
+		} else {
+			this = buf->len - buf->pos;
+			if (this > aunfuncs->max_block)
+				this = aunfuncs->max_block;
+			if (this > tx->size)
+				this = tx->size;
+			iov.iov_base = buf->data + buf->pos;
+			buf->pos += this;
 		}
-		pkt->type = AUN_TYPE_UNICAST;
-		pkt->dest_port = c->req->urd;
-		pkt->flag = c->req->aun.flag & 1;
-		if (aunfuncs->xmit(pkt, sizeof(*pkt) + this, c->from) == -1)
-			warn("send data");
-		size -= this;
+		iov.iov_len = this;
+		hdr.type = AUN_TYPE_UNICAST;
+		hdr.dest_port = tx->c->req->urd;
+		hdr.flag = tx->c->req->aun.flag & 1;
+		tx->size -= this;
+		tx->inflight++;
+		buf->busy++;
+		aunfuncs->xmitv_async(&hdr, &iov, 1, tx->c->from,
+		    fs_data_tx_sent, buf);
+	}
+	tx->filling = false;
+	if (tx->inflight > 0 || tx->reading)
+		return;
+	if (tx->aborted) {
+		fs_data_tx_free(tx);
+		return;
+	}
+	if (tx->size == 0) {
+		tx->c->client->data_tx = NULL;
+		/* Leave the file pointer where read() would have. */
+		if (!tx->owns_fd)
+			lseek(tx->fd, tx->start + tx->got, SEEK_SET);
+		if (tx->error != 0) {
+			errno = tx->error;
+			tx->done(tx, -1);
+		} else
+			tx->done(tx, tx->got);
+		fs_data_tx_free(tx);
 	}
-	free(pkt);
-	return done;
 }
 
-static ssize_t
-fs_data_recv(struct fs_context *c, int fd, size_t size, int ackport)
+/*
+ * Set up to receive data for a SAVE or PUTBYTES.  This has to be
+ * done before we tell the client where to send the data, or we might
+ * turn away the first packet.
+ */
+static struct fs_data_rx *
+fs_data_rx_new(struct fs_context *c, int fd, size_t size, int ackport,
+    void (*done)(struct fs_data_rx *, ssize_t))
 {
-	struct aun_packet *pkt, *ack;
-	ssize_t msgsize, result;
-	struct aun_srcaddr from;
-	size_t done;
+	struct fs_data_rx *rx;
 
-	if ((ack = malloc(sizeof(*ack) + 1)) == NULL) {
+	if ((rx = calloc(1, sizeof(*rx))) == NULL ||
+	    (rx->c = fs_save_context(c)) == NULL) {
+		free(rx);
 		fs_err(c, EC_FS_E_NOMEM);
-		return -1;
-	}
-	done = 0;
-	while (size) {
-		from = *c->from;
-		pkt = aunfuncs->recv(&msgsize, &from, OUR_DATA_PORT);
-		if (!pkt) {
-			warn("receive data");
-			return -1;     /* no reply: client has gone away */
-		}
-		msgsize -= sizeof(struct aun_packet);
-		if (pkt->dest_port != OUR_DATA_PORT ||
-		    memcmp(&from, c->from, sizeof(from))) {
-			fs_error(c, 0xFF, "I'm confused");
-			return -1;
-		}
-		result = write(fd, pkt->data, msgsize);
-		if (result < 0) {
-			fs_errno(c);
-			return -1;
-		}
-		size -= msgsize;
-		if (size) {
-			/*
-			 * Send partial ACK.
-			 */
-			ack->type = AUN_TYPE_UNICAST;
-			ack->dest_port = ackport;
-			ack->flag = 0;
-			ack->data[0] = 0;
-			if (aunfuncs->xmit(ack, sizeof(*ack) + 1, c->from) ==
-			    -1)
-				warn("send data");
-		}
+		return NULL;
 	}
-	free(ack);
-	return done;
+	rx->fd = fd;
+	if ((rx->start = lseek(fd, 0, SEEK_CUR)) == -1)
+		rx->start = 0;
+	rx->size = size;
+	rx->ackport = ackport;
+	rx->done = done;
+	ev_timer_init(&rx->timeout, fs_data_timeout, rx);
+	/* A client can only do one of these at a time. */
+	fs_data_abort(c->client);
+	c->client->data_rx = rx;
+	return rx;
+}
+
+/*
+ * Start waiting for data to arrive.
+ */
+static void
+fs_data_recv(struct fs_data_rx *rx)
+{
+
+	if (rx->size == 0)
+		fs_data_finish(rx);
+	else
+		ev_timer_add(&rx->timeout, 50 * default_timeout);
+}
+
+static void
+fs_data_rx_free(struct fs_data_rx *rx)
+{
+
+	if (rx->owns_fd && rx->fd != -1)
+		close(rx->fd);
+	free(rx->upath);
+	fs_free_context(rx->c);
+	free(rx);
+}
+
+/*
+ * All the data has arrived, or something has gone wrong.  Either way,
+ * wait for any writes still going, then reply.
+ */
+static void
+fs_data_finish(struct fs_data_rx *rx)
+{
+
+	ev_timer_del(&rx->timeout);
+	if (rx->writing > 0)
+		return;
+	rx->c->client->data_rx = NULL;
+	/* Leave the file pointer where write() would have. */
+	if (!rx->owns_fd)
+		lseek(rx->fd, rx->start + rx->got, SEEK_SET);
+	if (rx->error != 0) {
+		errno = rx->error;
+		rx->done(rx, -1);
+	} else
+		rx->done(rx, rx->got);
+	fs_data_rx_free(rx);
+}
+
+/*
+ * Give up on a transfer without replying, because the client has
+ * gone away.
+ */
+void
+fs_data_abort(struct fs_client *client)
+{
+	struct fs_data_rx *rx;
+	struct fs_data_tx *tx;
+
+	if ((tx = client->data_tx) != NULL) {
+		if (debug) printf("abandoning data transfer to %s\n",
+		    aunfuncs->ntoa(&client->host));
+		/* Freed once the blocks in flight are finished with. */
+		client->data_tx = NULL;
+		tx->aborted = true;
+		if (tx->inflight == 0 && !tx->reading)
+			fs_data_tx_free(tx);
+	}
+	if ((rx = client->data_rx) == NULL)
+		return;
+	if (debug) printf("abandoning data transfer from %s\n",
+	    aunfuncs->ntoa(&client->host));
+	ev_timer_del(&rx->timeout);
+	client->data_rx = NULL;
+	/* Freed once the writes in progress are finished with. */
+	rx->aborted = true;
+	if (rx->writing == 0)
+		fs_data_rx_free(rx);
+}
+
+static void
+fs_data_timeout(void *arg)
+{
+	struct fs_data_rx *rx = arg;
+
+	warnx("receive data from %s: timed out",
+	    aunfuncs->ntoa(rx->c->from));
+	fs_data_abort(rx->c->client);
+}
+
+static int
+fs_data_wanted(struct aun_srcaddr *from)
+{
+	struct fs_client *client;
+
+	client = fs_find_client(from);
+	return client != NULL && client->data_rx != NULL;
+}
+
+static void
+fs_data_ack_done(void *arg, int error)
+{
+
+	if (error != 0)
+		warnx("send data: %s", strerror(error));
+}
+
+/* A block of data on its way to the disk. */
+struct fs_data_write {
+	struct fs_data_rx *rx;
+	size_t len;
+	uint8_t data[];
+};
+
+static void
+fs_data_written(void *arg, ssize_t result)
+{
+	struct fs_data_write *w = arg;
+	struct fs_data_rx *rx = w->rx;
+
+	if (result >= 0 && result < w->len)
+		result = -ENOSPC;	/* What else makes a file short? */
+	if (result < 0 && rx->error == 0)
+		rx->error = -result;
+	free(w);
+	rx->writing--;
+	if (rx->aborted) {
+		if (rx->writing == 0)
+			fs_data_rx_free(rx);
+		return;
+	}
+	if (rx->writing == 0 && (rx->got == rx->size || rx->error != 0))
+		fs_data_finish(rx);
+}
+
+static void
+fs_data_input(struct aun_packet *pkt, ssize_t msgsize,
+    struct aun_srcaddr *from)
+{
+	struct fs_client *client;
+	struct fs_data_rx *rx;
+	struct fs_data_write *w;
+	struct aun_packet *ack;
+	unsigned char ackbuf[sizeof(*ack) + 1];
+
+	client = fs_find_client(from);
+	if (client == NULL || (rx = client->data_rx) == NULL) {
+		if (debug) printf("unexpected data");
+		return;
+	}
+	msgsize -= sizeof(struct aun_packet);
+	if (msgsize < 0)
+		return;
+	if (msgsize > rx->size - rx->got)
+		msgsize = rx->size - rx->got;
+	if (debug) printf("data [%zd]", msgsize);
+	if (rx->error != 0) {
+		fs_data_finish(rx);
+		return;
+	}
+	/*
+	 * The packet buffer isn't ours to keep, so the data has to be
+	 * copied while it's written out.
+	 */
+	if ((w = malloc(sizeof(*w) + msgsize)) == NULL) {
+		rx->error = ENOMEM;
+		fs_data_finish(rx);
+		return;
+	}
+	w->rx = rx;
+	w->len = msgsize;
+	memcpy(w->data, pkt->data, msgsize);
+	rx->writing++;
+	rx->got += msgsize;
+	aio_write(rx->fd, w->data, msgsize, rx->start + rx->got - msgsize,
+	    fs_data_written, w);
+	/* That may have finished everything off already. */
+	if (client->data_rx != rx)
+		return;
+	if (rx->got == rx->size) {
+		fs_data_finish(rx);
+		return;
+	}
+	ev_timer_add(&rx->timeout, 50 * default_timeout);
+	/*
+	 * Send partial ACK.
+	 */
+	ack = (struct aun_packet *)ackbuf;
+	ack->type = AUN_TYPE_UNICAST;
+	ack->dest_port = rx->ackport;
+	ack->flag = 0;
+	ack->data[0] = 0;
+	aunfuncs->xmit_async(ack, sizeof(*ack) + 1, rx->c->from,
+	    fs_data_ack_done, NULL);
+}
+
+void
+fs_data_init(void)
+{
+
+	ec_port_listen(OUR_DATA_PORT, "file server data", fs_data_input,
+	    fs_data_wanted);
 }
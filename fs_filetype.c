@@ -68,19 +68,19 @@ struct fs_typemap {
 TAILQ_HEAD(fs_typemap_head, fs_typemap);
 static struct fs_typemap_head typemap = TAILQ_HEAD_INITIALIZER(typemap);
 
-static int fs_check_typemap(FTSENT *, struct fs_typemap *);
+static int fs_check_typemap(struct fs_ent *, struct fs_typemap *);
 
 /*
  * fs_guess_type - pick a sensible RISC OS file type for a Unix file.
  */
-int fs_guess_type(FTSENT *f)
+int fs_guess_type(struct fs_ent *f)
 {
 	struct fs_typemap *map;
 	
 	/* First check for magic names */
-	if (f->fts_namelen >= 4 && f->fts_name[f->fts_namelen-4] == ',')
+	if (f->namelen >= 4 && f->name[f->namelen-4] == ',')
 		/* XXX should support ,xxx and ,lxa */
-		return strtoul(f->fts_name + f->fts_namelen - 3, NULL, 16);
+		return strtoul(f->name + f->namelen - 3, NULL, 16);
 	for (map = typemap.tqh_first; map != NULL; map = map->link.tqe_next)
 		if (fs_check_typemap(f, map)) break;
 
@@ -89,16 +89,16 @@ int fs_guess_type(FTSENT *f)
 	return FT_DATA;
 }
 
-int fs_check_typemap(FTSENT *f, struct fs_typemap *map)
+int fs_check_typemap(struct fs_ent *f, struct fs_typemap *map)
 {
 	switch (map->kind) {
 	case FS_MAP_DEFAULT:
 		return 1;
 	case FS_MAP_MODE:
-		return (f->fts_statp->st_mode & map->crit.mode.mask) ==
+		return (f->mode & map->crit.mode.mask) ==
 		    map->crit.mode.val;
 	case FS_MAP_NAME:
-		if (regexec(map->crit.name_re, f->fts_name, 0, NULL, 0) == 0)
+		if (regexec(map->crit.name_re, f->name, 0, NULL, 0) == 0)
 			return 1;
 		else
 			return 0;
@@ -32,7 +32,9 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -42,6 +44,10 @@
 
 #define MAX_HANDLES 256
 
+#ifndef O_PATH
+#define O_PATH O_RDONLY
+#endif
+
 static int fs_alloc_handle(struct fs_client *, bool);
 static void fs_free_handle(struct fs_client *, int);
 
@@ -89,21 +95,40 @@ int fs_check_handle(struct fs_client *client, int h)
 /*
  * Open a new handle for a client.  path gives the Unix path of the
  * file or directory to open.
+ *
+ * Directories other than those opened with OPEN are held by an
+ * O_PATH descriptor, which fs_path_at() hands to the *at() calls so
+ * that names under them are looked up from there rather than from
+ * the root every time.  The path is still kept, for the code that
+ * works with whole pathnames, and fs_handle_check_path() keeps it
+ * up to date if the directory is moved.
  */
 int
 fs_open_handle(struct fs_client *client, char *path, int open_flags,
     bool for_open)
 {
 	struct stat sb;
+	struct fs_handle *hp;
+	const char *rel;
 	char *newpath;
-	int h, fd;
+	int h, fd, at;
 
+	at = fs_path_at(client, path, &rel);
 	h = fs_alloc_handle(client, for_open);
 	if (h == 0) {
 		errno = EMFILE;
 		return h;
 	}
-	if ((fd = open(path, open_flags,
+	hp = client->handles[h];
+	hp->pin = NULL;
+	fd = -1;
+	if (!for_open &&
+	    (fd = openat(at, rel, O_PATH | O_DIRECTORY | O_CLOEXEC)) == -1 &&
+	    errno != ENOTDIR) {
+		fs_free_handle(client, h);
+		return 0;
+	}
+	if (fd == -1 && (fd = openat(at, rel, open_flags,
 		    S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH)) == -1) {
 		fs_free_handle(client, h);
 		return 0;
@@ -113,18 +138,20 @@ fs_open_handle(struct fs_client *client, char *path, int open_flags,
 		fs_free_handle(client, h);
 		return 0;
 	}
-	if (S_ISDIR(sb.st_mode))
-		client->handles[h]->type = FS_HANDLE_DIR;
-	else if (S_ISREG(sb.st_mode)) {
-		client->handles[h]->type = FS_HANDLE_FILE;
+	if (S_ISDIR(sb.st_mode)) {
+		hp->type = FS_HANDLE_DIR;
+		hp->dev = sb.st_dev;
+		hp->ino = sb.st_ino;
+	} else if (S_ISREG(sb.st_mode)) {
+		hp->type = FS_HANDLE_FILE;
 		/*
 		 * Initialise the sequence number to 'unknown', so
 		 * that the first request from the client will not
 		 * be considered a repeat regardless of its sequence
 		 * number.
 		 */
-		client->handles[h]->sequence = 0xFF;
-		client->handles[h]->oldoffset = 0;
+		hp->sequence = 0xFF;
+		hp->oldoffset = 0;
 	} else {
 		warnx("fs_open_handle: tried to open something odd");
 		close(fd);
@@ -132,8 +159,8 @@ fs_open_handle(struct fs_client *client, char *path, int open_flags,
 		errno = ENOENT;
 		return 0;
 	}
-	client->handles[h]->fd = fd;
-	newpath = client->handles[h]->path = malloc(strlen(path)+1);
+	hp->fd = fd;
+	newpath = hp->path = malloc(strlen(path)+1);
 	if (newpath == NULL) {
 		warnx("fs_open_handle: malloc failed");
 		close(fd);
@@ -144,6 +171,8 @@ fs_open_handle(struct fs_client *client, char *path, int open_flags,
 	strcpy(newpath, path);
 	if (newpath[strlen(newpath)-1] == '/')
 		newpath[strlen(newpath)-1] = '\0';
+	if (hp->type == FS_HANDLE_DIR)
+		hp->pin = fs_pathcache_pin(newpath);
 	if (debug) printf("{%d=%s} ", h, newpath);
 	return h;
 }
@@ -160,9 +189,147 @@ fs_close_handle(struct fs_client *client, int h)
 	if (debug) printf("{%d closed} ", h);
 	close(client->handles[h]->fd);
 	free(client->handles[h]->path);
+	fs_pathcache_unpin(client->handles[h]->pin);
 	fs_free_handle(client, h);
 }
 
+/*
+ * Work out where a directory handle's directory is now, from what
+ * the kernel says about its descriptor.  Returns a mallocked path
+ * relative to the root, or NULL if it's no longer under the root.
+ */
+static char *
+fs_handle_fd_path(struct fs_handle *hp)
+{
+	static char *root;
+	static size_t rootlen;
+	struct stat sb;
+	char link[PATH_MAX], proc[32];
+	char *newpath;
+	ssize_t n;
+
+	if (root == NULL) {
+		if ((root = getcwd(NULL, 0)) == NULL)
+			return NULL;
+		rootlen = strlen(root);
+		if (rootlen == 1)
+			rootlen = 0;	/* Root is "/" */
+	}
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", hp->fd);
+	if ((n = readlink(proc, link, sizeof(link) - 1)) == -1)
+		return NULL;
+	link[n] = '\0';
+	if (strncmp(link, root, rootlen) != 0 ||
+	    (link[rootlen] != '/' && link[rootlen] != '\0'))
+		return NULL;
+	if ((newpath = malloc(n - rootlen + 2)) == NULL)
+		return NULL;
+	sprintf(newpath, ".%s", link + rootlen);
+	if (strcmp(newpath, "./") == 0)
+		newpath[1] = '\0';
+	/* Deleted directories get " (deleted)" added, for instance. */
+	if (stat(newpath, &sb) == -1 ||
+	    sb.st_dev != hp->dev || sb.st_ino != hp->ino) {
+		free(newpath);
+		return NULL;
+	}
+	return newpath;
+}
+
+/*
+ * A directory handle's directory has gone somewhere we can't follow,
+ * such as outside the root, so its descriptor mustn't be used any
+ * more.  Open whatever is at its path now instead, as though the
+ * handle were just a path.  If there's nothing there, the handle is
+ * left without a descriptor, and names under it are looked up from
+ * the root.
+ */
+static void
+fs_handle_reopen(struct fs_handle *hp)
+{
+	struct stat sb;
+
+	if (debug) printf("{%s lost} ", hp->path);
+	if (hp->fd != -1)
+		close(hp->fd);
+	if ((hp->fd = open(hp->path, O_PATH | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return;
+	if (fstat(hp->fd, &sb) == -1) {
+		close(hp->fd);
+		hp->fd = -1;
+		return;
+	}
+	hp->dev = sb.st_dev;
+	hp->ino = sb.st_ino;
+}
+
+/*
+ * Make sure a directory handle's path still leads to its directory.
+ * The caller should have called fs_pathcache_update() first.  Where
+ * we can't watch for moves, this costs a stat() each time.
+ */
+void
+fs_handle_check_path(struct fs_handle *hp)
+{
+	struct stat sb;
+	char *newpath;
+
+	if (hp->type != FS_HANDLE_DIR ||
+	    (hp->pin != NULL && !fs_pathcache_moved(hp->pin)))
+		return;
+	if (stat(hp->path, &sb) == -1 ||
+	    sb.st_dev != hp->dev || sb.st_ino != hp->ino) {
+		if ((newpath = fs_handle_fd_path(hp)) != NULL) {
+			if (debug)
+				printf("{%s moved to %s} ", hp->path, newpath);
+			free(hp->path);
+			hp->path = newpath;
+		} else
+			fs_handle_reopen(hp);
+	}
+	fs_pathcache_unpin(hp->pin);
+	hp->pin = fs_pathcache_pin(hp->path);
+}
+
+/*
+ * Find the best directory to resolve 'upath' from: the client's
+ * directory handle with the longest path leading to it.  Returns a
+ * descriptor to pass to an *at() call, with *rel set to the rest of
+ * the path, or AT_FDCWD and the whole path if there's no such
+ * handle.
+ */
+int
+fs_path_at(struct fs_client *client, const char *upath, const char **rel)
+{
+	struct fs_handle *hp, *best;
+	size_t len, bestlen;
+	int h;
+
+	fs_pathcache_update();
+	best = NULL;
+	bestlen = 0;
+	for (h = 1; h < client->nhandles; h++) {
+		hp = client->handles[h];
+		if (hp == NULL || hp->type != FS_HANDLE_DIR)
+			continue;
+		fs_handle_check_path(hp);
+		if (hp->fd == -1)
+			continue;
+		len = strlen(hp->path);
+		if (len > bestlen && strncmp(upath, hp->path, len) == 0 &&
+		    upath[len] == '/' && upath[len + 1] != '\0') {
+			best = hp;
+			bestlen = len;
+		}
+	}
+	if (best == NULL) {
+		*rel = upath;
+		return AT_FDCWD;
+	}
+	*rel = upath + bestlen + 1;
+	return best->fd;
+}
+
 /*
  * Handle allocation is slightly tricksy owing to strange behaviour on
  * the part of early 8-bit clients (up to NFS 3.60 at least).  These
@@ -0,0 +1,412 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * fs_journal.c - putting off changes to metadata
+ *
+ * Every SAVE and CREATE, and many SET_INFOs, set an object's load and
+ * execute addresses, and with the symlink or catalog backends that
+ * means changing a directory or two on disc before we can reply.  If
+ * a journal file is configured, those changes are instead written to
+ * the end of it, one record each, and remembered, and
+ * FS_JOURNAL_DELAY later everything that's built up is handed to the
+ * backend in one go.  Only the last change to each object matters by
+ * then, so an object saved several times in quick succession is only
+ * updated once.  fs_get_meta() looks here before asking the backend.
+ *
+ * If aund stops before the backend has caught up, the journal is
+ * still there when it starts again, and the changes in it are made
+ * then.  Records are only ever appended by a single write(), so a
+ * crash can at worst leave a partial record at the end, which is
+ * ignored.  Once a batch has been applied, the journal is emptied.
+ *
+ * Changes that are waiting can only be seen by the process that made
+ * them, so the journal can't be used with more than one worker.
+ * They go by the object's path, so anything that moves objects
+ * (renaming, and deleting directories) catches up first with
+ * fs_journal_flush().  Where the backend keeps metadata
+ * in the file itself, a change also records which file it was for,
+ * and is dropped if something else has turned up at that path.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "fileserver.h"
+
+#define FS_JOURNAL_DELAY	500000	/* Microseconds before applying */
+#define FS_JOURNAL_BATCH	1024	/* Changes to keep before applying */
+#define FS_JOURNAL_BUCKETS	1024
+
+char *fs_journal_file = NULL;		/* set by conf_lex.l */
+
+/*
+ * A record in the journal file, followed by the path, relative to
+ * the root, without a terminating NUL.  The file never moves between
+ * machines, so it's in host byte order.
+ */
+struct fs_jrec {
+	uint64_t dev, ino;		/* Zero unless metafuncs->byinode */
+	uint8_t op;			/* FS_JOURNAL_SET or FS_JOURNAL_DEL */
+	uint8_t pad;
+	uint16_t pathlen;
+	struct ec_fs_meta meta;
+};
+
+/* A change that the backend hasn't seen yet. */
+struct fs_jent {
+	TAILQ_ENTRY(fs_jent) order;
+	LIST_ENTRY(fs_jent) link;
+	uint32_t hash;
+	int op;
+	uint64_t dev, ino;
+	struct ec_fs_meta meta;
+	char path[];
+};
+
+TAILQ_HEAD(fs_jent_order, fs_jent);
+LIST_HEAD(fs_jent_list, fs_jent);
+
+static int fs_journal_fd = -1;
+static struct fs_jent_order fs_jorder = TAILQ_HEAD_INITIALIZER(fs_jorder);
+static struct fs_jent_list fs_jents[FS_JOURNAL_BUCKETS];
+static int fs_njents;
+static struct ev_timer fs_journal_timer;
+
+static unsigned long fs_journal_written, fs_journal_applied;
+static unsigned long fs_journal_batches, fs_journal_replayed;
+
+static uint32_t
+fs_journal_hash(const char *path, size_t len)
+{
+	uint32_t h = 2166136261U;
+
+	while (len-- > 0)
+		h = (h ^ (uint8_t)*path++) * 16777619U;
+	return h;
+}
+
+static struct fs_jent *
+fs_journal_find(const char *path, size_t len, uint32_t h)
+{
+	struct fs_jent *e;
+
+	LIST_FOREACH(e, &fs_jents[h % FS_JOURNAL_BUCKETS], link)
+		if (e->hash == h && strncmp(e->path, path, len) == 0 &&
+		    e->path[len] == '\0')
+			return e;
+	return NULL;
+}
+
+/*
+ * Remember a change, replacing any earlier one to the same object.
+ */
+static int
+fs_journal_note(struct fs_jrec *r, const char *path, size_t len)
+{
+	struct fs_jent *e;
+	uint32_t h;
+
+	h = fs_journal_hash(path, len);
+	if ((e = fs_journal_find(path, len, h)) == NULL) {
+		if ((e = malloc(sizeof(*e) + len + 1)) == NULL)
+			return -1;
+		memcpy(e->path, path, len);
+		e->path[len] = '\0';
+		e->hash = h;
+		LIST_INSERT_HEAD(&fs_jents[h % FS_JOURNAL_BUCKETS], e, link);
+		TAILQ_INSERT_TAIL(&fs_jorder, e, order);
+		fs_njents++;
+	}
+	e->op = r->op;
+	e->dev = r->dev;
+	e->ino = r->ino;
+	e->meta = r->meta;
+	return 0;
+}
+
+/*
+ * Make a change to the backend.
+ */
+static void
+fs_journal_apply(struct fs_jent *e)
+{
+	struct fs_ent ent;
+
+	if (fs_ent_stat(e->path, &ent) < 0)
+		ent.dev = ent.ino = 0;
+	/* Something else may have turned up in its place. */
+	if (e->ino != 0 && (ent.dev != e->dev || ent.ino != e->ino))
+		return;
+	if (e->op == FS_JOURNAL_DEL)
+		metafuncs->del(&ent);
+	else if (metafuncs->set(&ent, &e->meta) < 0)
+		warn("%s: metadata", e->path);
+	fs_journal_applied++;
+}
+
+/*
+ * Bring the backend up to date, and empty the journal.
+ */
+void
+fs_journal_flush(void)
+{
+	struct fs_jent *e;
+
+	if (TAILQ_EMPTY(&fs_jorder))
+		return;
+	ev_timer_del(&fs_journal_timer);
+	while ((e = TAILQ_FIRST(&fs_jorder)) != NULL) {
+		fs_journal_apply(e);
+		TAILQ_REMOVE(&fs_jorder, e, order);
+		LIST_REMOVE(e, link);
+		free(e);
+	}
+	fs_njents = 0;
+	fs_journal_batches++;
+	if (fs_journal_fd >= 0 && ftruncate(fs_journal_fd, 0) < 0)
+		warn("%s: ftruncate", fs_journal_file);
+}
+
+static void
+fs_journal_timeout(void *arg)
+{
+
+	fs_journal_flush();
+}
+
+/*
+ * Write a change to the journal.  Returns -1 if we're not keeping
+ * one, or it can't be written, in which case the caller should make
+ * the change itself.
+ */
+static int
+fs_journal_add(int op, struct fs_ent *ent, struct ec_fs_meta *meta)
+{
+	struct {
+		struct fs_jrec r;
+		char path[PATH_MAX];
+	} rec;
+	size_t len, reclen;
+	ssize_t n;
+	off_t end;
+
+	if (fs_journal_fd < 0)
+		return -1;
+	len = ent->pathlen;
+	if (len == 0 || len > UINT16_MAX || len > sizeof(rec.path))
+		return -1;
+	memset(&rec.r, 0, sizeof(rec.r));
+	if (metafuncs->byinode) {
+		rec.r.dev = ent->dev;
+		rec.r.ino = ent->ino;
+	}
+	rec.r.op = op;
+	rec.r.pathlen = len;
+	if (meta != NULL)
+		rec.r.meta = *meta;
+	memcpy(rec.path, ent->path, len);
+	reclen = sizeof(rec.r) + len;
+	if ((end = lseek(fs_journal_fd, 0, SEEK_END)) < 0)
+		return -1;
+	if ((n = write(fs_journal_fd, &rec, reclen)) != (ssize_t)reclen) {
+		/* Replay would stop at a partial record, so lose it. */
+		if (n > 0 && ftruncate(fs_journal_fd, end) < 0)
+			warn("%s: ftruncate", fs_journal_file);
+		return -1;
+	}
+	if (fs_journal_note(&rec.r, ent->path, len) < 0) {
+		/* Too late to back out, so catch up now. */
+		fs_journal_flush();
+		return -1;
+	}
+	fs_journal_written++;
+	if (fs_njents >= FS_JOURNAL_BATCH)
+		fs_journal_flush();
+	else if (!fs_journal_timer.pending)
+		ev_timer_add(&fs_journal_timer, FS_JOURNAL_DELAY);
+	return 0;
+}
+
+int
+fs_journal_set(struct fs_ent *ent, struct ec_fs_meta *meta)
+{
+
+	return fs_journal_add(FS_JOURNAL_SET, ent, meta);
+}
+
+int
+fs_journal_del(struct fs_ent *ent)
+{
+
+	return fs_journal_add(FS_JOURNAL_DEL, ent, NULL);
+}
+
+/*
+ * Look for a change to an object that the backend hasn't seen yet.
+ * Returns FS_JOURNAL_SET, having filled in 'meta', FS_JOURNAL_DEL if
+ * its metadata has been deleted, or 0 if the backend knows best.
+ */
+int
+fs_journal_get(struct fs_ent *ent, struct ec_fs_meta *meta)
+{
+	struct fs_jent *e;
+
+	if (fs_njents == 0)
+		return 0;
+	if ((e = fs_journal_find(ent->path, ent->pathlen,
+	    fs_journal_hash(ent->path, ent->pathlen))) == NULL)
+		return 0;
+	if (e->ino != 0 && (ent->dev != e->dev || ent->ino != e->ino))
+		return 0;
+	if (e->op == FS_JOURNAL_SET)
+		*meta = e->meta;
+	return e->op;
+}
+
+/*
+ * Read the changes in a journal left over from last time, and make
+ * them.  Returns -1, with errno set, if it can't be read.
+ */
+static int
+fs_journal_replay(const char *path)
+{
+	struct fs_jrec r;
+	struct stat st;
+	char *buf;
+	size_t off;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || (buf = malloc(st.st_size + 1)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	if (read(fd, buf, st.st_size) != st.st_size) {
+		free(buf);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	for (off = 0; off + sizeof(r) <= (size_t)st.st_size;
+	     off += sizeof(r) + r.pathlen) {
+		memcpy(&r, buf + off, sizeof(r));
+		if ((r.op != FS_JOURNAL_SET && r.op != FS_JOURNAL_DEL) ||
+		    r.pathlen == 0 ||
+		    off + sizeof(r) + r.pathlen > (size_t)st.st_size ||
+		    memchr(buf + off + sizeof(r), '\0', r.pathlen) != NULL)
+			break;
+		if (fs_journal_note(&r, buf + off + sizeof(r), r.pathlen) < 0)
+			fs_journal_flush();
+		else
+			fs_journal_replayed++;
+	}
+	if (off < (size_t)st.st_size && debug)
+		printf("fs_journal: %s: ignoring %lu bytes at end\n", path,
+		    (unsigned long)(st.st_size - off));
+	free(buf);
+	fs_journal_flush();
+	return 0;
+}
+
+/*
+ * Make the changes in any journal left behind last time aund
+ * stopped.
+ */
+void
+fs_journal_recover(void)
+{
+
+	if (fs_journal_file == NULL)
+		return;
+	if (fs_journal_replay(fs_journal_file) < 0 && errno != ENOENT)
+		err(1, "%s", fs_journal_file);
+	if (debug && fs_journal_replayed > 0)
+		printf("fs_journal: replayed %lu changes\n",
+		    fs_journal_replayed);
+}
+
+/*
+ * Start journalling, if we've been asked to.
+ */
+void
+fs_journal_start(void)
+{
+
+	if (fs_journal_file == NULL)
+		return;
+	if ((fs_journal_fd = open(fs_journal_file,
+	    O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) < 0)
+		err(1, "%s", fs_journal_file);
+	ev_timer_init(&fs_journal_timer, fs_journal_timeout, NULL);
+}
+
+/*
+ * Catch up before exiting.
+ */
+void
+fs_journal_stop(void)
+{
+
+	if (fs_journal_fd < 0)
+		return;
+	fs_journal_flush();
+	close(fs_journal_fd);
+	fs_journal_fd = -1;
+}
+
+void
+fs_journal_stats(void)
+{
+
+	if (fs_journal_fd < 0)
+		return;
+	stats_printf("metadata journal: %lu changes written, %lu applied "
+	    "in %lu batches, %d waiting, %lu replayed at startup",
+	    fs_journal_written, fs_journal_applied, fs_journal_batches,
+	    fs_njents, fs_journal_replayed);
+}
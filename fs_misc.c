@@ -38,6 +38,8 @@
 #include <sys/statvfs.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -84,10 +86,10 @@ fs_get_discs(struct fs_context *c)
 void
 fs_get_info(struct fs_context *c)
 {
-	char *upath, *path_argv[2];
+	char *upath;
 	struct ec_fs_req_get_info *request;
-	FTS *ftsp;
-	FTSENT *f;
+	struct fs_attr attr;
+	int ret;
 
 	if (c->client == NULL) {
 		fs_err(c, EC_FS_E_WHOAREYOU);
@@ -98,21 +100,19 @@ fs_get_info(struct fs_context *c)
 	if (debug) printf("get info [%d, %s]\n", request->arg, request->path);
 	upath = fs_unixify_path(c, request->path); /* This must be freed */
 	if (upath == NULL) return;
-	errno = 0;
-	path_argv[0] = upath;
-	path_argv[1] = NULL;
-	ftsp = fts_open(path_argv, FTS_LOGICAL, NULL);
-	f = fts_read(ftsp);
+	ret = fs_attr_get(upath, &attr,
+	    request->arg == EC_FS_GET_INFO_ALL ||
+	    request->arg == EC_FS_GET_INFO_META ? FS_ATTR_META : 0);
 	switch (request->arg) {
 	case EC_FS_GET_INFO_ACCESS: {
 		struct ec_fs_reply_info_access reply;
 		reply.std_tx.return_code = EC_FS_RC_OK;
 		reply.std_tx.command_code = EC_FS_CC_DONE;
-		if (f->fts_info == FTS_ERR || f->fts_info == FTS_NS) {
+		if (ret < 0) {
 			reply.type = EC_FS_TYPE_NONE;
 		} else {
-			reply.type = fs_mode_to_type(f->fts_statp->st_mode);
-			reply.access = fs_mode_to_access(f->fts_statp->st_mode);
+			reply.type = fs_mode_to_type(attr.ent.mode);
+			reply.access = fs_mode_to_access(attr.ent.mode);
 		}
 		fs_reply(c, &(reply.std_tx), sizeof(reply));
 	}
@@ -122,19 +122,19 @@ fs_get_info(struct fs_context *c)
 		
 		reply.std_tx.return_code = EC_FS_RC_OK;
 		reply.std_tx.command_code = EC_FS_CC_DONE;
-		if (f->fts_info == FTS_ERR || f->fts_info == FTS_NS) {
+		if (ret < 0) {
 			reply.type = EC_FS_TYPE_NONE;
 			memset(&(reply.meta), 0, sizeof(reply.meta));
 			memset(&(reply.size), 0, sizeof(reply.size));
 			memset(&(reply.access), 0, sizeof(reply.access));
 			memset(&(reply.date), 0, sizeof(reply.date));
 		} else {
-			reply.type = fs_mode_to_type(f->fts_statp->st_mode);
-			fs_get_meta(f, &(reply.meta));
-			fs_write_val(reply.size, f->fts_statp->st_size,
+			reply.type = fs_mode_to_type(attr.ent.mode);
+			reply.meta = attr.meta;
+			fs_write_val(reply.size, attr.ent.size,
 			    sizeof(reply.size));
-			reply.access = fs_mode_to_access(f->fts_statp->st_mode);
-			fs_write_date(&(reply.date), fs_get_birthtime(f));
+			reply.access = fs_mode_to_access(attr.ent.mode);
+			fs_write_date(&(reply.date), attr.birth);
 		}
 		fs_reply(c, &(reply.std_tx), sizeof(reply));
 	}
@@ -144,12 +144,12 @@ fs_get_info(struct fs_context *c)
 		
 		reply.std_tx.return_code = EC_FS_RC_OK;
 		reply.std_tx.command_code = EC_FS_CC_DONE;
-		if (f->fts_info == FTS_ERR || f->fts_info == FTS_NS) {
+		if (ret < 0) {
 			reply.type = EC_FS_TYPE_NONE;
 			memset(&(reply.date), 0, sizeof(reply.date));
 		} else {
-			reply.type = fs_mode_to_type(f->fts_statp->st_mode);
-			fs_write_date(&(reply.date), fs_get_birthtime(f));
+			reply.type = fs_mode_to_type(attr.ent.mode);
+			fs_write_date(&(reply.date), attr.birth);
 		}
 		fs_reply(c, &(reply.std_tx), sizeof(reply));
 	}
@@ -159,12 +159,12 @@ fs_get_info(struct fs_context *c)
 		
 		reply.std_tx.return_code = EC_FS_RC_OK;
 		reply.std_tx.command_code = EC_FS_CC_DONE;
-		if (f->fts_info == FTS_ERR || f->fts_info == FTS_NS) {
+		if (ret < 0) {
 			reply.type = EC_FS_TYPE_NONE;
 			memset(&(reply.meta), 0, sizeof(reply.meta));
 		} else {
-			reply.type = fs_mode_to_type(f->fts_statp->st_mode);
-			fs_get_meta(f, &(reply.meta));
+			reply.type = fs_mode_to_type(attr.ent.mode);
+			reply.meta = attr.meta;
 		}
 		fs_reply(c, &(reply.std_tx), sizeof(reply));
 	}
@@ -174,13 +174,13 @@ fs_get_info(struct fs_context *c)
 		
 		reply.std_tx.return_code = EC_FS_RC_OK;
 		reply.std_tx.command_code = EC_FS_CC_DONE;
-		if (f->fts_info == FTS_ERR || f->fts_info == FTS_NS) {
+		if (ret < 0) {
 			reply.type = EC_FS_TYPE_NONE;
 			memset(&(reply.size), 0, sizeof(reply.size));
 		} else {
-			reply.type = fs_mode_to_type(f->fts_statp->st_mode);
+			reply.type = fs_mode_to_type(attr.ent.mode);
 			fs_write_val(reply.size,
-			    f->fts_statp->st_size, sizeof(reply.size));
+			    attr.ent.size, sizeof(reply.size));
 		}
 		fs_reply(c, &(reply.std_tx), sizeof(reply));
 	}
@@ -188,10 +188,11 @@ fs_get_info(struct fs_context *c)
 	case EC_FS_GET_INFO_DIR:
 	{
 		struct ec_fs_reply_info_dir reply;
+		char name[NAME_MAX + 1];
 		
-		if (f->fts_info == FTS_ERR || f->fts_info == FTS_NS) {
+		if (ret < 0) {
 			fs_errno(c);
-			fts_close(ftsp);
+			free(upath);
 			return;
 		}
 		reply.std_tx.return_code = EC_FS_RC_OK;
@@ -199,10 +200,11 @@ fs_get_info(struct fs_context *c)
 		reply.undef0 = 0;
 		reply.zero = 0;
 		reply.ten = 10;
-		fs_acornify_name(f->fts_name);
-		if (f->fts_name[0] == '\0') strcpy(f->fts_name, "$");
-		strncpy(reply.dir_name, f->fts_name, sizeof(reply.dir_name));
-		strpad(reply.dir_name, ' ', sizeof(reply.dir_name));
+		strncpy(name, fs_leafname(upath), sizeof(name) - 1);
+		name[sizeof(name) - 1] = '\0';
+		fs_acornify_name(name);
+		if (name[0] == '\0') strcpy(name, "$");
+		strpadcpy(reply.dir_name, name, ' ', sizeof(reply.dir_name));
 		/* XXX should check ownership. See also cat_header */
 		reply.dir_access = FS_DIR_ACCESS_PUBLIC;
 		reply.cycle = 0; /* XXX should fake */
@@ -215,16 +217,16 @@ fs_get_info(struct fs_context *c)
 
 		reply.std_tx.return_code = EC_FS_RC_OK;
 		reply.std_tx.command_code = EC_FS_CC_DONE;
-		if (f->fts_info == FTS_ERR || f->fts_info == FTS_NS) {
+		if (ret < 0) {
 			reply.type = EC_FS_TYPE_NONE;
 			memset(&(reply.sin), 0, sizeof(reply.sin));
 			memset(&(reply.fsnum), 0, sizeof(reply.fsnum));
 		} else {
-			reply.type = fs_mode_to_type(f->fts_statp->st_mode);
-			fs_write_val(reply.sin, fs_get_sin(f),
+			reply.type = fs_mode_to_type(attr.ent.mode);
+			fs_write_val(reply.sin, attr.sin,
 			    sizeof(reply.sin));
 			reply.disc = 0;
-			fs_write_val(reply.fsnum, f->fts_statp->st_dev,
+			fs_write_val(reply.fsnum, attr.ent.dev,
 			    sizeof(reply.fsnum));
 			fs_reply(c, &(reply.std_tx), sizeof(reply));
 		}
@@ -233,21 +235,19 @@ fs_get_info(struct fs_context *c)
 	default:
 		fs_err(c, EC_FS_E_BADINFO);
 	}
-	fts_close(ftsp);
 	free(upath);
 }
 
 void
 fs_set_info(struct fs_context *c)
 {
-	char *path, *upath, *path_argv[2];
+	char *path, *upath;
 	struct ec_fs_req_set_info *request;
 	struct ec_fs_reply reply;
 	struct ec_fs_meta meta_in, meta_out;
 	uint8_t access;
 	int set_load = 0, set_exec = 0, set_access = 0;
-	FTS *ftsp;
-	FTSENT *f;
+	struct fs_attr attr;
 
 	if (c->client == NULL) {
 		fs_err(c, EC_FS_E_WHOAREYOU);
@@ -314,24 +314,21 @@ fs_set_info(struct fs_context *c)
 
 	upath = fs_unixify_path(c, path); /* This must be freed */
 	if (upath == NULL) return;
-	errno = 0;
-	path_argv[0] = upath;
-	path_argv[1] = NULL;
-	ftsp = fts_open(path_argv, FTS_LOGICAL, NULL);
-	f = fts_read(ftsp);
-	if (f->fts_info == FTS_ERR || f->fts_info == FTS_NS) {
+	/* We only need the old addresses if we're keeping one of them. */
+	if (fs_attr_get(upath, &attr,
+	    set_load != set_exec ? FS_ATTR_META : 0) < 0) {
 		fs_errno(c);
 		goto out;
 	}
 	if (set_load || set_exec) {
-		fs_get_meta(f, &meta_out);
+		meta_out = attr.meta;
 		if (set_load)
 			memcpy(meta_out.load_addr, meta_in.load_addr,
 			       sizeof(meta_in.load_addr));
 		if (set_exec)
 			memcpy(meta_out.exec_addr, meta_in.exec_addr,
 			       sizeof(meta_in.exec_addr));
-		if (!fs_set_meta(f, &meta_out)) {
+		if (!fs_set_meta(&attr.ent, &meta_out)) {
 			fs_errno(c);
 			goto out;
 		}
@@ -342,18 +339,19 @@ fs_set_info(struct fs_context *c)
 	 * directories, and NetFS and the Filer both do some rather
 	 * strange things with them.
 	 */
-	if (set_access && !S_ISDIR(f->fts_statp->st_mode)) {
+	if (set_access && !S_ISDIR(attr.ent.mode)) {
 		/* XXX Should chose usergroup sensibly */
-		if (chmod(f->fts_accpath, fs_access_to_mode(access, 0)) != 0) {
+		if (chmod(upath, fs_access_to_mode(access, 0)) != 0) {
 			fs_errno(c);
 			goto out;
 		}
+		fs_dirsnap_changed(upath);
+		fs_attr_changed(upath);
 	}
 	reply.return_code = EC_FS_RC_OK;
 	reply.command_code = EC_FS_CC_DONE;
 	fs_reply(c, &reply, sizeof(reply));
 out:
-	fts_close(ftsp);
 	free(upath);
 }
 
@@ -400,23 +398,17 @@ fs_cat_header(struct fs_context *c)
 {
 	struct ec_fs_req_cat_header *request;
 	struct ec_fs_reply_cat_header reply;
-	char *upath, *path_argv[2];
-	FTS *ftsp;
-	FTSENT *f;
+	struct fs_ent ent;
+	char *upath, name[NAME_MAX + 1];
 
 	request = (struct ec_fs_req_cat_header *)c->req;
 	request->path[strcspn(request->path, "\r")] = '\0';
 	if (debug) printf("catalogue header [%s]\n", request->path);
 	upath = fs_unixify_path(c, request->path); /* This must be freed */
 	if (upath == NULL) return;
-	errno = 0;
-	path_argv[0] = upath;
-	path_argv[1] = NULL;
-	ftsp = fts_open(path_argv, FTS_LOGICAL, NULL);
-	f = fts_read(ftsp);
-	if (f->fts_info == FTS_ERR || f->fts_info == FTS_NS) {
+	if (fs_ent_stat(upath, &ent) < 0) {
 		fs_errno(c);
-		fts_close(ftsp);
+		free(upath);
 		return;
 	}
 
@@ -426,10 +418,10 @@ fs_cat_header(struct fs_context *c)
 	strncpy(reply.csd_discname, discname, sizeof(reply.csd_discname));
 	strpad(reply.csd_discname, '\0', sizeof(reply.csd_discname));
 
-	fs_acornify_name(f->fts_name);
-	if (f->fts_name[0] == '\0') strcpy(f->fts_name, "$");
-	strncpy(reply.dir_name, f->fts_name, sizeof(reply.dir_name));
-	strpad(reply.dir_name, ' ', sizeof(reply.dir_name));
+	snprintf(name, sizeof(name), "%s", ent.name);
+	fs_acornify_name(name);
+	if (name[0] == '\0') strcpy(name, "$");
+	strpadcpy(reply.dir_name, name, ' ', sizeof(reply.dir_name));
 
 	/* XXX should check ownership. See also EC_FS_GET_INFO_DIR */
 	reply.ownership[0] = 'P';
@@ -439,7 +431,6 @@ fs_cat_header(struct fs_context *c)
 	memcpy(reply.cr80, "\r\x80", sizeof(reply.cr80));
 	fs_reply(c, &(reply.std_tx), sizeof(reply));
 
-	fts_close(ftsp);
 	free(upath);
 }
 
@@ -557,37 +548,38 @@ fs_delete(struct fs_context *c)
 void
 fs_delete1(struct fs_context *c, char *path)
 {
-	char *upath, *acornpath, *path_argv[2];
-	FTS *ftsp;
-	FTSENT *f;
+	char *upath;
+	const char *rel;
+	struct fs_attr attr;
+	int at, ret;
 
 	if (c->client == NULL) {
 		fs_err(c, EC_FS_E_WHOAREYOU);
 		return;
 	}
 	if ((upath = fs_unixify_path(c, path)) == NULL) return;
-	acornpath = malloc(10 + strlen(upath));
-	if (acornpath == NULL) {
-		free(upath);
-		fs_err(c, EC_FS_E_NOMEM);
-		return;
-	}
-	sprintf(acornpath, "%s/.Acorn", upath);
-	path_argv[0] = upath;
-	path_argv[1] = NULL;
-	ftsp = fts_open(path_argv, FTS_LOGICAL, NULL);
-	f = fts_read(ftsp);
-	if (f->fts_info == FTS_ERR || f->fts_info == FTS_NS) {
+	at = fs_path_at(c->client, upath, &rel);
+	if (fs_attr_get(upath, &attr,
+	    c->req->function == EC_FS_FUNC_DELETE ? FS_ATTR_META : 0) < 0) {
 		fs_errno(c);
 		goto out;
-	} else if (S_ISDIR(f->fts_statp->st_mode)) {
-		rmdir(acornpath);
-		if (rmdir(upath) < 0) {
+	} else if (S_ISDIR(attr.ent.mode)) {
+		fs_journal_flush();
+		/*
+		 * If all that's left is the metadata the backend kept
+		 * for what was there, that can go too.
+		 */
+		ret = unlinkat(at, rel, AT_REMOVEDIR);
+		if (ret < 0 && (errno == ENOTEMPTY || errno == EEXIST)) {
+			metafuncs->deldir(at, rel, 0);
+			ret = unlinkat(at, rel, AT_REMOVEDIR);
+		}
+		if (ret < 0) {
 			fs_errno(c);
 			goto out;
 		}
 	} else {
-		if (unlink(upath) < 0) {
+		if (unlinkat(at, rel, 0) < 0) {
 			fs_errno(c);
 			goto out;
 		}
@@ -600,9 +592,9 @@ fs_delete1(struct fs_context *c, char *path)
 		 * the metadata and size of something we've just
 		 * deleted, but there we go.
 		 */
-		fs_write_val(reply.size, f->fts_statp->st_size,
+		fs_write_val(reply.size, attr.ent.size,
 		    sizeof(reply.size));
-		fs_get_meta(f, &(reply.meta));
+		reply.meta = attr.meta;
 		reply.std_tx.command_code = EC_FS_CC_DONE;
 		reply.std_tx.return_code = EC_FS_RC_OK;
 		fs_reply(c, &(reply.std_tx), sizeof(reply));
@@ -613,10 +605,8 @@ fs_delete1(struct fs_context *c, char *path)
 		reply.return_code = EC_FS_RC_OK;
 		fs_reply(c, &reply, sizeof(reply));
 	}
-	fs_del_meta(f);
+	fs_del_meta(&attr.ent);
 out:
-	fts_close(ftsp);
-	free(acornpath);
 	free(upath);
 }
 
@@ -639,7 +629,9 @@ void
 fs_cdir1(struct fs_context *c, char *path)
 {
 	struct ec_fs_reply reply;
+	const char *rel;
 	char *upath;
+	int at;
 
 	if (c->client == NULL) {
 		fs_err(c, EC_FS_E_WHOAREYOU);
@@ -647,7 +639,8 @@ fs_cdir1(struct fs_context *c, char *path)
 	}
 	upath = fs_unixify_path(c, path);
 	if (upath == NULL) return;
-	if (mkdir(upath, 0777) < 0) {
+	at = fs_path_at(c->client, upath, &rel);
+	if (mkdirat(at, rel, 0777) < 0) {
 		fs_errno(c);
 	} else {
 		reply.command_code = EC_FS_CC_DONE;
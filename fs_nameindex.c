@@ -0,0 +1,360 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * fs_nameindex.c - case-insensitive index of directory contents
+ *
+ * When a client names a file that doesn't exist under exactly that
+ * name, fs_match_path() has to look for one that matches it
+ * ignoring case, or with a ",xxx" type suffix, or as a wildcard.
+ * Rather than reading the whole directory each time, we keep an
+ * index of recently searched directories: their entries in
+ * directory order, with the names that clients can match hashed by
+ * their upper-case form.  Lookups that find nothing are answered
+ * from the index too, so probing a series of directories for a
+ * command doesn't read them all every time.
+ *
+ * Indexes are identified by the directory's device and inode, so a
+ * directory reached by different paths, or moved, keeps its index.
+ * An index is only trusted while the directory's mtime and ctime
+ * are unchanged.  Timestamps move in clock ticks, so a
+ * directory that changed just before it was indexed could change
+ * again without them moving.  Such an index is only used for the
+ * lookup that built it.
+ *
+ * In directories where the file system itself ignores case (ext4's
+ * casefold attribute), the lstat() in fs_match_path() will already
+ * have found any name that differs only in case, so only names with
+ * a type suffix are hashed.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#if HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "fileserver.h"
+
+#define FS_NAMEINDEX_DIRS	64	/* Directories to remember */
+
+struct fs_nameent {
+	size_t name;		/* Offset of name in names */
+	int keylen;		/* Length clients match, or -1 if hidden */
+	uint32_t hash;
+	int next;		/* Next entry in hash chain, or -1 */
+};
+
+struct fs_nameindex {
+	TAILQ_ENTRY(fs_nameindex) link;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime, ctime;
+	int racy;
+	int casefold;
+	struct fs_nameent *ents;
+	int nents;
+	char *names;
+	int *buckets;
+	uint32_t nbuckets;	/* Power of two */
+};
+
+/* Most recently used first. */
+TAILQ_HEAD(fs_nameindex_head, fs_nameindex);
+static struct fs_nameindex_head fs_nameindexes =
+    TAILQ_HEAD_INITIALIZER(fs_nameindexes);
+static int fs_nnameindexes;
+
+static unsigned long fs_nameindex_lookups, fs_nameindex_reads;
+static unsigned long fs_nameindex_notfound;
+
+/*
+ * How much of a directory entry's name clients can match, or -1 if
+ * they can't see it at all.  This follows what fs_match_path() has
+ * always done: names starting with a dot are hidden unless they're
+ * dot-stuffed, a ",xxx" suffix is ignored, and anything longer than
+ * ten characters can't be matched.
+ */
+static int
+fs_nameindex_keylen(const char *name)
+{
+	int len = strlen(name);
+
+	if (name[0] == '.' && (len < 3 || name[1] != '.' || name[2] != '.'))
+		return -1;
+	if (len >= 4 && name[len - 4] == ',')
+		len -= 4;
+	return len <= 10 ? len : -1;
+}
+
+static uint32_t
+fs_nameindex_hash(const char *name, int len)
+{
+	uint32_t h = 2166136261U;
+
+	while (len-- > 0)
+		h = (h ^ (uint8_t)toupper((unsigned char)*name++)) *
+		    16777619U;
+	return h;
+}
+
+static void
+fs_nameindex_free(struct fs_nameindex *ni)
+{
+
+	TAILQ_REMOVE(&fs_nameindexes, ni, link);
+	fs_nnameindexes--;
+	free(ni->ents);
+	free(ni->names);
+	free(ni->buckets);
+	free(ni);
+}
+
+/*
+ * Read a directory into a new index.
+ */
+static struct fs_nameindex *
+fs_nameindex_read(int at, const char *dir, struct stat *st)
+{
+	struct fs_nameindex *ni;
+	struct fs_nameent *e;
+	struct dirent *dp;
+	DIR *d;
+	size_t namelen, namesize, namecap;
+	int fd, i, entcap, suffixed;
+	uint32_t b;
+#if defined(FS_IOC_GETFLAGS) && defined(FS_CASEFOLD_FL)
+	int flags;
+#endif
+
+	if ((fd = openat(at, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return NULL;
+	if ((d = fdopendir(fd)) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	if ((ni = calloc(1, sizeof(*ni))) == NULL)
+		goto fail;
+	ni->dev = st->st_dev;
+	ni->ino = st->st_ino;
+	fs_stat_times(st, &ni->mtime, &ni->ctime);
+	ni->racy = time(NULL) - (ni->mtime.tv_sec > ni->ctime.tv_sec ?
+	    ni->mtime.tv_sec : ni->ctime.tv_sec) <= FS_STAT_RACY;
+#if defined(FS_IOC_GETFLAGS) && defined(FS_CASEFOLD_FL)
+	if (ioctl(fd, FS_IOC_GETFLAGS, &flags) == 0 &&
+	    (flags & FS_CASEFOLD_FL))
+		ni->casefold = 1;
+#endif
+	entcap = 0;
+	namesize = namecap = 0;
+	while ((dp = readdir(d)) != NULL) {
+		namelen = strlen(dp->d_name) + 1;
+		if (ni->nents == entcap) {
+			entcap = entcap ? entcap * 2 : 64;
+			e = realloc(ni->ents, entcap * sizeof(*e));
+			if (e == NULL)
+				goto fail;
+			ni->ents = e;
+		}
+		if (namesize + namelen > namecap) {
+			char *names;
+
+			namecap = namecap ? namecap * 2 : 1024;
+			if (namecap < namesize + namelen)
+				namecap = namesize + namelen;
+			if ((names = realloc(ni->names, namecap)) == NULL)
+				goto fail;
+			ni->names = names;
+		}
+		e = &ni->ents[ni->nents++];
+		e->name = namesize;
+		memcpy(ni->names + namesize, dp->d_name, namelen);
+		namesize += namelen;
+		e->keylen = fs_nameindex_keylen(dp->d_name);
+		e->next = -1;
+	}
+	closedir(d);
+	d = NULL;
+
+	/*
+	 * Chain the entries in reverse, so that each chain is in
+	 * directory order and lookups find what a scan would have
+	 * found first.
+	 */
+	for (ni->nbuckets = 16; ni->nbuckets < 2 * ni->nents;
+	     ni->nbuckets *= 2)
+		continue;
+	if ((ni->buckets = malloc(ni->nbuckets * sizeof(int))) == NULL)
+		goto fail;
+	memset(ni->buckets, 0xff, ni->nbuckets * sizeof(int));
+	for (i = ni->nents - 1; i >= 0; i--) {
+		e = &ni->ents[i];
+		if (e->keylen < 0)
+			continue;
+		suffixed = strlen(ni->names + e->name) != e->keylen;
+		if (ni->casefold && !suffixed)
+			continue;
+		e->hash = fs_nameindex_hash(ni->names + e->name, e->keylen);
+		b = e->hash & (ni->nbuckets - 1);
+		e->next = ni->buckets[b];
+		ni->buckets[b] = i;
+	}
+	fs_nameindex_reads++;
+	if (debug)
+		printf("fs_nameindex: read %s, %d entries%s%s\n", dir,
+		    ni->nents, ni->casefold ? ", casefold" : "",
+		    ni->racy ? ", recently changed" : "");
+	TAILQ_INSERT_HEAD(&fs_nameindexes, ni, link);
+	if (++fs_nnameindexes > FS_NAMEINDEX_DIRS)
+		fs_nameindex_free(TAILQ_LAST(&fs_nameindexes,
+		    fs_nameindex_head));
+	return ni;
+fail:
+	if (d != NULL)
+		closedir(d);
+	if (ni != NULL) {
+		free(ni->ents);
+		free(ni->names);
+		free(ni->buckets);
+		free(ni);
+	}
+	return NULL;
+}
+
+/*
+ * Find the index for a directory, reading it again if it's changed.
+ */
+static struct fs_nameindex *
+fs_nameindex_get(int at, const char *dir)
+{
+	struct fs_nameindex *ni;
+	struct timespec mtime, ctime;
+	struct stat st;
+
+	if (fstatat(at, dir, &st, 0) < 0)
+		return NULL;
+	TAILQ_FOREACH(ni, &fs_nameindexes, link)
+		if (ni->dev == st.st_dev && ni->ino == st.st_ino)
+			break;
+	if (ni != NULL) {
+		fs_stat_times(&st, &mtime, &ctime);
+		if (!ni->racy &&
+		    ni->mtime.tv_sec == mtime.tv_sec &&
+		    ni->mtime.tv_nsec == mtime.tv_nsec &&
+		    ni->ctime.tv_sec == ctime.tv_sec &&
+		    ni->ctime.tv_nsec == ctime.tv_nsec) {
+			if (ni != TAILQ_FIRST(&fs_nameindexes)) {
+				TAILQ_REMOVE(&fs_nameindexes, ni, link);
+				TAILQ_INSERT_HEAD(&fs_nameindexes, ni, link);
+			}
+			return ni;
+		}
+		fs_nameindex_free(ni);
+	}
+	return fs_nameindex_read(at, dir, &st);
+}
+
+/*
+ * Find the first entry in directory 'dir' (relative to 'at') that
+ * a client could mean by 'leaf', which may be a wildcard.  The name
+ * returned is only valid until the next call.
+ */
+const char *
+fs_nameindex_find(int at, const char *dir, const char *leaf)
+{
+	struct fs_nameindex *ni;
+	struct fs_nameent *e;
+	struct fs_wildcard *w;
+	const char *found = NULL;
+	uint32_t h;
+	int i, len;
+
+	if ((ni = fs_nameindex_get(at, dir)) == NULL)
+		return NULL;
+	fs_nameindex_lookups++;
+	if (fs_wild_is_wild(leaf)) {
+		if ((w = fs_wild_compile(leaf)) == NULL)
+			return NULL;
+		for (i = 0; i < ni->nents; i++) {
+			e = &ni->ents[i];
+			if (e->keylen >= 0 &&
+			    fs_wild_match(w, ni->names + e->name, e->keylen)) {
+				found = ni->names + e->name;
+				break;
+			}
+		}
+		fs_wild_free(w);
+	} else {
+		len = strlen(leaf);
+		h = fs_nameindex_hash(leaf, len);
+		for (i = ni->buckets[h & (ni->nbuckets - 1)]; i >= 0;
+		     i = e->next) {
+			e = &ni->ents[i];
+			if (e->hash == h && e->keylen == len &&
+			    strncasecmp(ni->names + e->name, leaf, len) == 0) {
+				found = ni->names + e->name;
+				break;
+			}
+		}
+	}
+	if (found == NULL)
+		fs_nameindex_notfound++;
+	return found;
+}
+
+void
+fs_nameindex_stats(void)
+{
+
+	stats_printf("name index: %d directories, %lu lookups, "
+	    "%lu directory reads, %lu not found",
+	    fs_nnameindexes, fs_nameindex_lookups, fs_nameindex_reads,
+	    fs_nameindex_notfound);
+}
@@ -37,11 +37,9 @@
 #include <sys/types.h>
 
 #include <assert.h>
-#include <ctype.h>
-#include <dirent.h>
 #include <err.h>
 #include <errno.h>
-#include <libgen.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -50,7 +48,6 @@
 #include "fs_errors.h"
 
 static char *fs_unhat_path(char *);
-static void fs_match_path(char *);
 static void fs_trans_simple(char *, char *);
 
 /*
@@ -122,18 +119,21 @@ fs_hidden_name(char *name)
 char *
 fs_unixify_path(struct fs_context *c, char *path)
 {
-	const char *base;
-	int nnames;
-	char *urd = NULL, *csd = NULL, *lib = NULL;
-	size_t disclen;
+	static struct fs_handle root = {
+		.path = ".", .type = FS_HANDLE_DIR, .fd = AT_FDCWD
+	};
+	struct fs_handle *base;
+	struct fs_handle *urd = NULL, *csd = NULL, *lib = NULL;
+	int nnames, at;
+	size_t disclen, baselen;
 	char *path2;
 	char *path3;
-	char *p, *q;
+	char *p, *q, *rel;
 
 	switch (c->req->function) {
 	default:
 		urd = c->req->urd ?
-		    c->client->handles[c->req->urd]->path : NULL;
+		    c->client->handles[c->req->urd] : NULL;
 		/* FALLTHROUGH */
 	case EC_FS_FUNC_LOAD:
 	case EC_FS_FUNC_LOAD_COMMAND:
@@ -142,26 +142,15 @@ fs_unixify_path(struct fs_context *c, char *path)
 	case EC_FS_FUNC_PUTBYTES:
 		/* In these calls, the URD is replaced by a port number */
 		csd = c->req->csd ?
-		    c->client->handles[c->req->csd]->path : NULL;
+		    c->client->handles[c->req->csd] : NULL;
 		lib = c->req->lib ?
-		    c->client->handles[c->req->lib]->path : NULL;
+		    c->client->handles[c->req->lib] : NULL;
 		/* FALLTHROUGH */
 	case EC_FS_FUNC_GETBYTE:
 	case EC_FS_FUNC_PUTBYTE:
 		/* And these ones don't pass context at all. */
 		break;
 	}
-	/*
-	 * Plenty of space.
-	 */
-	path2 = malloc((urd ? strlen(urd) : 0) + (csd ? strlen(csd) : 0) +
-		       (lib ? strlen(lib) : 0) +
-		       2 * strlen(path) + 100);
-	if (path == NULL) {
-		fs_err(c, EC_FS_E_NOMEM);
-		return NULL;
-	}
-
 	if (debug) printf("fs_unixify_path: [%s]", path);
 
 	/* By default, resolve things from the CSD. */
@@ -182,7 +171,7 @@ fs_unixify_path(struct fs_context *c, char *path)
 		}
 		path += disclen;
 		if (*path) path++;
-		base = ".";
+		base = &root;
 	}
 	/*
 	 * Decide what base path this pathname is relative to, by
@@ -194,7 +183,7 @@ fs_unixify_path(struct fs_context *c, char *path)
 		switch (path[0]) {
 		case '$':
 		case ':': /* SJ alias */
-			base = "."; break;
+			base = &root; break;
 		case '&':
 			base = urd; break;
 		case '@':
@@ -206,11 +195,30 @@ fs_unixify_path(struct fs_context *c, char *path)
 		if (*path) path++;
 	}
 	if (base == NULL) {
-		free(path2);
 		fs_err(c, EC_FS_E_CHANNEL);
 		return NULL;
 	}
-	sprintf(path2, "%s/", base);
+
+	/*
+	 * We may well have been asked this before, though the base
+	 * directory may have moved since.
+	 */
+	fs_pathcache_update();
+	fs_handle_check_path(base);
+	if ((path3 = fs_pathcache_lookup(base->path, path)) != NULL) {
+		if (debug) printf("->[%s] (cached)\n", path3);
+		return path3;
+	}
+
+	/*
+	 * Plenty of space.
+	 */
+	path2 = malloc(strlen(base->path) + 2 * strlen(path) + 100);
+	if (path2 == NULL) {
+		fs_err(c, EC_FS_E_NOMEM);
+		return NULL;
+	}
+	sprintf(path2, "%s/", base->path);
 
 	/*
 	 * Append the supplied pathname to that prefix, performing
@@ -235,19 +243,50 @@ fs_unixify_path(struct fs_context *c, char *path)
 		strcpy(path2, ".");
 
 	/*
-	 * Process every path component through fs_match_path.
+	 * If we're still under the base directory, its path is
+	 * already right, and the rest can be looked up from its
+	 * descriptor.  Otherwise, start from the root.
+	 */
+	baselen = strlen(base->path);
+	if (base->type == FS_HANDLE_DIR && base->fd != -1 &&
+	    strncmp(path2, base->path, baselen) == 0 &&
+	    (path2[baselen] == '/' || path2[baselen] == '\0'))
+		at = base->fd;
+	else {
+		at = AT_FDCWD;
+		baselen = 0;
+	}
+
+	/*
+	 * Process every other path component through fs_match_path.
 	 */
 	for (p = path2, nnames = 1; *p; p++)
 		if (*p == '/')
 			nnames++;
-	path3 = malloc(20 * nnames + 10);
-	p = path2;
-	q = path3;
+	path3 = malloc(baselen + 20 * nnames + 10);
+	if (path3 == NULL) {
+		free(path2);
+		fs_err(c, EC_FS_E_NOMEM);
+		return NULL;
+	}
+	memcpy(path3, path2, baselen);
+	p = path2 + baselen;
+	q = path3 + baselen;
+	if (*p == '/')
+		*q++ = *p++;
+	rel = q;
 	while (*p) {
 		char *r = p;
 		while (*p && *p != '/') p++;
+		if (q == path3)
+			fs_pathcache_watch(".");
+		else {
+			q[-1] = '\0';
+			fs_pathcache_watch(path3);
+			q[-1] = '/';
+		}
 		sprintf(q, "%.*s", (int)(p-r), r);
-		fs_match_path(path3);
+		fs_match_path(at, rel);
 		q += strlen(q);
 		if (*p) {
 			p++;
@@ -259,6 +298,7 @@ fs_unixify_path(struct fs_context *c, char *path)
 
 	free(path2);
 	path3 = realloc(path3, 1 + strlen(path3));
+	fs_pathcache_add(base->path, path, path3);
 
 	return path3;
 }
@@ -306,79 +346,20 @@ fs_unhat_path(char *path)
 }
 
 /*
- * Case-insensitively match a file name against a potential
- * wildcard.
- */
-static int
-wcfrag(char *frag, char *file)
-{
-	while (*frag && *frag != '*') {
-		if (*frag != '?' && (toupper((unsigned char)*file) !=
-				     toupper((unsigned char)*frag)))
-			return 0;
-		frag++;
-		file++;
-	}
-	return 1;
-}
-
-static int
-wcmatch(char *wc, char *file, int len)
-{
-	char *fragend;
-	char *filestart = file;
-	int at_start = 1;
-
-	while (*wc) {
-		for (fragend = wc; *fragend && *fragend != '*'; fragend++);
-		if (*fragend) {
-			/*
-			 * This fragment isn't the end of the
-			 * wildcard, so we match it at the first
-			 * place we can.
-			 */
-			while (len >= fragend - wc &&
-			       ((at_start && file!=filestart) ||
-				!wcfrag(wc, file)))
-				file++, len--;
-			if (len < fragend - wc)
-				return 0;
-			file += fragend - wc;
-			len -= fragend - wc;
-			wc = fragend;
-		} else {
-			/*
-			 * This fragment is at the end, so we must
-			 * match it at precisely the end or fail.
-			 */
-			if (len < fragend - wc)
-				return 0;
-			file += len - (fragend - wc);
-			return ((!at_start || file==filestart) &&
-				wcfrag(wc, file));
-		}
-		while (*wc == '*') wc++;
-		at_start = 0;
-	}
-	return 1;
-}
-
-/*
- * Find the real file that matches the name in 'path'. This may
- * involve:
+ * Find the real file that matches the name in 'path', which is
+ * relative to 'dirfd' (as for openat()).  This may involve:
  *
  *  - truncating to 10 characters
- *  - case-insensitively matching
+ *  - case-insensitively matching, using the directory's name index
  *  - wildcard matching (we just return the first match)
  *  - appending ,??? for a RISC OS file type
  */
-static void
-fs_match_path(char *path)
+void
+fs_match_path(int dirfd, char *path)
 {
 	struct stat st;
-	char *pathcopy, *parentpath, *leaf, *wc;
-	DIR *parent;
-	struct dirent *dp;
+	const char *match;
+	char *leaf;
 	size_t leaflen;
 
 	leaf = strrchr(path, '/');
@@ -392,37 +373,17 @@ fs_match_path(char *path)
 		leaf[leaflen] = '\0';
 	}
 
-	if (lstat(path, &st) == -1 && errno == ENOENT) {
-		pathcopy = strdup(path);
-		parentpath = dirname(pathcopy);
-		parent = opendir(parentpath);
-		if (parent == NULL) {
-			free(pathcopy);
-			return;
-		}
-		wc = leaf;
-		if (wc[0] == '.' && wc[1] == '.' && wc[2] == '.')
-			wc += 2;       /* un-dot-stuff wildcard */
-		while ((dp = readdir(parent)) != NULL) {
-			char *name = dp->d_name;
-			int namelen = strlen(dp->d_name);
-			if (name[0] == '.') {
-				if (namelen >= 3 &&
-				    name[1] == '.' && name[2] == '.') {
-					name += 2;   /* un-dot-stuff */
-				} else
-					continue;    /* hidden file */
-			}
-			if (namelen >= 4 && dp->d_name[namelen-4] == ',')
-				namelen -= 4;
-			if (namelen <= 10 &&
-			    wcmatch(leaf, dp->d_name, namelen)) {
-				strcpy(leaf, dp->d_name);
-				break;
-                	}
+	if (fstatat(dirfd, path, &st, AT_SYMLINK_NOFOLLOW) == -1 &&
+	    errno == ENOENT) {
+		if (leaf == path)
+			match = fs_nameindex_find(dirfd, ".", leaf);
+		else {
+			leaf[-1] = '\0';
+			match = fs_nameindex_find(dirfd, path, leaf);
+			leaf[-1] = '/';
 		}
-		closedir(parent);
-		free(pathcopy);
+		if (match != NULL)
+			strcpy(leaf, match);
 	}
 }
 
@@ -0,0 +1,526 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * fs_pathcache.c - remembering how client paths were resolved
+ *
+ * Clients ask about the same paths over and over (the RISC OS Filer
+ * reads the information for every file in a window each time it
+ * redraws), and resolving each one means looking at every directory
+ * along the way.  So fs_unixify_path() remembers the last
+ * FS_PATHCACHE_SIZE answers, keyed by the directory the path was
+ * relative to and the path itself.  A change of CSD, URD or library
+ * changes the key, so stale handles can't be a problem.
+ *
+ * What can make an answer wrong is a change to one of the
+ * directories it depends on: the ones whose contents
+ * fs_match_path() looked at.  Those are watched with inotify, each
+ * watched directory has a generation number that goes up whenever
+ * anything in it is created, deleted or renamed, and each answer
+ * records the generations it saw.  The watch is set up before the
+ * directory is first looked at, so no change can be missed, and
+ * checking an answer costs one read() of the inotify descriptor,
+ * which usually has nothing to say.
+ *
+ * Directory handles use the same watches to notice when the
+ * directory they refer to, or any directory above it, is moved, so
+ * that their paths can be kept up to date (see fs_handle.c).  For
+ * that, each directory has a second generation number that only
+ * goes up when it moves or goes away.
+ *
+ * Without inotify, nothing is cached.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#if HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "fileserver.h"
+
+#if HAVE_SYS_INOTIFY_H
+
+#define FS_PATHCACHE_SIZE	1024	/* Answers to remember */
+#define FS_PATHCACHE_BUCKETS	2048
+#define FS_PATHCACHE_DIRS	256	/* Buckets for watched directories */
+#define FS_PATHCACHE_DEPTH	64	/* Most directories an answer needs */
+#define FS_PATHCACHE_EVENTS	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+				 IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | \
+				 IN_ONLYDIR)
+
+struct fs_pathdir {
+	LIST_ENTRY(fs_pathdir) link;
+	int wd;			/* -1 once the watch has gone */
+	int refs;		/* Answers and pins depending on this */
+	unsigned long gen;
+	unsigned long movegen;
+};
+
+struct fs_pathdep {
+	struct fs_pathdir *dir;
+	unsigned long gen;
+};
+
+struct fs_pathent {
+	TAILQ_ENTRY(fs_pathent) lru;
+	LIST_ENTRY(fs_pathent) link;
+	uint32_t hash;
+	size_t keylen;
+	char *key;		/* Base, NUL, path */
+	char *result;
+	int ndeps;
+	struct fs_pathdep deps[];
+};
+
+struct fs_pathpin {
+	int ndeps;
+	struct fs_pathdep deps[];	/* Generations are movegens */
+};
+
+LIST_HEAD(fs_pathdir_list, fs_pathdir);
+LIST_HEAD(fs_pathent_list, fs_pathent);
+TAILQ_HEAD(fs_pathent_lru, fs_pathent);
+
+static int fs_pathcache_fd = -1;
+static int fs_pathcache_broken;
+static struct fs_pathdir_list fs_pathdirs[FS_PATHCACHE_DIRS];
+static struct fs_pathent_list fs_pathents[FS_PATHCACHE_BUCKETS];
+static struct fs_pathent_lru fs_pathlru = TAILQ_HEAD_INITIALIZER(fs_pathlru);
+static int fs_npathents;
+
+/* Directories looked at during the resolution in progress. */
+static struct fs_pathdep fs_pending[FS_PATHCACHE_DEPTH];
+static int fs_npending;
+static int fs_pending_ok;
+
+static unsigned long fs_pathcache_hits, fs_pathcache_misses;
+static unsigned long fs_pathcache_stale;
+
+static int
+fs_pathcache_init(void)
+{
+
+	if (fs_pathcache_fd >= 0)
+		return 1;
+	if (fs_pathcache_broken)
+		return 0;
+	fs_pathcache_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fs_pathcache_fd < 0) {
+		if (debug)
+			printf("fs_pathcache: inotify_init1: %s\n",
+			    strerror(errno));
+		fs_pathcache_broken = 1;
+		return 0;
+	}
+	return 1;
+}
+
+static struct fs_pathdir *
+fs_pathdir_find(int wd)
+{
+	struct fs_pathdir *d;
+
+	LIST_FOREACH(d, &fs_pathdirs[wd % FS_PATHCACHE_DIRS], link)
+		if (d->wd == wd)
+			return d;
+	return NULL;
+}
+
+/*
+ * Watch a directory, and take a reference to it.
+ */
+static struct fs_pathdir *
+fs_pathdir_get(const char *dir)
+{
+	struct fs_pathdir *d;
+	int wd;
+
+	wd = inotify_add_watch(fs_pathcache_fd, dir, FS_PATHCACHE_EVENTS);
+	if (wd < 0)
+		return NULL;
+	if ((d = fs_pathdir_find(wd)) == NULL) {
+		if ((d = calloc(1, sizeof(*d))) == NULL) {
+			inotify_rm_watch(fs_pathcache_fd, wd);
+			errno = ENOMEM;
+			return NULL;
+		}
+		d->wd = wd;
+		LIST_INSERT_HEAD(&fs_pathdirs[wd % FS_PATHCACHE_DIRS], d, link);
+	}
+	d->refs++;
+	return d;
+}
+
+static void
+fs_pathdir_release(struct fs_pathdir *d)
+{
+
+	if (--d->refs > 0)
+		return;
+	if (d->wd >= 0) {
+		inotify_rm_watch(fs_pathcache_fd, d->wd);
+		LIST_REMOVE(d, link);
+	}
+	free(d);
+}
+
+static void
+fs_pathent_free(struct fs_pathent *e)
+{
+	int i;
+
+	TAILQ_REMOVE(&fs_pathlru, e, lru);
+	LIST_REMOVE(e, link);
+	fs_npathents--;
+	for (i = 0; i < e->ndeps; i++)
+		fs_pathdir_release(e->deps[i].dir);
+	free(e);
+}
+
+/*
+ * Deal with whatever inotify has to say.  If it lost track, so must
+ * we, and every pin will look as if it's moved.
+ */
+void
+fs_pathcache_update(void)
+{
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	struct inotify_event *ev;
+	struct fs_pathdir *d;
+	ssize_t n;
+	char *p;
+	int i;
+
+	if (fs_pathcache_fd < 0)
+		return;
+	while ((n = read(fs_pathcache_fd, u.buf, sizeof(u.buf))) > 0) {
+		for (p = u.buf; p < u.buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				while (!TAILQ_EMPTY(&fs_pathlru))
+					fs_pathent_free(
+					    TAILQ_FIRST(&fs_pathlru));
+				for (i = 0; i < FS_PATHCACHE_DIRS; i++)
+					LIST_FOREACH(d, &fs_pathdirs[i], link)
+						d->movegen++;
+				continue;
+			}
+			if ((d = fs_pathdir_find(ev->wd)) == NULL)
+				continue;
+			d->gen++;
+			if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF |
+			    IN_IGNORED))
+				d->movegen++;
+			if (ev->mask & IN_IGNORED) {
+				LIST_REMOVE(d, link);
+				d->wd = -1;
+			}
+		}
+	}
+}
+
+static uint32_t
+fs_pathcache_hash(const char *base, const char *path)
+{
+	uint32_t h = 2166136261U;
+
+	do
+		h = (h ^ (uint8_t)*base) * 16777619U;
+	while (*base++ != '\0');
+	while (*path != '\0')
+		h = (h ^ (uint8_t)*path++) * 16777619U;
+	return h;
+}
+
+/*
+ * Look for an earlier resolution of 'path' relative to 'base'.
+ * Returns a freshly mallocked copy of the answer, or NULL if it has
+ * to be worked out again, in which case the caller should tell us
+ * about every directory it looks in, and then the answer.  The
+ * caller should have called fs_pathcache_update() first.
+ */
+char *
+fs_pathcache_lookup(const char *base, const char *path)
+{
+	struct fs_pathent *e;
+	size_t baselen, keylen;
+	uint32_t h;
+	char *result;
+	int i;
+
+	for (i = 0; i < fs_npending; i++)
+		fs_pathdir_release(fs_pending[i].dir);
+	fs_npending = 0;
+	fs_pending_ok = 0;
+	if (!fs_pathcache_init())
+		return NULL;
+	baselen = strlen(base);
+	keylen = baselen + 1 + strlen(path);
+	h = fs_pathcache_hash(base, path);
+	LIST_FOREACH(e, &fs_pathents[h % FS_PATHCACHE_BUCKETS], link)
+		if (e->hash == h && e->keylen == keylen &&
+		    strcmp(e->key, base) == 0 &&
+		    strcmp(e->key + baselen + 1, path) == 0)
+			break;
+	if (e != NULL) {
+		for (i = 0; i < e->ndeps; i++)
+			if (e->deps[i].dir->gen != e->deps[i].gen)
+				break;
+		if (i == e->ndeps) {
+			if ((result = strdup(e->result)) == NULL)
+				return NULL;
+			TAILQ_REMOVE(&fs_pathlru, e, lru);
+			TAILQ_INSERT_HEAD(&fs_pathlru, e, lru);
+			fs_pathcache_hits++;
+			return result;
+		}
+		fs_pathcache_stale++;
+		fs_pathent_free(e);
+	}
+	fs_pathcache_misses++;
+	fs_pending_ok = 1;
+	return NULL;
+}
+
+/*
+ * The resolution in progress is about to look in directory 'dir'.
+ * If that doesn't exist, or isn't a directory, the directory above
+ * it will see it if it appears.
+ */
+void
+fs_pathcache_watch(const char *dir)
+{
+	struct fs_pathdir *d;
+
+	if (!fs_pending_ok)
+		return;
+	if (fs_npending == FS_PATHCACHE_DEPTH) {
+		fs_pending_ok = 0;
+		return;
+	}
+	if ((d = fs_pathdir_get(dir)) == NULL) {
+		if (errno != ENOENT && errno != ENOTDIR)
+			fs_pending_ok = 0;
+		return;
+	}
+	fs_pending[fs_npending].dir = d;
+	fs_pending[fs_npending++].gen = d->gen;
+}
+
+/*
+ * Remember the answer for the resolution in progress.
+ */
+void
+fs_pathcache_add(const char *base, const char *path, const char *result)
+{
+	struct fs_pathent *e = NULL;
+	size_t baselen, pathlen;
+	int i;
+
+	if (fs_pending_ok) {
+		baselen = strlen(base);
+		pathlen = strlen(path);
+		e = malloc(sizeof(*e) + fs_npending * sizeof(e->deps[0]) +
+		    baselen + pathlen + strlen(result) + 3);
+	}
+	if (e == NULL) {
+		for (i = 0; i < fs_npending; i++)
+			fs_pathdir_release(fs_pending[i].dir);
+		fs_npending = 0;
+		return;
+	}
+	e->ndeps = fs_npending;
+	memcpy(e->deps, fs_pending, fs_npending * sizeof(e->deps[0]));
+	e->key = (char *)&e->deps[fs_npending];
+	memcpy(e->key, base, baselen + 1);
+	memcpy(e->key + baselen + 1, path, pathlen + 1);
+	e->keylen = baselen + 1 + pathlen;
+	e->result = e->key + e->keylen + 1;
+	strcpy(e->result, result);
+	e->hash = fs_pathcache_hash(base, path);
+	LIST_INSERT_HEAD(&fs_pathents[e->hash % FS_PATHCACHE_BUCKETS], e,
+	    link);
+	TAILQ_INSERT_HEAD(&fs_pathlru, e, lru);
+	if (++fs_npathents > FS_PATHCACHE_SIZE)
+		fs_pathent_free(TAILQ_LAST(&fs_pathlru, fs_pathent_lru));
+	fs_npending = 0;
+	fs_pending_ok = 0;
+}
+
+/*
+ * Watch a directory and every directory above it for moves.
+ */
+struct fs_pathpin *
+fs_pathcache_pin(const char *path)
+{
+	struct fs_pathpin *pin;
+	struct fs_pathdir *d;
+	char *copy, *p;
+	int n;
+
+	if (!fs_pathcache_init())
+		return NULL;
+	for (n = 1, p = strchr(path, '/'); p != NULL; p = strchr(p + 1, '/'))
+		n++;
+	if ((copy = strdup(path)) == NULL ||
+	    (pin = malloc(sizeof(*pin) + n * sizeof(pin->deps[0]))) == NULL) {
+		free(copy);
+		return NULL;
+	}
+	pin->ndeps = 0;
+	for (p = copy;; p++) {
+		if (*p != '/' && *p != '\0')
+			continue;
+		if (p > copy) {
+			*p = '\0';
+			if ((d = fs_pathdir_get(copy)) == NULL) {
+				fs_pathcache_unpin(pin);
+				free(copy);
+				return NULL;
+			}
+			pin->deps[pin->ndeps].dir = d;
+			pin->deps[pin->ndeps++].gen = d->movegen;
+		}
+		if (p - copy == strlen(path))
+			break;
+		*p = '/';
+	}
+	free(copy);
+	return pin;
+}
+
+/*
+ * Has anything been moved since the pin was set up?  The caller
+ * should have called fs_pathcache_update() first.
+ */
+int
+fs_pathcache_moved(struct fs_pathpin *pin)
+{
+	int i;
+
+	for (i = 0; i < pin->ndeps; i++)
+		if (pin->deps[i].dir->movegen != pin->deps[i].gen)
+			return 1;
+	return 0;
+}
+
+void
+fs_pathcache_unpin(struct fs_pathpin *pin)
+{
+	int i;
+
+	if (pin == NULL)
+		return;
+	for (i = 0; i < pin->ndeps; i++)
+		fs_pathdir_release(pin->deps[i].dir);
+	free(pin);
+}
+
+void
+fs_pathcache_stats(void)
+{
+	unsigned long total = fs_pathcache_hits + fs_pathcache_misses;
+
+	stats_printf("path cache: %d entries, %lu hits, %lu misses "
+	    "(%.1f%% hit rate), %lu found stale",
+	    fs_npathents, fs_pathcache_hits, fs_pathcache_misses,
+	    total ? 100.0 * fs_pathcache_hits / total : 0.0,
+	    fs_pathcache_stale);
+}
+
+#else /* !HAVE_SYS_INOTIFY_H */
+
+void
+fs_pathcache_update(void)
+{
+}
+
+char *
+fs_pathcache_lookup(const char *base, const char *path)
+{
+
+	return NULL;
+}
+
+void
+fs_pathcache_watch(const char *dir)
+{
+}
+
+void
+fs_pathcache_add(const char *base, const char *path, const char *result)
+{
+}
+
+struct fs_pathpin *
+fs_pathcache_pin(const char *path)
+{
+
+	return NULL;
+}
+
+int
+fs_pathcache_moved(struct fs_pathpin *pin)
+{
+
+	return 1;
+}
+
+void
+fs_pathcache_unpin(struct fs_pathpin *pin)
+{
+}
+
+void
+fs_pathcache_stats(void)
+{
+}
+
+#endif
@@ -33,11 +33,14 @@
 #include <sys/errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#if HAVE_STATX
+#include <sys/sysmacros.h>
+#endif
 
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
-#include <fts.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -61,6 +64,23 @@ strpad(char *s, int c, size_t len)
 	return s;
 }
 
+/*
+ * Copy a string into a fixed-size field, cutting it short or padding
+ * it with c to fit.
+ */
+char *
+strpadcpy(char *dst, const char *src, int c, size_t len)
+{
+	size_t n;
+
+	n = strlen(src);
+	if (n > len)
+		n = len;
+	memcpy(dst, src, n);
+	memset(dst + n, c, len - n);
+	return dst;
+}
+
 uint8_t
 fs_mode_to_type(mode_t mode)
 {
@@ -161,133 +181,48 @@ fs_write_val(uint8_t *p, uint64_t value, size_t len)
 }
 
 /*
- * Construct path to Acorn metadata for a file.  The caller must free the
- * returned string itself.
+ * Get the load and execute addresses of an object, making some up
+ * from its type and date if it has none.  Returns 1 if they were
+ * the object's own, or 0 if they were made up.
  */
-static char *
-fs_metapath(FTSENT *f)
-{
-	char *lastslash, *metapath;
-
-	lastslash = strrchr(f->fts_accpath, '/');
-	if (lastslash)
-		lastslash++;
-	else
-		lastslash = f->fts_accpath;
-	metapath = malloc((lastslash - f->fts_accpath) +
-			  f->fts_namelen + 8 + 1);
-	if (metapath != NULL) {
-		sprintf(metapath, "%.*s.Acorn/%s",
-		    (int)(lastslash - f->fts_accpath),
-		    f->fts_accpath, f->fts_name);
-	}
-	return metapath;
-}
-
-void
-fs_get_meta(FTSENT *f, struct ec_fs_meta *meta)
+int
+fs_get_meta(struct fs_ent *ent, struct ec_fs_meta *meta)
 {
-	struct stat *st;
-	char *metapath, rawinfo[24];
 	uint64_t stamp;
-	int type, i, ret;
-
-	metapath = fs_metapath(f);
-	if (metapath != NULL) {
- 		rawinfo[23] = '\0';
-		ret = readlink(metapath, rawinfo, 23);
-		if (ret == 23) {
-			for (i = 0; i < 4; i++)
-				/* LINTED strtoul result < 0x100 */
-				meta->load_addr[i] =
-				    strtoul(rawinfo+i*3, NULL, 16);
-			for (i = 0; i < 4; i++)
-				/* LINTED strtoul result < 0x100 */
-				meta->exec_addr[i] =
-				    strtoul(rawinfo+12+i*3, NULL, 16);
-			return;
-		} else if (ret == 17) {
-			fs_write_val(meta->load_addr,
-			    strtoul(rawinfo, NULL, 16),
-			    sizeof(meta->load_addr));
-			fs_write_val(meta->exec_addr,
-			    strtoul(rawinfo + 9, NULL, 16),
-			    sizeof(meta->load_addr));
-			return;
-		}
-		free(metapath);
-	}
-	st = f->fts_statp;
-	if (st != NULL) {
-		stamp = fs_riscos_date(st->st_mtime,
-#if HAVE_STRUCT_STAT_ST_MTIMENSEC
-		    st->st_mtimensec / 10000000
-#elif HAVE_STRUCT_STAT_ST_MTIM
-		    st->st_mtim.tv_nsec / 10000000
-#else
-		    0
-#endif
-		    );
-		type = fs_guess_type(f);
-		fs_write_val(meta->load_addr,
-			     0xfff00000 | (type << 8) | (stamp >> 32), 4);
-		fs_write_val(meta->exec_addr, stamp & 0x00ffffffffULL, 4);
-	} else {	
-		fs_write_val(meta->load_addr, 0xdeaddead, 4);
-		fs_write_val(meta->exec_addr, 0xdeaddead, 4);
-	}
+	int type, op;
+
+	op = fs_journal_get(ent, meta);
+	if (op == FS_JOURNAL_SET ||
+	    (op == 0 && metafuncs->get(ent, meta) == 0))
+		return 1;
+	stamp = fs_riscos_date(ent->mtime.tv_sec,
+	    ent->mtime.tv_nsec / 10000000);
+	type = fs_guess_type(ent);
+	fs_write_val(meta->load_addr,
+		     0xfff00000 | (type << 8) | (stamp >> 32), 4);
+	fs_write_val(meta->exec_addr, stamp & 0x00ffffffffULL, 4);
+	return 0;
 }
 
 int
-fs_set_meta(FTSENT *f, struct ec_fs_meta *meta)
+fs_set_meta(struct fs_ent *ent, struct ec_fs_meta *meta)
 {
-	char *lastslash, *metapath, rawinfo[24];
-	int ret;
 
-	metapath = fs_metapath(f);
-	if (metapath == NULL) {
-		errno = ENOMEM;
+	if (fs_journal_set(ent, meta) < 0 &&
+	    metafuncs->set(ent, meta) < 0)
 		return 0;
-	}
-
-	lastslash = strrchr(metapath, '/');
-	*lastslash = '\0'; /* metapath now points to the .Acorn directory. */
-	ret = rmdir(metapath);
-	if (ret < 0 && errno != ENOENT && errno != ENOTEMPTY)
-		goto fail;
-	if ((ret < 0 && errno == ENOENT) || ret == 0) {
-		if (mkdir(metapath, 0777) < 0)
-			goto fail;
-	}
-	*lastslash = '/'; /* metapath now points to the metadata again. */
-	sprintf(rawinfo, "%08lX %08lX",
-	    (unsigned long)
-	    fs_read_val(meta->load_addr, sizeof(meta->load_addr)),
-	    (unsigned long)
-	    fs_read_val(meta->exec_addr, sizeof(meta->exec_addr)));
-	if (unlink(metapath) < 0 && errno != ENOENT)
-		goto fail;
-	if (symlink(rawinfo, metapath) < 0)
-		goto fail;
-	free(metapath);
+	fs_dirsnap_changed(ent->path);
+	fs_attr_set_meta(ent->path, meta);
 	return 1;
-fail:
-	free(metapath);
-	return 0;
 }
 
 void
-fs_del_meta(FTSENT *f)
+fs_del_meta(struct fs_ent *ent)
 {
-	char *metapath;
-
-	metapath = fs_metapath(f);
-	if (metapath != NULL) {
-		unlink(metapath);
-		*strrchr(metapath, '/') = '\0';
-		rmdir(metapath); /* Don't worry if it fails. */
-		free(metapath);
-	}
+
+	if (fs_journal_del(ent) < 0)
+		metafuncs->del(ent);
+	fs_attr_forget(ent->path);
 }
 
 /*
@@ -297,10 +232,10 @@ fs_del_meta(FTSENT *f)
  * optimal.
  */
 int
-fs_get_sin(FTSENT *f)
+fs_get_sin(struct fs_ent *ent)
 {
 
-	return f->fts_statp->st_ino & 0xFFFFFF;
+	return ent->ino & 0xFFFFFF;
 }
 
 /*
@@ -309,20 +244,13 @@ fs_get_sin(FTSENT *f)
  * or as a string.
  */
 time_t
-fs_get_birthtime(FTSENT *f)
+fs_get_birthtime(struct fs_ent *ent)
 {
 
-#if HAVE_STRUCT_STAT_ST_BIRTHTIME
-	/*
-	 * NetBSD 5.0 seems to be confused over whether an unknown
-	 * birthtime should be 0 or VNOVAL (-1).
-	 */
-	if (f->fts_statp->st_birthtime &&
-	    f->fts_statp->st_birthtime != (time_t)(-1))
-		return f->fts_statp->st_birthtime;
-#endif
+	if (ent->btime != 0)
+		return ent->btime;
 	/* Ah well, mtime will have to do. */
-	return f->fts_statp->st_mtime;
+	return ent->mtime.tv_sec;
 }
 
 /*
@@ -377,6 +305,122 @@ fs_stat(const char *path, struct stat *sb)
 	return rc;
 }
 
+/*
+ * Set the path of an entry, and find its name in it.  A path ending
+ * in a slash is its own name, as fts would have it.
+ */
+void
+fs_ent_path(struct fs_ent *ent, const char *path)
+{
+
+	ent->path = path;
+	ent->pathlen = strlen(path);
+	ent->name = fs_leafname(path);
+	if (*ent->name == '\0')
+		ent->name = path;
+	ent->namelen = strlen(ent->name);
+}
+
+/*
+ * Get an object's mtime and ctime out of a struct stat, as precisely
+ * as the system keeps them.
+ */
+void
+fs_stat_times(const struct stat *st, struct timespec *mtime,
+    struct timespec *ctime)
+{
+
+#if HAVE_STRUCT_STAT_ST_MTIM
+	*mtime = st->st_mtim;
+	*ctime = st->st_ctim;
+#else
+	mtime->tv_sec = st->st_mtime;
+	ctime->tv_sec = st->st_ctime;
+#if HAVE_STRUCT_STAT_ST_MTIMENSEC
+	mtime->tv_nsec = st->st_mtimensec;
+	ctime->tv_nsec = st->st_ctimensec;
+#else
+	mtime->tv_nsec = ctime->tv_nsec = 0;
+#endif
+#endif
+}
+
+/*
+ * Fill in the stat information of an entry from a struct stat, for
+ * objects found some other way.
+ */
+void
+fs_ent_fromstat(struct fs_ent *ent, const struct stat *st)
+{
+
+	ent->mode = st->st_mode;
+	ent->size = st->st_size;
+	ent->dev = st->st_dev;
+	ent->ino = st->st_ino;
+	fs_stat_times(st, &ent->mtime, &ent->ctime);
+#if HAVE_STRUCT_STAT_ST_BIRTHTIME
+	/*
+	 * NetBSD 5.0 seems to be confused over whether an unknown
+	 * birthtime should be 0 or VNOVAL (-1).
+	 */
+	if (st->st_birthtime != (time_t)(-1))
+		ent->btime = st->st_birthtime;
+	else
+#endif
+		ent->btime = 0;
+}
+
+/*
+ * Fill in the stat information of an entry for 'name', relative to
+ * the directory 'fd', as fs_stat() would.  With statx() we ask only
+ * for what we use.  The path and name are left alone.
+ */
+int
+fs_ent_statat(int fd, const char *name, struct fs_ent *ent)
+{
+#if HAVE_STATX
+	struct statx stx;
+	unsigned int mask = STATX_TYPE | STATX_MODE | STATX_INO |
+	    STATX_SIZE | STATX_MTIME | STATX_CTIME | STATX_BTIME;
+
+	if (statx(fd, name, 0, mask, &stx) < 0 &&
+	    (errno != ENOENT ||
+		statx(fd, name, AT_SYMLINK_NOFOLLOW, mask, &stx) < 0))
+		return -1;
+	ent->mode = stx.stx_mode;
+	ent->size = stx.stx_size;
+	ent->dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	ent->ino = stx.stx_ino;
+	ent->mtime.tv_sec = stx.stx_mtime.tv_sec;
+	ent->mtime.tv_nsec = stx.stx_mtime.tv_nsec;
+	ent->ctime.tv_sec = stx.stx_ctime.tv_sec;
+	ent->ctime.tv_nsec = stx.stx_ctime.tv_nsec;
+	ent->btime = (stx.stx_mask & STATX_BTIME) ? stx.stx_btime.tv_sec : 0;
+	return 0;
+#else
+	struct stat st;
+
+	if (fstatat(fd, name, &st, 0) < 0 &&
+	    (errno != ENOENT ||
+		fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0))
+		return -1;
+	fs_ent_fromstat(ent, &st);
+	return 0;
+#endif
+}
+
+/*
+ * Find out about the object at 'path', which must last as long as
+ * 'ent' does.  Returns -1, with errno set, on failure.
+ */
+int
+fs_ent_stat(const char *path, struct fs_ent *ent)
+{
+
+	fs_ent_path(ent, path);
+	return fs_ent_statat(AT_FDCWD, path, ent);
+}
+
 const char *
 fs_leafname(const char *path)
 {
@@ -0,0 +1,243 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * fs_wildcard.c - matching file names against client wildcards
+ *
+ * Clients may use '*' for any number of characters, and '#' (or '?')
+ * for any one, and case is ignored.  A wildcard is compiled once
+ * into the pieces between its stars, upper-cased through a table,
+ * and then matched against as many names as necessary.  The first
+ * piece must match at the start of the name and the last at the
+ * end; those in between are matched as early as possible, which is
+ * always right for this kind of pattern.
+ *
+ * Before that, names are weeded out cheaply: by length, by the
+ * characters fixed at either end, and by the longest run of literal
+ * characters in the middle pieces, which must appear somewhere.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extern.h"
+#include "fileserver.h"
+
+struct fs_wildpiece {
+	int off;		/* Offset in pattern */
+	int len;
+};
+
+struct fs_wildcard {
+	int npieces;
+	int minlen;		/* Length of the shortest matching name */
+	int first, last;	/* Characters fixed at each end, or -1 */
+	int litoff, litlen;	/* Literal that must appear, if litlen > 0 */
+	char *pattern;		/* Upper-cased, with '#' as '?' */
+	struct fs_wildpiece pieces[];
+};
+
+static uint8_t fs_wild_fold[256];
+
+static void
+fs_wild_init(void)
+{
+	int i;
+
+	for (i = 0; i < 256; i++)
+		fs_wild_fold[i] = toupper(i);
+}
+
+int
+fs_wild_is_wild(const char *name)
+{
+
+	return strpbrk(name, "*#?") != NULL;
+}
+
+struct fs_wildcard *
+fs_wild_compile(const char *wc)
+{
+	struct fs_wildcard *w;
+	struct fs_wildpiece *p;
+	const char *s;
+	char *q;
+	size_t len;
+	int npieces, i, j, run;
+
+	if (fs_wild_fold['a'] == 0)
+		fs_wild_init();
+	len = strlen(wc);
+	npieces = 1;
+	for (s = wc; *s; s++)
+		if (*s == '*' && s[1] != '*')
+			npieces++;
+	w = malloc(sizeof(*w) + npieces * sizeof(w->pieces[0]) + len + 1);
+	if (w == NULL)
+		return NULL;
+	w->pattern = (char *)&w->pieces[npieces];
+	w->npieces = npieces;
+	w->minlen = 0;
+	p = w->pieces;
+	p->off = 0;
+	for (s = wc, q = w->pattern; *s; s++) {
+		if (*s == '*') {
+			if (s[1] == '*')
+				continue;
+			p->len = (q - w->pattern) - p->off;
+			w->minlen += p->len;
+			p++;
+			p->off = q - w->pattern;
+		} else if (*s == '#' || *s == '?')
+			*q++ = '?';
+		else
+			*q++ = fs_wild_fold[(uint8_t)*s];
+	}
+	*q = '\0';
+	p->len = (q - w->pattern) - p->off;
+	w->minlen += p->len;
+
+	p = &w->pieces[0];
+	w->first = p->len > 0 && w->pattern[p->off] != '?' ?
+	    (uint8_t)w->pattern[p->off] : -1;
+	p = &w->pieces[npieces - 1];
+	w->last = p->len > 0 && w->pattern[p->off + p->len - 1] != '?' ?
+	    (uint8_t)w->pattern[p->off + p->len - 1] : -1;
+	w->litlen = 0;
+	for (i = 1; i < npieces - 1; i++) {
+		p = &w->pieces[i];
+		for (j = 0; j < p->len; j += run + 1) {
+			for (run = 0; j + run < p->len &&
+			    w->pattern[p->off + j + run] != '?'; run++)
+				continue;
+			if (run > w->litlen) {
+				w->litoff = p->off + j;
+				w->litlen = run;
+			}
+		}
+	}
+	return w;
+}
+
+void
+fs_wild_free(struct fs_wildcard *w)
+{
+
+	free(w);
+}
+
+/*
+ * Does a piece of the pattern match at the start of 'name'?
+ */
+static int
+fs_wild_piece(const char *pat, int len, const char *name)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		if (pat[i] != '?' && pat[i] != fs_wild_fold[(uint8_t)name[i]])
+			return 0;
+	return 1;
+}
+
+/*
+ * Does the literal 'lit' appear anywhere in name?
+ */
+static int
+fs_wild_find(const char *lit, int litlen, const char *name, int len)
+{
+	int i, j;
+
+	for (i = 0; i + litlen <= len; i++) {
+		if (lit[0] != fs_wild_fold[(uint8_t)name[i]])
+			continue;
+		for (j = 1; j < litlen; j++)
+			if (lit[j] != fs_wild_fold[(uint8_t)name[i + j]])
+				break;
+		if (j == litlen)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Match the first 'len' characters of 'name' against a compiled
+ * wildcard.
+ */
+int
+fs_wild_match(const struct fs_wildcard *w, const char *name, int len)
+{
+	const struct fs_wildpiece *p;
+	const char *start, *end;
+	int i;
+
+	if (len < w->minlen || (w->npieces == 1 && len != w->minlen))
+		return 0;
+	if (w->first >= 0 && fs_wild_fold[(uint8_t)name[0]] != w->first)
+		return 0;
+	if (w->last >= 0 && fs_wild_fold[(uint8_t)name[len - 1]] != w->last)
+		return 0;
+	if (w->litlen > 0 &&
+	    !fs_wild_find(w->pattern + w->litoff, w->litlen, name, len))
+		return 0;
+
+	p = &w->pieces[0];
+	if (!fs_wild_piece(w->pattern + p->off, p->len, name))
+		return 0;
+	if (w->npieces == 1)
+		return 1;
+	start = name + p->len;
+	p = &w->pieces[w->npieces - 1];
+	end = name + len - p->len;
+	if (!fs_wild_piece(w->pattern + p->off, p->len, end))
+		return 0;
+	for (i = 1; i < w->npieces - 1; i++) {
+		p = &w->pieces[i];
+		for (;; start++) {
+			if (end - start < p->len)
+				return 0;
+			if (fs_wild_piece(w->pattern + p->off, p->len, start))
+				break;
+		}
+		start += p->len;
+	}
+	return 1;
+}
@@ -0,0 +1,616 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * loopback.c - a simulated network inside aund's own process
+ *
+ * Rather than talking to real stations, this transport connects the
+ * server to client stations simulated in the same process, such as
+ * those run by aund-sim.  Packets pass between them through a
+ * simulated network which can lose, delay, duplicate and reorder
+ * them, as decided by a seeded random number generator, so a run
+ * with the same seed and settings is exactly repeatable.  Together
+ * with the event loop's virtual clock, this means the network's
+ * delays cost no real time at all.
+ *
+ * The protocol is AUN's: unicast packets carry sequence numbers and
+ * are acknowledged, and are retransmitted until they are.  The server
+ * retransmits according to its round-trip time estimate for each
+ * station, as aun.c does.  Stations retransmit at fixed intervals, as
+ * real clients do.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aun.h"
+#include "event.h"
+#include "extern.h"
+#include "loopback.h"
+
+struct econet_addr {
+	uint8_t station;
+	uint8_t network;
+};
+
+union internal_addr {
+	struct aun_srcaddr srcaddr;
+	struct econet_addr eaddr;
+};
+
+/* How many sequence numbers a station remembers, to spot repeats. */
+#define LB_SEEN 64
+
+struct lb_station {
+	LIST_ENTRY(lb_station) link;
+	int	stn;
+	lb_input_fn *input;
+	void	*arg;
+	uint32_t seq;			/* Last sequence number used */
+	uint32_t seen[LB_SEEN];		/* Recently received from server */
+	int	nseen;
+	unsigned long retransmits;	/* By the station */
+	struct rtt rtt;			/* Server's estimate for station */
+};
+
+/* A packet on its way across the network. */
+struct lb_pkt {
+	struct ev_timer timer;
+	struct lb_station *st;
+	int	to_server;
+	size_t	len;
+	/* Packet follows */
+};
+
+/* A unicast packet which hasn't been acknowledged yet. */
+struct lb_tx {
+	LIST_ENTRY(lb_tx) link;
+	struct ev_timer timer;
+	struct lb_station *st;
+	int	to_server;
+	uint32_t seq;
+	int	tries;
+	uint64_t first_sent;
+	uint64_t last_sent;
+	aun_done_fn *done;
+	void	*arg;
+	size_t	len;
+	/* Packet follows */
+};
+
+static LIST_HEAD(, lb_station) lb_stations =
+    LIST_HEAD_INITIALIZER(lb_stations);
+static LIST_HEAD(, lb_tx) lb_outstanding =
+    LIST_HEAD_INITIALIZER(lb_outstanding);
+
+static struct lb_params lb_params;
+static uint32_t lb_random_state = 1;
+static uint32_t lb_server_seq = 2;
+
+static unsigned long lb_sent, lb_lost, lb_duplicated, lb_reordered;
+
+static void lb_tx_send(struct lb_tx *);
+
+void
+lb_configure(const struct lb_params *p)
+{
+
+	lb_params = *p;
+	lb_random_state = p->seed != 0 ? p->seed : 1;
+}
+
+/*
+ * Return a random number in [0, 1).  This is xorshift32, which is
+ * quite good enough for deciding which packets to lose, and gives the
+ * same answers everywhere.
+ */
+static double
+lb_random(void)
+{
+	uint32_t x = lb_random_state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	lb_random_state = x;
+	return x / 4294967296.0;
+}
+
+static uint32_t
+lb_get_seq(struct aun_packet *pkt)
+{
+
+	return pkt->seq[0] | pkt->seq[1] << 8 | pkt->seq[2] << 16 |
+	    (uint32_t)pkt->seq[3] << 24;
+}
+
+static void
+lb_set_seq(struct aun_packet *pkt, uint32_t seq)
+{
+
+	pkt->seq[0] = seq;
+	pkt->seq[1] = seq >> 8;
+	pkt->seq[2] = seq >> 16;
+	pkt->seq[3] = seq >> 24;
+}
+
+static struct lb_station *
+lb_station_find(int stn)
+{
+	struct lb_station *st;
+
+	LIST_FOREACH(st, &lb_stations, link)
+		if (st->stn == stn)
+			return st;
+	return NULL;
+}
+
+static void lb_arrive(void *);
+
+/*
+ * Put a packet on the network, between the server and a station.
+ */
+static void
+lb_wire(struct lb_station *st, int to_server, const void *data, size_t len)
+{
+	struct lb_pkt *p;
+	uint64_t delay;
+	int copies;
+
+	lb_sent++;
+	if (lb_random() < lb_params.loss) {
+		lb_lost++;
+		return;
+	}
+	copies = 1;
+	if (lb_random() < lb_params.dup) {
+		lb_duplicated++;
+		copies = 2;
+	}
+	while (copies-- > 0) {
+		if ((p = malloc(sizeof(*p) + len)) == NULL) {
+			lb_lost++;
+			return;
+		}
+		p->st = st;
+		p->to_server = to_server;
+		p->len = len;
+		memcpy(p + 1, data, len);
+		delay = lb_params.delay;
+		if (lb_params.jitter > 0)
+			delay += lb_random() * lb_params.jitter;
+		if (lb_random() < lb_params.reorder) {
+			lb_reordered++;
+			delay += lb_params.reorder_delay;
+		}
+		ev_timer_init(&p->timer, lb_arrive, p);
+		ev_timer_add(&p->timer, delay);
+	}
+}
+
+static void
+lb_ack(struct lb_station *st, int to_server, struct aun_packet *pkt, int type)
+{
+	struct aun_packet ack;
+
+	memset(&ack, 0, sizeof(ack));
+	ack.type = type;
+	memcpy(ack.seq, pkt->seq, 4);
+	lb_wire(st, to_server, &ack, sizeof(ack));
+}
+
+/*
+ * Start sending a unicast packet, which is copied, and call done()
+ * once it has been acknowledged or we've given up.
+ */
+static void
+lb_tx_new(struct lb_station *st, int to_server, struct aun_packet *hdr,
+    const struct iovec *iov, int iovcnt, aun_done_fn *done, void *arg)
+{
+	struct lb_tx *tx;
+	size_t len;
+	uint8_t *p;
+	int i;
+
+	for (i = 0, len = sizeof(*hdr); i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if ((tx = malloc(sizeof(*tx) + len)) == NULL) {
+		if (done != NULL) done(arg, ENOMEM);
+		return;
+	}
+	p = (uint8_t *)(tx + 1);
+	memcpy(p, hdr, sizeof(*hdr));
+	p += sizeof(*hdr);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+	tx->st = st;
+	tx->to_server = to_server;
+	tx->seq = lb_get_seq(hdr);
+	tx->tries = 0;
+	tx->done = done;
+	tx->arg = arg;
+	tx->len = len;
+	LIST_INSERT_HEAD(&lb_outstanding, tx, link);
+	lb_tx_send(tx);
+}
+
+static void
+lb_tx_complete(struct lb_tx *tx, int error)
+{
+
+	ev_timer_del(&tx->timer);
+	LIST_REMOVE(tx, link);
+	if (tx->done != NULL)
+		tx->done(tx->arg, error);
+	free(tx);
+}
+
+/*
+ * The server gives up on a packet as aun.c does, once it has gone
+ * unacknowledged for as long as 50 fixed timeouts would have taken.
+ * Stations just retransmit every default_timeout for that long.
+ */
+static void
+lb_tx_timeout(void *arg)
+{
+	struct lb_tx *tx = arg;
+	struct rtt *rtt = &tx->st->rtt;
+
+	if (ev_now() - tx->first_sent >= 50 * (uint64_t)default_timeout) {
+		if (!tx->to_server)
+			rtt->failures++;
+		lb_tx_complete(tx, ETIMEDOUT);
+		return;
+	}
+	if (tx->to_server)
+		tx->st->retransmits++;
+	else
+		rtt_backoff(rtt);
+	lb_tx_send(tx);
+}
+
+static void
+lb_tx_send(struct lb_tx *tx)
+{
+	uint64_t timeout;
+
+	tx->last_sent = ev_now();
+	if (tx->tries++ == 0)
+		tx->first_sent = tx->last_sent;
+	if (tx->to_server)
+		timeout = default_timeout;
+	else {
+		tx->st->rtt.sent++;
+		timeout = tx->st->rtt.rto;
+	}
+	ev_timer_init(&tx->timer, lb_tx_timeout, tx);
+	ev_timer_add(&tx->timer, timeout);
+	lb_wire(tx->st, tx->to_server, tx + 1, tx->len);
+}
+
+/*
+ * An ACK has arrived, at the server if to_server is set, or at a
+ * station otherwise.
+ */
+static void
+lb_tx_ack(struct lb_station *st, int to_server, struct aun_packet *ack)
+{
+	struct lb_tx *tx;
+	uint32_t seq = lb_get_seq(ack);
+
+	LIST_FOREACH(tx, &lb_outstanding, link)
+		if (tx->st == st && tx->to_server != to_server &&
+		    tx->seq == seq) {
+			/* Karn: only time packets sent just once. */
+			if (!tx->to_server && tx->tries == 1)
+				rtt_sample(&st->rtt,
+				    ev_now() - tx->last_sent);
+			lb_tx_complete(tx, 0);
+			return;
+		}
+}
+
+static void
+lb_server_input(struct lb_station *st, struct aun_packet *pkt, size_t len)
+{
+	union internal_addr from;
+
+	memset(&from, 0, sizeof(from));
+	from.eaddr.station = st->stn;
+	switch (pkt->type) {
+	case AUN_TYPE_ACK:
+		lb_tx_ack(st, 1, pkt);
+		break;
+	case AUN_TYPE_UNICAST:
+	case AUN_TYPE_BROADCAST:
+		if (ec_port_wanted(pkt->dest_port, &from.srcaddr)) {
+			if (pkt->type == AUN_TYPE_UNICAST)
+				lb_ack(st, 0, pkt, AUN_TYPE_ACK);
+			ec_port_input(pkt, len, &from.srcaddr);
+		} else {
+			if (pkt->type == AUN_TYPE_UNICAST)
+				lb_ack(st, 0, pkt, AUN_TYPE_REJ);
+		}
+		break;
+	}
+}
+
+static void
+lb_station_input(struct lb_station *st, struct aun_packet *pkt, size_t len)
+{
+	uint32_t seq;
+	int i;
+
+	switch (pkt->type) {
+	case AUN_TYPE_ACK:
+		lb_tx_ack(st, 0, pkt);
+		break;
+	case AUN_TYPE_UNICAST:
+		lb_ack(st, 1, pkt, AUN_TYPE_ACK);
+		/* Our ACK may have been lost, so this may be a repeat. */
+		seq = lb_get_seq(pkt);
+		for (i = 0; i < LB_SEEN; i++)
+			if (st->seen[i] == seq)
+				return;
+		st->seen[st->nseen++ % LB_SEEN] = seq;
+		/* FALLTHROUGH */
+	case AUN_TYPE_BROADCAST:
+		st->input(st, pkt, len, st->arg);
+		break;
+	}
+}
+
+static void
+lb_arrive(void *arg)
+{
+	struct lb_pkt *p = arg;
+	struct aun_packet *pkt = (struct aun_packet *)(p + 1);
+
+	if (p->len >= sizeof(*pkt)) {
+		if (p->to_server)
+			lb_server_input(p->st, pkt, p->len);
+		else
+			lb_station_input(p->st, pkt, p->len);
+	}
+	free(p);
+}
+
+/*
+ * Add a simulated station.  input() is called with each packet the
+ * server sends it.
+ */
+struct lb_station *
+lb_station_new(int stn, lb_input_fn *input, void *arg)
+{
+	struct lb_station *st;
+
+	if ((st = calloc(1, sizeof(*st))) == NULL)
+		return NULL;
+	st->stn = stn;
+	st->input = input;
+	st->arg = arg;
+	st->seq = 0x1000;
+	rtt_init(&st->rtt);
+	LIST_INSERT_HEAD(&lb_stations, st, link);
+	return st;
+}
+
+int
+lb_station_number(struct lb_station *st)
+{
+
+	return st->stn;
+}
+
+/*
+ * Send a packet from a station to the server's port, and call done()
+ * once it has been acknowledged.  The data is copied.
+ */
+void
+lb_station_xmit(struct lb_station *st, int port, int flag, const void *data,
+    size_t len, aun_done_fn *done, void *arg)
+{
+	struct aun_packet hdr;
+	struct iovec iov;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.type = AUN_TYPE_UNICAST;
+	hdr.dest_port = port;
+	hdr.flag = flag;
+	st->seq += 4;
+	lb_set_seq(&hdr, st->seq);
+	iov.iov_base = (void *)data;
+	iov.iov_len = len;
+	lb_tx_new(st, 1, &hdr, &iov, 1, done, arg);
+}
+
+static void
+loopback_setup(void)
+{
+
+	/* Stations are added by whoever is simulating them. */
+}
+
+static void
+loopback_xmitv_async(struct aun_packet *hdr, const struct iovec *iov,
+    int iovcnt, struct aun_srcaddr *vto, aun_done_fn *done, void *arg)
+{
+	union internal_addr *ato = (union internal_addr *)vto;
+	struct lb_station *st;
+	uint8_t buf[sizeof(struct aun_packet) + AUN_MAX_BLOCK];
+	size_t len;
+	int i;
+
+	if ((st = lb_station_find(ato->eaddr.station)) == NULL) {
+		if (done != NULL) done(arg, EHOSTUNREACH);
+		return;
+	}
+	hdr->retrans = 0;
+	lb_set_seq(hdr, lb_server_seq);
+	lb_server_seq += 4;
+	if (hdr->type == AUN_TYPE_UNICAST) {
+		lb_tx_new(st, 0, hdr, iov, iovcnt, done, arg);
+		return;
+	}
+	/* Nothing to wait for. */
+	memcpy(buf, hdr, sizeof(*hdr));
+	for (i = 0, len = sizeof(*hdr); i < iovcnt; i++) {
+		if (len + iov[i].iov_len > sizeof(buf)) {
+			if (done != NULL) done(arg, EMSGSIZE);
+			return;
+		}
+		memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	lb_wire(st, 0, buf, len);
+	if (done != NULL) done(arg, 0);
+}
+
+static void
+loopback_xmit_async(struct aun_packet *pkt, size_t len,
+    struct aun_srcaddr *vto, aun_done_fn *done, void *arg)
+{
+	struct iovec iov;
+
+	iov.iov_base = pkt->data;
+	iov.iov_len = len - sizeof(*pkt);
+	loopback_xmitv_async(pkt, &iov, 1, vto, done, arg);
+}
+
+struct lb_wait {
+	int pending;
+	int error;
+};
+
+static void
+lb_wait_done(void *arg, int error)
+{
+	struct lb_wait *w = arg;
+
+	w->pending = 0;
+	w->error = error;
+}
+
+static ssize_t
+loopback_xmit(struct aun_packet *pkt, size_t len, struct aun_srcaddr *vto)
+{
+	struct lb_wait w;
+
+	w.pending = 1;
+	loopback_xmit_async(pkt, len, vto, lb_wait_done, &w);
+	while (w.pending)
+		ev_run_once(1);
+	if (w.error != 0) {
+		errno = w.error;
+		return -1;
+	}
+	return len;
+}
+
+static char *
+loopback_ntoa(struct aun_srcaddr *vfrom)
+{
+	union internal_addr *afrom = (union internal_addr *)vfrom;
+	static char buf[8];
+
+	snprintf(buf, sizeof(buf), "%d.%d", afrom->eaddr.network,
+	    afrom->eaddr.station);
+	return buf;
+}
+
+static int
+loopback_aton(const char *s, struct aun_srcaddr *vaddr)
+{
+	union internal_addr *aaddr = (union internal_addr *)vaddr;
+	unsigned net, stn;
+
+	memset(aaddr, 0, sizeof(*aaddr));
+	if (sscanf(s, "%u.%u", &net, &stn) != 2 || net > 255 || stn > 255)
+		return -1;
+	aaddr->eaddr.network = net;
+	aaddr->eaddr.station = stn;
+	return 0;
+}
+
+/*
+ * Report what the network has done to packets, and how each station
+ * has fared.
+ */
+static void
+loopback_stats(void)
+{
+	struct lb_station *st;
+	unsigned long retransmits = 0;
+	char name[8];
+
+	LIST_FOREACH(st, &lb_stations, link)
+		retransmits += st->retransmits;
+	stats_printf("loopback: %lu packets sent, %lu lost, %lu duplicated, "
+	    "%lu reordered; stations retransmitted %lu", lb_sent, lb_lost,
+	    lb_duplicated, lb_reordered, retransmits);
+	LIST_FOREACH(st, &lb_stations, link) {
+		snprintf(name, sizeof(name), "0.%d", st->stn);
+		rtt_report(name, &st->rtt);
+	}
+}
+
+static void
+loopback_get_stn(struct aun_srcaddr *vfrom, uint8_t *out)
+{
+	union internal_addr *afrom = (union internal_addr *)vfrom;
+
+	out[0] = afrom->eaddr.station;
+	out[1] = afrom->eaddr.network;
+}
+
+const struct aun_funcs loopback = {
+	AUN_MAX_BLOCK,
+	loopback_setup,
+	loopback_xmit,
+	loopback_xmit_async,
+	loopback_xmitv_async,
+	NULL,
+	loopback_ntoa,
+	loopback_aton,
+	loopback_stats,
+	NULL,
+	loopback_get_stn,
+};
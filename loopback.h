@@ -0,0 +1,77 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * loopback.h - simulated network between aund and client stations
+ */
+
+#ifndef _LOOPBACK_H
+#define _LOOPBACK_H
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/*
+ * How badly the simulated network behaves.  Probabilities apply to
+ * each packet, in either direction, independently; times are in
+ * microseconds.  A packet which is "reordered" is held back for an
+ * extra reorder_delay, so that later ones overtake it.
+ */
+struct lb_params {
+	double	loss;
+	double	dup;
+	double	reorder;
+	uint64_t delay;
+	uint64_t jitter;
+	uint64_t reorder_delay;
+	uint32_t seed;
+};
+
+struct lb_station;
+
+/*
+ * Called when a simulated station receives a packet from the server.
+ * Duplicates have already been weeded out, and the packet ACKed.
+ */
+typedef void lb_input_fn(struct lb_station *, struct aun_packet *, size_t,
+    void *);
+
+extern const struct aun_funcs loopback;
+
+extern void lb_configure(const struct lb_params *);
+extern struct lb_station *lb_station_new(int, lb_input_fn *, void *);
+extern int lb_station_number(struct lb_station *);
+extern void lb_station_xmit(struct lb_station *, int, int, const void *,
+    size_t, aun_done_fn *, void *);
+
+#endif
@@ -0,0 +1,176 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * meta.c - choosing where Acorn metadata is kept
+ *
+ * Load and execute addresses don't fit anywhere in a Unix file
+ * system, so they're kept to one side by one of several backends
+ * (see struct meta_funcs).  The symlink and xattr backends store
+ * them as text, as "LLLLLLLL EEEEEEEE" in hex, which is what the
+ * original symbolic links hold.  The catalog backend keeps them in
+ * binary, as struct ec_fs_meta.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "extern.h"
+#include "fileserver.h"
+
+struct meta_funcs const *metafuncs = &meta_symlink;
+
+static struct meta_funcs const *const meta_backends[] = {
+	&meta_symlink, &meta_xattr, &meta_catalog, NULL
+};
+
+/*
+ * Find a backend by name, or return NULL if there isn't one.
+ */
+struct meta_funcs const *
+meta_find(char const *name)
+{
+	int i;
+
+	for (i = 0; meta_backends[i] != NULL; i++)
+		if (strcasecmp(meta_backends[i]->name, name) == 0)
+			return meta_backends[i];
+	return NULL;
+}
+
+static void
+meta_write(uint8_t *p, unsigned long val)
+{
+	int i;
+
+	for (i = 0; i < 4; i++, val >>= 8)
+		p[i] = val & 0xff;
+}
+
+static unsigned long
+meta_read(uint8_t *p)
+{
+
+	return (unsigned long)p[0] | (unsigned long)p[1] << 8 |
+	    (unsigned long)p[2] << 16 | (unsigned long)p[3] << 24;
+}
+
+/*
+ * Write metadata as text into 'buf', which needs room for
+ * META_TEXTLEN + 1 bytes.
+ */
+void
+meta_format(char *buf, struct ec_fs_meta *meta)
+{
+
+	sprintf(buf, "%08lX %08lX", meta_read(meta->load_addr),
+	    meta_read(meta->exec_addr));
+}
+
+/*
+ * Read metadata from 'len' bytes of text.  Besides our own format,
+ * this understands the older one of eight two-digit hex bytes.
+ * Returns -1 if it can't make sense of it.
+ */
+int
+meta_parse(char const *raw, size_t len, struct ec_fs_meta *meta)
+{
+	char buf[META_OLDTEXTLEN + 1];
+	int i;
+
+	if (len != META_TEXTLEN && len != META_OLDTEXTLEN)
+		return -1;
+	memcpy(buf, raw, len);
+	buf[len] = '\0';
+	if (len == META_OLDTEXTLEN) {
+		for (i = 0; i < 4; i++)
+			/* LINTED strtoul result < 0x100 */
+			meta->load_addr[i] = strtoul(buf + i * 3, NULL, 16);
+		for (i = 0; i < 4; i++)
+			/* LINTED strtoul result < 0x100 */
+			meta->exec_addr[i] =
+			    strtoul(buf + 12 + i * 3, NULL, 16);
+	} else {
+		meta_write(meta->load_addr, strtoul(buf, NULL, 16));
+		meta_write(meta->exec_addr, strtoul(buf + 9, NULL, 16));
+	}
+	return 0;
+}
+
+/*
+ * Note the identity, size and times of whatever is at 'path', for a
+ * backend's stamp() or dirstamp().  It's all zero if there's nothing
+ * there.
+ */
+void
+meta_stamp_path(char const *path, struct meta_stamp *ms)
+{
+	struct stat st;
+
+	memset(ms, 0, sizeof(*ms));
+	if (lstat(path, &st) < 0)
+		return;
+	ms->dev = st.st_dev;
+	ms->ino = st.st_ino;
+	ms->size = st.st_size;
+	ms->mtime = st.st_mtime;
+	ms->ctime = st.st_ctime;
+}
+
+int
+meta_stamp_same(struct meta_stamp const *a, struct meta_stamp const *b)
+{
+
+	return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+	    a->mtime == b->mtime && a->ctime == b->ctime;
+}
+
+/*
+ * Returns non-zero if a stamp was changed too recently to show a
+ * further change (see FS_STAT_RACY).
+ */
+int
+meta_stamp_racy(struct meta_stamp const *ms, time_t now)
+{
+
+	return now - ms->mtime <= FS_STAT_RACY ||
+	    now - ms->ctime <= FS_STAT_RACY;
+}
@@ -0,0 +1,591 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * meta_catalog.c - Acorn metadata in a catalog file per directory
+ *
+ * The metadata for everything in a directory is kept in one file,
+ * .Acorn.cat, which we map into memory to read.  It starts with a
+ * header and an array of slots sorted by name, which we can binary
+ * search, followed by the names they point at.  After that comes a
+ * tail of records, each followed by its name, that haven't been
+ * sorted in yet.  A record in the tail overrides any slot of the
+ * same name, and later records override earlier ones.  Numbers are
+ * in host byte order.
+ *
+ * Changing metadata that's already in the file is done in place.
+ * New names are appended to the tail, and once it's CATALOG_TAIL
+ * records long the whole file is rewritten in order, and renamed
+ * over the old one.  Deleted entries are marked as such and go at
+ * the next rewrite.  Writers lock the file with flock(), so more
+ * than one worker can share a catalog.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "fileserver.h"
+
+#define CATALOG_NAME	".Acorn.cat"
+#define CATALOG_MAGIC	"AundCat1"
+#define CATALOG_TAIL	64	/* Records in the tail before sorting */
+#define CATALOG_CACHE	8	/* Catalogs to keep mapped */
+
+struct catalog_hdr {
+	char magic[8];
+	uint32_t nslots;
+	uint32_t namesize;
+};
+
+/* An entry in the sorted part.  'flags' and 'meta' are adjacent. */
+struct catalog_slot {
+	uint32_t nameoff;
+	uint8_t namelen;
+	uint8_t pad[2];
+	uint8_t flags;
+	struct ec_fs_meta meta;
+};
+
+/* A record in the tail, followed by its name. */
+struct catalog_rec {
+	uint8_t namelen;
+	uint8_t flags;
+	struct ec_fs_meta meta;
+};
+
+#define CATALOG_DELETED	0x01
+
+/* Where an entry was found, and what's in the file. */
+struct catalog_found {
+	off_t off; /* Of its flags and metadata, or -1 if not there */
+	uint8_t flags;
+	struct ec_fs_meta meta;
+	int ntail;
+};
+
+/* A catalog we have mapped, for reading. */
+static struct catalog {
+	char *path; /* NULL if this one's free */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	unsigned char *map;
+	unsigned long used;
+} catalogs[CATALOG_CACHE];
+
+/*
+ * The catalog for a file: the one in the directory it's in.  It's
+ * put in 'buf', which holds PATH_MAX bytes.  Returns -1, with errno
+ * set, if it won't fit.
+ */
+static int
+catalog_path(struct fs_ent *f, char *buf)
+{
+	size_t dirlen;
+
+	dirlen = f->name - f->path;
+	if (dirlen + sizeof(CATALOG_NAME) > PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	sprintf(buf, "%.*s%s", (int)dirlen, f->path, CATALOG_NAME);
+	return 0;
+}
+
+static int
+catalog_namecmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int ret;
+
+	ret = memcmp(a, b, alen < blen ? alen : blen);
+	if (ret != 0)
+		return ret;
+	return (alen > blen) - (alen < blen);
+}
+
+static int
+catalog_valid(unsigned char *map, size_t size)
+{
+	struct catalog_hdr *hdr = (struct catalog_hdr *)map;
+
+	return size >= sizeof(*hdr) &&
+	    memcmp(hdr->magic, CATALOG_MAGIC, sizeof(hdr->magic)) == 0 &&
+	    sizeof(*hdr) + (uint64_t)hdr->nslots *
+		sizeof(struct catalog_slot) + hdr->namesize <= size;
+}
+
+/*
+ * Look a name up in a catalog's contents, which catalog_valid() has
+ * passed.
+ */
+static void
+catalog_find(unsigned char *map, size_t size, const char *name, size_t len,
+    struct catalog_found *cf)
+{
+	struct catalog_hdr *hdr = (struct catalog_hdr *)map;
+	struct catalog_slot *slots = (struct catalog_slot *)(hdr + 1);
+	struct catalog_rec *rec;
+	const char *names;
+	size_t lo, hi, mid, off;
+	int cmp;
+
+	names = (const char *)(slots + hdr->nslots);
+	cf->off = -1;
+	cf->ntail = 0;
+	lo = 0;
+	hi = hdr->nslots;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (slots[mid].nameoff + slots[mid].namelen > hdr->namesize)
+			return; /* Corrupt */
+		cmp = catalog_namecmp(names + slots[mid].nameoff,
+		    slots[mid].namelen, name, len);
+		if (cmp == 0) {
+			cf->off = (unsigned char *)&slots[mid].flags - map;
+			cf->flags = slots[mid].flags;
+			cf->meta = slots[mid].meta;
+			break;
+		}
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	off = (const unsigned char *)names + hdr->namesize - map;
+	while (off + sizeof(*rec) <= size) {
+		rec = (struct catalog_rec *)(map + off);
+		if (off + sizeof(*rec) + rec->namelen > size)
+			break;
+		if (catalog_namecmp((char *)(rec + 1), rec->namelen,
+		    name, len) == 0) {
+			cf->off = (unsigned char *)&rec->flags - map;
+			cf->flags = rec->flags;
+			cf->meta = rec->meta;
+		}
+		cf->ntail++;
+		off += sizeof(*rec) + rec->namelen;
+	}
+}
+
+/*
+ * Get a catalog mapped, using the one we mapped before if the file
+ * hasn't been replaced or grown since.  Returns NULL if there isn't
+ * one, or it doesn't make sense.
+ */
+static struct catalog *
+catalog_get(const char *path)
+{
+	static unsigned long clock;
+	struct catalog *cat, *victim;
+	struct stat st;
+	int i, fd;
+
+	if (stat(path, &st) < 0)
+		return NULL;
+	victim = NULL;
+	for (i = 0; i < CATALOG_CACHE; i++) {
+		cat = &catalogs[i];
+		if (cat->path != NULL && strcmp(cat->path, path) == 0)
+			break;
+		if (victim == NULL || (victim->path != NULL &&
+		    (cat->path == NULL || cat->used < victim->used)))
+			victim = cat;
+	}
+	if (i < CATALOG_CACHE) {
+		if (cat->dev == st.st_dev && cat->ino == st.st_ino &&
+		    cat->size == st.st_size) {
+			cat->used = ++clock;
+			return cat->map != NULL ? cat : NULL;
+		}
+		victim = cat;
+	}
+	cat = victim;
+	if (cat->map != NULL)
+		munmap(cat->map, cat->size);
+	cat->map = NULL;
+	if (cat->path == NULL || strcmp(cat->path, path) != 0) {
+		free(cat->path);
+		if ((cat->path = strdup(path)) == NULL)
+			return NULL;
+	}
+	cat->dev = st.st_dev;
+	cat->ino = st.st_ino;
+	cat->size = st.st_size;
+	cat->used = ++clock;
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+	if (st.st_size > 0) {
+		cat->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+		    fd, 0);
+		if (cat->map == MAP_FAILED)
+			cat->map = NULL;
+		else if (!catalog_valid(cat->map, st.st_size)) {
+			munmap(cat->map, st.st_size);
+			cat->map = NULL;
+		}
+	}
+	close(fd);
+	return cat->map != NULL ? cat : NULL;
+}
+
+static int
+catalog_get_meta(struct fs_ent *f, struct ec_fs_meta *meta)
+{
+	struct catalog_found cf;
+	struct catalog *cat;
+	char path[PATH_MAX];
+
+	if (catalog_path(f, path) < 0 || (cat = catalog_get(path)) == NULL)
+		return -1;
+	catalog_find(cat->map, cat->size, f->name, f->namelen, &cf);
+	if (cf.off == -1 || (cf.flags & CATALOG_DELETED))
+		return -1;
+	*meta = cf.meta;
+	return 0;
+}
+
+/*
+ * Open a catalog to change it, creating it if it isn't there, and
+ * lock it.  If someone else replaces it while we're waiting for the
+ * lock, start again with the new one.
+ */
+static int
+catalog_lock(const char *path)
+{
+	struct catalog_hdr hdr;
+	struct stat st, pst;
+	int fd;
+
+	for (;;) {
+		if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666)) < 0)
+			return -1;
+		if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0)
+			goto fail;
+		if (stat(path, &pst) == 0 && pst.st_dev == st.st_dev &&
+		    pst.st_ino == st.st_ino)
+			break;
+		close(fd);
+	}
+	if (st.st_size == 0) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, CATALOG_MAGIC, sizeof(hdr.magic));
+		if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			goto fail;
+	}
+	return fd;
+fail:
+	close(fd);
+	return -1;
+}
+
+/* An entry being sorted into a new catalog. */
+struct catalog_ent {
+	const char *name;
+	size_t len;
+	int seq;
+	uint8_t flags;
+	struct ec_fs_meta meta;
+};
+
+static int
+catalog_entcmp(const void *a, const void *b)
+{
+	const struct catalog_ent *ea = a, *eb = b;
+	int ret;
+
+	ret = catalog_namecmp(ea->name, ea->len, eb->name, eb->len);
+	return ret != 0 ? ret : ea->seq - eb->seq;
+}
+
+/*
+ * Rewrite a catalog with everything sorted into slots, leaving out
+ * what's been deleted.  The caller holds the lock on the old one.
+ */
+static int
+catalog_rewrite(const char *path, unsigned char *map, size_t size)
+{
+	struct catalog_hdr *hdr = (struct catalog_hdr *)map, *nhdr;
+	struct catalog_slot *slots = (struct catalog_slot *)(hdr + 1), *nslot;
+	struct catalog_ent *ents;
+	struct catalog_rec *rec;
+	const char *names;
+	unsigned char *buf;
+	char *tmp;
+	size_t off, namesize, bufsize;
+	uint32_t i;
+	int n, j, nout, fd, ret;
+
+	names = (const char *)(slots + hdr->nslots);
+	off = (const unsigned char *)names + hdr->namesize - map;
+	/* No more records than bytes in the tail could hold. */
+	ents = malloc((hdr->nslots + (size - off) / sizeof(*rec) + 1) *
+	    sizeof(*ents));
+	if (ents == NULL)
+		return -1;
+	n = 0;
+	for (i = 0; i < hdr->nslots; i++, n++) {
+		ents[n].name = names + slots[i].nameoff;
+		ents[n].len = slots[i].namelen;
+		ents[n].seq = n;
+		ents[n].flags = slots[i].flags;
+		ents[n].meta = slots[i].meta;
+	}
+	while (off + sizeof(*rec) <= size) {
+		rec = (struct catalog_rec *)(map + off);
+		if (off + sizeof(*rec) + rec->namelen > size)
+			break;
+		ents[n].name = (const char *)(rec + 1);
+		ents[n].len = rec->namelen;
+		ents[n].seq = n;
+		ents[n].flags = rec->flags;
+		ents[n].meta = rec->meta;
+		n++;
+		off += sizeof(*rec) + rec->namelen;
+	}
+	qsort(ents, n, sizeof(*ents), catalog_entcmp);
+	/* Keep the last of each name, if it's not been deleted. */
+	for (j = nout = 0, namesize = 0; j < n; j++) {
+		if (j + 1 < n && catalog_namecmp(ents[j].name, ents[j].len,
+		    ents[j + 1].name, ents[j + 1].len) == 0)
+			continue;
+		if (ents[j].flags & CATALOG_DELETED)
+			continue;
+		namesize += ents[j].len;
+		ents[nout++] = ents[j];
+	}
+	bufsize = sizeof(*nhdr) + nout * sizeof(*nslot) + namesize;
+	if ((buf = calloc(1, bufsize)) == NULL) {
+		free(ents);
+		return -1;
+	}
+	nhdr = (struct catalog_hdr *)buf;
+	memcpy(nhdr->magic, CATALOG_MAGIC, sizeof(nhdr->magic));
+	nhdr->nslots = nout;
+	nhdr->namesize = namesize;
+	nslot = (struct catalog_slot *)(nhdr + 1);
+	for (j = 0, off = 0; j < nout; j++) {
+		nslot[j].nameoff = off;
+		nslot[j].namelen = ents[j].len;
+		nslot[j].meta = ents[j].meta;
+		memcpy((char *)(nslot + nout) + off, ents[j].name,
+		    ents[j].len);
+		off += ents[j].len;
+	}
+	free(ents);
+	ret = -1;
+	if ((tmp = malloc(strlen(path) + 5)) == NULL)
+		goto out;
+	sprintf(tmp, "%s.new", path);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+	    0666)) < 0)
+		goto out;
+	if (write(fd, buf, bufsize) == (ssize_t)bufsize && close(fd) == 0)
+		ret = rename(tmp, path);
+	else
+		close(fd);
+	if (ret < 0)
+		unlink(tmp);
+out:
+	free(tmp);
+	free(buf);
+	return ret;
+}
+
+/*
+ * Set or delete ('flags' is CATALOG_DELETED) an entry.
+ */
+static int
+catalog_update(struct fs_ent *f, struct ec_fs_meta *meta, uint8_t flags)
+{
+	struct catalog_found cf;
+	struct catalog_rec rec;
+	struct stat st;
+	unsigned char *map, change[1 + sizeof(*meta)];
+	char path[PATH_MAX];
+	int fd, ret, saved;
+
+	if (catalog_path(f, path) < 0)
+		return -1;
+	if ((fd = catalog_lock(path)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0) {
+		saved = errno;
+		close(fd);
+		errno = saved;
+		return -1;
+	}
+	ret = -1;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto out;
+	if (!catalog_valid(map, st.st_size)) {
+		errno = EINVAL;
+		goto unmap;
+	}
+	catalog_find(map, st.st_size, f->name, f->namelen, &cf);
+	change[0] = flags;
+	memcpy(change + 1, meta, sizeof(*meta));
+	if (cf.off != -1) {
+		/* It's already there, so change it where it is. */
+		if (pwrite(fd, change, sizeof(change), cf.off) ==
+		    sizeof(change))
+			ret = 0;
+	} else if (flags & CATALOG_DELETED)
+		ret = 0;
+	else if (f->namelen > UINT8_MAX)
+		errno = ENAMETOOLONG;
+	else if (cf.ntail >= CATALOG_TAIL) {
+		/* Time to tidy up: sort it in, then try again. */
+		if (catalog_rewrite(path, map, st.st_size) == 0) {
+			munmap(map, st.st_size);
+			close(fd);
+			return catalog_update(f, meta, flags);
+		}
+	} else {
+		rec.namelen = f->namelen;
+		rec.flags = flags;
+		rec.meta = *meta;
+		if (pwrite(fd, &rec, sizeof(rec), st.st_size) ==
+		    sizeof(rec) &&
+		    pwrite(fd, f->name, f->namelen,
+			st.st_size + sizeof(rec)) == (ssize_t)f->namelen)
+			ret = 0;
+	}
+unmap:
+	munmap(map, st.st_size);
+out:
+	saved = errno;
+	close(fd);
+	errno = saved;
+	return ret;
+}
+
+static int
+catalog_set_meta(struct fs_ent *f, struct ec_fs_meta *meta)
+{
+
+	return catalog_update(f, meta, 0);
+}
+
+static void
+catalog_del_meta(struct fs_ent *f)
+{
+	struct ec_fs_meta meta;
+
+	/* Don't make a catalog just to say there's nothing in it. */
+	if (catalog_get_meta(f, &meta) == 0)
+		catalog_update(f, &meta, CATALOG_DELETED);
+}
+
+/*
+ * Unless the metadata has been moved elsewhere, the catalog can only
+ * go if it's all that's left in the directory, or the metadata of
+ * everything else would be lost.
+ */
+static void
+catalog_deldir(int at, char const *rel, int moved)
+{
+	char path[PATH_MAX];
+	struct dirent *dp;
+	DIR *dir;
+	int fd, alone = 1;
+
+	if (snprintf(path, sizeof(path), "%s/%s", rel, CATALOG_NAME) >=
+	    (int)sizeof(path))
+		return;
+	if (!moved) {
+		if ((fd = openat(at, rel,
+		    O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+			return;
+		if ((dir = fdopendir(fd)) == NULL) {
+			close(fd);
+			return;
+		}
+		while (alone && (dp = readdir(dir)) != NULL)
+			if (strcmp(dp->d_name, ".") != 0 &&
+			    strcmp(dp->d_name, "..") != 0 &&
+			    strcmp(dp->d_name, CATALOG_NAME) != 0)
+				alone = 0;
+		closedir(dir);
+	}
+	if (alone)
+		unlinkat(at, path, 0);
+}
+
+/*
+ * Everything in a directory shares its catalog, which is changed in
+ * place or replaced, so its mtime or inode number shows any change.
+ */
+static void
+catalog_stamp(struct fs_ent *f, struct meta_stamp *ms)
+{
+	char path[PATH_MAX];
+
+	if (catalog_path(f, path) < 0)
+		memset(ms, 0, sizeof(*ms));
+	else
+		meta_stamp_path(path, ms);
+}
+
+static void
+catalog_dirstamp(char const *dir, struct meta_stamp *ms)
+{
+	char path[PATH_MAX];
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir, CATALOG_NAME) >=
+	    (int)sizeof(path))
+		memset(ms, 0, sizeof(*ms));
+	else
+		meta_stamp_path(path, ms);
+}
+
+struct meta_funcs const meta_catalog = {
+	"catalog", 0, catalog_get_meta, catalog_set_meta, catalog_del_meta,
+	catalog_deldir, catalog_stamp, catalog_dirstamp
+};
@@ -0,0 +1,176 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * meta_symlink.c - Acorn metadata in symbolic links
+ *
+ * The original way of keeping metadata: for each file with any,
+ * a symbolic link of the same name in a .Acorn directory alongside
+ * it, pointing at the text of its load and execute addresses.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "fileserver.h"
+
+/*
+ * Construct path to Acorn metadata for a file in 'buf', which holds
+ * PATH_MAX bytes.  Returns -1, with errno set, if it won't fit.
+ */
+static int
+symlink_path(struct fs_ent *f, char *buf)
+{
+	size_t dirlen;
+
+	dirlen = f->name - f->path;
+	if (dirlen + 7 + f->namelen >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	sprintf(buf, "%.*s.Acorn/%s", (int)dirlen, f->path, f->name);
+	return 0;
+}
+
+static int
+symlink_get(struct fs_ent *f, struct ec_fs_meta *meta)
+{
+	char metapath[PATH_MAX], rawinfo[META_OLDTEXTLEN + 1];
+	ssize_t ret;
+
+	if (symlink_path(f, metapath) < 0)
+		return -1;
+	ret = readlink(metapath, rawinfo, sizeof(rawinfo));
+	if (ret < 0)
+		return -1;
+	return meta_parse(rawinfo, ret, meta);
+}
+
+/*
+ * Make the link, making the .Acorn directory or replacing an old
+ * link only if we have to.
+ */
+static int
+symlink_set(struct fs_ent *f, struct ec_fs_meta *meta)
+{
+	char *lastslash, metapath[PATH_MAX], rawinfo[META_TEXTLEN + 1];
+	int ret, tries;
+
+	if (symlink_path(f, metapath) < 0)
+		return -1;
+	meta_format(rawinfo, meta);
+	for (tries = 0; (ret = symlink(rawinfo, metapath)) < 0 && tries < 2;
+	     tries++) {
+		if (errno == EEXIST) {
+			if (unlink(metapath) < 0 && errno != ENOENT)
+				break;
+		} else if (errno == ENOENT) {
+			lastslash = strrchr(metapath, '/');
+			*lastslash = '\0';
+			ret = mkdir(metapath, 0777);
+			*lastslash = '/';
+			if (ret < 0 && errno != EEXIST)
+				break;
+		} else
+			break;
+	}
+	return ret;
+}
+
+static void
+symlink_del(struct fs_ent *f)
+{
+	char metapath[PATH_MAX];
+
+	if (symlink_path(f, metapath) == 0) {
+		unlink(metapath);
+		*strrchr(metapath, '/') = '\0';
+		rmdir(metapath); /* Don't worry if it fails. */
+	}
+}
+
+static void
+symlink_deldir(int at, char const *rel, int moved)
+{
+	char *acornpath;
+
+	/* This only works if .Acorn is empty, so nothing can be lost. */
+	if ((acornpath = malloc(strlen(rel) + 8)) == NULL)
+		return;
+	sprintf(acornpath, "%s/.Acorn", rel);
+	unlinkat(at, acornpath, AT_REMOVEDIR);
+	free(acornpath);
+}
+
+/*
+ * Links are replaced rather than changed, so each new one has a new
+ * ctime, and the .Acorn directory a new mtime.
+ */
+static void
+symlink_stamp(struct fs_ent *f, struct meta_stamp *ms)
+{
+	char metapath[PATH_MAX];
+
+	if (symlink_path(f, metapath) < 0)
+		memset(ms, 0, sizeof(*ms));
+	else
+		meta_stamp_path(metapath, ms);
+}
+
+static void
+symlink_dirstamp(char const *dir, struct meta_stamp *ms)
+{
+	char acornpath[PATH_MAX];
+
+	if (snprintf(acornpath, sizeof(acornpath), "%s/.Acorn", dir) >=
+	    (int)sizeof(acornpath))
+		memset(ms, 0, sizeof(*ms));
+	else
+		meta_stamp_path(acornpath, ms);
+}
+
+struct meta_funcs const meta_symlink = {
+	"symlink", 0, symlink_get, symlink_set, symlink_del, symlink_deldir,
+	symlink_stamp, symlink_dirstamp
+};
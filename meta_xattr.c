@@ -0,0 +1,123 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * meta_xattr.c - Acorn metadata in extended attributes
+ *
+ * Load and execute addresses are kept on the file itself, as the
+ * extended attributes user.acorn.load and user.acorn.exec, each
+ * eight hex digits.  This takes no extra inodes or directory
+ * entries, and the metadata follows the file when it's renamed, but
+ * the file system has to support user attributes.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#if HAVE_SYS_XATTR_H
+#include <sys/xattr.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+#include "extern.h"
+#include "fileserver.h"
+
+#define XATTR_LOAD	"user.acorn.load"
+#define XATTR_EXEC	"user.acorn.exec"
+
+#if HAVE_SYS_XATTR_H
+static int
+xattr_get(struct fs_ent *f, struct ec_fs_meta *meta)
+{
+	char rawinfo[META_TEXTLEN + 1];
+
+	if (getxattr(f->path, XATTR_LOAD, rawinfo, 8) != 8 ||
+	    getxattr(f->path, XATTR_EXEC, rawinfo + 9, 8) != 8)
+		return -1;
+	rawinfo[8] = ' ';
+	return meta_parse(rawinfo, META_TEXTLEN, meta);
+}
+
+static int
+xattr_set(struct fs_ent *f, struct ec_fs_meta *meta)
+{
+	char rawinfo[META_TEXTLEN + 1];
+
+	meta_format(rawinfo, meta);
+	if (setxattr(f->path, XATTR_LOAD, rawinfo, 8, 0) < 0 ||
+	    setxattr(f->path, XATTR_EXEC, rawinfo + 9, 8, 0) < 0)
+		return -1;
+	return 0;
+}
+
+static void
+xattr_del(struct fs_ent *f)
+{
+
+	/* The file may well have gone already, taking them with it. */
+	removexattr(f->path, XATTR_LOAD);
+	removexattr(f->path, XATTR_EXEC);
+}
+#else
+static int
+xattr_get(struct fs_ent *f, struct ec_fs_meta *meta)
+{
+
+	return -1;
+}
+
+static int
+xattr_set(struct fs_ent *f, struct ec_fs_meta *meta)
+{
+
+	errno = ENOTSUP;
+	return -1;
+}
+
+static void
+xattr_del(struct fs_ent *f)
+{
+}
+#endif
+
+static void
+xattr_deldir(int at, char const *rel, int moved)
+{
+}
+
+struct meta_funcs const meta_xattr = {
+	"xattr", 1, xattr_get, xattr_set, xattr_del, xattr_deldir,
+	NULL, NULL
+};
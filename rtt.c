@@ -0,0 +1,114 @@
+/*-
+ * Copyright (c) 2026 aund contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This is part of aund, an implementation of Acorn Universal
+ * Networking for Unix.
+ */	
+/*
+ * rtt.c - round-trip time estimation
+ *
+ * Each transport keeps one of these per station, and uses it to
+ * decide how long to wait for an acknowledgement before
+ * retransmitting.  The estimator is the usual one from TCP
+ * (Jacobson, "Congestion Avoidance and Control", 1988), and in line
+ * with Karn's algorithm, only packets which weren't retransmitted
+ * provide samples, and a backed-off timeout stays backed off until a
+ * new sample arrives.
+ */
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "extern.h"
+
+/* Don't retransmit more often than this, however fast the network. */
+#define RTT_MIN_RTO	2000
+/* Nor back off further than this. */
+#define RTT_MAX_RTO	1000000
+
+void
+rtt_init(struct rtt *r)
+{
+
+	memset(r, 0, sizeof(*r));
+	r->rto = default_timeout;
+}
+
+void
+rtt_sample(struct rtt *r, uint64_t sample)
+{
+	uint64_t delta;
+
+	r->samples++;
+	if (r->srtt == 0) {
+		r->srtt = sample ? sample : 1;
+		r->rttvar = sample / 2;
+	} else {
+		delta = sample > r->srtt ? sample - r->srtt : r->srtt - sample;
+		r->rttvar = (3 * r->rttvar + delta) / 4;
+		r->srtt = (7 * r->srtt + sample) / 8;
+		if (r->srtt == 0)
+			r->srtt = 1;
+	}
+	r->rto = r->srtt + 4 * r->rttvar;
+	if (r->rto < RTT_MIN_RTO)
+		r->rto = RTT_MIN_RTO;
+	if (r->rto > RTT_MAX_RTO)
+		r->rto = RTT_MAX_RTO;
+}
+
+/*
+ * A packet has timed out, so wait twice as long next time.
+ */
+void
+rtt_backoff(struct rtt *r)
+{
+
+	r->retransmits++;
+	r->rto *= 2;
+	if (r->rto > RTT_MAX_RTO)
+		r->rto = RTT_MAX_RTO > default_timeout ?
+		    RTT_MAX_RTO : default_timeout;
+}
+
+/*
+ * Describe the state of an estimator for the statistics report.
+ */
+void
+rtt_report(const char *who, struct rtt *r)
+{
+
+	stats_printf("%s: rtt %ju.%03jums rttvar %ju.%03jums "
+	    "rto %ju.%03jums, %lu sent, %lu retransmitted, %lu failed",
+	    who, (uintmax_t)r->srtt / 1000, (uintmax_t)r->srtt % 1000,
+	    (uintmax_t)r->rttvar / 1000, (uintmax_t)r->rttvar % 1000,
+	    (uintmax_t)r->rto / 1000, (uintmax_t)r->rto % 1000,
+	    r->sent, r->retransmits, r->failures);
+}